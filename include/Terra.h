@@ -46,14 +46,22 @@ typedef struct {
 typedef TerraFloat3 ( TerraBSDFSampleRoutine ) ( const TerraShadingSurface* surface, float e1, float e2, float e3, const TerraFloat3* wo );
 typedef float       ( TerraBSDFPdfRoutine )    ( const TerraShadingSurface* surface, const TerraFloat3* wi, const TerraFloat3* wo );
 typedef TerraFloat3 ( TerraBSDFEvalRoutine )   ( const TerraShadingSurface* surface, const TerraFloat3* wi, const TerraFloat3* wo );
+// Fused routines, returning the BSDF value along with the sampled direction and/or its pdf
+typedef TerraFloat3 ( TerraBSDFSampleEvalRoutine ) ( const TerraShadingSurface* surface, float e1, float e2, float e3, const TerraFloat3* wo, TerraFloat3* wi, float* pdf );
+typedef TerraFloat3 ( TerraBSDFEvalPdfRoutine )    ( const TerraShadingSurface* surface, const TerraFloat3* wi, const TerraFloat3* wo, float* pdf );
 
+// sample_eval and eval_pdf are optional (NULL), they let the BSDF share the work common to sample, pdf and eval.
+// When present they are used in place of the separate routines.
 typedef struct {
-    TerraBSDFSampleRoutine* sample;
-    TerraBSDFPdfRoutine*    pdf;
-    TerraBSDFEvalRoutine*   eval;
+    TerraBSDFSampleRoutine*     sample;
+    TerraBSDFPdfRoutine*        pdf;
+    TerraBSDFEvalRoutine*       eval;
+    TerraBSDFSampleEvalRoutine* sample_eval;
+    TerraBSDFEvalPdfRoutine*    eval_pdf;
 } TerraBSDF;
 
-// Sampling filter to be applied. Trilinear & Anisotropic enable ray differentials and mipmap generation at scene_end()
+// Sampling filter to be applied. Trilinear & Anisotropic pick the mip level from the footprint of the ray cone
+// traced from each pixel, the mip chain is generated on finalize or scene commit.
 typedef enum {
     kTerraFilterPoint,
     kTerraFilterBilinear,
@@ -68,15 +76,59 @@ typedef enum {
     kTerraTextureAddressClamp
 } TerraTextureAddressMode;
 
-// A texture is invalid if pixels is NULL
-typedef struct {
+// How the texels are stored in memory, decoded on fetch. LDR formats are created from 8 bit components,
+// HDR ones from floats. Block compressed formats need TERRA_TEXTURE_TILE_LOG2 2, each tile is a 4x4 block.
+typedef enum {
+    kTerraTextureFormatUnorm8,      // 1-3 components
+    kTerraTextureFormatFloat32,     // 1-3 components
+    kTerraTextureFormatFloat16,     // 1-3 components, HDR in half the memory
+    kTerraTextureFormatRGB9E5,      // 3 components sharing a 5 bit exponent, 32 bits per texel
+    kTerraTextureFormatBC1,         // 3 components, 4 bits per texel
+    kTerraTextureFormatBC5,         // 2 components (e.g. tangent space normals), 8 bits per texel
+    kTerraTextureFormatCount
+} TerraTextureFormat;
+
+// Most anisotropic filter probes per lookup
+#ifndef TERRA_TEXTURE_MAX_ANISOTROPY
+#define TERRA_TEXTURE_MAX_ANISOTROPY 8
+#endif
+
+// Pixels are stored in square tiles of 2^TERRA_TEXTURE_TILE_LOG2 texels per side, both the tiles and the
+// texels inside them in row-major order. The size is padded to a multiple of the tile.
+#ifndef TERRA_TEXTURE_TILE_LOG2
+#define TERRA_TEXTURE_TILE_LOG2 2
+#endif
+
+struct TerraTexture;
+struct TerraTexturePagedLevel;
+typedef TerraFloat3 ( *TerraTextureFetch ) ( const struct TerraTexture* texture, int32_t x, int32_t y );
+
+// Paged textures keep their pixels on disk and page them in a TerraTextureCache on demand, in pages of
+// 2^TERRA_TEXTURE_PAGE_LOG2 texels per side. Each page is laid out in tiles like a resident texture.
+#ifndef TERRA_TEXTURE_PAGE_LOG2
+#define TERRA_TEXTURE_PAGE_LOG2 5
+#endif
+
+typedef struct TerraTextureCache TerraTextureCache;
+
+// A texture is invalid if both pixels and paged are NULL, paged textures have no resident pixels.
+// Texture coordinates are normalized, [0, 1] spans the whole texture.
+// Trilinear and anisotropic textures get a mip chain, mips[i] is half the size of the level above it.
+// fetch reads a texel and is specialized on format and address mode, it is picked on init and scene commit.
+// depth is the size of the source components, 1 for LDR and 4 for HDR formats.
+typedef struct TerraTexture {
     void*    pixels;
     uint16_t width;
     uint16_t height;
     uint8_t  components;
     uint8_t  depth;
+    uint8_t  format;        // kTerraTextureFormat
     uint8_t  filter;        // kTerraTextureFilter
     uint8_t  address_mode;  // kTerraTextureAddressMode
+    struct TerraTexture* mips;
+    uint8_t  mips_count;
+    TerraTextureFetch fetch;
+    struct TerraTexturePagedLevel* paged;
 } TerraTexture;
 
 typedef void        ( *TerraAttributeFinalize ) ( void* attribute );
@@ -150,6 +202,7 @@ typedef enum {
     kTerraIntegratorSimple,
     kTerraIntegratorDirect,
     kTerraIntegratorDirectMis,
+    kTerraIntegratorPath,
     kTerraIntegratorDebugMono,
     kTerraIntegratorDebugDepth,
     kTerraIntegratorDebugNormals,
@@ -158,7 +211,6 @@ typedef enum {
 
 typedef struct {
     TerraAttribute              environment_map;
-    TerraTonemappingOperator    tonemapping_operator;
     TerraAccelerator            accelerator;
     TerraSamplingMethod         sampling_method;
     TerraIntegrator             integrator;
@@ -168,8 +220,8 @@ typedef struct {
     size_t  bounces;
     size_t  strata;
 
-    float   manual_exposure;
-    float   gamma;
+    bool    batch_shading;  // Groups the primary hits of each pixel batch by object before shading them
+    uint32_t seed;          // Renders with different seeds are independent and can be merged, the same seed repeats the samples
 } TerraSceneOptions;
 
 // Scene
@@ -182,16 +234,79 @@ typedef struct {
 
 typedef struct {
     TerraFloat3 acc;
+    float       acc_lum2;   // Sum of the squared sample luminances, used to estimate the pixel variance
     int         samples;
 } TerraRawIntegrationResult;
 
+// Applied by terra_framebuffer_resolve(), apart from the scene options as they don't affect the accumulated radiance
 typedef struct {
-    TerraFloat3*               pixels;
-    TerraRawIntegrationResult* results;
+    TerraTonemappingOperator    tonemapping_operator;
+    float                       manual_exposure;
+    float                       gamma;
+} TerraTonemappingOptions;
+
+// Cleared by terra_framebuffer_resolve() and terra_framebuffer_save_state() respectively
+typedef enum {
+    kTerraTileUnresolved = 1,
+    kTerraTileUnsaved    = 2
+} TerraTileFlags;
+
+// How the resolved pixels are stored, the compact formats are meant for display and saving
+typedef enum {
+    kTerraPixelFormatFloat3,        // TerraFloat3, 12 bytes per pixel
+    kTerraPixelFormatHalf4,         // RGBA half floats, alpha is 1. 8 bytes per pixel
+    kTerraPixelFormatRGBA8,         // Clamped to [0, 1], alpha is 255. 4 bytes per pixel
+    kTerraPixelFormatCount
+} TerraPixelFormat;
+
+// How the accumulated samples are stored. The compact formats keep the mean radiance and the standard deviation
+// of the luminance instead of the sums, values above 65504 are clamped and the sample count stops at 65535,
+// the passes past it are dropped. Each terra_render() call updates the means once, the precision is fine as long
+// as a pass adds at least a few thousandths to the count.
+typedef enum {
+    kTerraAccumulationFormatFloat,  // TerraRawIntegrationResult, 16 bytes per pixel
+    kTerraAccumulationFormatHalf,   // Half floats and a 16 bit count, 10 bytes per pixel
+    kTerraAccumulationFormatRGB9E5, // Shared exponent radiance, half luminance and a 16 bit count, 8 bytes per pixel
+    kTerraAccumulationFormatCount
+} TerraAccumulationFormat;
+
+// terra_render() only accumulates into results, pixels are written by terra_framebuffer_resolve() and allocated
+// by the first one. Both are laid out in row-major order, read the results through terra_framebuffer_get_result().
+// dirty has kTerraTile flags per TERRA_RENDER_TILE_SIZE tile, set when the tile is rendered.
+// passes counts the terra_render() calls starting in each tile, they seed the samples.
+// tonemapping holds the options of the last resolve.
+// A bucket covers the width x height region at image_x, image_y of a larger image, the camera rays are traced
+// through the whole image. Other framebuffers are the whole image.
+typedef struct {
+    void*                      pixels;
+    void*                      results;
+    int32_t*                   dirty;
+    int32_t*                   passes;
     size_t                     width;
     size_t                     height;
+    size_t                     image_x;
+    size_t                     image_y;
+    size_t                     image_width;
+    size_t                     image_height;
+    uint8_t                    pixel_format;        // kTerraPixelFormat
+    uint8_t                    accumulation_format; // kTerraAccumulationFormat
+    TerraTonemappingOptions    tonemapping;
 } TerraFramebuffer;
 
+// Side of the tiles terra_render_until() estimates the error on and of the framebuffer dirty tiles
+#ifndef TERRA_RENDER_TILE_SIZE
+#define TERRA_RENDER_TILE_SIZE 32
+#endif
+
+// Filled by terra_render_until()
+typedef struct {
+    size_t samples;         // Samples taken by the call over the whole region
+    size_t tiles;           // Tiles the region was split into
+    size_t tiles_converged; // Tiles that reached the target error
+    float  error;           // Estimated relative error of the region at the end of the call
+    double time_ms;         // Time spent inside the call
+} TerraRenderStats;
+
 typedef struct {
     uint32_t object_idx : 8;
     uint32_t triangle_idx : 24;
@@ -204,23 +319,64 @@ typedef void*   HTerraScene;
 
 HTerraScene         terra_scene_create();
 TerraObject*        terra_scene_add_object ( HTerraScene scene, size_t triangle_count );
+// Objects are stored contiguously, the pointer is only valid until the next terra_scene_add_object()
+TerraObject*        terra_scene_get_object ( HTerraScene scene, size_t index );
 size_t              terra_scene_count_objects ( HTerraScene scene );
 void                terra_scene_commit ( HTerraScene scene );
 void                terra_scene_clear ( HTerraScene scene );
 TerraSceneOptions*  terra_scene_get_options ( HTerraScene scene );
 void                terra_scene_destroy ( HTerraScene scene );
 
+// Float pixels and accumulation
 bool                terra_framebuffer_create ( TerraFramebuffer* framebuffer, size_t width, size_t height );
+bool                terra_framebuffer_create_format ( TerraFramebuffer* framebuffer, size_t width, size_t height,
+        TerraPixelFormat pixel_format, TerraAccumulationFormat accumulation_format );
+// Float pixels and accumulation. terra_render() coordinates are relative to the bucket.
+bool                terra_framebuffer_create_bucket ( TerraFramebuffer* bucket, size_t image_width, size_t image_height,
+        size_t x, size_t y, size_t width, size_t height );
 void                terra_framebuffer_clear ( TerraFramebuffer* framebuffer );
 void                terra_framebuffer_destroy ( TerraFramebuffer* framebuffer );
+float               terra_framebuffer_error ( const TerraFramebuffer* framebuffer, size_t x, size_t y, size_t width, size_t height );
+// Sums of the samples of a pixel, decoded from the accumulation format
+TerraRawIntegrationResult terra_framebuffer_get_result ( const TerraFramebuffer* framebuffer, size_t x, size_t y );
+// Exposes, tonemaps and gamma corrects the tiles rendered since the last resolve into pixels. To be called before
+// reading pixels (display, save), possibly while rendering: the tiles rendered meanwhile are left dirty.
+// Every tile is resolved again if the options differ from the last call, the accumulation is left untouched.
+void                terra_framebuffer_resolve ( TerraFramebuffer* framebuffer, const TerraTonemappingOptions* options );
+// Adds the samples of other, of the same size, e.g. a run with another scene seed
+bool                terra_framebuffer_merge ( TerraFramebuffer* framebuffer, const TerraFramebuffer* other );
+// Writes the accumulated samples to a file, possibly while rendering. incremental only writes the tiles rendered
+// since the last save, to update a file written by a previous save or loaded from. The file is written whole
+// if it does not match the framebuffer, through path.tmp so that the previous file survives a failed save.
+// A file left by an interrupted incremental save is refused by terra_framebuffer_load_state().
+bool                terra_framebuffer_save_state ( TerraFramebuffer* framebuffer, const char* path, bool incremental );
+// Replaces the accumulated samples with the ones saved to path. The framebuffer has to be of the same size
+// and accumulation format. Rendering goes on from the loaded samples.
+bool                terra_framebuffer_load_state ( TerraFramebuffer* framebuffer, const char* path );
 
 bool                terra_texture_init ( TerraTexture* texture, size_t width, size_t height, size_t components, const void* data );
 bool                terra_texture_init_hdr ( TerraTexture* texture, size_t width, size_t height, size_t components, const float* data );
+// data is 8 bit for the LDR formats and float for HDR ones. The encoding is spread across threads.
+// Returns false if the format can not store the components.
+bool                terra_texture_init_format ( TerraTexture* texture, size_t width, size_t height, size_t components, const void* data, TerraTextureFormat format );
 TerraFloat3         terra_texture_read ( TerraTexture* texture, size_t x, size_t y );
 TerraFloat3         terra_texture_sample ( void* texture, const void* uv, const void* xyz );
 TerraFloat3         terra_texture_sample_latlong ( void* texture, const void* dir, const void* xyz );
 void                terra_texture_destroy ( TerraTexture* texture );
 void                terra_texture_finalize ( void* texture );
+void                terra_texture_generate_mips ( TerraTexture* texture );
+void                terra_texture_bind_fetch ( TerraTexture* texture );
+
+// The cache holds about budget bytes of pages shared by all the paged textures created on it, in slots sized
+// for the page of each format. Every page size gets a few slots even past the budget. Pages are looked up
+// without locks from the render threads, misses claim a slot under a lock, evicting the least recently used
+// page of the same size (clock), and are read from the file outside of it. Destroy the textures before their cache.
+TerraTextureCache*  terra_texture_cache_create ( size_t budget );
+void                terra_texture_cache_destroy ( TerraTextureCache* cache );
+// Writes the texture and its mip chain (generated if missing) in pages to a file for terra_texture_init_paged()
+bool                terra_texture_save_paged ( TerraTexture* texture, const char* path );
+// The file is kept open until terra_texture_destroy(), mips are read from the file.
+bool                terra_texture_init_paged ( TerraTexture* texture, TerraTextureCache* cache, const char* path );
 
 void                terra_attribute_init_constant ( TerraAttribute* attr, const TerraFloat3* value );
 void                terra_attribute_init_texture ( TerraAttribute* attr, TerraTexture* texture );
@@ -228,6 +384,26 @@ void                terra_attribute_init_cubemap ( TerraAttribute* attr, TerraTe
 
 void                terra_render ( const TerraCamera* camera, HTerraScene scene, const TerraFramebuffer* framebuffer, size_t x, size_t y, size_t width, size_t height );
 
+// Progressively renders the region in TERRA_RENDER_TILE_SIZE tiles, one samples_per_pixel pass at a time.
+// A tile stops receiving samples as soon as its estimated relative error is below target_error, the
+// whole call returns once every tile has converged or budget_ms have elapsed (checked between passes).
+// A zero budget or target disables the respective criterion, with both disabled a single pass is done.
+// Returns true if all the tiles reached the target error. stats can be NULL.
+bool                terra_render_until ( const TerraCamera* camera, HTerraScene scene, const TerraFramebuffer* framebuffer, size_t x, size_t y, size_t width, size_t height,
+                                         double budget_ms, float target_error, TerraRenderStats* stats );
+
+// Renders a width x height image without a framebuffer for all of it. The image is split in buckets of
+// bucket_size pixels per side, rendered in parallel with terra_render_until(). Each bucket is resolved and
+// written to the file at path as soon as it is done, then freed: only one bucket per thread is resident.
+// The output is a PFM file sized upfront, kTerraTonemappingOperatorNone with an exposure of 1 keeps the
+// radiance. Returns false if the file could not be written.
+bool                terra_render_buckets ( const TerraCamera* camera, HTerraScene scene, size_t width, size_t height, size_t bucket_size,
+        double bucket_budget_ms, float target_error, const TerraTonemappingOptions* tonemapping, const char* path );
+
+// The work Terra spreads across threads (texture encoding, mips, distributions, resolve) runs on the calling
+// thread only while serial is set, for callers already running one job per core. Set per thread.
+void                terra_parallel_serial ( bool serial );
+
 //--------------------------------------------------------------------------------------------------
 // Terra system API
 //--------------------------------------------------------------------------------------------------
@@ -257,10 +257,10 @@ inline TerraFloat4x4 terra_f4x4_basis ( const TerraFloat3* normal ) {
     // http://www.pbr-book.org/3ed-2018/Geometry_and_Transformations/Vectors.html#CoordinateSystemfromaVector
     if ( fabs ( normal->x ) > fabs ( normal->y ) ) {
         tangent = terra_f3_set ( normal->z, 0.f, -normal->x );
-        tangent = terra_mulf3 ( &tangent, sqrtf ( normal->x * normal->x + normal->z * normal->z ) );
+        tangent = terra_mulf3 ( &tangent, 1.f / sqrtf ( normal->x * normal->x + normal->z * normal->z ) );
     } else {
         tangent = terra_f3_set ( 0.f, -normal->z, normal->y );
-        tangent = terra_mulf3 ( &tangent, sqrtf ( normal->y * normal->y + normal->z * normal->z ) );
+        tangent = terra_mulf3 ( &tangent, 1.f / sqrtf ( normal->y * normal->y + normal->z * normal->z ) );
     }
 
     bitangent = terra_crossf3 ( normal, &tangent );
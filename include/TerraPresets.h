@@ -22,7 +22,7 @@ typedef struct {
 #define TERRA_PHONG_ALBEDO             1
 #define TERRA_PHONG_SPECULAR_COLOR     0
 #define TERRA_PHONG_SPECULAR_INTENSITY 2
-#define TERRA_PHONG_SAMPLE_PICK        3
+#define TERRA_PHONG_SAMPLE_PICK        3    // Unused, the pdf is the mixture of both lobes
 #define TERRA_PHONG_END                4
 void terra_bsdf_phong_init ( TerraBSDF* bsdf );
 
@@ -33,8 +33,17 @@ typedef struct {
     bool sample_diffuse;
 } TerraMaterialPhong;
 
-#define TERRA_DISNEY_BASE_COLOR 0
-#define TERRA_DISNEY_SHEEN      1
+// DISNEY
+// Reflection only principled BSDF: diffuse, anisotropic GGX specular, sheen and clearcoat
+#define TERRA_DISNEY_BASE_COLOR     0   // rgb
+#define TERRA_DISNEY_METALNESS      1   // x
+#define TERRA_DISNEY_ROUGHNESS      2   // x
+#define TERRA_DISNEY_SPECULAR       3   // <specular, specular_tint, _>
+#define TERRA_DISNEY_SHEEN          4   // <sheen, sheen_tint, _>
+#define TERRA_DISNEY_CLEARCOAT      5   // <clearcoat, clearcoat_gloss, _>
+#define TERRA_DISNEY_ANISOTROPIC    6   // <anisotropic, subsurface, _>
+#define TERRA_DISNEY_END            7
+void terra_bsdf_disney_init ( TerraBSDF* bsdf );
 
 typedef struct {
     TerraFloat3 base_color;
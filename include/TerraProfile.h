@@ -7,11 +7,7 @@
 extern "C" {
 #endif
 
-#ifdef _WIN32
 typedef int64_t TerraClockTime;
-#else
-typedef clock_t TerraClockTime;
-#endif
 
 TerraClockTime      terra_clock();
 double              terra_clock_to_ms ( TerraClockTime delta_time );
@@ -133,7 +129,7 @@ bool                    terra_profile_session_exists ( size_t session );
 #define TERRA_PROFILE_UPDATE_STATS( session, target )                       0
 #define TERRA_PROFILE_UPDATE_LOCAL_STATS( session, target )                 0
 #define TERRA_PROFILE_CLEAR_TARGET( session, target )                       0
-#define TERRA_PROFILE_DELETE_SESSION( session, target )                     0
+#define TERRA_PROFILE_DELETE_SESSION( session )                             0
 #define TERRA_CLOCK()                                                       0
 
 #endif
@@ -400,7 +400,7 @@ ApolloAdjacencyTableItem*   apollo_adjacency_table_insert ( ApolloAdjacencyTable
 ApolloAdjacencyTableItem*   apollo_adjacency_table_lookup ( ApolloAdjacencyTable* table, uint32_t key );
 
 #define APOLLO_ALLOC_ALIGN(allocator, T, n, align) (T*) (allocator)->alloc(allocator, sizeof(T) * n, align)
-#define APOLLO_ALLOC(allocator, T, n, align) APOLLO_ALLOC_ALIGN(allocator, T, n, alignof(T))
+#define APOLLO_ALLOC(allocator, T, n) APOLLO_ALLOC_ALIGN(allocator, T, n, alignof(T))
 // Waiting for the day MSVC C compiler will support typeof()...
 #define APOLLO_REALLOC_ALIGN(allocator, T, p, old_n, new_n, align) (T*) (allocator)->alloc(allocator, p, sizeof(T) * old_n, sizeof(T) * new_n, align)
 #define APOLLO_REALLOC(allocator, T, p, old_n, new_n, align) APOLLO_REALLOC_ALIGN(allocator, T, p, old_n, new_n, alignof(T))
@@ -1211,7 +1211,7 @@ ApolloResult apollo_import_model_obj ( const char* filename, ApolloModel* model,
                     case ' ': {
                         ApolloOBJMesh* m = apollo_sb_add ( meshes, 1, options->temp_allocator );
                         apollo_initialize_mesh_obj ( m );
-                        m->indices_offset = apollo_sb_count ( m_idx, options->temp_allocator );
+                        m->indices_offset = apollo_sb_count ( m_idx );
                         fscanf ( file, "%s", m->name );
                         break;
                     }
@@ -2246,14 +2246,14 @@ bool apollo_adjacency_item_add_unique ( ApolloAdjacencyTableItem* item, uint32_t
             item->values[item->count++] = value;
             return false;
         } else {
-            item->next = ( ApolloAdjacencyTableExtension* ) APOLLO_ALLOC ( allocator, ApolloAdjacencyTableExtension, 1, 64 );
+            item->next = ( ApolloAdjacencyTableExtension* ) APOLLO_ALLOC_ALIGN ( allocator, ApolloAdjacencyTableExtension, 1, 64 );
             memset ( item->next, 0, sizeof ( *item->next ) );
             ext = item->next;
         }
     }
 
     if ( ext->count == APOLLO_ADJACENCY_EXTENSION_CAPACITY ) {
-        ext->next = ( ApolloAdjacencyTableExtension* ) APOLLO_ALLOC ( allocator, ApolloAdjacencyTableExtension, 1, 64 );
+        ext->next = ( ApolloAdjacencyTableExtension* ) APOLLO_ALLOC_ALIGN ( allocator, ApolloAdjacencyTableExtension, 1, 64 );
         memset ( ext->next, 0, sizeof ( *ext->next ) );
         ext = ext->next;
     }
@@ -2408,7 +2408,7 @@ ApolloAdjacencyTableItem* apollo_adjacency_table_lookup ( ApolloAdjacencyTable*
 //--------------------------------------------------------------------------------------------------
 // STB SB
 //--------------------------------------------------------------------------------------------------
-static void* apollo__sbgrowf ( void* arr, int increment, int itemsize, ApolloAllocator* allocator ) {
+void* apollo__sbgrowf ( void* arr, int increment, int itemsize, ApolloAllocator* allocator ) {
     int dbl_cur = arr ? 2 * apollo__sbm ( arr ) : 0;
     int min_needed = apollo_sb_count ( arr ) + increment;
     int m = dbl_cur > min_needed ? dbl_cur : min_needed;
@@ -0,0 +1,111 @@
+#pragma once
+
+// C++ STL
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <string>
+#include <memory>
+
+// Terra
+#include <Terra.h>
+#include <TerraProfile.h>
+
+#include <Config.hpp>
+#include <Tiles.hpp>
+
+//
+// Headless counterpart of TerraRenderer, no GL or Windows dependency.
+// Dispatches the same tile jobs on a pool of std::threads, one pass over all the tiles at a time.
+// Every pass renders the longest tiles of the previous one first, the first pass follows a Hilbert curve.
+// Job options (workers, tile size, deadline, target error, checkpoint) are read from Config.
+//
+class BatchRenderer {
+  public:
+    // Written only by the worker owning them
+    struct WorkerStats {
+        size_t   tiles = 0;
+        uint64_t samples = 0;
+        double   busy_ms = 0;
+        double   tile_ms_min = 0;
+        double   tile_ms_max = 0;
+    };
+
+    struct Stats {
+        int      passes = 0;
+        size_t   tiles = 0;          // Rendered, converged tiles are skipped
+        uint64_t samples = 0;        // Taken during this run, checkpoints excluded
+        double   elapsed_ms = 0;
+        std::vector<WorkerStats> workers;
+    };
+
+  public:
+    BatchRenderer();
+    ~BatchRenderer();
+
+    // Renders up to `passes` passes of samples_per_pixel each (0 for unbounded), stopping earlier when the
+    // deadline expires or every tile reached the target error. Resumes from the checkpoint if it exists.
+    bool render ( const TerraCamera& camera, HTerraScene scene, int width, int height, int passes );
+
+    // Resolves the accumulated samples, the framebuffer stays valid until the next render()
+    const TerraFloat3* resolve ( const TerraTonemappingOptions& tonemapping );
+
+    int                 width() const;
+    int                 height() const;
+    const Stats&        stats() const;
+
+  private:
+    struct Tile {
+        int      x, y;
+        int      width, height;
+        bool     converged;  // Reached the target error, skipped by the next passes
+        double   time_ms;    // Of the last rendering, orders and splits the next pass
+        int      base;       // Tile split into this one, see Tiles.hpp
+        uint32_t node;
+    };
+
+    // Tiles dealt to a worker, every workers-th one starting at its index. The next slot is
+    // shared with the workers stealing from it once theirs are done.
+    struct alignas ( 64 ) TileRange {
+        std::atomic<size_t> next;
+        size_t              end;
+    };
+
+    void _setup_threads ( int workers );
+    void _stop_threads();
+    void _setup_tiles ( int tile_size );
+    void _run_pass();
+    void _worker ( int id );
+    size_t _fetch_tile ( int id, uint32_t& rng );
+    bool _deadline_passed() const;
+    bool _stop_criteria_met ( int passes );
+
+    // Threading
+    std::vector<std::thread>  _threads;
+    std::mutex                _mutex;
+    std::condition_variable   _pass_begin;
+    std::condition_variable   _pass_end;
+    std::atomic<size_t>       _next_tile;      // Shared queue
+    std::unique_ptr<TileRange[]> _ranges;      // One per worker with work stealing
+    int                       _pass = 0;       // Incremented to wake up the workers
+    int                       _active = 0;     // Workers still rendering the current pass
+    bool                      _quit = false;
+
+    // Terra
+    TerraFramebuffer          _framebuffer;
+    std::vector<Tile>         _tiles;
+    size_t                    _max_tiles = 0;  // Bounds the splits
+    const TerraCamera*        _target_camera = nullptr;
+    HTerraScene               _target_scene = nullptr;
+
+    // Config
+    int            _samples_per_pixel = 0;
+    bool           _work_stealing = false;
+    int            _deadline_ms = 0;
+    float          _target_error = 0;
+    std::string    _checkpoint_path;
+    TerraClockTime _launch_time;
+    Stats          _stats;
+};
@@ -10,25 +10,41 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Placed after the struct keyword, so that sizeof is rounded up to the alignment on every compiler
 #ifdef _MSC_VER
 #define CLOTO_DECL_ALIGN(bits) __declspec(align(bits))
+#elif defined ( __GNUC__ )
+#define CLOTO_DECL_ALIGN(bits) __attribute__((aligned(bits)))
 #else
-// TODO
 #error "Define __declspec(align()) for this compiler!"
 #endif
 
 #define CLOTO_L1D$_SIZE 64
 
+// Idle slaves either sleep, yield or spin for a while and then park until new jobs are pushed.
+// Parking uses futexes on Linux and WaitOnAddress on Windows, other platforms fall back to yielding.
 #define CLOTO_IDLE_MODE_SLEEP 0
 #define CLOTO_IDLE_MODE_YIELD 1
+#define CLOTO_IDLE_MODE_PARK  2
 
 #ifndef CLOTO_IDLE_MODE
-#define CLOTO_IDLE_MODE CLOTO_IDLE_MODE_SLEEP
+#define CLOTO_IDLE_MODE CLOTO_IDLE_MODE_PARK
+#endif
+
+// Bounds of the adaptive spin before parking, in pause instructions. Slaves which find a job while spinning
+// double their limit, slaves which have to park halve it.
+#ifndef CLOTO_SPIN_MIN
+#define CLOTO_SPIN_MIN 64
+#endif
+
+#ifndef CLOTO_SPIN_MAX
+#define CLOTO_SPIN_MAX 16384
 #endif
 
 //--------------------------------------------------------------------------------------------------
@@ -40,6 +56,27 @@ void        cloto_compiler_barrier();
 uint32_t    cloto_atomic_fetch_add_u32 ( uint32_t* atomic, uint32_t value );
 // Returns whether the operation was successful. The actual read is written into the expected_read param.
 bool        cloto_atomic_compare_exchange_u32 ( uint32_t* atomic, uint32_t* expected_read, uint32_t conditional_write );
+// Reads after it can not be moved before it
+uint32_t    cloto_atomic_load_acquire_u32 ( uint32_t* atomic );
+// Writes before it can not be moved after it
+void        cloto_atomic_store_release_u32 ( uint32_t* atomic, uint32_t value );
+// Hint to the cpu that the thread is busy waiting
+void        cloto_cpu_relax();
+
+//--------------------------------------------------------------------------------------------------
+// Parker
+// Threads park on the epoch until a wake increments it. Waiting on an epoch which has already changed
+// returns immediately, read the epoch before checking for work so that no wake is lost.
+
+typedef struct {
+    uint32_t epoch;
+    uint32_t waiters;
+} ClotoParker;
+
+void        cloto_parker_init ( ClotoParker* parker );
+uint32_t    cloto_parker_epoch ( ClotoParker* parker );
+void        cloto_parker_wait ( ClotoParker* parker, uint32_t epoch );
+void        cloto_parker_wake_all ( ClotoParker* parker );
 
 //--------------------------------------------------------------------------------------------------
 // Job
@@ -48,7 +85,7 @@ typedef void ClotoJobRoutine ( void* args );
 #define CLOTO_JOB(name) void name (void* args)
 
 // TODO allow local args
-typedef CLOTO_DECL_ALIGN ( CLOTO_L1D$_SIZE ) struct {
+typedef struct CLOTO_DECL_ALIGN ( CLOTO_L1D$_SIZE ) {
     ClotoJobRoutine* routine;
     void* args;
 } ClotoJob;
@@ -58,6 +95,7 @@ void cloto_job_create ( ClotoJob* job, ClotoJobRoutine* routine, void* args );
 //--------------------------------------------------------------------------------------------------
 // Work Queue (Deque)
 // https://blog.molecular-matters.com/2015/08/24/job-system-2-0-lock-free-work-stealing-part-1-basics/
+// Push and pop are reserved to the owner thread and work on top (LIFO), any thread can steal from bottom (FIFO).
 
 typedef struct ClotoWorkQueue {
     char _p0[CLOTO_L1D$_SIZE];
@@ -125,7 +163,7 @@ typedef struct {
     char buffer[CLOTO_MSG_PAYLOAD_SIZE - 8];
 } ClotoMessageJobPayload;
 
-typedef CLOTO_DECL_ALIGN ( CLOTO_L1D$_SIZE ) struct {
+typedef struct CLOTO_DECL_ALIGN ( CLOTO_L1D$_SIZE ) {
     char payload[CLOTO_MSG_PAYLOAD_SIZE];
     // ClotoMessageType
     uint32_t type : 2;
@@ -192,6 +230,8 @@ typedef struct {
     void* args;
     ClotoMessageQueue msg_queue;
     ClotoUserMessageQueue user_msg_queue;
+    // Woken when a message is sent to the thread, if it parks
+    ClotoParker* parker;
 } ClotoThread;
 
 void            cloto_thread_register();
@@ -208,8 +248,13 @@ bool            cloto_thread_query_message_status ( ClotoThread* destinatary, ui
 
 //--------------------------------------------------------------------------------------------------
 // Slave (job fetch-execute only worker thread)
-// A single queue is used. The typical use case for this is static, push-all-jobs-then-execute workloads.
+// The typical use case for this is static, push-all-jobs-then-execute workloads.
 // After executon it is possible to reset the queue and redo all the jobs.
+// Call cloto_slavegroup_wake() after pushing jobs, parked slaves don't notice them otherwise.
+// By default a single shared queue is used. With work stealing every slave owns a deque, seeds it with its
+// share of the batches and steals from a random victim when it runs dry. Jobs pushed into the shared
+// queue are still executed, after the deques.
+// Batch jobs are dealt round robin, each slave runs its share in batch order and thieves take the end of it.
 
 typedef struct ClotoSlaveGroup ClotoSlaveGroup;
 typedef struct {
@@ -217,6 +262,9 @@ typedef struct {
     ClotoSlaveGroup* group;
     uint32_t id;
     uint32_t stop_flag;
+    uint32_t spin_limit;
+    uint32_t batch_epoch;   // Last batch whose share was pushed to the slave queue
+    uint32_t rng;           // Victim selection
 } ClotoSlave;
 
 bool        cloto_slave_create ( ClotoSlave* slave, ClotoSlaveGroup* group, uint32_t id );
@@ -225,14 +273,24 @@ bool        cloto_slave_destroy ( ClotoSlave* slave );
 
 typedef struct ClotoSlaveGroup {
     ClotoWorkQueue queue;
+    ClotoWorkQueue* queues;     // One per slave with work stealing, NULL otherwise
     ClotoSlave* slaves;
     uint32_t slave_count;
+    ClotoParker parker;
+    const ClotoJob* batch;
+    uint32_t batch_size;
+    uint32_t batch_epoch;
 } ClotoSlaveGroup;
 
-bool        cloto_slavegroup_create ( ClotoSlaveGroup* group, uint32_t slave_count, uint32_t queue_capacity );
+bool        cloto_slavegroup_create ( ClotoSlaveGroup* group, uint32_t slave_count, uint32_t queue_capacity, bool work_stealing );
 bool        cloto_slavegroup_destroy ( ClotoSlaveGroup* group );
 void        cloto_slavegroup_join ( ClotoSlaveGroup* group );
+// Replaces the jobs of the previous batch, which must have completed. With work stealing the slaves copy their
+// share when they wake up, `jobs` has to stay valid until the batch completes. Also wakes the slaves.
+void        cloto_slavegroup_push_batch ( ClotoSlaveGroup* group, const ClotoJob* jobs, uint32_t count );
+// Redoes all the jobs of the last batch (or of the shared queue). Also wakes the slaves
 void        cloto_slavegroup_reset ( ClotoSlaveGroup* group );
+void        cloto_slavegroup_wake ( ClotoSlaveGroup* group );
 
 //--------------------------------------------------------------------------------------------------
 // Worker (job fetch-execute-dispatch worker thread)
@@ -286,6 +344,21 @@ bool        cloto_workgroup_destroy ( ClotoWorkgroup* group );
 // Implementation-local header
 //--------------------------------------------------------------------------------------------------
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#ifdef _WIN32
+    #pragma comment ( lib, "Synchronization.lib" )
+#else
+    #include <sched.h>
+    #include <unistd.h>
+#endif
+
+#ifdef __linux__
+    #include <linux/futex.h>
+    #include <sys/syscall.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -302,8 +375,9 @@ typedef struct {
 
 #ifdef _MSC_VER
 __declspec ( thread ) ClotoThread* __cloto_thread;
+#elif defined ( __GNUC__ )
+__thread ClotoThread* __cloto_thread;
 #else
-// TODO
 #error "Define __declspec(thread) for this compiler!"
 #endif
 
@@ -348,43 +422,91 @@ void cloto_compiler_barrier() {
 #endif
 }
 
-#ifndef _WIN32  // TODO do a linux port
-pthread_mutex_t g_mutex;
-void cloto_init() {
-    pthread_mutex_init ( &g_mutex, NULL );
-}
-#endif
-
 uint32_t cloto_atomic_fetch_add_u32 ( uint32_t* atomic, uint32_t value ) {
 #ifdef _WIN32
-    return InterlockedAdd ( ( long* ) atomic, value );
-#else   // TODO do a linux port
-    pthread_mutex_lock ( &g_mutex );
-    ClotoAtomic32 res = *atomic + value;
-    *atomic = res;
-    pthread_mutex_unlock ( &g_mutex );
-    return res;
-    //return __sync_add_and_fetch((long*) atomic, value);
+    return ( uint32_t ) InterlockedExchangeAdd ( ( volatile LONG* ) atomic, ( LONG ) value );
+#else
+    return __atomic_fetch_add ( atomic, value, __ATOMIC_SEQ_CST );
 #endif
 }
 
 bool cloto_atomic_compare_exchange_u32 ( uint32_t* atomic, uint32_t* expected_read, uint32_t conditional_write ) {
 #ifdef _WIN32
-    uint32_t read = InterlockedCompareExchange ( atomic, conditional_write, *expected_read );
+    uint32_t read = InterlockedCompareExchange ( ( volatile LONG* ) atomic, conditional_write, *expected_read );
     bool success = read == *expected_read;
     *expected_read = read;
     return success;
-#else   // TODO do a linux port
-    pthread_mutex_lock ( &g_mutex );
-    ClotoAtomic32 res = *atomic;
+#else
+    return __atomic_compare_exchange_n ( atomic, expected_read, conditional_write, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+#endif
+}
+
+uint32_t cloto_atomic_load_acquire_u32 ( uint32_t* atomic ) {
+#ifdef _WIN32
+    return ( uint32_t ) InterlockedOr ( ( volatile LONG* ) atomic, 0 );
+#else
+    return __atomic_load_n ( atomic, __ATOMIC_ACQUIRE );
+#endif
+}
+
+void cloto_atomic_store_release_u32 ( uint32_t* atomic, uint32_t value ) {
+#ifdef _WIN32
+    InterlockedExchange ( ( volatile LONG* ) atomic, ( LONG ) value );
+#else
+    __atomic_store_n ( atomic, value, __ATOMIC_RELEASE );
+#endif
+}
+
+void cloto_cpu_relax() {
+#if defined ( _MSC_VER )
+    YieldProcessor();
+#elif defined ( __i386__ ) || defined ( __x86_64__ )
+    __builtin_ia32_pause();
+#elif defined ( __aarch64__ ) || defined ( __arm__ )
+    asm volatile ( "yield" ::: "memory" );
+#else
+    cloto_compiler_barrier();
+#endif
+}
 
-    if ( *atomic == expected ) {
-        *atomic = desired;
+//--------------------------------------------------------------------------------------------------
+// Parker
+//--------------------------------------------------------------------------------------------------
+void cloto_parker_init ( ClotoParker* parker ) {
+    parker->epoch = 0;
+    parker->waiters = 0;
+}
+
+uint32_t cloto_parker_epoch ( ClotoParker* parker ) {
+    return cloto_atomic_fetch_add_u32 ( &parker->epoch, 0 );
+}
+
+// The waiter count is published before the epoch is compared by the kernel, a concurrent wake either
+// sees it or changes the epoch first. Both are sequentially consistent.
+void cloto_parker_wait ( ClotoParker* parker, uint32_t epoch ) {
+    cloto_atomic_fetch_add_u32 ( &parker->waiters, 1 );
+#if defined ( _WIN32 )
+    WaitOnAddress ( &parker->epoch, &epoch, sizeof ( epoch ), INFINITE );
+#elif defined ( __linux__ )
+    syscall ( SYS_futex, &parker->epoch, FUTEX_WAIT_PRIVATE, epoch, NULL, NULL, 0 );
+#else
+    sched_yield();
+#endif
+    cloto_atomic_fetch_add_u32 ( &parker->waiters, ( uint32_t ) -1 );
+}
+
+void cloto_parker_wake_all ( ClotoParker* parker ) {
+    cloto_atomic_fetch_add_u32 ( &parker->epoch, 1 );
+
+    // Nothing to do in the common case of busy slaves
+    if ( cloto_atomic_fetch_add_u32 ( &parker->waiters, 0 ) == 0 ) {
+        return;
     }
 
-    pthread_mutex_unlock ( &g_mutex );
-    return res;
-    //return __sync_val_compare_and_swap((long*) atomic, expected, desired);
+#if defined ( _WIN32 )
+    WakeByAddressAll ( &parker->epoch );
+#elif defined ( __linux__ )
+    syscall ( SYS_futex, &parker->epoch, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0 );
 #endif
 }
 
@@ -582,6 +704,7 @@ bool cloto_workqueue_push ( ClotoWorkQueue* queue, const ClotoJob* job ) {
             the read to bottom had already happened. This is a compiler fence.
         2. A pop decreases top always first, and then reads bottom. This is a memory fence.
 
+    Indices only grow and eventually wrap, they are compared through their signed difference.
 */
 bool cloto_workqueue_pop ( ClotoWorkQueue* queue, ClotoJob* dest ) {
     uint32_t top = queue->top - 1;
@@ -589,14 +712,14 @@ bool cloto_workqueue_pop ( ClotoWorkQueue* queue, ClotoJob* dest ) {
     cloto_memory_barrier();
     uint32_t bottom = queue->bottom;
 
-    if ( bottom > top ) {
+    if ( ( int32_t ) ( top - bottom ) < 0 ) {
         queue->top = bottom;
         return false;
     }
 
     ClotoJob job = queue->jobs[top & queue->mask];
 
-    if ( bottom < top ) {
+    if ( bottom != top ) {
         *dest = job;
         return true;
     }
@@ -613,11 +736,11 @@ bool cloto_workqueue_pop ( ClotoWorkQueue* queue, ClotoJob* dest ) {
 }
 
 bool cloto_workqueue_steal ( ClotoWorkQueue* queue, ClotoJob* job ) {
-    uint32_t bottom = queue->bottom;
-    cloto_compiler_barrier();
-    uint32_t top = queue->top;
+    uint32_t bottom = cloto_atomic_load_acquire_u32 ( &queue->bottom );
+    // The job is read after top, the push published it before incrementing top
+    uint32_t top = cloto_atomic_load_acquire_u32 ( &queue->top );
 
-    if ( bottom >= top ) {
+    if ( ( int32_t ) ( top - bottom ) <= 0 ) {
         return false;
     }
 
@@ -652,6 +775,7 @@ void cloto_thread_register() {
     i->thread.routine = NULL;
     i->thread.args = NULL;
     i->thread.handle = GetCurrentThread();
+    i->thread.parker = NULL;
     cloto_msgqueue_create ( &i->thread.msg_queue, 32 );
     cloto_usermsgqueue_create ( &i->thread.user_msg_queue, 32 );
     i->group = NULL;
@@ -676,6 +800,7 @@ DWORD WINAPI cloto_thread_launcher ( LPVOID param ) {
 bool cloto_thread_create ( ClotoThread* thread, ClotoThreadRoutine* routine, void* args, uint32_t msg_queue_cap, uint32_t user_msg_queue_cap ) {
     thread->routine = routine;
     thread->args = args;
+    thread->parker = NULL;
     CLOTO_SAFECALL ( cloto_msgqueue_create ( &thread->msg_queue, msg_queue_cap ) );
     CLOTO_SAFECALL ( cloto_usermsgqueue_create ( &thread->user_msg_queue, user_msg_queue_cap ) );
     HANDLE handle = CreateThread ( NULL, 0, cloto_thread_launcher, thread, 0, NULL );
@@ -718,44 +843,62 @@ void cloto_thread_sleep ( int ms ) {
 
 #else
 
+void cloto_thread_register() {
+    IClotoMainThread* i = ( IClotoMainThread* ) cloto_malloc ( sizeof ( IClotoMainThread ) );
+    i->thread.routine = NULL;
+    i->thread.args = NULL;
+    i->thread.handle = pthread_self();
+    i->thread.parker = NULL;
+    cloto_msgqueue_create ( &i->thread.msg_queue, 32 );
+    cloto_usermsgqueue_create ( &i->thread.user_msg_queue, 32 );
+    i->group = NULL;
+    i->id = 0;
+    i->stop_flag = 0;
+    __cloto_thread = &i->thread;
+}
+
+void cloto_thread_dispose() {
+    cloto_msgqueue_destroy ( &__cloto_thread->msg_queue );
+    cloto_usermsgqueue_destroy ( &__cloto_thread->user_msg_queue );
+    cloto_free ( ( IClotoMainThread* ) __cloto_thread );
+}
+
 void* cloto_thread_launcher ( void* param ) {
     ClotoThread* thread = ( ClotoThread* ) param;
+    __cloto_thread = thread;
     thread->routine ( thread->args );
-    return 0;
+    return NULL;
 }
 
-bool cloto_thread_create ( ClotoThread* thread, ClotoThreadRoutine routine, void* args ) {
+bool cloto_thread_create ( ClotoThread* thread, ClotoThreadRoutine* routine, void* args, uint32_t msg_queue_cap, uint32_t user_msg_queue_cap ) {
     thread->routine = routine;
     thread->args = args;
-    pthread_t handle;
-    int result = pthread_create ( &handle, NULL, cloto_thread_launcher, thread );
+    thread->parker = NULL;
+    CLOTO_SAFECALL ( cloto_msgqueue_create ( &thread->msg_queue, msg_queue_cap ) );
+    CLOTO_SAFECALL ( cloto_usermsgqueue_create ( &thread->user_msg_queue, user_msg_queue_cap ) );
 
-    if ( result == 0 ) {
-        thread->handle = handle;
-        return true;
+    if ( pthread_create ( &thread->handle, NULL, cloto_thread_launcher, thread ) != 0 ) {
+        cloto_msgqueue_destroy ( &thread->msg_queue );
+        cloto_usermsgqueue_destroy ( &thread->user_msg_queue );
+        return false;
     }
 
-    return false;
+    return true;
 }
 
 bool cloto_thread_join ( ClotoThread* thread ) {
-    int result = pthread_join ( thread->handle, NULL );
-
-    if ( result == 0 ) {
-        thread->handle = 0;
-        return true;
-    }
-
-    return false;
+    return pthread_join ( thread->handle, NULL ) == 0;
 }
 
+// pthread has no destroy, joining already released the thread
 bool cloto_thread_destroy ( ClotoThread* thread ) {
-    // pthread has no destroy, only join.
-    return thread->handle == 0;
+    cloto_msgqueue_destroy ( &thread->msg_queue );
+    cloto_usermsgqueue_destroy ( &thread->user_msg_queue );
+    return true;
 }
 
 void cloto_thread_yield() {
-    pthread_yield();
+    sched_yield();
 }
 
 void cloto_thread_sleep ( int ms ) {
@@ -813,6 +956,10 @@ uint32_t cloto_thread_send_message ( ClotoThread* to, ClotoMessageType type, con
         cloto_thread_yield();
     }
 
+    if ( to->parker != NULL ) {
+        cloto_parker_wake_all ( to->parker );
+    }
+
     return id;
 }
 
@@ -823,22 +970,122 @@ bool cloto_thread_query_message_status ( ClotoThread* destinatary, uint32_t msg_
 //--------------------------------------------------------------------------------------------------
 // Slaves
 //--------------------------------------------------------------------------------------------------
+// Pushes the slave share of the current batch into its own queue, once per batch.
+// The epoch is read again after the batch, a batch pushed in between is picked up instead.
+void cloto_slave_seed ( ClotoSlave* self ) {
+    ClotoSlaveGroup* group = self->group;
+    uint32_t epoch = group->batch_epoch;
+
+    if ( epoch == self->batch_epoch ) {
+        return;
+    }
+
+    cloto_memory_barrier();
+    const ClotoJob* batch = group->batch;
+    uint32_t size = group->batch_size;
+    cloto_memory_barrier();
+
+    if ( epoch != group->batch_epoch ) {
+        return;
+    }
+
+    // Every slave_count-th job starting from the slave id, pushed backwards so that pops follow the batch order
+    uint32_t share = ( size + group->slave_count - 1 - self->id ) / group->slave_count;
+    ClotoWorkQueue* queue = &group->queues[self->id];
+
+    for ( uint32_t k = share; k-- > 0; ) {
+        const ClotoJob* job = &batch[self->id + k * group->slave_count];
+
+        // The queue is sized for a whole batch, but run the job rather than dropping it
+        if ( !cloto_workqueue_push ( queue, job ) ) {
+            job->routine ( job->args );
+        }
+    }
+
+    // The share is in the queue once the epoch is seen
+    cloto_atomic_store_release_u32 ( &self->batch_epoch, epoch );
+}
+
+// Xorshift32, never returns 0
+uint32_t cloto_slave_random ( ClotoSlave* self ) {
+    uint32_t x = self->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    self->rng = x;
+    return x;
+}
+
+// Own queue first, then a random victim and the following ones, then the shared queue
+bool cloto_slave_fetch ( ClotoSlave* self, ClotoJob* job ) {
+    ClotoSlaveGroup* group = self->group;
+
+    if ( group->queues == NULL ) {
+        return cloto_workqueue_steal ( &group->queue, job );
+    }
+
+    cloto_slave_seed ( self );
+
+    if ( cloto_workqueue_pop ( &group->queues[self->id], job ) ) {
+        return true;
+    }
+
+    uint32_t victim = cloto_slave_random ( self ) % group->slave_count;
+
+    for ( uint32_t i = 0; i < group->slave_count; ++i ) {
+        if ( victim != self->id && cloto_workqueue_steal ( &group->queues[victim], job ) ) {
+            return true;
+        }
+
+        victim = victim + 1 < group->slave_count ? victim + 1 : 0;
+    }
+
+    return cloto_workqueue_steal ( &group->queue, job );
+}
+
 void cloto_slave_thread_routine ( void* args ) {
     ClotoSlave* self = ( ClotoSlave* ) args;
     ClotoJob job;
+    uint32_t spins = 0;
 
     while ( !self->stop_flag ) {
+        // Read before looking for work, a wake in between makes the wait return immediately
+        uint32_t epoch = cloto_parker_epoch ( &self->group->parker );
+
         if ( !cloto_thread_process_messages ( &self->thread ) ) {
             // TODO something went wrong (full user msg queue)
         }
 
-        if ( cloto_workqueue_steal ( &self->group->queue, &job ) ) {
+        if ( cloto_slave_fetch ( self, &job ) ) {
+            // Spinning paid off, spin longer next time
+            if ( spins > 0 && self->spin_limit < CLOTO_SPIN_MAX ) {
+                self->spin_limit *= 2;
+            }
+
+            spins = 0;
             job.routine ( job.args );
         } else {
 #if CLOTO_IDLE_MODE == CLOTO_IDLE_MODE_YIELD
             cloto_thread_yield();
 #elif CLOTO_IDLE_MODE == CLOTO_IDLE_MODE_SLEEP
             cloto_thread_sleep ( 1 );
+#elif CLOTO_IDLE_MODE == CLOTO_IDLE_MODE_PARK
+
+            if ( spins < self->spin_limit ) {
+                ++spins;
+                cloto_cpu_relax();
+            } else {
+                if ( self->spin_limit > CLOTO_SPIN_MIN ) {
+                    self->spin_limit /= 2;
+                }
+
+                spins = 0;
+
+                if ( !self->stop_flag ) {
+                    cloto_parker_wait ( &self->group->parker, epoch );
+                }
+            }
+
 #endif
         }
     }
@@ -848,12 +1095,17 @@ bool cloto_slave_create ( ClotoSlave* slave, ClotoSlaveGroup* group, uint32_t id
     slave->group = group;
     slave->id = id;
     slave->stop_flag = 0;
+    slave->spin_limit = CLOTO_SPIN_MIN;
+    slave->batch_epoch = group->batch_epoch;
+    slave->rng = ( 0x9e3779b9u * ( id + 1 ) ) | 1;
     CLOTO_SAFECALL ( cloto_thread_create ( &slave->thread, &cloto_slave_thread_routine, slave, 32, 32 ) );
+    slave->thread.parker = &group->parker;
     return true;
 }
 
 bool cloto_slave_join ( ClotoSlave* slave ) {
     slave->stop_flag = 1;
+    cloto_slavegroup_wake ( slave->group );
     CLOTO_SAFECALL ( cloto_thread_join ( &slave->thread ) );
     return true;
 }
@@ -863,11 +1115,24 @@ bool cloto_slave_destroy ( ClotoSlave* slave ) {
     return true;
 }
 
-bool cloto_slavegroup_create ( ClotoSlaveGroup* group, uint32_t slave_count, uint32_t queue_cap ) {
+bool cloto_slavegroup_create ( ClotoSlaveGroup* group, uint32_t slave_count, uint32_t queue_cap, bool work_stealing ) {
     group->slaves = ( ClotoSlave* ) cloto_malloc ( sizeof ( ClotoSlave ) * slave_count );
     group->slave_count = slave_count;
+    group->queues = NULL;
+    group->batch = NULL;
+    group->batch_size = 0;
+    group->batch_epoch = 0;
+    cloto_parker_init ( &group->parker );
     CLOTO_SAFECALL ( cloto_workqueue_create ( &group->queue, queue_cap ) );
 
+    if ( work_stealing ) {
+        group->queues = ( ClotoWorkQueue* ) cloto_malloc ( sizeof ( ClotoWorkQueue ) * slave_count );
+
+        for ( uint32_t i = 0; i < slave_count; ++i ) {
+            CLOTO_SAFECALL ( cloto_workqueue_create ( &group->queues[i], queue_cap ) );
+        }
+    }
+
     for ( uint32_t i = 0; i < group->slave_count; ++i ) {
         CLOTO_SAFECALL ( cloto_slave_create ( &group->slaves[i], group, i ) );
     }
@@ -881,26 +1146,62 @@ bool cloto_slavegroup_destroy ( ClotoSlaveGroup* group ) {
         group->slaves[i].stop_flag = 1;
     }
 
+    cloto_slavegroup_wake ( group );
+
     for ( size_t i = 0; i < group->slave_count; ++i ) {
         CLOTO_SAFECALL ( cloto_slave_join ( &group->slaves[i] ) )
         CLOTO_SAFECALL ( cloto_slave_destroy ( &group->slaves[i] ) )
     }
 
     cloto_workqueue_destroy ( &group->queue );
+
+    if ( group->queues != NULL ) {
+        for ( uint32_t i = 0; i < group->slave_count; ++i ) {
+            cloto_workqueue_destroy ( &group->queues[i] );
+        }
+
+        cloto_free ( group->queues );
+        group->queues = NULL;
+    }
+
     group->slave_count = 0;
     return true;
 }
 
+// Shares not yet seeded by their slave count as pending
+bool cloto_slavegroup_pending ( ClotoSlaveGroup* group ) {
+    if ( cloto_atomic_load_acquire_u32 ( &group->queue.bottom ) != cloto_atomic_load_acquire_u32 ( &group->queue.top ) ) {
+        return true;
+    }
+
+    if ( group->queues != NULL ) {
+        for ( uint32_t i = 0; i < group->slave_count; ++i ) {
+            if ( cloto_atomic_load_acquire_u32 ( &group->slaves[i].batch_epoch ) != group->batch_epoch ||
+                    cloto_atomic_load_acquire_u32 ( &group->queues[i].bottom ) != cloto_atomic_load_acquire_u32 ( &group->queues[i].top ) ) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
 void cloto_slavegroup_join ( ClotoSlaveGroup* group ) {
     ClotoJob job;
     ClotoThread* thread = cloto_thread_get();
 
-    while ( group->queue.bottom != group->queue.top ) {
+    while ( cloto_slavegroup_pending ( group ) ) {
         if ( !cloto_thread_process_messages ( thread ) ) {
             // TODO full user msg queue
         }
 
-        if ( cloto_workqueue_steal ( &group->queue, &job ) ) {
+        bool job_found = cloto_workqueue_steal ( &group->queue, &job );
+
+        for ( uint32_t i = 0; group->queues != NULL && !job_found && i < group->slave_count; ++i ) {
+            job_found = cloto_workqueue_steal ( &group->queues[i], &job );
+        }
+
+        if ( job_found ) {
             job.routine ( job.args );
         } else {
             cloto_thread_yield();
@@ -908,8 +1209,35 @@ void cloto_slavegroup_join ( ClotoSlaveGroup* group ) {
     }
 }
 
+void cloto_slavegroup_push_batch ( ClotoSlaveGroup* group, const ClotoJob* jobs, uint32_t count ) {
+    if ( group->queues == NULL ) {
+        cloto_workqueue_clear ( &group->queue );
+
+        for ( uint32_t i = 0; i < count; ++i ) {
+            cloto_workqueue_push ( &group->queue, &jobs[i] );
+        }
+    } else {
+        // Published by the epoch increment
+        group->batch = jobs;
+        group->batch_size = count;
+        cloto_atomic_fetch_add_u32 ( &group->batch_epoch, 1 );
+    }
+
+    cloto_slavegroup_wake ( group );
+}
+
 void cloto_slavegroup_reset ( ClotoSlaveGroup* group ) {
-    group->queue.bottom = 0;
+    if ( group->queues == NULL ) {
+        group->queue.bottom = 0;
+    } else {
+        cloto_atomic_fetch_add_u32 ( &group->batch_epoch, 1 );
+    }
+
+    cloto_slavegroup_wake ( group );
+}
+
+void cloto_slavegroup_wake ( ClotoSlaveGroup* group ) {
+    cloto_parker_wake_all ( &group->parker );
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -942,10 +1270,11 @@ void cloto_worker_thread_routine ( void* args ) {
             }
 
             if ( !job_found ) {
-#if CLOTO_IDLE_MODE == CLOTO_IDLE_MODE_YIELD
-                cloto_thread_yield();
-#elif CLOTO_IDLE_MODE == CLOTO_IDLE_MODE_SLEEP
+#if CLOTO_IDLE_MODE == CLOTO_IDLE_MODE_SLEEP
                 cloto_thread_sleep ( 1 );
+#else
+                // Jobs pushed from other workers don't wake anybody, workers never park
+                cloto_thread_yield();
 #endif
             }
         }
@@ -24,6 +24,22 @@
 #define RENDER_OPT_TILE_SIZE_NAME "tile-size"
 #define RENDER_OPT_TILE_SIZE_DEFAULT 128
 
+#define RENDER_OPT_DEADLINE_DESC "Milliseconds after which a loop stops (0 to disable)"
+#define RENDER_OPT_DEADLINE_NAME "deadline"
+#define RENDER_OPT_DEADLINE_DEFAULT 0
+
+#define RENDER_OPT_TARGET_ERROR_DESC "Relative error below which a tile stops being rendered (0 to disable)"
+#define RENDER_OPT_TARGET_ERROR_NAME "target-error"
+#define RENDER_OPT_TARGET_ERROR_DEFAULT 0.f
+
+#define RENDER_OPT_CHECKPOINT_DESC "File the accumulation is saved to at the end of every loop iteration (empty to disable)"
+#define RENDER_OPT_CHECKPOINT_NAME "checkpoint"
+#define RENDER_OPT_CHECKPOINT_DEFAULT ""
+
+#define RENDER_OPT_WORK_STEALING_DESC "Give each worker its own job queue and steal from the others when it is empty (0 for one shared queue)"
+#define RENDER_OPT_WORK_STEALING_NAME "work-stealing"
+#define RENDER_OPT_WORK_STEALING_DEFAULT 1
+
 #define RENDER_OPT_BOUNCES_DESC "Maximum ray bounces (-1 for unbounded)"
 #define RENDER_OPT_BOUNCES_NAME "bounces"
 #define RENDER_OPT_BOUNCES_DEFAULT 4
@@ -101,17 +117,26 @@
 #define RENDER_OPT_JITTER_NAME "jitter"
 #define RENDER_OPT_JITTER_DEFAULT 0.f
 
-#define RENDER_OPT_INTEGRATOR_DESC "Integrator [simple|direct|mis|debug-mono|debug-depth|debug-normals|debug-mis]"
+#define RENDER_OPT_INTEGRATOR_DESC "Integrator [simple|direct|mis|path|debug-mono|debug-depth|debug-normals|debug-mis]"
 #define RENDER_OPT_INTEGRATOR_NAME "integrator"
 #define RENDER_OPT_INTEGRATOR_BASIC "simple"
 #define RENDER_OPT_INTEGRATOR_DIRECT "direct"
 #define RENDER_OPT_INTEGRATOR_DIRECT_MIS "mis"
+#define RENDER_OPT_INTEGRATOR_PATH "path"
 #define RENDER_OPT_INTEGRATOR_DEBUG_MONO "debug-mono"
 #define RENDER_OPT_INTEGRATOR_DEBUG_DEPTH "debug-depth"
 #define RENDER_OPT_INTEGRATOR_DEBUG_NORMALS "debug-normals"
 #define RENDER_OPT_INTEGRATOR_DEBUG_MIS "debug-mis"
 #define RENDER_OPT_INTEGRATOR_DEFAULT RENDER_OPT_INTEGRATOR_DIRECT
 
+#define RENDER_OPT_BATCH_SHADING_DESC "Shade the primary hits grouped by material"
+#define RENDER_OPT_BATCH_SHADING_NAME "batch-shading"
+#define RENDER_OPT_BATCH_SHADING_DEFAULT 0
+
+#define RENDER_OPT_SEED_DESC "Random seed, renderings with different seeds can be merged"
+#define RENDER_OPT_SEED_NAME "seed"
+#define RENDER_OPT_SEED_DEFAULT 0
+
 //
 // Config wraps any configurable bit of the app.
 // Can be safely read/written from anywhere, although writing should probably
@@ -145,17 +170,20 @@ namespace Config {
 
         JOB_N_WORKERS = 0,
         JOB_TILE_SIZE,
+        JOB_DEADLINE_MS,
+        JOB_TARGET_ERROR,
+        JOB_CHECKPOINT,
+        JOB_WORK_STEALING,
 
 
         RENDER_MAX_BOUNCES,
         RENDER_SAMPLES,
-        RENDER_GAMMA,
-        RENDER_EXPOSURE,
-        RENDER_TONEMAP,
         RENDER_ACCELERATOR,
         RENDER_SAMPLING,
         RENDER_JITTER,
         RENDER_INTEGRATOR,
+        RENDER_BATCH_SHADING,
+        RENDER_SEED,
         RENDER_WIDTH,
         RENDER_HEIGHT,
         RENDER_SCENE_PATH,
@@ -168,6 +196,11 @@ namespace Config {
         RENDER_BEGIN = RENDER_MAX_BOUNCES,
         RENDER_END = RENDER_ENVMAP_COLOR,
 
+        // Only applied when resolving the framebuffer, changing them keeps the rendering
+        TONEMAP_GAMMA,
+        TONEMAP_EXPOSURE,
+        TONEMAP_OPERATOR,
+
         VISUALIZER_PROGRESSIVE,
 
         OPTS_COUNT
@@ -5,9 +5,11 @@
 #include <memory>
 #include <functional>
 #include <mutex>
+#include <string>
 
 // Terra
 #include <Terra.h>
+#include <TerraProfile.h>
 
 // Cloto
 #include <Cloto.h>
@@ -45,6 +47,15 @@ class TerraRenderer {
     // Call this to notify the renderer of changes to config.
     void update_config();
 
+    // Applied to the accumulated samples by the next framebuffer() call, the rendering goes on.
+    void set_tonemapping ( const TerraTonemappingOptions& tonemapping );
+
+    // Accumulation checkpoints, see terra_framebuffer_save_state(). Loading and merging replace or add to
+    // the samples of the current framebuffer, only while paused. A loop goes on from the loaded samples.
+    bool save_state ( const char* path );
+    bool load_state ( const char* path );
+    bool merge_state ( const char* path );
+
     // Getters
     const TextureData&          framebuffer();
     bool                        is_framebuffer_clear() const;
@@ -55,10 +66,11 @@ class TerraRenderer {
     bool     _launch();
     void     _setup_threads();
     void     _push_jobs();
-    void     _restart_jobs();
     void     _update_stats();
     void     _clear_stats();
     void     _process_messages();
+    bool     _deadline_passed() const; // Also checked by the tiles, which are skipped once it has passed
+    bool     _stop_criteria_met();   // Checks deadline and target error at the end of an iteration
 
     void     _num_tiles ( int& tiles_x, int& tiles_y ); // Calculates the number of tiles from the current framebuffer / tile_size
 
@@ -66,6 +78,10 @@ class TerraRenderer {
         TerraRenderer*  renderer;
         int             x, y;
         int             width, height;
+        bool            converged;  // Reached the target error, skipped until the next launch
+        double          time_ms;    // Of the last rendering, orders and splits the next iteration
+        int             base;       // Tile split into this one, see Tiles.hpp
+        uint32_t        node;
     } TerraRenderArgs;
     friend void terra_render_launcher ( void* );
 
@@ -77,7 +93,10 @@ class TerraRenderer {
     // Terra
     TerraFramebuffer                 _framebuffer;
     TextureData                      _framebuffer_data;
+    TerraTonemappingOptions          _tonemapping;
     std::vector<TerraRenderArgs>     _job_args;
+    std::vector<ClotoJob>            _jobs;     // One per tile, read by the workers while a batch is running
+    size_t                           _max_tiles; // Bounds the splits, the job queues are sized for it
 
     // Renderer state
     bool         _opt_render_change = true;
@@ -97,4 +116,9 @@ class TerraRenderer {
     int _height;
     int _tile_size;
     int _worker_count;
+    bool _work_stealing;
+    int _deadline_ms;
+    float _target_error;
+    std::string _checkpoint_path;
+    TerraClockTime _launch_time;
 };
\ No newline at end of file
@@ -4,6 +4,9 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
 
 // Terra
 #include <Terra.h>
@@ -62,8 +65,25 @@ class Scene {
 
     const TerraSceneOptions& get_options();
 
+    // Not part of the scene options, changing them doesn't invalidate the rendering
+    const TerraTonemappingOptions& get_tonemapping();
+
   private:
+    // Decoded once per path and shared by all the materials referencing it
+    struct Texture {
+        std::string  path;
+        TerraTexture texture;
+        bool         srgb = false;
+        bool         loaded = false; // Written by the loading thread, read after the join
+    };
+
     TerraTexture* _allocate_texture ( const char* texture );
+    std::string   _texture_path ( const char* texture ) const;
+    // Decoding runs on worker threads between begin and end, while the geometry is being built
+    void          _load_textures_begin();
+    void          _load_textures_end();
+    void          _release_textures();
+    static void   _load_texture ( Texture* texture );
     bool          _load_scene ( const char* filename );
     bool          _build_scene();
     void          _read_config();
@@ -77,12 +97,16 @@ class Scene {
     TerraCamera       _camera;
     HTerraScene       _scene;
     TerraSceneOptions _opts;
+    TerraTonemappingOptions _tonemapping;
     bool              _first_load = true;
 
     TerraFloat3       _envmap_color;
 
-    // Hopefully temporary
-    std::vector<std::unique_ptr<TerraTexture>> _textures;
+    // Path => texture, kept across rebuilds while the model references them
+    std::unordered_map<std::string, std::unique_ptr<Texture>> _textures;
+    std::vector<Texture*>    _texture_queue;
+    std::atomic<size_t>      _texture_next;
+    std::vector<std::thread> _texture_workers;
     // Move gen (because mesh move is idx driven)
     std::vector<uint32_t> _vert_gens;
     uint32_t _gen = 0;
@@ -0,0 +1,192 @@
+#pragma once
+
+// C++ STL
+#include <vector>
+#include <map>
+#include <cmath>
+#include <climits>
+#include <cstdint>
+#include <algorithm>
+
+//
+// Tile scheduling shared by TerraRenderer and BatchRenderer.
+// Tile types need x, y, width, height, a converged flag and the time_ms of their last rendering. base is the
+// position along the Hilbert curve of the tile they come from, node their place in its quadtree: 1 for the
+// tile itself, 4 * n + q for the quadrant q of node n.
+//
+namespace Tiles {
+    // Tiles are split until their quadrants are at least this large
+    const int SPLIT_MIN_SIZE = 16;
+    // A tile is split when its last rendering took longer than this fraction of the time share of a worker
+    const double SPLIT_SHARE = 0.25;
+    // Quadrants are merged back once together they take less than this fraction of the split limit,
+    // below the limit itself so that a tile does not flip between split and merged from pass to pass
+    const double MERGE_SHARE = 0.5;
+
+    // Grid coordinates (column, row) along a Hilbert curve, neighboring tiles get rendered together and
+    // the progressive preview grows as a compact region instead of a band
+    inline std::vector<std::pair<int, int>> hilbert_order ( int tiles_x, int tiles_y ) {
+        std::vector<std::pair<int, int>> order;
+        int n = 1;
+
+        while ( n < tiles_x || n < tiles_y ) {
+            n *= 2;
+        }
+
+        // The curve covers the power of two square, cells outside the grid are skipped
+        for ( int d = 0; d < n * n; ++d ) {
+            int x = 0;
+            int y = 0;
+
+            for ( int s = 1, t = d; s < n; s *= 2, t /= 4 ) {
+                int rx = 1 & ( t / 2 );
+                int ry = 1 & ( t ^ rx );
+
+                if ( ry == 0 ) {
+                    if ( rx == 1 ) {
+                        x = s - 1 - x;
+                        y = s - 1 - y;
+                    }
+
+                    std::swap ( x, y );
+                }
+
+                x += s * rx;
+                y += s * ry;
+            }
+
+            if ( x < tiles_x && y < tiles_y ) {
+                order.emplace_back ( x, y );
+            }
+        }
+
+        return order;
+    }
+
+    // Replaces four quadrants of the same tile by the tile once they render quickly enough, or once they have
+    // all converged. The tile takes the place of its first quadrant and is expected to take as long as all four.
+    template <typename Tile>
+    void merge_cheap ( std::vector<Tile>& tiles, double limit_ms ) {
+        std::map<std::pair<int, uint32_t>, std::vector<size_t>> siblings;
+
+        for ( size_t i = 0; i < tiles.size(); ++i ) {
+            if ( tiles[i].node > 1 ) {
+                siblings[std::make_pair ( tiles[i].base, tiles[i].node / 4 )].push_back ( i );
+            }
+        }
+
+        std::vector<bool> merged ( tiles.size(), false );
+
+        for ( const auto& group : siblings ) {
+            const std::vector<size_t>& quadrants = group.second;
+
+            if ( quadrants.size() != 4 ) {
+                continue;
+            }
+
+            size_t q[4];
+            double time_ms = 0;
+            int converged = 0;
+
+            for ( size_t i : quadrants ) {
+                q[tiles[i].node % 4] = i;
+                time_ms += tiles[i].time_ms;
+                converged += tiles[i].converged ? 1 : 0;
+            }
+
+            if ( converged != 4 && ( converged != 0 || time_ms > limit_ms * MERGE_SHARE ) ) {
+                continue;
+            }
+
+            Tile& tile = tiles[q[0]];
+            tile.width += tiles[q[1]].width;
+            tile.height += tiles[q[2]].height;
+            tile.node = group.first.second;
+            tile.time_ms = time_ms;
+            tile.converged = converged == 4;
+            merged[q[1]] = merged[q[2]] = merged[q[3]] = true;
+        }
+
+        size_t count = 0;
+
+        for ( size_t i = 0; i < tiles.size(); ++i ) {
+            if ( !merged[i] ) {
+                tiles[count++] = tiles[i];
+            }
+        }
+
+        tiles.resize ( count );
+    }
+
+    // Merges back the quadrants that got cheap, then replaces the tiles expected to end the pass with a worker
+    // still busy by their quadrants, recursively, without growing past max_tiles. The expected time comes from
+    // the last rendering, a quarter per quadrant.
+    template <typename Tile>
+    void split_expensive ( std::vector<Tile>& tiles, int workers, size_t max_tiles ) {
+        double total_ms = 0;
+
+        for ( const Tile& tile : tiles ) {
+            total_ms += tile.converged ? 0 : tile.time_ms;
+        }
+
+        double limit_ms = total_ms / workers * SPLIT_SHARE;
+        merge_cheap ( tiles, limit_ms );
+
+        for ( size_t i = 0; i < tiles.size() && tiles.size() + 3 <= max_tiles; ) {
+            Tile tile = tiles[i];
+
+            if ( tile.converged || tile.time_ms <= limit_ms || tile.width < 2 * SPLIT_MIN_SIZE || tile.height < 2 * SPLIT_MIN_SIZE ) {
+                ++i;
+                continue;
+            }
+
+            // The quadrants take the place of the tile, the first one is checked again
+            int w = tile.width / 2;
+            int h = tile.height / 2;
+            tile.time_ms /= 4;
+            Tile quadrants[4] = { tile, tile, tile, tile };
+            quadrants[0].width = quadrants[2].width = w;
+            quadrants[1].x = quadrants[3].x = tile.x + w;
+            quadrants[1].width = quadrants[3].width = tile.width - w;
+            quadrants[0].height = quadrants[1].height = h;
+            quadrants[2].y = quadrants[3].y = tile.y + h;
+            quadrants[2].height = quadrants[3].height = tile.height - h;
+
+            for ( uint32_t q = 0; q < 4; ++q ) {
+                quadrants[q].node = tile.node * 4 + q;
+            }
+
+            tiles[i] = quadrants[0];
+            tiles.insert ( tiles.begin() + i + 1, quadrants + 1, quadrants + 4 );
+        }
+    }
+
+    // Power of two the time falls in, tiles without timings come last
+    inline int time_bucket ( double time_ms ) {
+        return time_ms > 0 ? std::ilogb ( time_ms ) : INT_MIN;
+    }
+
+    // Longest processing time first, converged tiles last. Timings within a factor of two are considered
+    // equal, those tiles follow the Hilbert curve.
+    template <typename Tile>
+    void sort_longest_first ( std::vector<Tile>& tiles ) {
+        std::sort ( tiles.begin(), tiles.end(), [] ( const Tile& a, const Tile& b ) {
+            if ( a.converged != b.converged ) {
+                return b.converged;
+            }
+
+            int bucket_a = time_bucket ( a.time_ms );
+            int bucket_b = time_bucket ( b.time_ms );
+
+            if ( bucket_a != bucket_b ) {
+                return bucket_a > bucket_b;
+            }
+
+            if ( a.base != b.base ) {
+                return a.base < b.base;
+            }
+
+            return a.y != b.y ? a.y < b.y : a.x < b.x;
+        } );
+    }
+}
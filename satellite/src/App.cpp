@@ -47,6 +47,10 @@ using namespace std;
 #define CMD_MESH_NAME "mesh"
 #define CMD_MESH_LIST_NAME "list"
 #define CMD_MESH_MOVE_NAME "move"
+#define CMD_STATE_NAME "state"
+#define CMD_STATE_SAVE_NAME "save"
+#define CMD_STATE_LOAD_NAME "load"
+#define CMD_STATE_MERGE_NAME "merge"
 
 #define DEFAULT_UI_FONT "Inconsolata.ttf"
 
@@ -560,6 +564,39 @@ success:
 
         return 0;
     };
+    // state
+    auto cmd_state = [this] ( const CommandArgs & args ) {
+        string usage = MULTILINE ( R"(
+            save <path>  - Save the accumulated samples
+            load <path>  - Replace the accumulated samples with saved ones (paused)
+            merge <path> - Add saved samples, rendered with another seed (paused)" );
+
+        if ( args.size() < 2 ) {
+            Log::console ( usage.c_str() );
+            return 1;
+        }
+
+        bool result;
+
+        if ( args[0].compare ( CMD_STATE_SAVE_NAME ) == 0 ) {
+            result = _renderer.save_state ( args[1].c_str() );
+        } else if ( args[0].compare ( CMD_STATE_LOAD_NAME ) == 0 ) {
+            result = _renderer.load_state ( args[1].c_str() );
+        } else if ( args[0].compare ( CMD_STATE_MERGE_NAME ) == 0 ) {
+            result = _renderer.merge_state ( args[1].c_str() );
+        } else {
+            Log::error ( STR ( "Unrecognized command" ) );
+            return 1;
+        }
+
+        if ( !result ) {
+            Log::error ( FMT ( "Failed to %s %s", args[0].c_str(), args[1].c_str() ) );
+            return 1;
+        }
+
+        _visualizer.set_texture_data ( _renderer.framebuffer() );
+        return 0;
+    };
     //
     _c_map[CMD_CLEAR_NAME] = cmd_clear;
     _c_map[CMD_HELP_NAME] = cmd_help;
@@ -575,6 +612,7 @@ success:
     _c_map[CMD_HIDE_NAME] = cmd_hide;
     _c_map[CMD_STATS_NAME] = cmd_stats;
     _c_map[CMD_MESH_NAME] = cmd_mesh;
+    _c_map[CMD_STATE_NAME] = cmd_state;
 }
 
 int App::_boot() {
@@ -665,8 +703,12 @@ void App::_on_config_change ( bool clear ) {
     _scene.update_config();
     _gfx.update_config();
     _visualizer.update_config();
+    _renderer.set_tonemapping ( _scene.get_tonemapping() );
 
+    // Tonemapping changes don't clear, the accumulated samples are displayed again
     if ( clear ) {
         _clear();
+    } else if ( !_renderer.is_framebuffer_clear() ) {
+        _visualizer.set_texture_data ( _renderer.framebuffer() );
     }
 }
\ No newline at end of file
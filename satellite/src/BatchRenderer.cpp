@@ -0,0 +1,296 @@
+// Header
+#include <BatchRenderer.hpp>
+
+// C++ STL
+#include <algorithm>
+#include <cstring>
+
+// Satellite
+#include <Logging.hpp>
+
+using namespace std;
+
+BatchRenderer::BatchRenderer() {
+    memset ( &_framebuffer, 0, sizeof ( TerraFramebuffer ) );
+    _next_tile = 0;
+}
+
+BatchRenderer::~BatchRenderer() {
+    _stop_threads();
+
+    if ( _framebuffer.results != nullptr ) {
+        terra_framebuffer_destroy ( &_framebuffer );
+    }
+}
+
+bool BatchRenderer::render ( const TerraCamera& camera, HTerraScene scene, int width, int height, int passes ) {
+    int workers = Config::read_i ( Config::JOB_N_WORKERS );
+    int tile_size = Config::read_i ( Config::JOB_TILE_SIZE );
+    _deadline_ms = Config::read_i ( Config::JOB_DEADLINE_MS );
+    _target_error = Config::read_f ( Config::JOB_TARGET_ERROR );
+    _checkpoint_path = Config::read_s ( Config::JOB_CHECKPOINT );
+    _work_stealing = Config::read_i ( Config::JOB_WORK_STEALING ) != 0;
+
+    if ( workers <= 0 || tile_size <= 0 ) {
+        Log::error ( FMT ( "Invalid job options, %d workers with tiles of %d pixels", workers, tile_size ) );
+        return false;
+    }
+
+    if ( passes <= 0 && _deadline_ms <= 0 && _target_error <= 0 ) {
+        Log::error ( STR ( "An unbounded rendering needs a deadline or a target error" ) );
+        return false;
+    }
+
+    if ( _framebuffer.results != nullptr ) {
+        terra_framebuffer_destroy ( &_framebuffer );
+        memset ( &_framebuffer, 0, sizeof ( TerraFramebuffer ) );
+    }
+
+    if ( !terra_framebuffer_create ( &_framebuffer, width, height ) ) {
+        Log::error ( FMT ( "Failed to create Terra framebuffer %dx%d", width, height ) );
+        return false;
+    }
+
+    // A missing checkpoint starts from scratch, the file is created by the first pass
+    if ( !_checkpoint_path.empty() ) {
+        if ( terra_framebuffer_load_state ( &_framebuffer, _checkpoint_path.c_str() ) ) {
+            Log::info ( FMT ( "Resuming from checkpoint %s", _checkpoint_path.c_str() ) );
+        } else {
+            terra_framebuffer_clear ( &_framebuffer );
+        }
+    }
+
+    _target_camera = &camera;
+    _target_scene = scene;
+    _samples_per_pixel = terra_scene_get_options ( scene )->samples_per_pixel;
+    _stats = Stats();
+    _stats.workers.resize ( workers );
+    _setup_tiles ( tile_size );
+    _setup_threads ( workers );
+    Log::info ( FMT ( "Rendering %dx%d, %d tiles on %d workers", width, height, ( int ) _tiles.size(), workers ) );
+    _launch_time = terra_clock();
+
+    do {
+        _run_pass();
+
+        // Only the tiles rendered since the previous pass are written
+        if ( !_checkpoint_path.empty() && !terra_framebuffer_save_state ( &_framebuffer, _checkpoint_path.c_str(), true ) ) {
+            Log::error ( FMT ( "Failed to save checkpoint %s", _checkpoint_path.c_str() ) );
+        }
+    } while ( !_stop_criteria_met ( passes ) );
+
+    _stats.elapsed_ms = terra_clock_to_ms ( terra_clock() - _launch_time );
+    _stop_threads();
+
+    for ( const WorkerStats& worker : _stats.workers ) {
+        _stats.tiles += worker.tiles;
+        _stats.samples += worker.samples;
+    }
+
+    return true;
+}
+
+const TerraFloat3* BatchRenderer::resolve ( const TerraTonemappingOptions& tonemapping ) {
+    if ( _framebuffer.results == nullptr ) {
+        Log::error ( STR ( "Nothing to resolve, no rendering has been started" ) );
+        return nullptr;
+    }
+
+    terra_framebuffer_resolve ( &_framebuffer, &tonemapping );
+    return ( const TerraFloat3* ) _framebuffer.pixels;
+}
+
+int BatchRenderer::width() const {
+    return ( int ) _framebuffer.width;
+}
+
+int BatchRenderer::height() const {
+    return ( int ) _framebuffer.height;
+}
+
+const BatchRenderer::Stats& BatchRenderer::stats() const {
+    return _stats;
+}
+
+void BatchRenderer::_setup_threads ( int workers ) {
+    _stop_threads();
+    _quit = false;
+    _pass = 0;
+    _active = 0;
+    _ranges.reset ( _work_stealing ? new TileRange[workers] : nullptr );
+
+    for ( int i = 0; i < workers; ++i ) {
+        _threads.emplace_back ( &BatchRenderer::_worker, this, i );
+    }
+}
+
+void BatchRenderer::_stop_threads() {
+    {
+        lock_guard<mutex> lock ( _mutex );
+        _quit = true;
+    }
+
+    _pass_begin.notify_all();
+
+    for ( thread& t : _threads ) {
+        t.join();
+    }
+
+    _threads.clear();
+}
+
+void BatchRenderer::_setup_tiles ( int tile_size ) {
+    int tiles_x = ( int ) ( _framebuffer.width + tile_size - 1 ) / tile_size;
+    int tiles_y = ( int ) ( _framebuffer.height + tile_size - 1 ) / tile_size;
+    _tiles.clear();
+    _max_tiles = ( size_t ) tiles_x * tiles_y * 4;
+
+    for ( const pair<int, int>& cell : Tiles::hilbert_order ( tiles_x, tiles_y ) ) {
+        int j = cell.first;
+        int i = cell.second;
+        Tile tile;
+        tile.x = j * tile_size;
+        tile.y = i * tile_size;
+        tile.width = ( int ) terra_mini ( ( size_t ) ( j + 1 ) * tile_size, _framebuffer.width ) - j * tile_size;
+        tile.height = ( int ) terra_mini ( ( size_t ) ( i + 1 ) * tile_size, _framebuffer.height ) - i * tile_size;
+        tile.converged = false;
+        tile.time_ms = 0;
+        tile.base = ( int ) _tiles.size();
+        tile.node = 1;
+        _tiles.push_back ( tile );
+    }
+}
+
+// Wakes up the workers and waits for all of them to run out of tiles
+void BatchRenderer::_run_pass() {
+    unique_lock<mutex> lock ( _mutex );
+    size_t workers = _threads.size();
+    Tiles::split_expensive ( _tiles, ( int ) workers, _max_tiles );
+    Tiles::sort_longest_first ( _tiles );
+    _next_tile = 0;
+
+    // Dealt round robin, every worker starts with one of the longest tiles
+    for ( size_t i = 0; _ranges != nullptr && i < workers; ++i ) {
+        _ranges[i].next = 0;
+        _ranges[i].end = ( _tiles.size() + workers - 1 - i ) / workers;
+    }
+
+    _active = ( int ) _threads.size();
+    ++_pass;
+    _pass_begin.notify_all();
+    _pass_end.wait ( lock, [this] () {
+        return _active == 0;
+    } );
+    ++_stats.passes;
+}
+
+void BatchRenderer::_worker ( int id ) {
+    WorkerStats& stats = _stats.workers[id];
+    uint32_t rng = ( 0x9e3779b9u * ( id + 1 ) ) | 1;
+    int pass = 0;
+    unique_lock<mutex> lock ( _mutex );
+
+    for ( ;; ) {
+        _pass_begin.wait ( lock, [this, pass] () {
+            return _quit || _pass != pass;
+        } );
+
+        if ( _quit ) {
+            return;
+        }
+
+        pass = _pass;
+        lock.unlock();
+
+        // Past the deadline the tiles left are not handed out, the pass ends with the ones being rendered
+        while ( !_deadline_passed() ) {
+            size_t t = _fetch_tile ( id, rng );
+
+            if ( t >= _tiles.size() ) {
+                break;
+            }
+
+            Tile& tile = _tiles[t];
+
+            if ( tile.converged ) {
+                continue;
+            }
+
+            TerraClockTime begin = terra_clock();
+            terra_render ( _target_camera, _target_scene, &_framebuffer, tile.x, tile.y, tile.width, tile.height );
+
+            if ( _target_error > 0 ) {
+                tile.converged = terra_framebuffer_error ( &_framebuffer, tile.x, tile.y, tile.width, tile.height ) <= _target_error;
+            }
+
+            double ms = terra_clock_to_ms ( terra_clock() - begin );
+            tile.time_ms = ms;
+            stats.tile_ms_min = stats.tiles == 0 ? ms : min ( stats.tile_ms_min, ms );
+            stats.tile_ms_max = max ( stats.tile_ms_max, ms );
+            stats.busy_ms += ms;
+            stats.samples += ( uint64_t ) tile.width * tile.height * _samples_per_pixel;
+            ++stats.tiles;
+        }
+
+        lock.lock();
+
+        if ( --_active == 0 ) {
+            _pass_end.notify_one();
+        }
+    }
+}
+
+// Own range first, then a random victim and the following ones. Returns _tiles.size() once all are taken.
+size_t BatchRenderer::_fetch_tile ( int id, uint32_t& rng ) {
+    if ( _ranges == nullptr ) {
+        return _next_tile++;
+    }
+
+    size_t workers = _threads.size();
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    size_t victim = rng % workers;
+
+    for ( size_t i = 0; i <= workers; ++i ) {
+        size_t owner = i == 0 ? ( size_t ) id : victim;
+        TileRange& range = _ranges[owner];
+
+        // Empty ranges are skipped without writing to their cache line
+        if ( range.next.load ( memory_order_relaxed ) < range.end ) {
+            size_t slot = range.next++;
+
+            if ( slot < range.end ) {
+                return owner + slot * workers;
+            }
+        }
+
+        if ( i > 0 ) {
+            victim = victim + 1 < workers ? victim + 1 : 0;
+        }
+    }
+
+    return _tiles.size();
+}
+
+bool BatchRenderer::_deadline_passed() const {
+    return _deadline_ms > 0 && terra_clock_to_ms ( terra_clock() - _launch_time ) >= _deadline_ms;
+}
+
+bool BatchRenderer::_stop_criteria_met ( int passes ) {
+    bool done = passes > 0 && _stats.passes >= passes;
+    bool deadline = _deadline_passed();
+    bool converged = _target_error > 0;
+
+    for ( const Tile& tile : _tiles ) {
+        converged = converged && tile.converged;
+    }
+
+    if ( deadline ) {
+        Log::info ( FMT ( "Deadline reached after %d passes", _stats.passes ) );
+    } else if ( converged ) {
+        Log::info ( FMT ( "Target error reached after %d passes", _stats.passes ) );
+    }
+
+    return done || deadline || converged;
+}
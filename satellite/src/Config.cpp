@@ -15,12 +15,18 @@
 #include <memory>
 #include <map>
 #include <shared_mutex>
+#include <mutex>
 #include <iomanip>
 
+// libc
+#include <cstring>
+
 using namespace std;
 
 #ifdef _WIN32
     #include <Windows.h>
+#else
+    #define _strdup strdup
 #endif
 
 namespace Config {
@@ -55,7 +61,10 @@ namespace Config {
                 type = other.type;
 
                 if ( type == Type::Str ) {
-                    v.s = _strdup ( other.v.s );
+                    // Unlike _strdup, strdup doesn't accept null
+                    if ( other.v.s != nullptr ) {
+                        v.s = _strdup ( other.v.s );
+                    }
                 } else if ( type == Type::Int ) {
                     v.i = other.v.i;
                 } else if ( type == Type::Real ) {
@@ -280,6 +289,7 @@ namespace Config {
         TRY_COMPARE_S ( s, RENDER_OPT_INTEGRATOR_BASIC, kTerraIntegratorSimple );
         TRY_COMPARE_S ( s, RENDER_OPT_INTEGRATOR_DIRECT, kTerraIntegratorDirect );
         TRY_COMPARE_S ( s, RENDER_OPT_INTEGRATOR_DIRECT_MIS, kTerraIntegratorDirectMis );
+        TRY_COMPARE_S ( s, RENDER_OPT_INTEGRATOR_PATH, kTerraIntegratorPath );
         TRY_COMPARE_S ( s, RENDER_OPT_INTEGRATOR_DEBUG_MONO, kTerraIntegratorDebugMono );
         TRY_COMPARE_S ( s, RENDER_OPT_INTEGRATOR_DEBUG_DEPTH, kTerraIntegratorDebugDepth );
         TRY_COMPARE_S ( s, RENDER_OPT_INTEGRATOR_DEBUG_NORMALS, kTerraIntegratorDebugNormals );
@@ -323,11 +333,15 @@ namespace Config {
         float envmap[] = RENDER_OPT_ENVMAP_COLOR_DEFAULT;
         add_opt ( JOB_N_WORKERS,            RENDER_OPT_WORKERS_DEFAULT,             RENDER_OPT_WORKERS_NAME,            RENDER_OPT_WORKERS_DESC );
         add_opt ( JOB_TILE_SIZE,            RENDER_OPT_TILE_SIZE_DEFAULT,           RENDER_OPT_TILE_SIZE_NAME,          RENDER_OPT_TILE_SIZE_DESC );
+        add_opt ( JOB_DEADLINE_MS,          RENDER_OPT_DEADLINE_DEFAULT,            RENDER_OPT_DEADLINE_NAME,           RENDER_OPT_DEADLINE_DESC );
+        add_opt ( JOB_TARGET_ERROR,         RENDER_OPT_TARGET_ERROR_DEFAULT,        RENDER_OPT_TARGET_ERROR_NAME,       RENDER_OPT_TARGET_ERROR_DESC );
+        add_opt ( JOB_CHECKPOINT,           RENDER_OPT_CHECKPOINT_DEFAULT,          RENDER_OPT_CHECKPOINT_NAME,         RENDER_OPT_CHECKPOINT_DESC );
+        add_opt ( JOB_WORK_STEALING,        RENDER_OPT_WORK_STEALING_DEFAULT,       RENDER_OPT_WORK_STEALING_NAME,      RENDER_OPT_WORK_STEALING_DESC );
         add_opt ( RENDER_MAX_BOUNCES,       RENDER_OPT_BOUNCES_DEFAULT,             RENDER_OPT_BOUNCES_NAME,            RENDER_OPT_BOUNCES_DESC );
         add_opt ( RENDER_SAMPLES,           RENDER_OPT_SAMPLES_DEFAULT,             RENDER_OPT_SAMPLES_NAME,            RENDER_OPT_SAMPLES_DESC );
-        add_opt ( RENDER_GAMMA,             RENDER_OPT_GAMMA_DEFAULT,               RENDER_OPT_GAMMA_NAME,              RENDER_OPT_GAMMA_DESC );
-        add_opt ( RENDER_EXPOSURE,          RENDER_OPT_EXPOSURE_DEFAULT,            RENDER_OPT_EXPOSURE_NAME,           RENDER_OPT_EXPOSURE_DESC );
-        add_opt ( RENDER_TONEMAP,           RENDER_OPT_TONEMAP_DEFAULT,             RENDER_OPT_TONEMAP_NAME,            RENDER_OPT_TONEMAP_DESC );
+        add_opt ( TONEMAP_GAMMA,            RENDER_OPT_GAMMA_DEFAULT,               RENDER_OPT_GAMMA_NAME,              RENDER_OPT_GAMMA_DESC );
+        add_opt ( TONEMAP_EXPOSURE,         RENDER_OPT_EXPOSURE_DEFAULT,            RENDER_OPT_EXPOSURE_NAME,           RENDER_OPT_EXPOSURE_DESC );
+        add_opt ( TONEMAP_OPERATOR,         RENDER_OPT_TONEMAP_DEFAULT,             RENDER_OPT_TONEMAP_NAME,            RENDER_OPT_TONEMAP_DESC );
         add_opt ( RENDER_ACCELERATOR,       RENDER_OPT_ACCELERATOR_DEFAULT,         RENDER_OPT_ACCELERATOR_NAME,        RENDER_OPT_ACCELERATOR_DESC );
         add_opt ( RENDER_SAMPLING,          RENDER_OPT_SAMPLER_DEFAULT,             RENDER_OPT_SAMPLER_NAME,            RENDER_OPT_SAMPLER_DESC );
         add_opt ( RENDER_WIDTH,             RENDER_OPT_WIDTH_DEFAULT,               RENDER_OPT_WIDTH_NAME,              RENDER_OPT_WIDTH_DESC );
@@ -341,6 +355,8 @@ namespace Config {
         add_opt ( RENDER_ENVMAP_COLOR,      envmap,                                 RENDER_OPT_ENVMAP_COLOR_NAME,       RENDER_OPT_ENVMAP_COLOR_DESC );
         add_opt ( RENDER_JITTER,            RENDER_OPT_JITTER_DEFAULT,              RENDER_OPT_JITTER_NAME,             RENDER_OPT_JITTER_DESC );
         add_opt ( RENDER_INTEGRATOR,        RENDER_OPT_INTEGRATOR_DEFAULT,          RENDER_OPT_INTEGRATOR_NAME,         RENDER_OPT_INTEGRATOR_DESC );
+        add_opt ( RENDER_BATCH_SHADING,     RENDER_OPT_BATCH_SHADING_DEFAULT,       RENDER_OPT_BATCH_SHADING_NAME,      RENDER_OPT_BATCH_SHADING_DESC );
+        add_opt ( RENDER_SEED,              RENDER_OPT_SEED_DEFAULT,                RENDER_OPT_SEED_NAME,               RENDER_OPT_SEED_DESC );
         /*if ( !load () ) {
             Log::info ( STR ( "No configuration file loaded." ) );
             return true;
@@ -435,11 +451,15 @@ namespace Config {
         float envmap[] = RENDER_OPT_ENVMAP_COLOR_DEFAULT;
         write_i ( JOB_N_WORKERS, n_threads );
         write_i ( JOB_TILE_SIZE, RENDER_OPT_TILE_SIZE_DEFAULT );
+        write_i ( JOB_DEADLINE_MS, RENDER_OPT_DEADLINE_DEFAULT );
+        write_f ( JOB_TARGET_ERROR, RENDER_OPT_TARGET_ERROR_DEFAULT );
+        write_s ( JOB_CHECKPOINT, RENDER_OPT_CHECKPOINT_DEFAULT );
+        write_i ( JOB_WORK_STEALING, RENDER_OPT_WORK_STEALING_DEFAULT );
         write_i ( RENDER_MAX_BOUNCES, RENDER_OPT_BOUNCES_DEFAULT );
         write_i ( RENDER_SAMPLES, RENDER_OPT_SAMPLES_DEFAULT );
-        write_f ( RENDER_GAMMA, RENDER_OPT_GAMMA_DEFAULT );
-        write_f ( RENDER_EXPOSURE, RENDER_OPT_EXPOSURE_DEFAULT );
-        write_s ( RENDER_TONEMAP, RENDER_OPT_TONEMAP_DEFAULT );
+        write_f ( TONEMAP_GAMMA, RENDER_OPT_GAMMA_DEFAULT );
+        write_f ( TONEMAP_EXPOSURE, RENDER_OPT_EXPOSURE_DEFAULT );
+        write_s ( TONEMAP_OPERATOR, RENDER_OPT_TONEMAP_DEFAULT );
         write_s ( RENDER_ACCELERATOR, RENDER_OPT_ACCELERATOR_DEFAULT );
         write_s ( RENDER_SAMPLING, RENDER_OPT_SAMPLER_DEFAULT );
         write_i ( RENDER_WIDTH, RENDER_OPT_WIDTH_DEFAULT );
@@ -453,6 +473,8 @@ namespace Config {
         write_f3 ( RENDER_ENVMAP_COLOR, envmap );
         write_f ( RENDER_JITTER, RENDER_OPT_JITTER_DEFAULT );
         write_s ( RENDER_INTEGRATOR, RENDER_OPT_INTEGRATOR_DEFAULT );
+        write_i ( RENDER_BATCH_SHADING, RENDER_OPT_BATCH_SHADING_DEFAULT );
+        write_i ( RENDER_SEED, RENDER_OPT_SEED_DEFAULT );
     }
 
     bool load ( const char* path ) {
@@ -483,14 +505,14 @@ namespace Config {
     bool save ( const char* path ) {
         unique_lock<shared_mutex> ( opts_lock );
         // TODO save at given path
-        Log::info ( FMT ( "Feature not supported yet." ) );
+        Log::info ( STR ( "Feature not supported yet." ) );
         return true;
     }
 
     bool save() {
         unique_lock<shared_mutex> ( opts_lock );
         // TODO save at config_path
-        Log::info ( FMT ( "Feature not supported yet." ) );
+        Log::info ( STR ( "Feature not supported yet." ) );
         return true;
     }
 
@@ -2,7 +2,9 @@
 #include <Logging.hpp>
 
 // Satellite
+#ifndef SATELLITE_HEADLESS
 #include <Console.hpp>
+#endif
 
 // stdlib
 #include <cstdarg>
@@ -38,7 +40,23 @@ namespace {
         va_end ( args );
     }
 
+    // The headless build has no console, console_p is never set
+    void console_vprintf ( const char* fmt, va_list args ) {
+#ifndef SATELLITE_HEADLESS
+        console_p->vprintf ( fmt, args );
+#endif
+    }
+
     void print ( FILE* fp, const char* fun, const char* tag, const char* fmt, va_list args ) {
+        // Disabled channel
+        if ( fp == nullptr ) {
+            return;
+        }
+
+        // A va_list can only be walked once
+        va_list args_cp;
+        va_copy ( args_cp, args );
+
         if ( ( fp != stdout && fp != stderr ) || console_p == nullptr ) {
             string new_fmt = tag;
             new_fmt += "> ";
@@ -54,10 +72,12 @@ namespace {
             new_fmt += "> ";
             new_fmt += fmt;
             new_fmt += "\n";
-            console_p->vprintf ( new_fmt.c_str(), args );
+            console_vprintf ( new_fmt.c_str(), args_cp );
         } else {
-            vbuf ( fmt, args );
+            vbuf ( fmt, args_cp );
         }
+
+        va_end ( args_cp );
     }
 
 }
@@ -93,15 +113,18 @@ namespace Log {
 
         va_list args;
         va_start ( args, fmt );
-        console_p->vprintf ( fmt, args );
+        console_vprintf ( fmt, args );
         va_end ( args );
     }
 
     void flush() {
+#ifndef SATELLITE_HEADLESS
         if ( console_p ) {
             for ( const string& s : console_buf ) {
                 console_p->printf ( "boot> %s", s.c_str() );
             }
         }
+
+#endif
     }
 }
\ No newline at end of file
@@ -10,6 +10,7 @@
 #define CLOTO_IMPLEMENTATION
 #include <Cloto.h>
 #include <Config.hpp>
+#include <Tiles.hpp>
 
 // Terra
 #include <TerraProfile.h>
@@ -72,6 +73,12 @@ void terra_render_launcher ( void* _args ) {
     using Args = TerraRenderer::TerraRenderArgs;
     Args* args = ( Args* ) _args;
 
+    // Past the deadline of a loop the tiles left in the queues are dropped, the iteration ends with the ones being rendered
+    if ( args->converged || ( args->renderer->_iterative && args->renderer->_deadline_passed() ) ) {
+        cloto_atomic_fetch_add_u32 ( &args->renderer->_tile_counter, -1 );
+        return;
+    }
+
     if ( args->renderer->_on_tile_begin ) {
         ClotoMessageJobPayload msg;
         msg.routine = tile_msg_stub;
@@ -80,7 +87,15 @@ void terra_render_launcher ( void* _args ) {
         cloto_thread_send_message ( args->renderer->thread(), CLOTO_MSG_JOB_LOCAL_ARGS, &msg, sizeof ( msg ) );
     }
 
+    TerraClockTime begin = terra_clock();
     terra_render ( args->renderer->_target_camera, args->renderer->_target_scene, &args->renderer->_framebuffer, args->x, args->y, args->width, args->height );
+    args->time_ms = terra_clock_to_ms ( terra_clock() - begin );
+
+    if ( args->renderer->_target_error > 0 ) {
+        float error = terra_framebuffer_error ( &args->renderer->_framebuffer, args->x, args->y, args->width, args->height );
+        args->converged = error <= args->renderer->_target_error;
+    }
+
     TERRA_PROFILE_UPDATE_LOCAL_STATS ( TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_RENDER );
     TERRA_PROFILE_UPDATE_LOCAL_STATS ( TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_RAY );
     TERRA_PROFILE_UPDATE_LOCAL_STATS ( TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_TRACE );
@@ -105,6 +120,11 @@ TerraRenderer::TerraRenderer ( ) {
     _tile_counter = 0;
     _target_camera = nullptr;
     _target_scene = nullptr;
+    _tonemapping.tonemapping_operator = kTerraTonemappingOperatorLinear;
+    _tonemapping.manual_exposure = 1.f;
+    _tonemapping.gamma = 2.2f;
+    _deadline_ms = 0;
+    _target_error = 0;
 }
 
 TerraRenderer::~TerraRenderer() {
@@ -126,6 +146,11 @@ void TerraRenderer::update() {
     if ( _tile_counter == 0 ) {
         _update_stats();
 
+        // Only the tiles rendered since the previous iteration are written
+        if ( _iterative && !_checkpoint_path.empty() && !terra_framebuffer_save_state ( &_framebuffer, _checkpoint_path.c_str(), true ) ) {
+            Log::error ( FMT ( "Failed to save checkpoint %s", _checkpoint_path.c_str() ) );
+        }
+
         // Notifying
         if ( _on_step_end ) {
             _on_step_end();
@@ -138,15 +163,16 @@ void TerraRenderer::update() {
                 // TODO move this out, make the rendering stop asap
                 Log::warning ( STR ( "Rendering settings were changed. Call step() or loop() to begin a new rendering." ) );
                 _paused = true;
+            } else if ( _stop_criteria_met() ) {
+                _paused = true;
             } else {
                 if ( _opt_job_change ) {
                     _setup_threads();
                     _opt_job_change = false;
-                    _push_jobs();
-                } else {
-                    _restart_jobs();
                 }
 
+                _push_jobs();
+
                 ++_iterations;
             }
         } else {
@@ -158,6 +184,11 @@ void TerraRenderer::update() {
 
 void TerraRenderer::clear() {
     terra_framebuffer_clear ( &_framebuffer );
+
+    for ( TerraRenderArgs& args : _job_args ) {
+        args.converged = false;
+    }
+
     _clear_stats();
     _clear_framebuffer = true;
 }
@@ -205,6 +236,7 @@ void TerraRenderer::update_config() {
     // We defer the actual update until a new rendering step is required
     if ( _tile_size != Config::read_i ( Config::JOB_TILE_SIZE )
             || _worker_count != Config::read_f ( Config::JOB_N_WORKERS )
+            || _work_stealing != ( Config::read_i ( Config::JOB_WORK_STEALING ) != 0 )
        ) {
         // Update the job system, keep the current rendering valid
         _opt_job_change = true;
@@ -216,10 +248,67 @@ void TerraRenderer::update_config() {
         // Restart the rendering
         _opt_render_change = true;
     }
+
+    _deadline_ms = Config::read_i ( Config::JOB_DEADLINE_MS );
+    _target_error = Config::read_f ( Config::JOB_TARGET_ERROR );
+    _checkpoint_path = Config::read_s ( Config::JOB_CHECKPOINT );
+}
+
+bool TerraRenderer::save_state ( const char* path ) {
+    if ( _framebuffer.results == nullptr ) {
+        Log::error ( STR ( "Nothing to save, no rendering has been started" ) );
+        return false;
+    }
+
+    return terra_framebuffer_save_state ( &_framebuffer, path, false );
+}
+
+bool TerraRenderer::load_state ( const char* path ) {
+    if ( !_paused || _framebuffer.results == nullptr ) {
+        Log::error ( STR ( "The renderer has to be paused, after a rendering has been started" ) );
+        return false;
+    }
+
+    if ( !terra_framebuffer_load_state ( &_framebuffer, path ) ) {
+        return false;
+    }
+
+    _clear_framebuffer = false;
+    return true;
+}
+
+bool TerraRenderer::merge_state ( const char* path ) {
+    if ( !_paused || _framebuffer.results == nullptr ) {
+        Log::error ( STR ( "The renderer has to be paused, after a rendering has been started" ) );
+        return false;
+    }
+
+    TerraFramebuffer other;
+
+    if ( !terra_framebuffer_create_format ( &other, _framebuffer.width, _framebuffer.height, ( TerraPixelFormat ) _framebuffer.pixel_format,
+                                            ( TerraAccumulationFormat ) _framebuffer.accumulation_format ) ) {
+        return false;
+    }
+
+    bool merged = terra_framebuffer_load_state ( &other, path ) && terra_framebuffer_merge ( &_framebuffer, &other );
+    terra_framebuffer_destroy ( &other );
+
+    if ( merged ) {
+        _clear_framebuffer = false;
+    }
+
+    return merged;
 }
 
 const TextureData& TerraRenderer::framebuffer() {
     assert ( sizeof ( TerraFloat3 ) == sizeof ( float ) * 3 );
+
+    // Rendering only accumulates, the tiles finished since the last call are tonemapped here.
+    // Every tile is tonemapped again after set_tonemapping changed the options.
+    if ( _framebuffer.results != nullptr ) {
+        terra_framebuffer_resolve ( &_framebuffer, &_tonemapping );
+    }
+
     _framebuffer_data.data = ( float* ) _framebuffer.pixels;
     _framebuffer_data.width = ( int ) _framebuffer.width;
     _framebuffer_data.height = ( int ) _framebuffer.height;
@@ -227,6 +316,10 @@ const TextureData& TerraRenderer::framebuffer() {
     return _framebuffer_data;
 }
 
+void TerraRenderer::set_tonemapping ( const TerraTonemappingOptions& tonemapping ) {
+    _tonemapping = tonemapping;
+}
+
 bool TerraRenderer::is_framebuffer_clear() const {
     return _clear_framebuffer;
 }
@@ -253,10 +346,40 @@ void TerraRenderer::_clear_stats() {
     TERRA_PROFILE_CLEAR_TARGET ( TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_RAY_TRIANGLE_INTERSECTION );
 }
 
+bool TerraRenderer::_deadline_passed() const {
+    return _deadline_ms > 0 && terra_clock_to_ms ( terra_clock() - _launch_time ) >= _deadline_ms;
+}
+
+bool TerraRenderer::_stop_criteria_met() {
+    bool deadline = _deadline_passed();
+    bool converged = _target_error > 0;
+
+    for ( const TerraRenderArgs& args : _job_args ) {
+        converged = converged && args.converged;
+    }
+
+    if ( !deadline && !converged ) {
+        return false;
+    }
+
+    size_t samples = 0;
+
+    for ( size_t y = 0; y < _framebuffer.height; ++y ) {
+        for ( size_t x = 0; x < _framebuffer.width; ++x ) {
+            samples += terra_framebuffer_get_result ( &_framebuffer, x, y ).samples;
+        }
+    }
+
+    float error = terra_framebuffer_error ( &_framebuffer, 0, 0, _framebuffer.width, _framebuffer.height );
+    float spp = ( float ) samples / ( _framebuffer.width * _framebuffer.height );
+    Log::info ( FMT ( "%s after %d iterations: error %f, %.1f samples per pixel", converged ? "Target error reached" : "Deadline reached", _iterations, error, spp ) );
+    return true;
+}
+
 void TerraRenderer::_num_tiles ( int& tiles_x, int& tiles_y ) {
     int tile_size = Config::read_i ( Config::Opts::JOB_TILE_SIZE );
 
-    if ( _framebuffer.pixels == nullptr || tile_size < 0 ) {
+    if ( _framebuffer.results == nullptr || tile_size < 0 ) {
         Log::error ( STR ( "Internal state not initialized" ) );
         return;
     }
@@ -267,6 +390,9 @@ void TerraRenderer::_num_tiles ( int& tiles_x, int& tiles_y ) {
 
 void TerraRenderer::_setup_threads () {
     int workers = Config::read_i ( Config::JOB_N_WORKERS );
+    _worker_count = workers;
+    _tile_size = Config::read_i ( Config::JOB_TILE_SIZE );
+    _work_stealing = Config::read_i ( Config::JOB_WORK_STEALING ) != 0;
 
     // Free previous allocations
     if ( _workers != nullptr ) {
@@ -278,7 +404,9 @@ void TerraRenderer::_setup_threads () {
     // Compute tile/queue size
     int tx, ty;
     _num_tiles ( tx, ty );
-    int job_buffer_size = tx * ty;
+    // Room for the splits of the expensive tiles
+    int job_buffer_size = tx * ty * 4;
+    _max_tiles = job_buffer_size;
     // Rounding to next power of two, we should also try the `countleadingzeros` intrinsic
     // http://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2
     {
@@ -292,7 +420,7 @@ void TerraRenderer::_setup_threads () {
     }
     // create workers
     _workers.reset ( new ClotoSlaveGroup );
-    cloto_slavegroup_create ( _workers.get(), workers, job_buffer_size );
+    cloto_slavegroup_create ( _workers.get(), workers, job_buffer_size, _work_stealing );
     // setup profiler
     TERRA_PROFILE_CREATE_SESSION ( TERRA_PROFILE_SESSION_DEFAULT, workers );
     TERRA_PROFILE_CREATE_TARGET ( time, TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_RENDER, 0xaffff );
@@ -317,44 +445,38 @@ void TerraRenderer::_setup_threads () {
     int num_tiles_x, num_tiles_y;
     _num_tiles ( num_tiles_x, num_tiles_y );
     _job_args.clear();
-    _job_args.resize ( num_tiles_x * num_tiles_y );
-
-    for ( int i = 0; i < num_tiles_y; ++i ) {
-        for ( int j = 0; j < num_tiles_x; ++j ) {
-            TerraRenderArgs* args = _job_args.data() + i * num_tiles_x + j;
-            args->renderer = this;
-            args->x = j * tile_size;
-            args->y = i * tile_size;
-            args->width = ( int ) terra_mini ( ( size_t ) ( j + 1 ) * tile_size, _framebuffer.width ) - j * tile_size;
-            args->height = ( int ) terra_mini ( ( size_t ) ( i + 1 ) * tile_size, _framebuffer.height ) - i * tile_size;
-        }
+
+    for ( const pair<int, int>& cell : Tiles::hilbert_order ( num_tiles_x, num_tiles_y ) ) {
+        int j = cell.first;
+        int i = cell.second;
+        TerraRenderArgs args;
+        args.renderer = this;
+        args.x = j * tile_size;
+        args.y = i * tile_size;
+        args.width = ( int ) terra_mini ( ( size_t ) ( j + 1 ) * tile_size, _framebuffer.width ) - j * tile_size;
+        args.height = ( int ) terra_mini ( ( size_t ) ( i + 1 ) * tile_size, _framebuffer.height ) - i * tile_size;
+        args.converged = false;
+        args.time_ms = 0;
+        args.base = ( int ) _job_args.size();
+        args.node = 1;
+        _job_args.push_back ( args );
     }
 }
 
+// Splits and orders the tiles with the timings of the previous iteration, the first one follows the Hilbert curve.
+// Jobs are dealt round robin to the workers with work stealing, every worker starts with one of the longest tiles.
 void TerraRenderer::_push_jobs() {
-    int num_tiles_x, num_tiles_y;
-    _num_tiles ( num_tiles_x, num_tiles_y );
-    _tile_counter = num_tiles_x * num_tiles_y;
-    Log::verbose ( FMT ( "Pushing %d jobs", _tile_counter ) );
-    cloto_workqueue_clear ( &_workers->queue );
-
-    for ( int i = 0; i < num_tiles_y; ++i ) {
-        for ( int j = 0; j < num_tiles_x; ++j ) {
-            TerraRenderArgs* args = _job_args.data() + i * num_tiles_x + j;
-            ClotoJob job;
-            job.routine = &terra_render_launcher;
-            job.args = args;
-            cloto_workqueue_push ( &_workers->queue, &job );
-        }
+    Tiles::split_expensive ( _job_args, _worker_count, _max_tiles );
+    Tiles::sort_longest_first ( _job_args );
+    _jobs.resize ( _job_args.size() );
+
+    for ( size_t i = 0; i < _job_args.size(); ++i ) {
+        cloto_job_create ( &_jobs[i], &terra_render_launcher, &_job_args[i] );
     }
-}
 
-void TerraRenderer::_restart_jobs() {
-    int tx, ty;
-    _num_tiles ( tx, ty );
-    int n_jobs = tx * ty;
-    _tile_counter = n_jobs;
-    cloto_slavegroup_reset ( _workers.get() );
+    _tile_counter = ( uint32_t ) _jobs.size();
+    Log::verbose ( FMT ( "Pushing %d jobs", _tile_counter ) );
+    cloto_slavegroup_push_batch ( _workers.get(), _jobs.data(), ( uint32_t ) _jobs.size() );
 }
 
 bool TerraRenderer::_launch () {
@@ -368,7 +490,7 @@ bool TerraRenderer::_launch () {
 
     // Sync config
     if ( _opt_render_change ) {
-        if ( _framebuffer.pixels != nullptr ) {
+        if ( _framebuffer.results != nullptr ) {
             terra_framebuffer_destroy ( &_framebuffer );
             memset ( &_framebuffer, 0, sizeof ( TerraFramebuffer ) );
         }
@@ -396,6 +518,15 @@ bool TerraRenderer::_launch () {
     _paused             = false;
     _iterations         = 0;
     _clear_framebuffer  = false;
+    _deadline_ms        = Config::read_i ( Config::JOB_DEADLINE_MS );
+    _target_error       = Config::read_f ( Config::JOB_TARGET_ERROR );
+    _checkpoint_path    = Config::read_s ( Config::JOB_CHECKPOINT );
+    _launch_time        = terra_clock();
+
+    for ( TerraRenderArgs& args : _job_args ) {
+        args.converged = false;
+    }
+
     // Push jobs
     _push_jobs();
     return true;
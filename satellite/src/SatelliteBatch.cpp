@@ -0,0 +1,205 @@
+//
+// Headless batch renderer: loads a scene and its config like Satellite does, renders it without
+// any window and writes the result to an image file. Build with SATELLITE_HEADLESS defined.
+//
+// SatelliteBatch [-c <config>] [-n <passes>] -o <output.pfm|hdr|png> [<option>=<value> ...]
+//
+
+// C++ STL
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// Satellite
+#include <BatchRenderer.hpp>
+#include <Scene.hpp>
+#include <Config.hpp>
+#include <Logging.hpp>
+
+// Visualization.cpp is not part of the headless build
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+using namespace std;
+
+namespace {
+    struct Override {
+        int    opt;
+        string value;
+    };
+
+    bool has_extension ( const char* path, const char* ext ) {
+        size_t path_len = strlen ( path );
+        size_t ext_len = strlen ( ext );
+        return path_len >= ext_len && strcmp ( path + path_len - ext_len, ext ) == 0;
+    }
+
+    // PFM rows go from the bottom to the top of the image
+    bool write_pfm ( const char* path, const TerraFloat3* pixels, int width, int height ) {
+        FILE* fp = fopen ( path, "wb" );
+
+        if ( fp == nullptr ) {
+            return false;
+        }
+
+        bool ok = fprintf ( fp, "PF\n%d %d\n-1.0\n", width, height ) > 0;
+
+        for ( int y = height - 1; ok && y >= 0; --y ) {
+            ok = fwrite ( pixels + ( size_t ) y * width, sizeof ( TerraFloat3 ), width, fp ) == ( size_t ) width;
+        }
+
+        return fclose ( fp ) == 0 && ok;
+    }
+
+    // Linear formats keep the exposure only, png is tonemapped with the scene options
+    bool write_image ( BatchRenderer& renderer, const TerraTonemappingOptions& tonemapping, const char* path ) {
+        int width = renderer.width();
+        int height = renderer.height();
+        bool ldr = has_extension ( path, ".png" );
+        TerraTonemappingOptions linear;
+        linear.tonemapping_operator = kTerraTonemappingOperatorNone;
+        linear.manual_exposure = tonemapping.manual_exposure;
+        linear.gamma = 1.f;
+        const TerraFloat3* pixels = renderer.resolve ( ldr ? tonemapping : linear );
+
+        if ( pixels == nullptr ) {
+            return false;
+        }
+
+        if ( has_extension ( path, ".pfm" ) ) {
+            return write_pfm ( path, pixels, width, height );
+        }
+
+        if ( has_extension ( path, ".hdr" ) ) {
+            return stbi_write_hdr ( path, width, height, 3, ( const float* ) pixels ) != 0;
+        }
+
+        vector<uint8_t> data ( ( size_t ) width * height * 3 );
+
+        for ( size_t i = 0; i < data.size(); ++i ) {
+            float v = ( ( const float* ) pixels ) [i];
+            data[i] = ( uint8_t ) ( min ( max ( v, 0.f ), 1.f ) * 255.f + 0.5f );
+        }
+
+        return stbi_write_png ( path, width, height, 3, data.data(), width * 3 ) != 0;
+    }
+
+    void print_stats ( const BatchRenderer::Stats& stats, int width, int height ) {
+        double seconds = stats.elapsed_ms / 1000;
+        double msamples = stats.samples / 1e6;
+        Log::info ( FMT ( "Rendered %d passes in %.2f s, %.1f samples per pixel", stats.passes, seconds, ( double ) stats.samples / ( ( size_t ) width * height ) ) );
+        Log::info ( FMT ( "Throughput %.2f Msamples/s, %.2f Msamples/s per worker", msamples / seconds, msamples / seconds / stats.workers.size() ) );
+
+        size_t tiles = 0;
+        double busy_ms = 0;
+        double tile_ms_min = 0;
+        double tile_ms_max = 0;
+
+        for ( const BatchRenderer::WorkerStats& worker : stats.workers ) {
+            if ( worker.tiles > 0 ) {
+                tile_ms_min = tiles == 0 ? worker.tile_ms_min : min ( tile_ms_min, worker.tile_ms_min );
+                tile_ms_max = max ( tile_ms_max, worker.tile_ms_max );
+                tiles += worker.tiles;
+                busy_ms += worker.busy_ms;
+            }
+        }
+
+        Log::info ( FMT ( "Tiles %d, %.2f ms average, %.2f ms min, %.2f ms max", ( int ) stats.tiles, tiles > 0 ? busy_ms / tiles : 0., tile_ms_min, tile_ms_max ) );
+
+        // Idle time is spent waiting for the slowest worker at the end of every pass
+        for ( size_t i = 0; i < stats.workers.size(); ++i ) {
+            const BatchRenderer::WorkerStats& worker = stats.workers[i];
+            Log::info ( FMT ( "Worker %d: %d tiles, %.1f%% busy", ( int ) i, ( int ) worker.tiles, stats.elapsed_ms > 0 ? 100 * worker.busy_ms / stats.elapsed_ms : 0. ) );
+        }
+    }
+
+    int usage ( const char* name ) {
+        fprintf ( stderr, "usage: %s [-c <config>] [-n <passes>] -o <output.pfm|hdr|png> [<option>=<value> ...]\n", name );
+        fprintf ( stderr, "Renders until <passes> (default 1) passes of `samples` samples per pixel are done, or until the\n" );
+        fprintf ( stderr, "`deadline` or `target-error` options stop it earlier. -n 0 only stops on those.\n" );
+        return EXIT_FAILURE;
+    }
+}
+
+int main ( int argc, char* argv[] ) {
+    Log::set_targets ( stdout, stderr, stderr, nullptr );
+    Config::init();
+
+    const char* config_path = nullptr;
+    const char* output_path = nullptr;
+    int passes = 1;
+    vector<Override> overrides;
+
+    for ( int i = 1; i < argc; ++i ) {
+        const char* arg = argv[i];
+
+        if ( strcmp ( arg, "-c" ) == 0 && i + 1 < argc ) {
+            config_path = argv[++i];
+        } else if ( strcmp ( arg, "-o" ) == 0 && i + 1 < argc ) {
+            output_path = argv[++i];
+        } else if ( strcmp ( arg, "-n" ) == 0 && i + 1 < argc && Config::parse_i ( argv[i + 1], passes ) ) {
+            ++i;
+        } else if ( strchr ( arg, '=' ) != nullptr ) {
+            string name ( arg, strchr ( arg, '=' ) );
+            int opt = Config::find ( name.c_str() );
+
+            if ( opt == -1 ) {
+                Log::error ( FMT ( "Unrecognized option name %s", name.c_str() ) );
+                return EXIT_FAILURE;
+            }
+
+            overrides.push_back ( { opt, strchr ( arg, '=' ) + 1 } );
+        } else {
+            return usage ( argv[0] );
+        }
+    }
+
+    if ( output_path == nullptr || !( has_extension ( output_path, ".pfm" ) || has_extension ( output_path, ".hdr" ) || has_extension ( output_path, ".png" ) ) ) {
+        return usage ( argv[0] );
+    }
+
+    if ( config_path != nullptr ? !Config::load ( config_path ) : !Config::load() ) {
+        if ( config_path != nullptr ) {
+            Log::error ( FMT ( "Failed to load configuration %s", config_path ) );
+            return EXIT_FAILURE;
+        }
+
+        Log::warning ( STR ( "No configuration file found, defaulting all options." ) );
+    }
+
+    // Applied again after loading the scene, which can come with its own config
+    for ( const Override& o : overrides ) {
+        Config::write ( o.opt, o.value );
+    }
+
+    Scene scene;
+
+    if ( !scene.load ( Config::read_s ( Config::RENDER_SCENE_PATH ).c_str() ) ) {
+        return EXIT_FAILURE;
+    }
+
+    for ( const Override& o : overrides ) {
+        Config::write ( o.opt, o.value );
+    }
+
+    scene.update_config();
+    HTerraScene terra_scene = scene.construct_terra_scene();
+    BatchRenderer renderer;
+
+    if ( !renderer.render ( scene.get_camera(), terra_scene, Config::read_i ( Config::RENDER_WIDTH ), Config::read_i ( Config::RENDER_HEIGHT ), passes ) ) {
+        return EXIT_FAILURE;
+    }
+
+    print_stats ( renderer.stats(), renderer.width(), renderer.height() );
+
+    if ( !write_image ( renderer, scene.get_tonemapping(), output_path ) ) {
+        Log::error ( FMT ( "Failed to save image %s", output_path ) );
+        return EXIT_FAILURE;
+    }
+
+    Log::info ( FMT ( "Saved %s", output_path ) );
+    return EXIT_SUCCESS;
+}
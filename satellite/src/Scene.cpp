@@ -3,6 +3,8 @@
 
 // stdlib
 #include <cstdio>
+#include <cstdlib>
+#include <cctype>
 #include <utility>
 #include <algorithm>
 
@@ -17,6 +19,12 @@
 #define APOLLO_IMPLEMENTATION
 #include <Apollo.h>
 
+// Optional, for the formats not decoded below (png, jpg, hdr, ..)
+#ifdef SATELLITE_STB_IMAGE
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+#endif
+
 using namespace std;
 
 namespace {
@@ -29,21 +37,307 @@ namespace {
         if (texture == nullptr) { terra_attribute_init_constant(&attr, &constant); }\
         else { terra_attribute_init_texture(&attr, texture);}}
 
-    template <typename T>
-    TerraFloat3 to_constant ( const T v ) { }
-
-    template <typename T>
-    TerraFloat3 to_constant ( const T* v ) { }
-
-    template <>
+    // Plain overloads, an explicit specialization doesn't match the float arrays on every compiler
     TerraFloat3 to_constant ( const float* v ) {
         return terra_f3_set ( v[0], v[1], v[2] );
     }
 
-    template <>
-    TerraFloat3 to_constant ( const float v ) {
+    TerraFloat3 to_constant ( float v ) {
         return terra_f3_set1 ( v );
     }
+
+    // Decoded pixels, rows from top to bottom. Either ldr or hdr is filled.
+    // Alpha is dropped, Terra textures have up to 3 components.
+    struct Image {
+        size_t width = 0;
+        size_t height = 0;
+        size_t components = 0;
+        std::vector<uint8_t> ldr;
+        std::vector<float>   hdr;
+    };
+
+    template <typename T>
+    void flip_rows ( std::vector<T>& pixels, size_t row ) {
+        for ( size_t top = 0, bottom = pixels.size() - row; top < bottom; top += row, bottom -= row ) {
+            std::swap_ranges ( pixels.begin() + top, pixels.begin() + top + row, pixels.begin() + bottom );
+        }
+    }
+
+    void flip_rows ( Image& image ) {
+        size_t row = image.width * image.components;
+
+        if ( row > 0 && !image.ldr.empty() ) {
+            flip_rows ( image.ldr, row );
+        }
+
+        if ( row > 0 && !image.hdr.empty() ) {
+            flip_rows ( image.hdr, row );
+        }
+    }
+
+    bool has_extension ( const char* path, const char* ext ) {
+        const char* dot = strrchr ( path, '.' );
+
+        if ( dot == nullptr || strlen ( dot ) != strlen ( ext ) ) {
+            return false;
+        }
+
+        for ( size_t i = 0; dot[i] != '\0'; ++i ) {
+            if ( tolower ( dot[i] ) != ext[i] ) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Next whitespace separated token of a PNM header, comments are skipped.
+    // The single whitespace following the token is consumed.
+    bool pnm_token ( FILE* fp, char* token, size_t size ) {
+        int c = fgetc ( fp );
+
+        while ( c != EOF && ( isspace ( c ) || c == '#' ) ) {
+            if ( c == '#' ) {
+                while ( c != '\n' && c != EOF ) {
+                    c = fgetc ( fp );
+                }
+            }
+
+            c = fgetc ( fp );
+        }
+
+        size_t n = 0;
+
+        while ( c != EOF && !isspace ( c ) && n + 1 < size ) {
+            token[n++] = ( char ) c;
+            c = fgetc ( fp );
+        }
+
+        token[n] = '\0';
+        return n > 0;
+    }
+
+    // Binary graymap/pixmap (P5, P6) and float maps (Pf, PF)
+    bool load_pnm ( FILE* fp, Image& image ) {
+        char magic[4], width[16], height[16], max[32];
+
+        if ( !pnm_token ( fp, magic, sizeof ( magic ) ) || !pnm_token ( fp, width, sizeof ( width ) ) ||
+                !pnm_token ( fp, height, sizeof ( height ) ) || !pnm_token ( fp, max, sizeof ( max ) ) ) {
+            return false;
+        }
+
+        bool pfm = strcmp ( magic, "PF" ) == 0 || strcmp ( magic, "Pf" ) == 0;
+
+        if ( !pfm && strcmp ( magic, "P6" ) != 0 && strcmp ( magic, "P5" ) != 0 ) {
+            return false;
+        }
+
+        image.width = strtoul ( width, nullptr, 10 );
+        image.height = strtoul ( height, nullptr, 10 );
+        image.components = magic[1] == 'F' || magic[1] == '6' ? 3 : 1;
+
+        if ( image.width == 0 || image.height == 0 || image.width > UINT16_MAX || image.height > UINT16_MAX ) {
+            return false;
+        }
+
+        const size_t count = image.width * image.height * image.components;
+
+        if ( pfm ) {
+            image.hdr.resize ( count );
+
+            if ( fread ( image.hdr.data(), sizeof ( float ), count, fp ) != count ) {
+                return false;
+            }
+
+            // A negative scale means little endian
+            const uint16_t probe = 1;
+            const bool little_endian = * ( const uint8_t* ) &probe == 1;
+
+            if ( ( strtof ( max, nullptr ) < 0.f ) != little_endian ) {
+                for ( float& v : image.hdr ) {
+                    uint8_t* bytes = ( uint8_t* ) &v;
+                    std::swap ( bytes[0], bytes[3] );
+                    std::swap ( bytes[1], bytes[2] );
+                }
+            }
+
+            // Rows are stored from bottom to top
+            const size_t row = image.width * image.components;
+
+            for ( size_t y = 0; y < image.height / 2; ++y ) {
+                std::swap_ranges ( &image.hdr[y * row], &image.hdr[y * row] + row, &image.hdr[( image.height - 1 - y ) * row] );
+            }
+
+            return true;
+        }
+
+        const unsigned long max_value = strtoul ( max, nullptr, 10 );
+
+        if ( max_value == 0 || max_value > UINT16_MAX ) {
+            return false;
+        }
+
+        // 16 bit samples are big endian
+        const size_t depth = max_value > UINT8_MAX ? 2 : 1;
+        std::vector<uint8_t> raw ( count * depth );
+
+        if ( fread ( raw.data(), depth, count, fp ) != count ) {
+            return false;
+        }
+
+        image.ldr.resize ( count );
+
+        for ( size_t i = 0; i < count; ++i ) {
+            unsigned long v = depth == 2 ? ( raw[2 * i] << 8 ) | raw[2 * i + 1] : raw[i];
+            image.ldr[i] = ( uint8_t ) ( ( std::min ( v, max_value ) * UINT8_MAX + max_value / 2 ) / max_value );
+        }
+
+        return true;
+    }
+
+    // Uncompressed and RLE true color/grayscale Targa, color mapped ones are not supported
+    bool load_tga ( FILE* fp, Image& image ) {
+        uint8_t header[18];
+
+        if ( fread ( header, 1, sizeof ( header ), fp ) != sizeof ( header ) ) {
+            return false;
+        }
+
+        const uint8_t type = header[2];
+        const size_t bpp = header[16] / 8;
+        const bool rle = type == 10 || type == 11;
+        const bool gray = type == 3 || type == 11;
+
+        if ( header[1] != 0 || ( type != 2 && type != 3 && !rle ) || ( gray ? bpp != 1 : ( bpp != 3 && bpp != 4 ) ) ) {
+            return false;
+        }
+
+        image.width = header[12] | ( header[13] << 8 );
+        image.height = header[14] | ( header[15] << 8 );
+        image.components = gray ? 1 : 3;
+
+        if ( image.width == 0 || image.height == 0 || fseek ( fp, header[0], SEEK_CUR ) != 0 ) {
+            return false;
+        }
+
+        const size_t count = image.width * image.height;
+        std::vector<uint8_t> raw ( count * bpp );
+
+        if ( !rle ) {
+            if ( fread ( raw.data(), bpp, count, fp ) != count ) {
+                return false;
+            }
+        }
+
+        // Packets of up to 128 pixels, either repeated or raw
+        for ( size_t i = 0; rle && i < count; ) {
+            int packet = fgetc ( fp );
+            size_t n = ( packet & 0x7f ) + 1;
+
+            if ( packet == EOF || i + n > count ) {
+                return false;
+            }
+
+            if ( packet & 0x80 ) {
+                if ( fread ( &raw[i * bpp], 1, bpp, fp ) != bpp ) {
+                    return false;
+                }
+
+                for ( size_t j = 1; j < n; ++j ) {
+                    memcpy ( &raw[( i + j ) * bpp], &raw[i * bpp], bpp );
+                }
+            } else if ( fread ( &raw[i * bpp], bpp, n, fp ) != n ) {
+                return false;
+            }
+
+            i += n;
+        }
+
+        // Bottom to top unless bit 5 of the descriptor is set, BGR(A) order
+        const bool top_down = ( header[17] & 0x20 ) != 0;
+        image.ldr.resize ( count * image.components );
+
+        for ( size_t y = 0; y < image.height; ++y ) {
+            const size_t row = top_down ? y : image.height - 1 - y;
+
+            for ( size_t x = 0; x < image.width; ++x ) {
+                const uint8_t* src = &raw[( row * image.width + x ) * bpp];
+                uint8_t* dst = &image.ldr[( y * image.width + x ) * image.components];
+
+                if ( gray ) {
+                    dst[0] = src[0];
+                } else {
+                    dst[0] = src[2];
+                    dst[1] = src[1];
+                    dst[2] = src[0];
+                }
+            }
+        }
+
+        return true;
+    }
+
+#ifdef SATELLITE_STB_IMAGE
+    bool load_stb ( const char* path, Image& image ) {
+        int width, height, components;
+        const bool hdr = stbi_is_hdr ( path ) != 0;
+        void* data = hdr ? ( void* ) stbi_loadf ( path, &width, &height, &components, 0 ) : ( void* ) stbi_load ( path, &width, &height, &components, 0 );
+
+        if ( data == nullptr || width > UINT16_MAX || height > UINT16_MAX ) {
+            stbi_image_free ( data );
+            return false;
+        }
+
+        image.width = width;
+        image.height = height;
+        // Gray alpha and RGBA
+        image.components = components < 3 ? 1 : 3;
+        const size_t count = image.width * image.height;
+        hdr ? image.hdr.resize ( count * image.components ) : image.ldr.resize ( count * image.components );
+
+        for ( size_t i = 0; i < count; ++i ) {
+            for ( size_t c = 0; c < image.components; ++c ) {
+                if ( hdr ) {
+                    image.hdr[i * image.components + c] = ( ( const float* ) data ) [i * components + c];
+                } else {
+                    image.ldr[i * image.components + c] = ( ( const uint8_t* ) data ) [i * components + c];
+                }
+            }
+        }
+
+        stbi_image_free ( data );
+        return true;
+    }
+#endif
+
+    bool load_image ( const char* path, Image& image ) {
+        bool loaded = false;
+        FILE* fp = fopen ( path, "rb" );
+
+        if ( fp != nullptr ) {
+            char magic[2] = { 0 };
+            bool pnm = fread ( magic, 1, 2, fp ) == 2 && magic[0] == 'P' && strchr ( "56Ff", magic[1] ) != nullptr;
+            rewind ( fp );
+
+            if ( pnm ) {
+                loaded = load_pnm ( fp, image );
+            } else if ( has_extension ( path, ".tga" ) ) {
+                loaded = load_tga ( fp, image );
+            }
+
+            fclose ( fp );
+        }
+
+#ifdef SATELLITE_STB_IMAGE
+
+        if ( !loaded ) {
+            image = Image();
+            loaded = load_stb ( path, image );
+        }
+
+#endif
+        return loaded;
+    }
 }
 
 Scene::Scene() {
@@ -51,8 +345,13 @@ Scene::Scene() {
 }
 
 Scene::~Scene() {
+    _release_textures();
 }
+#ifdef _WIN32
 #include <Windows.h>
+#else
+#include <unistd.h>
+#endif
 // Just use malloc for everything
 void* apollo_alloc ( void* _, size_t size, size_t align ) {
     return malloc ( size );
@@ -98,7 +397,13 @@ bool Scene::_load_scene ( const char* filename ) {
     options.prealloc_mesh_count = 16;
     Log::info ( FMT ( "Importing model file %s", filename ) );
     char dir[256];
+#ifdef _WIN32
     GetCurrentDirectory ( 256, dir );
+#else
+    if ( getcwd ( dir, 256 ) == nullptr ) {
+        dir[0] = '\0';
+    }
+#endif
     Log::info ( FMT ( "Working dir: %s", dir ) );
 
     if ( apollo_import_model_obj ( filename, _apollo_model, &_apollo_materials, &_apollo_textures, &options ) != APOLLO_SUCCESS ) {
@@ -117,7 +422,7 @@ bool Scene::_load_scene ( const char* filename ) {
     _name = std::string ( _apollo_model->name );
     Log::info ( FMT ( "Finished importing %s.", filename ) );
     Log::info ( FMT ( "Meshes(%d) [ pbr(%d) diffuse(%d) specular(%d) mirror(%d) ], textures(%d)",
-                      _apollo_model->mesh_count, bsdf_count[APOLLO_PBR], bsdf_count[APOLLO_DIFFUSE], bsdf_count[APOLLO_SPECULAR], bsdf_count[APOLLO_MIRROR], _textures.size() ) );
+                      _apollo_model->mesh_count, bsdf_count[APOLLO_PBR], bsdf_count[APOLLO_DIFFUSE], bsdf_count[APOLLO_SPECULAR], bsdf_count[APOLLO_MIRROR], apollo_buffer_size ( _apollo_textures ) ) );
     // Try loading a config
     std::string config_path ( _apollo_model->dir );
     config_path += _apollo_model->name;
@@ -136,7 +441,12 @@ bool Scene::_build_scene() {
         _read_config();
     }
 
-    clear(); // release current scene
+    // release current scene, the textures still referenced by the model are kept
+    if ( _scene != NULL ) {
+        terra_scene_clear ( _scene );
+    }
+
+    _load_textures_begin();
     //
     // Importing into Terra Scene
     //
@@ -179,6 +489,13 @@ bool Scene::_build_scene() {
             object->properties[i].texcoord_c.y = vertex_data->tex_v[face->idx_c[i]];
         }
 
+        n_triangles += object->triangles_count;
+    }
+
+    _load_textures_end();
+
+    for ( int m = 0; m < _apollo_model->mesh_count; ++m ) {
+        TerraObject* object = terra_scene_get_object ( _scene, m );
         //
         // Reading materials
         //
@@ -211,12 +528,40 @@ bool Scene::_build_scene() {
                 break;
             }
 
+            case APOLLO_PBR: {
+                TerraAttribute albedo, metallic, roughness;
+                READ_ATTR ( albedo, material.albedo, _apollo_textures );
+                READ_ATTR ( metallic, material.metallic, _apollo_textures );
+                READ_ATTR ( roughness, material.roughness, _apollo_textures );
+                object->material.attributes[TERRA_DISNEY_BASE_COLOR] = albedo;
+                object->material.attributes[TERRA_DISNEY_METALNESS] = metallic;
+                object->material.attributes[TERRA_DISNEY_ROUGHNESS] = roughness;
+                // Specular 0.5 is the 4% reflectance of ior 1.5, the default when Ni is missing
+                float specular = 0.5f;
+
+                if ( material.ior > 1.f ) {
+                    float r0 = ( material.ior - 1.f ) / ( material.ior + 1.f );
+                    specular = r0 * r0 / 0.08f;
+                }
+
+                TerraFloat3 values[] = {
+                    terra_f3_set ( specular, material.specular_tint, 0.f ),
+                    terra_f3_set ( material.sheen, material.sheen_tint, 0.f ),
+                    terra_f3_set ( material.clearcoat, material.clearcoat_gloss, 0.f ),
+                    terra_f3_set ( material.anisotropic, material.subsurface, 0.f ),
+                };
+                terra_attribute_init_constant ( &object->material.attributes[TERRA_DISNEY_SPECULAR], &values[0] );
+                terra_attribute_init_constant ( &object->material.attributes[TERRA_DISNEY_SHEEN], &values[1] );
+                terra_attribute_init_constant ( &object->material.attributes[TERRA_DISNEY_CLEARCOAT], &values[2] );
+                terra_attribute_init_constant ( &object->material.attributes[TERRA_DISNEY_ANISOTROPIC], &values[3] );
+                object->material.attributes_count = TERRA_DISNEY_END;
+                terra_bsdf_disney_init ( &object->material.bsdf );
+                break;
+            }
+
             default:
             case APOLLO_MIRROR:
-                Log::warning ( FMT ( "Scene(%s) Unsupported mirror material(%s). Defaulting to diffuse." ), _apollo_model->name, material.name );
-
-            case APOLLO_PBR:
-                Log::warning ( FMT ( "Scene(%s) Unsupported pbr material(%s). Defaulting to diffuse" ), _apollo_model->name, material.name );
+                Log::warning ( FMT ( "Scene(%s) Unsupported mirror material(%s). Defaulting to diffuse.", _apollo_model->name, material.name ) );
 
             case APOLLO_DIFFUSE: {
                 // Log::info ( FMT ( "Loading diffuse material" ) );
@@ -228,8 +573,6 @@ bool Scene::_build_scene() {
                 break;
             }
         }
-
-        n_triangles += object->triangles_count;
     }
 
     // TODO free materials/textures?
@@ -340,12 +683,12 @@ void Scene::clear() {
         terra_scene_clear ( _scene );
     }
 
-    _textures.clear();
+    _release_textures();
     memset ( &_scene, 0, sizeof ( HTerraScene ) );
 }
 
 void Scene::_read_config() {
-    string tonemap_str     = Config::read_s ( Config::RENDER_TONEMAP );
+    string tonemap_str     = Config::read_s ( Config::TONEMAP_OPERATOR );
     string accelerator_str = Config::read_s ( Config::RENDER_ACCELERATOR );
     string sampling_str    = Config::read_s ( Config::RENDER_SAMPLING );
     string integrator_str  = Config::read_s ( Config::RENDER_INTEGRATOR );
@@ -355,7 +698,7 @@ void Scene::_read_config() {
     TerraIntegrator integrator       = Config::to_terra_integrator ( integrator_str );
 
     if ( tonemap == -1 ) {
-        Log::error ( FMT ( "Invalid configuration RENDER_TONEMAP value %s. Defaulting to none.", tonemap_str.c_str() ) );
+        Log::error ( FMT ( "Invalid configuration TONEMAP_OPERATOR value %s. Defaulting to none.", tonemap_str.c_str() ) );
         tonemap = kTerraTonemappingOperatorNone;
     }
 
@@ -376,8 +719,8 @@ void Scene::_read_config() {
 
     int bounces = Config::read_i ( Config::RENDER_MAX_BOUNCES );
     int samples = Config::read_i ( Config::RENDER_SAMPLES );
-    float exposure = Config::read_f ( Config::RENDER_EXPOSURE );
-    float gamma = Config::read_f ( Config::RENDER_GAMMA );
+    float exposure = Config::read_f ( Config::TONEMAP_EXPOSURE );
+    float gamma = Config::read_f ( Config::TONEMAP_GAMMA );
     float jitter = Config::read_f ( Config::RENDER_JITTER );
 
     if ( bounces < 0 ) {
@@ -391,12 +734,12 @@ void Scene::_read_config() {
     }
 
     if ( exposure < 0 ) {
-        Log::error ( FMT ( "Invalid configuration RENDER_EXPOSURE (%f < 0). Defaulting to 1.0.", exposure ) );
+        Log::error ( FMT ( "Invalid configuration TONEMAP_EXPOSURE (%f < 0). Defaulting to 1.0.", exposure ) );
         exposure = 1.0;
     }
 
-    if ( gamma < 0 ) {
-        Log::error ( FMT ( "Invalid configuration RENDER_GAMMA (%f < 0). Defaulting to 2.2.", gamma ) );
+    if ( gamma <= 0 ) {
+        Log::error ( FMT ( "Invalid configuration TONEMAP_GAMMA (%f <= 0). Defaulting to 2.2.", gamma ) );
         gamma = 2.2f;
     }
 
@@ -408,13 +751,15 @@ void Scene::_read_config() {
     _opts.bounces              = bounces;
     _opts.samples_per_pixel    = samples;
     _opts.subpixel_jitter      = jitter;
-    _opts.tonemapping_operator = tonemap;
-    _opts.manual_exposure      = exposure;
-    _opts.gamma                = gamma;
     _opts.accelerator          = accelerator;
     _opts.strata               = 4;
     _opts.sampling_method      = sampling;
     _opts.integrator           = integrator;
+    _opts.batch_shading        = Config::read_i ( Config::RENDER_BATCH_SHADING ) != 0;
+    _opts.seed                 = ( uint32_t ) Config::read_i ( Config::RENDER_SEED );
+    _tonemapping.tonemapping_operator = tonemap;
+    _tonemapping.manual_exposure      = exposure;
+    _tonemapping.gamma                = gamma;
     _envmap_color     = Config::read_f3 ( Config::RENDER_ENVMAP_COLOR );
     terra_attribute_init_constant ( &_opts.environment_map, &_envmap_color );
     _camera.fov       = Config::read_f ( Config::RENDER_CAMERA_VFOV_DEG );
@@ -430,13 +775,15 @@ void Scene::update_config() {
     TerraFloat3 camera_up = Config::read_f3(Config::RENDER_ENVMAP_COLOR);
     if ( _opts.bounces != Config::read_i ( Config::RENDER_MAX_BOUNCES )
             || _opts.samples_per_pixel != Config::read_i ( Config::RENDER_SAMPLES )
-            || _opts.gamma != Config::read_f ( Config::RENDER_GAMMA )
-            || _opts.manual_exposure != Config::read_f ( Config::RENDER_EXPOSURE )
+            || _tonemapping.gamma != Config::read_f ( Config::TONEMAP_GAMMA )
+            || _tonemapping.manual_exposure != Config::read_f ( Config::TONEMAP_EXPOSURE )
             || _opts.subpixel_jitter != Config::read_f ( Config::RENDER_JITTER )
-            || _opts.tonemapping_operator != Config::to_terra_tonemap ( Config::read_s ( Config::RENDER_TONEMAP ) )
+            || _tonemapping.tonemapping_operator != Config::to_terra_tonemap ( Config::read_s ( Config::TONEMAP_OPERATOR ) )
             || _opts.accelerator != Config::to_terra_accelerator ( Config::read_s ( Config::RENDER_ACCELERATOR ) )
             || _opts.sampling_method != Config::to_terra_sampling ( Config::read_s ( Config::RENDER_SAMPLING ) )
             || _opts.integrator != Config::to_terra_integrator ( Config::read_s ( Config::RENDER_INTEGRATOR ) )
+            || _opts.batch_shading != ( Config::read_i ( Config::RENDER_BATCH_SHADING ) != 0 )
+            || _opts.seed != ( uint32_t ) Config::read_i ( Config::RENDER_SEED )
             || !terra_equalf3 ( &envmap_color, &_envmap_color )
             || !terra_equalf3 ( &camera_pos, &_camera.position )
             || !terra_equalf3 ( &camera_dir, &_camera.direction )
@@ -468,10 +815,148 @@ const TerraSceneOptions& Scene::get_options() {
     return _opts;
 }
 
+const TerraTonemappingOptions& Scene::get_tonemapping() {
+    return _tonemapping;
+}
+
 const char* Scene::name() const {
     return _name.c_str();
 }
 
-TerraTexture* Scene::_allocate_texture ( const char* path ) {
-    return nullptr;
+TerraTexture* Scene::_allocate_texture ( const char* texture ) {
+    auto it = _textures.find ( _texture_path ( texture ) );
+    return it != _textures.end() && it->second->loaded ? &it->second->texture : nullptr;
+}
+
+std::string Scene::_texture_path ( const char* texture ) const {
+    // Relative to the model
+    if ( texture[0] == '/' || texture[0] == '\\' || ( texture[0] != '\0' && texture[1] == ':' ) ) {
+        return texture;
+    }
+
+    return std::string ( _apollo_model->dir ) + texture;
+}
+
+void Scene::_load_textures_begin() {
+    std::unordered_map<std::string, std::unique_ptr<Texture>> textures;
+    // Color maps are stored in sRGB, the others hold linear data.
+    // A map shared by color and data attributes is decoded as its first use.
+    auto request = [&] ( uint32_t idx, bool srgb ) {
+        if ( idx == APOLLO_TEXTURE_NONE ) {
+            return;
+        }
+
+        std::string path = _texture_path ( _apollo_textures[idx].name );
+
+        if ( textures.find ( path ) != textures.end() ) {
+            return;
+        }
+
+        auto cached = _textures.find ( path );
+
+        if ( cached != _textures.end() ) {
+            textures.emplace ( path, std::move ( cached->second ) );
+            _textures.erase ( cached );
+            return;
+        }
+
+        std::unique_ptr<Texture> texture ( new Texture );
+        texture->path = path;
+        texture->srgb = srgb;
+        _texture_queue.push_back ( texture.get() );
+        textures.emplace ( path, std::move ( texture ) );
+    };
+
+    // Same attributes as read by _build_scene()
+    for ( int m = 0; m < _apollo_model->mesh_count; ++m ) {
+        const ApolloMaterial& material = _apollo_materials[_apollo_model->meshes[m].material_id];
+        request ( material.emissive_texture, true );
+        request ( material.albedo_texture, true );
+
+        if ( material.bsdf == APOLLO_SPECULAR ) {
+            request ( material.specular_texture, true );
+            request ( material.specular_exp_texture, false );
+        } else if ( material.bsdf == APOLLO_PBR ) {
+            request ( material.metallic_texture, false );
+            request ( material.roughness_texture, false );
+        }
+    }
+
+    // The ones left are not referenced anymore, the scene using them has been cleared
+    _release_textures();
+    _textures = std::move ( textures );
+
+    if ( _texture_queue.empty() ) {
+        return;
+    }
+
+    Log::info ( FMT ( "Loading %zu textures", _texture_queue.size() ) );
+    size_t workers = std::min ( ( size_t ) std::max ( thread::hardware_concurrency(), 1u ), _texture_queue.size() );
+    _texture_next = 0;
+
+    for ( size_t i = 0; i < workers; ++i ) {
+        // With a texture per core Terra does not spread the encoding across threads on top of it
+        _texture_workers.emplace_back ( [this, workers]() {
+            terra_parallel_serial ( workers > 1 );
+
+            for ( size_t t = _texture_next++; t < _texture_queue.size(); t = _texture_next++ ) {
+                _load_texture ( _texture_queue[t] );
+            }
+        } );
+    }
+}
+
+void Scene::_load_textures_end() {
+    for ( thread& worker : _texture_workers ) {
+        worker.join();
+    }
+
+    _texture_workers.clear();
+
+    for ( Texture* texture : _texture_queue ) {
+        if ( !texture->loaded ) {
+            Log::warning ( FMT ( "Failed to load texture %s", texture->path.c_str() ) );
+        }
+    }
+
+    _texture_queue.clear();
+}
+
+void Scene::_release_textures() {
+    for ( auto& texture : _textures ) {
+        if ( texture.second->loaded ) {
+            terra_texture_destroy ( &texture.second->texture );
+        }
+    }
+
+    _textures.clear();
+}
+
+void Scene::_load_texture ( Texture* texture ) {
+    Image image;
+
+    if ( !load_image ( texture->path.c_str(), image ) ) {
+        return;
+    }
+
+    // OBJ texture coordinates start from the bottom of the image, Terra reads row v * height
+    flip_rows ( image );
+    TerraTexture* t = &texture->texture;
+    t->filter = kTerraFilterTrilinear;
+    t->address_mode = kTerraTextureAddressWrap;
+    const bool hdr = !image.hdr.empty();
+
+    if ( hdr ? !terra_texture_init_hdr ( t, image.width, image.height, image.components, image.hdr.data() ) :
+            !terra_texture_init ( t, image.width, image.height, image.components, image.ldr.data() ) ) {
+        return;
+    }
+
+    // Linearizes and filters the mips, in linear space. HDR and data maps are linear already.
+    if ( texture->srgb && !hdr ) {
+        terra_texture_finalize ( t );
+    } else {
+        terra_texture_generate_mips ( t );
+    }
+
+    texture->loaded = true;
 }
\ No newline at end of file
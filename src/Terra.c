@@ -9,6 +9,10 @@
 // Terra
 #include "TerraPrivate.h"
 #include "TerraBVH.h"
+#include "TerraLightBVH.h"
+#include "TerraTextureCache.h"
+#include "TerraTextureFormat.h"
+#include "TerraParallel.h"
 #include "TerraPresets.h"
 #include "TerraProfile.h"
 
@@ -35,17 +39,60 @@ typedef struct {
     size_t              lights_triangles_count;
     TerraFloat3         total_light_power;
     TerraFloat3         envmap_light_power;
+    TerraDistributon2D  envmap_distribution;    // Latlong environment maps only, luminance * sin(theta) of each texel
+    float               envmap_pick_pdf;        // Probability of sampling the environment rather than the emissive triangles
     TerraBVH            bvh;
+    TerraLightBVH       light_bvh;
+    TerraMaterialProgram* materials;            // Compiled material of each object, rebuilt on every commit
 
     TerraSceneOptions   new_opts;
     bool                dirty_objects;
     bool                dirty_lights;
 } TerraScene;
 
+// Parts of a TerraShadingSurface, evaluated on demand from a hit
+#define TERRA_SURFACE_NORMAL                0x1     // normal
+#define TERRA_SURFACE_EMISSIVE              0x2     // emissive
+#define TERRA_SURFACE_ATTRIBUTES            0x4     // attributes
+#define TERRA_SURFACE_FRAME                 0x8     // transform
+#define TERRA_SURFACE_LIGHT                 ( TERRA_SURFACE_NORMAL | TERRA_SURFACE_EMISSIVE )
+#define TERRA_SURFACE_ALL                   ( TERRA_SURFACE_LIGHT | TERRA_SURFACE_ATTRIBUTES | TERRA_SURFACE_FRAME )
+
+// The hit of a raycast and the parts of its shading surface evaluated so far.
+// Shadow and light rays only need the normal and emission, the rest is only computed for the vertices a path
+// continues from.
+typedef struct {
+    TerraObject*        object;     // NULL on miss
+    const TerraMaterialProgram* material;
+    TerraHit            hit;
+    TerraFloat3         point;
+    TerraFloat3         direction;  // Of the ray
+    float               cone_width; // Of the ray cone at the hit
+    float               cone_spread;
+    TerraFloat2         texcoord;
+    TerraTextureFootprint footprint; // Evaluated with the attributes if the material filters textures
+    uint32_t            evaluated;  // TERRA_SURFACE_* flags of the valid surface parts (and texcoord, with any of them)
+    TerraShadingSurface surface;
+} TerraHitContext;
+
 #define TERRA_SCENE_PREALLOCATED_OBJECTS    64
+#define TERRA_SCENE_MAX_OBJECTS             256     // TerraPrimitiveRef::object_idx
+
+// Samples whose primary hits are shaded together when TerraSceneOptions::batch_shading is set
+#ifndef TERRA_SHADING_BATCH_SIZE
+#define TERRA_SHADING_BATCH_SIZE            256
+#endif
 #define TERRA_SCENE_PREALLOCATED_LIGHTS     16
 
-TerraFloat3     terra_trace     ( TerraScene* scene, const TerraRay* primary_ray );
+// Spherical triangles are sampled by solid angle in this range (steradians). Smaller ones lose too much precision
+// and are sampled by area instead, which is almost as good when the triangle is that small or far.
+#define TERRA_LIGHT_MIN_SOLID_ANGLE         3e-4f
+#define TERRA_LIGHT_MAX_SOLID_ANGLE         6.22f
+
+TerraFloat3     terra_trace     ( TerraScene* scene, const TerraRay* primary_ray, const TerraHitContext* primary_hit );
+TerraFloat3     terra_bsdf_sample_eval ( const TerraBSDF* bsdf, const TerraShadingSurface* surface, float e1, float e2, float e3, const TerraFloat3* wo, TerraFloat3* wi, float* pdf );
+TerraFloat3     terra_bsdf_eval_pdf    ( const TerraBSDF* bsdf, const TerraShadingSurface* surface, const TerraFloat3* wi, const TerraFloat3* wo, float* pdf );
+TerraFloat3     terra_trace_path ( TerraScene* scene, const TerraRay* primary_ray, const TerraHitContext* primary_hit );
 
 TerraFloat3     terra_integrate (
     const TerraScene* scene,
@@ -91,28 +138,48 @@ TerraFloat3 terra_integrate_debug_mis_weight ( const TerraScene* scene,
                                                const TerraFloat3* throughput,
                                                size_t bounce );
 
-float           terra_luminance ( const TerraFloat3* color );
-
 TerraRay        terra_ray ( const TerraFloat3* origin, const TerraFloat3* direction );
+void            terra_ray_cone_continue ( TerraRay* ray, const TerraHitContext* hit );
 
 TerraRay        terra_surface_ray  ( const TerraShadingSurface* surface, const TerraFloat3* point, const TerraFloat3* direction, float sign );
-void            terra_surface_init ( TerraShadingSurface* surface, const TerraTriangle* triangle, const TerraMaterial* material, const TerraTriangleProperties* properties, const TerraFloat3* point );
+const TerraShadingSurface* terra_surface_eval ( TerraHitContext* ctx, uint32_t parts );
+void            terra_surface_eval_batch ( TerraHitContext* hits, const uint32_t* indices, size_t count );
 
 TerraFloat3     terra_camera_perspective_sample ( const TerraCamera* camera, const TerraFramebuffer* frame, size_t x, size_t y, float jitter, float r1, float r2 );
+float           terra_camera_pixel_spread ( const TerraCamera* camera, const TerraFramebuffer* frame );
 TerraFloat4x4   terra_camera_to_world_frame  ( const TerraCamera* camera );
 
-TerraLight*     terra_scene_pick_light ( TerraScene* scene, float e, float* pdf );
-TerraObject*    terra_scene_raycast    ( TerraScene* scene, const TerraRay* ray, const TerraRayState* state, TerraShadingSurface* surface_out, TerraFloat3* intersection_point, size_t* triangle );
+TerraLight*     terra_scene_pick_light     ( const TerraScene* scene, const TerraFloat3* point, const TerraFloat3* normal, float e, size_t* triangle, float* pdf );
+float           terra_scene_pick_light_pdf ( const TerraScene* scene, const TerraFloat3* point, const TerraFloat3* normal, const TerraObject* object, size_t triangle );
+TerraFloat3     terra_scene_sample_light   ( const TerraScene* scene, const TerraShadingSurface* surface, const TerraFloat3* point, TerraFloat3* wi, float* pdf );
+float           terra_scene_sample_light_pdf ( const TerraScene* scene, const TerraShadingSurface* surface, const TerraFloat3* point, const TerraFloat3* wi,
+        const TerraHitContext* light );
+TerraObject*    terra_scene_raycast    ( TerraScene* scene, const TerraRay* ray, TerraHitContext* ctx );
 
-size_t          terra_light_pick_triangle   ( const TerraLight* light, float e, float* pdf );
 void            terra_light_sample_triangle ( const TerraLight* light, size_t triangle_idx, float e1, float e2, TerraFloat3* pos, TerraFloat2* uv, TerraFloat3* norm, float* pdf );
+bool            terra_light_use_solid_angle ( float solid_angle );
+float           terra_triangle_solid_angle  ( const TerraTriangle* triangle, const TerraFloat3* point );
+TerraFloat3     terra_triangle_sample_solid_angle ( const TerraTriangle* triangle, const TerraFloat3* point, float e1, float e2 );
+void            terra_envmap_create         ( TerraScene* scene );
+void            terra_envmap_destroy        ( TerraScene* scene );
+TerraFloat3     terra_envmap_sample         ( const TerraScene* scene, float e1, float e2, TerraFloat3* wi, float* pdf );
+float           terra_envmap_pdf            ( const TerraScene* scene, const TerraFloat3* wi );
 
 float           terra_triangle_area          ( const TerraTriangle* triangle );
 TerraFloat3     terra_attribute_eval         ( const TerraAttribute* attribute, const void* uv, const TerraFloat3* xyz );
+void            terra_material_compile       ( const TerraMaterial* material, TerraMaterialProgram* program );
+TerraFloat3     terra_material_run_op        ( const TerraAttributeOp* op, const TerraFloat2* texcoord, const TerraFloat3* point, const TerraTextureFootprint* footprint );
+void            terra_material_run           ( const TerraMaterialProgram* program, uint32_t parts, const TerraFloat2* texcoord, const TerraFloat3* point,
+        const TerraTextureFootprint* footprint, TerraShadingSurface* surface );
+TerraFloat3     terra_texture_sample_point    ( const TerraTexture* texture, const TerraFloat2* uv );
+TerraFloat3     terra_texture_sample_bilinear ( const TerraTexture* texture, const TerraFloat2* uv );
+TerraFloat3     terra_texture_sample_trilinear ( const TerraTexture* texture, const TerraFloat2* uv, float lod );
+TerraFloat3     terra_texture_sample_footprint ( const TerraTexture* texture, const TerraFloat2* uv, const TerraTextureFootprint* footprint );
 TerraFloat3     terra_tonemapping_uncharted2 ( const TerraFloat3* x );
 
-// TODO remove this?
-#define _randf() (float)rand() / RAND_MAX
+// Random numbers of the thread rendering, seeded by each terra_render() call
+static TERRA_THREAD_LOCAL TerraSamplerRandom terra_thread_random = { 0, 1 };
+#define _randf() terra_sampler_random_next ( &terra_thread_random )
 
 //--------------------------------------------------------------------------------------------------
 // @TerraAPI
@@ -141,7 +208,7 @@ TerraObject* terra_scene_add_object ( HTerraScene _scene, size_t triangles_count
     TerraScene* scene = ( TerraScene* ) _scene;
 
     if ( scene->objects_pop == scene->objects_cap ) {
-        scene->objects = ( TerraObject* ) terra_realloc ( scene->objects, scene->objects_cap * 2 );
+        scene->objects = ( TerraObject* ) terra_realloc ( scene->objects, sizeof ( TerraObject ) * scene->objects_cap * 2 );
         scene->objects_cap *= 2;
     }
 
@@ -154,6 +221,12 @@ TerraObject* terra_scene_add_object ( HTerraScene _scene, size_t triangles_count
     return &scene->objects[scene->objects_pop++];
 }
 
+TerraObject* terra_scene_get_object ( HTerraScene _scene, size_t index ) {
+    TerraScene* scene = ( TerraScene* ) _scene;
+    assert ( index < scene->objects_pop );
+    return &scene->objects[index];
+}
+
 size_t terra_scene_count_objects ( HTerraScene _scene ) {
     TerraScene* scene = ( TerraScene* ) _scene;
     return scene->objects_pop;
@@ -178,9 +251,17 @@ void terra_scene_commit ( HTerraScene _scene ) {
         }
     }
 
+    // The environment is sampled as a light, its distribution is rebuilt whenever it changes.
+    // Texture contents are not diffed, edit a texture in place and the distribution goes stale.
+    bool dirty_envmap = scene->dirty_lights || memcmp ( &scene->opts.environment_map, &scene->new_opts.environment_map, sizeof ( TerraAttribute ) ) != 0;
+
     // Commit the new options values, lose the old ones.
     scene->opts = scene->new_opts;
 
+    if ( scene->opts.environment_map.eval == terra_texture_sample_latlong ) {
+        terra_texture_bind_fetch ( ( TerraTexture* ) scene->opts.environment_map.state );
+    }
+
     // Rebuild the acceleration structure, if necessary.
     if ( dirty_accelerator ) {
         if ( scene->opts.accelerator == kTerraAcceleratorBVH ) {
@@ -192,7 +273,12 @@ void terra_scene_commit ( HTerraScene _scene ) {
 
     // lights
     if ( scene->dirty_lights ) {
+        for ( size_t i = 0; i < scene->lights_pop; ++i ) {
+            terra_free ( scene->lights[i].triangle_area );
+        }
+
         scene->lights_pop = 0;
+        scene->lights_triangles_count = 0;
         scene->total_light_power = terra_f3_zero;
 
         for ( size_t i = 0; i < scene->objects_pop; ++i ) {
@@ -203,6 +289,11 @@ void terra_scene_commit ( HTerraScene _scene ) {
                 continue;
             }
 
+            if ( scene->lights_pop == scene->lights_cap ) {
+                scene->lights = ( TerraLight* ) terra_realloc ( scene->lights, sizeof ( TerraLight ) * scene->lights_cap * 2 );
+                scene->lights_cap *= 2;
+            }
+
             size_t idx = scene->lights_pop;
             float area = 0;
             scene->lights[idx].triangle_area = terra_malloc ( sizeof ( float ) * scene->objects[i].triangles_count );
@@ -216,18 +307,28 @@ void terra_scene_commit ( HTerraScene _scene ) {
 
             TerraFloat3 power = terra_mulf3 ( &emissive, area * terra_PI );
             scene->total_light_power = terra_addf3 ( &scene->total_light_power, &power );
-
-            if ( scene->lights_pop == scene->lights_cap ) {
-                scene->lights = ( TerraLight* ) terra_realloc ( scene->lights, scene->lights_cap * 2 );
-                scene->lights_cap *= 2;
-            }
-
             scene->lights[idx].object = &scene->objects[i];
             scene->lights[idx].area = area;
             scene->lights[idx].power = power;
             scene->lights_triangles_count += scene->objects[i].triangles_count;
             ++scene->lights_pop;
         }
+
+        terra_light_bvh_destroy ( &scene->light_bvh );
+        terra_light_bvh_create ( &scene->light_bvh, scene->objects, ( int ) scene->objects_pop, scene->lights, ( int ) scene->lights_pop );
+    }
+
+    if ( dirty_envmap ) {
+        terra_envmap_destroy ( scene );
+        terra_envmap_create ( scene );
+    }
+
+    // Materials can be edited in place without notice, they are always recompiled.
+    terra_free ( scene->materials );
+    scene->materials = ( TerraMaterialProgram* ) terra_malloc ( sizeof ( TerraMaterialProgram ) * terra_maxi ( scene->objects_pop, 1 ) );
+
+    for ( size_t i = 0; i < scene->objects_pop; ++i ) {
+        terra_material_compile ( &scene->objects[i].material, &scene->materials[i] );
     }
 
     // Clear the scene dirty flags.
@@ -245,6 +346,8 @@ void terra_scene_clear ( HTerraScene _scene ) {
     }
 
     scene->lights_pop = 0;
+    terra_light_bvh_destroy ( &scene->light_bvh );
+    terra_envmap_destroy ( scene );
     scene->dirty_objects = true;
 }
 
@@ -268,7 +371,15 @@ void terra_scene_destroy ( HTerraScene _scene ) {
     }
 
     terra_free ( scene->objects );
+
+    for ( size_t i = 0; i < scene->lights_pop; ++i ) {
+        terra_free ( scene->lights[i].triangle_area );
+    }
+
     terra_free ( scene->lights );
+    terra_light_bvh_destroy ( &scene->light_bvh );
+    terra_envmap_destroy ( scene );
+    terra_free ( scene->materials );
 
     // Free acceleration structure
     if ( scene->opts.accelerator == kTerraAcceleratorBVH ) {
@@ -306,348 +417,1325 @@ void terra_attribute_init_cubemap ( TerraAttribute* attr, TerraTexture* texture
 //--------------------------------------------------------------------------------------------------
 // @TerraFramebuffer
 //--------------------------------------------------------------------------------------------------
-bool terra_framebuffer_create ( TerraFramebuffer* framebuffer, size_t width, size_t height ) {
+// Flags the tiles overlapping the region, after its results have been written
+static void terra_framebuffer_touch ( const TerraFramebuffer* framebuffer, size_t x, size_t y, size_t width, size_t height ) {
     if ( width == 0 || height == 0 ) {
-        return false;
+        return;
     }
 
-    framebuffer->width = width;
-    framebuffer->height = height;
-    framebuffer->pixels = ( TerraFloat3* ) terra_malloc ( sizeof ( TerraFloat3 ) * width * height );
-    framebuffer->results = ( TerraRawIntegrationResult* ) terra_malloc ( sizeof ( TerraRawIntegrationResult ) * width * height );
+    size_t tiles_x = terra_framebuffer_tiles_x ( framebuffer );
 
-    for ( size_t i = 0; i < width * height; ++i ) {
-        framebuffer->pixels[i] = terra_f3_zero;
-        framebuffer->results[i].acc = terra_f3_zero;
-        framebuffer->results[i].samples = 0;
+    for ( size_t ty = y / TERRA_RENDER_TILE_SIZE; ty <= ( y + height - 1 ) / TERRA_RENDER_TILE_SIZE; ++ty ) {
+        for ( size_t tx = x / TERRA_RENDER_TILE_SIZE; tx <= ( x + width - 1 ) / TERRA_RENDER_TILE_SIZE; ++tx ) {
+            terra_atomic_fetch_or ( &framebuffer->dirty[ty * tiles_x + tx], kTerraTileUnresolved | kTerraTileUnsaved );
+        }
     }
+}
 
-    return true;
+static size_t terra_framebuffer_pixel_bytes ( uint8_t format ) {
+    switch ( format ) {
+        case kTerraPixelFormatFloat3:
+            return sizeof ( TerraFloat3 );
+
+        case kTerraPixelFormatHalf4:
+            return sizeof ( uint16_t ) * 4;
+
+        case kTerraPixelFormatRGBA8:
+            return sizeof ( uint8_t ) * 4;
+
+        default:
+            return 0;
+    }
 }
 
-void terra_framebuffer_clear ( TerraFramebuffer* framebuffer ) {
-    for ( size_t i = 0; i < framebuffer->height; ++i ) {
-        for ( size_t j = 0; j < framebuffer->width; ++j ) {
-            framebuffer->pixels[i * framebuffer->width + j] = terra_f3_zero;
-            framebuffer->results[i * framebuffer->width + j].acc = terra_f3_zero;
-            framebuffer->results[i * framebuffer->width + j].samples = 0;
+static TerraRawIntegrationResult terra_framebuffer_result ( const TerraFramebuffer* framebuffer, size_t idx ) {
+    TerraRawIntegrationResult result;
+
+    switch ( framebuffer->accumulation_format ) {
+        case kTerraAccumulationFormatHalf: {
+            const TerraResultHalf* packed = ( const TerraResultHalf* ) framebuffer->results + idx;
+            TerraFloat3 mean = terra_f3_set ( terra_half_to_float ( packed->mean[0] ), terra_half_to_float ( packed->mean[1] ), terra_half_to_float ( packed->mean[2] ) );
+            float std_lum = terra_half_to_float ( packed->std_lum );
+            float mean_lum = terra_luminance ( &mean );
+            result.acc = terra_mulf3 ( &mean, ( float ) packed->samples );
+            result.acc_lum2 = ( std_lum * std_lum + mean_lum * mean_lum ) * packed->samples;
+            result.samples = packed->samples;
+            break;
+        }
+
+        case kTerraAccumulationFormatRGB9E5: {
+            const TerraResultRGB9E5* packed = ( const TerraResultRGB9E5* ) framebuffer->results + idx;
+            TerraFloat3 mean = terra_rgb9e5_decode ( packed->mean );
+            float std_lum = terra_half_to_float ( packed->std_lum );
+            float mean_lum = terra_luminance ( &mean );
+            result.acc = terra_mulf3 ( &mean, ( float ) packed->samples );
+            result.acc_lum2 = ( std_lum * std_lum + mean_lum * mean_lum ) * packed->samples;
+            result.samples = packed->samples;
+            break;
         }
+
+        default:
+            result = ( ( const TerraRawIntegrationResult* ) framebuffer->results ) [idx];
+            break;
     }
+
+    return result;
 }
 
-void terra_framebuffer_destroy ( TerraFramebuffer* framebuffer ) {
-    if ( framebuffer == NULL ) {
-        return;
+// Mean and variance of the sample luminances of the pixel, returns the samples count. The compact formats store
+// the standard deviation as the difference of the moments would be lost to the half precision.
+static int terra_framebuffer_moments ( const TerraFramebuffer* framebuffer, size_t idx, double* mean, double* variance ) {
+    TerraRawIntegrationResult result = terra_framebuffer_result ( framebuffer, idx );
+    *mean = 0;
+    *variance = 0;
+
+    if ( result.samples == 0 ) {
+        return 0;
     }
 
-    terra_free ( framebuffer->results );
-    terra_free ( framebuffer->pixels );
-}
+    *mean = ( double ) terra_luminance ( &result.acc ) / result.samples;
 
-//--------------------------------------------------------------------------------------------------
-// @TerraTexture
-//--------------------------------------------------------------------------------------------------
-bool terra_texture_init ( TerraTexture* texture, size_t width, size_t height, size_t components, const void* data ) {
-    texture->pixels = terra_malloc ( width * height * components );
-    memcpy ( texture->pixels, data, width * height * components );
-    texture->width = ( uint16_t ) width;
-    texture->height = ( uint16_t ) height;
-    texture->components = ( uint8_t ) components;
-    texture->depth = 1;
-}
+    if ( framebuffer->accumulation_format == kTerraAccumulationFormatFloat ) {
+        *variance = fmax ( ( double ) result.acc_lum2 / result.samples - *mean * *mean, 0 );
+    } else {
+        const uint16_t* std_lum = framebuffer->accumulation_format == kTerraAccumulationFormatHalf ?
+                                  &( ( const TerraResultHalf* ) framebuffer->results + idx )->std_lum :
+                                  &( ( const TerraResultRGB9E5* ) framebuffer->results + idx )->std_lum;
+        double deviation = terra_half_to_float ( *std_lum );
+        *variance = deviation * deviation;
+    }
 
-bool terra_texture_init_hdr ( TerraTexture* texture, size_t width, size_t height, size_t components, const float* data ) {
-    texture->pixels = terra_malloc ( sizeof ( float ) * width * height * components );
-    memcpy ( texture->pixels, data, sizeof ( float ) * width * height * components );
-    texture->width = ( uint16_t ) width;
-    texture->height = ( uint16_t ) height;
-    texture->components = ( uint8_t ) components;
-    texture->depth = 4;
+    return result.samples;
 }
 
-TerraFloat3 terra_texture_read ( TerraTexture* texture, size_t x, size_t y ) {
-    switch ( texture->address_mode ) {
-        case kTerraTextureAddressClamp:
-            x = terra_mini ( x, texture->width - 1 );
-            y = terra_mini ( y, texture->height - 1 );
-            break;
-
-        case kTerraTextureAddressWrap:
-            x = x % texture->width;
-            y = y % texture->height;
-            break;
+// Adds samples to the pixel from their radiance sum and the sum of the squared deviations of their luminances
+// from the mean. The compact formats combine the deviations with the stored ones (Chan et al.) and
+// drop the samples that would take the count past 65535.
+static void terra_framebuffer_add ( const TerraFramebuffer* framebuffer, size_t idx, const TerraFloat3* acc, double m2_lum, size_t samples ) {
+    double mean_lum = ( double ) terra_luminance ( acc ) / samples;
 
-        case kTerraTextureAddressMirror: {
-            if ( ( x / texture->width ) % 2 == 0 ) {
-                x = x % texture->width;
-                y = y % texture->height;
-            } else {
-                x = texture->width - ( x % texture->width );
-                y = texture->height - ( y % texture->height );
-            }
+    if ( framebuffer->accumulation_format == kTerraAccumulationFormatFloat ) {
+        TerraRawIntegrationResult* partial = ( TerraRawIntegrationResult* ) framebuffer->results + idx;
+        partial->acc = terra_addf3 ( acc, &partial->acc );
+        partial->acc_lum2 += ( float ) ( m2_lum + mean_lum * mean_lum * samples );
+        partial->samples += ( int ) samples;
+        return;
+    }
 
-            break;
-        }
+    double stored_mean_lum;
+    double stored_variance;
+    size_t stored = ( size_t ) terra_framebuffer_moments ( framebuffer, idx, &stored_mean_lum, &stored_variance );
 
-        default:
-            assert ( false );
+    if ( stored + samples > UINT16_MAX ) {
+        return;
     }
 
-    if ( texture->depth == 1 ) {
-        assert ( texture->components <= 3 );
-        uint8_t* pixel = ( ( uint8_t* ) texture->pixels ) + ( y * texture->width + x ) * texture->components;
-        return terra_f3_set ( pixel[0] / 255.f, pixel[1] / 255.f, pixel[2] / 255.f );
-    } else if ( texture->depth == 4 ) {
-        assert ( texture->components <= 3 );
-        float* pixel = ( ( float* ) texture->pixels ) + ( y * texture->width + x ) * texture->components;
-        return * ( TerraFloat3* ) pixel;
+    TerraRawIntegrationResult result = terra_framebuffer_result ( framebuffer, idx );
+    double count = ( double ) ( stored + samples );
+    double delta = mean_lum - stored_mean_lum;
+    double m2 = stored_variance * stored + m2_lum + delta * delta * stored * samples / count;
+    result.acc = terra_addf3 ( acc, &result.acc );
+    TerraFloat3 mean = terra_divf3 ( &result.acc, ( float ) count );
+    uint16_t std_lum = terra_float_to_half ( ( float ) sqrt ( m2 / count ) );
+    uint16_t total = ( uint16_t ) ( stored + samples );
+
+    if ( framebuffer->accumulation_format == kTerraAccumulationFormatHalf ) {
+        TerraResultHalf* packed = ( TerraResultHalf* ) framebuffer->results + idx;
+        packed->mean[0] = terra_float_to_half ( mean.x );
+        packed->mean[1] = terra_float_to_half ( mean.y );
+        packed->mean[2] = terra_float_to_half ( mean.z );
+        packed->std_lum = std_lum;
+        packed->samples = total;
+    } else {
+        TerraResultRGB9E5* packed = ( TerraResultRGB9E5* ) framebuffer->results + idx;
+        packed->mean = terra_rgb9e5_encode ( &mean );
+        packed->std_lum = std_lum;
+        packed->samples = total;
     }
+}
 
-    assert ( false );
-    return terra_f3_zero;
+// Adds the sums of a pass to the pixel
+static void terra_framebuffer_accumulate ( const TerraFramebuffer* framebuffer, size_t idx, const TerraFloat3* acc, float acc_lum2, size_t samples ) {
+    double mean_lum = ( double ) terra_luminance ( acc ) / samples;
+    terra_framebuffer_add ( framebuffer, idx, acc, fmax ( acc_lum2 - mean_lum * mean_lum * samples, 0 ), samples );
 }
 
-TerraFloat3 terra_texture_sample ( void* _texture, const void* _uv, const void* _xyz ) {
-    TerraTexture* texture = ( TerraTexture* ) _texture;
-    TerraFloat2* uv = ( TerraFloat2* ) _uv;
-    size_t ix = ( size_t ) uv->x;
-    size_t iy = ( size_t ) uv->y;
-    TerraFloat3 sample = terra_f3_zero;
+bool terra_framebuffer_create ( TerraFramebuffer* framebuffer, size_t width, size_t height ) {
+    return terra_framebuffer_create_format ( framebuffer, width, height, kTerraPixelFormatFloat3, kTerraAccumulationFormatFloat );
+}
 
-    switch ( texture->filter ) {
-        case kTerraFilterPoint:
-            sample = terra_texture_read ( texture, ix, iy );
-            break;
+bool terra_framebuffer_create_format ( TerraFramebuffer* framebuffer, size_t width, size_t height,
+                                       TerraPixelFormat pixel_format, TerraAccumulationFormat accumulation_format ) {
+    if ( width == 0 || height == 0 || pixel_format >= kTerraPixelFormatCount || accumulation_format >= kTerraAccumulationFormatCount ) {
+        return false;
+    }
 
-        case kTerraFilterBilinear: {
-            // TL
-            size_t x1 = ix;
-            size_t y1 = iy;
-            // TR
-            size_t x2 = terra_mini ( ix + 1, texture->width - 1 );
-            size_t y2 = iy;
-            // BL
-            size_t x3 = ix;
-            size_t y3 = terra_mini ( iy + 1, texture->height - 1 );
-            // BR
-            size_t x4 = terra_mini ( ix + 1, texture->width - 1 );
-            size_t y4 = terra_mini ( iy + 1, texture->height - 1 );
-            // Read
-            TerraFloat3 n1 = terra_texture_read ( texture, x1, y1 );
-            TerraFloat3 n2 = terra_texture_read ( texture, x2, y2 );
-            TerraFloat3 n3 = terra_texture_read ( texture, x3, y3 );
-            TerraFloat3 n4 = terra_texture_read ( texture, x4, y4 );
-            // Compute weights for Bilinear filter
-            float w_u = uv->x - ix;
-            float w_v = uv->y - iy;
-            float w_ou = 1.f - w_u;
-            float w_ov = 1.f - w_v;
-            // Mix
-            sample.x = ( n1.x * w_ou + n2.x * w_u ) * w_ov + ( n3.x * w_ou + n4.x * w_u ) * w_v;
-            sample.y = ( n1.y * w_ou + n2.y * w_u ) * w_ov + ( n3.y * w_ou + n4.y * w_u ) * w_v;
-            sample.z = ( n1.z * w_ou + n2.z * w_u ) * w_ov + ( n3.z * w_ou + n4.z * w_u ) * w_v;
-            break;
-        }
+    framebuffer->width = width;
+    framebuffer->height = height;
+    framebuffer->image_x = 0;
+    framebuffer->image_y = 0;
+    framebuffer->image_width = width;
+    framebuffer->image_height = height;
+    framebuffer->pixel_format = ( uint8_t ) pixel_format;
+    framebuffer->accumulation_format = ( uint8_t ) accumulation_format;
+    // Allocated by the first resolve, a framebuffer that is only saved as raw results never needs them
+    framebuffer->pixels = NULL;
+    size_t results_bytes = terra_framebuffer_result_bytes ( framebuffer->accumulation_format ) * width * height;
+    framebuffer->results = terra_malloc ( results_bytes );
+    // Zero is an empty pixel in every format
+    memset ( framebuffer->results, 0, results_bytes );
+    framebuffer->dirty = ( int32_t* ) terra_malloc ( sizeof ( int32_t ) * terra_framebuffer_tiles ( framebuffer ) );
+    memset ( framebuffer->dirty, 0, sizeof ( int32_t ) * terra_framebuffer_tiles ( framebuffer ) );
+    framebuffer->passes = ( int32_t* ) terra_malloc ( sizeof ( int32_t ) * terra_framebuffer_tiles ( framebuffer ) );
+    memset ( framebuffer->passes, 0, sizeof ( int32_t ) * terra_framebuffer_tiles ( framebuffer ) );
+    // Not a valid configuration, the first resolve goes over the whole framebuffer
+    memset ( &framebuffer->tonemapping, 0, sizeof ( TerraTonemappingOptions ) );
+    return true;
+}
 
-        case kTerraFilterTrilinear:
-            // TODO
-            break;
+bool terra_framebuffer_create_bucket ( TerraFramebuffer* bucket, size_t image_width, size_t image_height,
+                                       size_t x, size_t y, size_t width, size_t height ) {
+    if ( x + width > image_width || y + height > image_height ||
+            !terra_framebuffer_create_format ( bucket, width, height, kTerraPixelFormatFloat3, kTerraAccumulationFormatFloat ) ) {
+        return false;
+    }
 
-        case kTerraFilterAnisotropic:
-            // TODO
-            break;
+    bucket->image_x = x;
+    bucket->image_y = y;
+    bucket->image_width = image_width;
+    bucket->image_height = image_height;
+    return true;
+}
 
-        default:
-            assert ( false );
-            break;
+// The pixels are left as they are, the next resolve writes every tile back to black
+void terra_framebuffer_clear ( TerraFramebuffer* framebuffer ) {
+    memset ( framebuffer->results, 0, terra_framebuffer_result_bytes ( framebuffer->accumulation_format ) * framebuffer->width * framebuffer->height );
+
+    for ( size_t i = 0; i < terra_framebuffer_tiles ( framebuffer ); ++i ) {
+        framebuffer->dirty[i] = kTerraTileUnresolved | kTerraTileUnsaved;
     }
+}
 
-    return sample;
+void terra_framebuffer_destroy ( TerraFramebuffer* framebuffer ) {
+    if ( framebuffer == NULL ) {
+        return;
+    }
+
+    terra_free ( framebuffer->results );
+    terra_free ( framebuffer->pixels );
+    terra_free ( framebuffer->dirty );
+    terra_free ( framebuffer->passes );
 }
 
-TerraFloat3 terra_texture_sample_latlong ( void* _texture, const void* _dir, const void* _xyz ) {
-    TerraTexture* texture = ( TerraTexture* ) _texture;
-    TerraFloat3* dir = ( TerraFloat3* ) _dir;
-    TerraFloat3 d = terra_normf3 ( dir );
-    float theta = acosf ( d.y );
-    float phi = atan2f ( d.z, d.x ) + terra_PI;
-    size_t u = ( size_t ) ( ( phi / ( 2 * terra_PI ) ) * texture->width );
-    size_t v = ( size_t ) ( ( theta / ( terra_PI ) ) * texture->height );
-    return terra_texture_read ( texture, u, v );
+TerraRawIntegrationResult terra_framebuffer_get_result ( const TerraFramebuffer* framebuffer, size_t x, size_t y ) {
+    assert ( x < framebuffer->width && y < framebuffer->height );
+    return terra_framebuffer_result ( framebuffer, y * framebuffer->width + x );
 }
 
-void terra_texture_destroy ( TerraTexture* texture ) {
-    terra_free ( texture->pixels );
-    texture->pixels = NULL;
+bool terra_framebuffer_merge ( TerraFramebuffer* framebuffer, const TerraFramebuffer* other ) {
+    if ( framebuffer->width != other->width || framebuffer->height != other->height ) {
+        return false;
+    }
+
+    for ( size_t i = 0; i < framebuffer->width * framebuffer->height; ++i ) {
+        TerraRawIntegrationResult result = terra_framebuffer_result ( other, i );
+        double mean_lum;
+        double variance;
+
+        if ( terra_framebuffer_moments ( other, i, &mean_lum, &variance ) > 0 ) {
+            terra_framebuffer_add ( framebuffer, i, &result.acc, variance * result.samples, result.samples );
+        }
+    }
+
+    terra_framebuffer_touch ( framebuffer, 0, 0, framebuffer->width, framebuffer->height );
+    return true;
 }
 
-void terra_texture_finalize ( void* _texture ) {
-#ifndef TERRA_TEXTURE_NO_SRGB
-    TerraTexture* texture = ( TerraTexture* ) _texture;
+// Average over the region of the per-pixel relative standard error of the mean luminance.
+// The luminance bias keeps (nearly) black pixels from dominating the estimate.
+float terra_framebuffer_error ( const TerraFramebuffer* framebuffer, size_t x, size_t y, size_t width, size_t height ) {
+    const float luminance_bias = 1e-2f;
+    double error = 0;
 
-    if ( texture != NULL && texture->pixels != NULL ) {
-        size_t size = ( size_t ) texture->width * texture->height * texture->components;
+    for ( size_t i = y; i < y + height; ++i ) {
+        for ( size_t j = x; j < x + width; ++j ) {
+            double mean;
+            double variance;
+            int samples = terra_framebuffer_moments ( framebuffer, i * framebuffer->width + j, &mean, &variance );
 
-        if ( texture->depth == 1 ) {
-            for ( size_t i = 0; i < size; ++i ) {
-                uint8_t* pixel = ( uint8_t* ) texture->pixels + i;
-                *pixel = ( uint8_t ) ( powf ( *pixel / 255.f, 2.2f ) * 255 );
-            }
-        } else if ( texture->depth == 4 ) {
-            for ( size_t i = 0; i < size; ++i ) {
-                float* pixel = ( float* ) texture->pixels + i;
-                *pixel = powf ( *pixel, 2.2f );
+            if ( samples < 2 ) {
+                return FLT_MAX;
             }
-        } else {
-            assert ( false );
+
+            error += sqrt ( variance / ( samples - 1 ) ) / ( mean + luminance_bias );
         }
     }
 
-#endif
+    return ( float ) ( error / ( width * height ) );
 }
 
-//--------------------------------------------------------------------------------------------------
-// @TerraRender
-//--------------------------------------------------------------------------------------------------
-void terra_render ( const TerraCamera* camera, HTerraScene _scene, const TerraFramebuffer* framebuffer, size_t x, size_t y, size_t width, size_t height ) {
-    TerraScene* scene = ( TerraScene* ) _scene;
-    TerraClockTime t = TERRA_CLOCK();
-    TerraFloat4x4 camera_rotation = terra_camera_to_world_frame ( camera );
-    size_t spp = scene->opts.samples_per_pixel;
-    size_t samples_per_strata = 0;
+// The constants of a resolve, shared by all the pixels
+typedef struct {
+    TerraTonemappingOperator op;
+    float exposure;
+    float inv_gamma;
+    float white_scale;
+    const TerraFramebuffer* framebuffer;
+} TerraResolve;
+
+// Every operator works on each channel independently
+static inline float terra_tonemap ( const TerraResolve* resolve, float v ) {
+    switch ( resolve->op ) {
+        // TODO: Should exposure be 2^exposure as with f-stops ?
+        // Gamma correction
+        case kTerraTonemappingOperatorLinear:
+            return v > 0.f ? powf ( v, resolve->inv_gamma ) : 0.f;
+
+        // Simple version, local operator w/o white balancing
+        case kTerraTonemappingOperatorReinhard:
+            v = v / ( 1.f + v );
+            return v > 0.f ? powf ( v, resolve->inv_gamma ) : 0.f;
+
+        // Approx, gamma 2.2 included
+        case kTerraTonemappingOperatorFilmic:
+            v = terra_maxf ( 0.f, v - 0.004f );
+            return ( v * ( 6.2f * v + 0.5f ) ) / ( v * ( 6.2f * v + 1.7f ) + 0.06f );
+
+        case kTerraTonemappingOperatorUncharted2: {
+            // Exposure bias of 2
+            TerraFloat3 t = terra_f3_set1 ( v * 2.f );
+            v = terra_tonemapping_uncharted2 ( &t ).x * resolve->white_scale;
+            return v > 0.f ? powf ( v, resolve->inv_gamma ) : 0.f;
+        }
 
-    if ( scene->opts.sampling_method == kTerraSamplingMethodStratified ) {
-        size_t cur = scene->opts.strata * scene->opts.strata;
+        default:
+            return v;
+    }
+}
 
-        while ( ++samples_per_strata && spp > cur ) {
-            cur *= cur;
+#if defined ( __SSE2__ ) || defined ( _M_X64 ) || ( defined ( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#define TERRA_RESOLVE_SSE2
+#include <emmintrin.h>
+
+// Exponent plus the atanh series of the mantissa, taken in [sqrt(1/2), sqrt(2)). Absolute error below 1e-7.
+static inline __m128 terra_sse_log2 ( __m128 x ) {
+    const __m128 one = _mm_set1_ps ( 1.f );
+    __m128i bits = _mm_castps_si128 ( x );
+    __m128 e = _mm_cvtepi32_ps ( _mm_sub_epi32 ( _mm_srli_epi32 ( bits, 23 ), _mm_set1_epi32 ( 127 ) ) );
+    __m128 m = _mm_castsi128_ps ( _mm_or_si128 ( _mm_and_si128 ( bits, _mm_set1_epi32 ( 0x007fffff ) ), _mm_castps_si128 ( one ) ) );
+    __m128 big = _mm_cmpgt_ps ( m, _mm_set1_ps ( 1.41421356f ) );
+    m = _mm_sub_ps ( m, _mm_and_ps ( big, _mm_mul_ps ( m, _mm_set1_ps ( 0.5f ) ) ) );
+    e = _mm_add_ps ( e, _mm_and_ps ( big, one ) );
+    __m128 t = _mm_div_ps ( _mm_sub_ps ( m, one ), _mm_add_ps ( m, one ) );
+    __m128 t2 = _mm_mul_ps ( t, t );
+    // 2 / ln ( 2 ) * ( t + t^3 / 3 + t^5 / 5 + t^7 / 7 )
+    __m128 p = _mm_add_ps ( _mm_mul_ps ( _mm_set1_ps ( 1.f / 7 ), t2 ), _mm_set1_ps ( 1.f / 5 ) );
+    p = _mm_add_ps ( _mm_mul_ps ( p, t2 ), _mm_set1_ps ( 1.f / 3 ) );
+    p = _mm_add_ps ( _mm_mul_ps ( p, t2 ), one );
+    return _mm_add_ps ( e, _mm_mul_ps ( _mm_mul_ps ( p, t ), _mm_set1_ps ( 2.88539008f ) ) );
+}
+
+// 2^round ( x ) built in the exponent bits times the Taylor series of 2^f, f in [-0.5, 0.5]. Relative error below 2e-7.
+static inline __m128 terra_sse_exp2 ( __m128 x ) {
+    x = _mm_max_ps ( _mm_min_ps ( x, _mm_set1_ps ( 127.f ) ), _mm_set1_ps ( -126.f ) );
+    __m128i i = _mm_cvtps_epi32 ( x );
+    __m128 f = _mm_sub_ps ( x, _mm_cvtepi32_ps ( i ) );
+    __m128 p = _mm_add_ps ( _mm_mul_ps ( _mm_set1_ps ( 1.54035304e-4f ), f ), _mm_set1_ps ( 1.33335581e-3f ) );
+    p = _mm_add_ps ( _mm_mul_ps ( p, f ), _mm_set1_ps ( 9.61812911e-3f ) );
+    p = _mm_add_ps ( _mm_mul_ps ( p, f ), _mm_set1_ps ( 5.55041087e-2f ) );
+    p = _mm_add_ps ( _mm_mul_ps ( p, f ), _mm_set1_ps ( 2.40226507e-1f ) );
+    p = _mm_add_ps ( _mm_mul_ps ( p, f ), _mm_set1_ps ( 6.93147181e-1f ) );
+    p = _mm_add_ps ( _mm_mul_ps ( p, f ), _mm_set1_ps ( 1.f ) );
+    return _mm_mul_ps ( p, _mm_castsi128_ps ( _mm_slli_epi32 ( _mm_add_epi32 ( i, _mm_set1_epi32 ( 127 ) ), 23 ) ) );
+}
+
+// Zero for x <= 0
+static inline __m128 terra_sse_pow ( __m128 x, float e ) {
+    __m128 positive = _mm_cmpgt_ps ( x, _mm_setzero_ps() );
+    __m128 y = terra_sse_exp2 ( _mm_mul_ps ( terra_sse_log2 ( _mm_max_ps ( x, _mm_set1_ps ( FLT_MIN ) ) ), _mm_set1_ps ( e ) ) );
+    return _mm_and_ps ( positive, y );
+}
+
+// Vector version of terra_tonemap()
+static inline __m128 terra_sse_tonemap ( const TerraResolve* resolve, __m128 v ) {
+    const __m128 one = _mm_set1_ps ( 1.f );
+
+    switch ( resolve->op ) {
+        case kTerraTonemappingOperatorLinear:
+            return terra_sse_pow ( v, resolve->inv_gamma );
+
+        case kTerraTonemappingOperatorReinhard:
+            return terra_sse_pow ( _mm_div_ps ( v, _mm_add_ps ( one, v ) ), resolve->inv_gamma );
+
+        case kTerraTonemappingOperatorFilmic: {
+            v = _mm_max_ps ( _mm_setzero_ps(), _mm_sub_ps ( v, _mm_set1_ps ( 0.004f ) ) );
+            __m128 v62 = _mm_mul_ps ( v, _mm_set1_ps ( 6.2f ) );
+            __m128 num = _mm_mul_ps ( v, _mm_add_ps ( v62, _mm_set1_ps ( 0.5f ) ) );
+            __m128 den = _mm_add_ps ( _mm_mul_ps ( v, _mm_add_ps ( v62, _mm_set1_ps ( 1.7f ) ) ), _mm_set1_ps ( 0.06f ) );
+            return _mm_div_ps ( num, den );
         }
 
-        spp = cur;
+        case kTerraTonemappingOperatorUncharted2: {
+            // Same constants as terra_tonemapping_uncharted2()
+            const float A = 0.15f, B = 0.5f, C = 0.1f, D = 0.2f, E = 0.02f, F = 0.3f;
+            v = _mm_mul_ps ( v, _mm_set1_ps ( 2.f ) );
+            __m128 num = _mm_add_ps ( _mm_mul_ps ( v, _mm_add_ps ( _mm_mul_ps ( _mm_set1_ps ( A ), v ), _mm_set1_ps ( C * B ) ) ), _mm_set1_ps ( D * E ) );
+            __m128 den = _mm_add_ps ( _mm_mul_ps ( v, _mm_add_ps ( _mm_mul_ps ( _mm_set1_ps ( A ), v ), _mm_set1_ps ( B ) ) ), _mm_set1_ps ( D * F ) );
+            v = _mm_sub_ps ( _mm_div_ps ( num, den ), _mm_set1_ps ( E / F ) );
+            return terra_sse_pow ( _mm_mul_ps ( v, _mm_set1_ps ( resolve->white_scale ) ), resolve->inv_gamma );
+        }
+
+        default:
+            return v;
     }
+}
+#endif
 
-    TerraSamplerRandom random_sampler;
-    terra_sampler_random_init ( &random_sampler );
+static void terra_framebuffer_resolve_tiles ( void* _resolve, size_t begin, size_t end ) {
+    const TerraResolve* resolve = ( const TerraResolve* ) _resolve;
+    const TerraFramebuffer* framebuffer = resolve->framebuffer;
+    size_t tiles_x = terra_framebuffer_tiles_x ( framebuffer );
 
-    for ( size_t i = y; i < y + height; ++i ) {
-        for ( size_t j = x; j < x + width; ++j ) {
-            // Init sampler
-            TerraSampler2D hemisphere_sampler;
-            hemisphere_sampler.sampler = NULL;
-            TerraSamplerStratified stratified_sampler;
-            TerraSamplerHalton halton_sampler;
+    for ( size_t t = begin; t < end; ++t ) {
+        // Cleared before reading the results, a concurrent render flags the tile again
+        if ( ( terra_atomic_fetch_and ( &framebuffer->dirty[t], ~kTerraTileUnresolved ) & kTerraTileUnresolved ) == 0 ) {
+            continue;
+        }
 
-            if ( scene->opts.sampling_method == kTerraSamplingMethodStratified ) {
-                hemisphere_sampler.sampler = &stratified_sampler;
-                hemisphere_sampler.sample = terra_sampler_stratified_next_pair;
-                terra_sampler_stratified_init ( &stratified_sampler, &random_sampler, ( int ) scene->opts.strata, 16 );
-            } else if ( scene->opts.sampling_method == kTerraSamplingMethodHalton ) {
-                hemisphere_sampler.sampler = &halton_sampler;
-                hemisphere_sampler.sample = terra_sampler_halton_next_pair;
-                terra_sampler_halton_init ( &halton_sampler );
+        size_t x = ( t % tiles_x ) * TERRA_RENDER_TILE_SIZE;
+        size_t y = ( t / tiles_x ) * TERRA_RENDER_TILE_SIZE;
+        size_t width = terra_mini ( TERRA_RENDER_TILE_SIZE, framebuffer->width - x );
+        size_t height = terra_mini ( TERRA_RENDER_TILE_SIZE, framebuffer->height - y );
+        TerraFloat3 scratch[TERRA_RENDER_TILE_SIZE];
+
+        for ( size_t i = y; i < y + height; ++i ) {
+            size_t row = i * framebuffer->width + x;
+            // Float pixels are tonemapped in place, the other formats go through the scratch row
+            TerraFloat3* row_pixels = framebuffer->pixel_format == kTerraPixelFormatFloat3 ? ( TerraFloat3* ) framebuffer->pixels + row : scratch;
+
+            for ( size_t j = 0; j < width; ++j ) {
+                TerraRawIntegrationResult result = terra_framebuffer_result ( framebuffer, row + j );
+                float scale = result.samples > 0 ? resolve->exposure / result.samples : 0.f;
+                row_pixels[j] = terra_mulf3 ( &result.acc, scale );
             }
 
-            // Integrate
-            TerraFloat3 acc = terra_f3_zero;
+            // The channels of the row are tonemapped as a flat array
+            float* values = &row_pixels[0].x;
+            size_t count = width * 3;
+            size_t k = 0;
+#ifdef TERRA_RESOLVE_SSE2
 
-            for ( size_t s = 0; s < spp; ++s ) {
-                // Sample random jitter
-                float r1 = terra_sampler_random_next ( &random_sampler );
-                float r2 = terra_sampler_random_next ( &random_sampler );
-                // Build camera ray
-                TerraFloat3 ray_dir = terra_camera_perspective_sample ( camera, framebuffer, j, i, scene->opts.subpixel_jitter, r1, r2 );
-                ray_dir = terra_transformf3 ( &camera_rotation, &ray_dir );
-                TerraRay ray = terra_ray ( &camera->position, &ray_dir );
-                // Trace
-                TerraClockTime t = TERRA_CLOCK();
-                TerraFloat3 dL = terra_trace ( scene, &ray );
-                TERRA_PROFILE_ADD_SAMPLE ( time, TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_TRACE, TERRA_CLOCK() - t );
-                // Accumulate radiance
-                acc = terra_addf3 ( &acc, &dL );
+            for ( ; k + 4 <= count; k += 4 ) {
+                _mm_storeu_ps ( values + k, terra_sse_tonemap ( resolve, _mm_loadu_ps ( values + k ) ) );
             }
 
-            // Accumulate with previous integrations
-            TerraRawIntegrationResult* partial = &framebuffer->results[i * framebuffer->width + j];
-            partial->acc = terra_addf3 ( &acc, &partial->acc );
-            partial->samples += spp;
-            // Manual exposure
-            TerraFloat3 color = terra_divf3 ( &partial->acc, ( float ) partial->samples );
-            color = terra_mulf3 ( &color, scene->opts.manual_exposure );
-
-            // Tonemapping
-            switch ( scene->opts.tonemapping_operator ) {
-                // TODO: Should exposure be 2^exposure as with f-stops ?
-                // Gamma correction
-                case kTerraTonemappingOperatorLinear: {
-                    color = terra_powf3 ( &color, 1.f / scene->opts.gamma );
-                    break;
-                }
+#endif
 
-                // Simple version, local operator w/o white balancing
-                case kTerraTonemappingOperatorReinhard: {
-                    // TODO: same as inv_dir invf3
-                    color.x = color.x / ( 1.f + color.x );
-                    color.y = color.y / ( 1.f + color.y );
-                    color.z = color.z / ( 1.f + color.z );
-                    color = terra_powf3 ( &color, 1.f / scene->opts.gamma );
-                    break;
-                }
+            for ( ; k < count; ++k ) {
+                values[k] = terra_tonemap ( resolve, values[k] );
+            }
+
+            if ( framebuffer->pixel_format == kTerraPixelFormatHalf4 ) {
+                uint16_t* dst = ( uint16_t* ) framebuffer->pixels + row * 4;
 
-                // Approx
-                case kTerraTonemappingOperatorFilmic: {
-                    TerraFloat3 x;
-                    x.x = terra_maxf ( 0.f, color.x - 0.004f );
-                    x.y = terra_maxf ( 0.f, color.y - 0.004f );
-                    x.z = terra_maxf ( 0.f, color.z - 0.004f );
-                    color.x = ( x.x * ( 6.2f * x.x + 0.5f ) ) / ( x.x * ( 6.2f * x.x + 1.7f ) + 0.06f );
-                    color.y = ( x.y * ( 6.2f * x.y + 0.5f ) ) / ( x.y * ( 6.2f * x.y + 1.7f ) + 0.06f );
-                    color.x = ( x.z * ( 6.2f * x.z + 0.5f ) ) / ( x.z * ( 6.2f * x.z + 1.7f ) + 0.06f );
-                    // Gamma 2.2 included
-                    break;
+                for ( size_t j = 0; j < width; ++j ) {
+                    dst[j * 4 + 0] = terra_float_to_half ( row_pixels[j].x );
+                    dst[j * 4 + 1] = terra_float_to_half ( row_pixels[j].y );
+                    dst[j * 4 + 2] = terra_float_to_half ( row_pixels[j].z );
+                    dst[j * 4 + 3] = 0x3c00;
                 }
+            } else if ( framebuffer->pixel_format == kTerraPixelFormatRGBA8 ) {
+                uint8_t* dst = ( uint8_t* ) framebuffer->pixels + row * 4;
 
-                case kTerraTonemappingOperatorUncharted2: {
-                    // TODO: Should white be tweaked ?
-                    // This is the white point in linear space
-                    const TerraFloat3 linear_white = terra_f3_set1 ( 11.2f );
-                    TerraFloat3 white_scale = terra_tonemapping_uncharted2 ( &linear_white );
-                    white_scale.x = 1.f / white_scale.x;
-                    white_scale.y = 1.f / white_scale.y;
-                    white_scale.z = 1.f / white_scale.z;
-                    const float exposure_bias = 2.f;
-                    TerraFloat3 t = terra_mulf3 ( &color, exposure_bias );
-                    t = terra_tonemapping_uncharted2 ( &t );
-                    color = terra_pointf3 ( &t, &white_scale );
-                    color = terra_powf3 ( &color, 1.f / scene->opts.gamma );
-                    break;
+                for ( size_t j = 0; j < width * 3; ++j ) {
+                    dst[j / 3 * 4 + j % 3] = ( uint8_t ) ( terra_clamp ( values[j], 0.f, 1.f ) * 255.f + 0.5f );
                 }
 
-                default:
-                    break;
+                for ( size_t j = 0; j < width; ++j ) {
+                    dst[j * 4 + 3] = 255;
+                }
             }
+        }
+    }
+}
+
+// Returns the number of tiles to go through
+static size_t terra_framebuffer_resolve_init ( TerraFramebuffer* framebuffer, const TerraTonemappingOptions* options, TerraResolve* resolve ) {
+    size_t tiles = terra_framebuffer_tiles ( framebuffer );
+
+    if ( framebuffer->pixels == NULL ) {
+        framebuffer->pixels = terra_malloc ( terra_framebuffer_pixel_bytes ( framebuffer->pixel_format ) * framebuffer->width * framebuffer->height );
+        // Forces the options comparison to fail
+        memset ( &framebuffer->tonemapping, 0, sizeof ( TerraTonemappingOptions ) );
+    }
+
+    if ( framebuffer->tonemapping.tonemapping_operator != options->tonemapping_operator ||
+            framebuffer->tonemapping.manual_exposure != options->manual_exposure || framebuffer->tonemapping.gamma != options->gamma ) {
+        framebuffer->tonemapping = *options;
 
-            // Store the final color value on the framebuffer
-            framebuffer->pixels[i * framebuffer->width + j] = color;
+        for ( size_t i = 0; i < tiles; ++i ) {
+            terra_atomic_fetch_or ( &framebuffer->dirty[i], kTerraTileUnresolved );
         }
     }
 
-    TERRA_PROFILE_ADD_SAMPLE ( time, TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_RENDER, TERRA_CLOCK() - t );
+    resolve->op = options->tonemapping_operator;
+    resolve->exposure = options->manual_exposure;
+    resolve->inv_gamma = 1.f / options->gamma;
+    resolve->framebuffer = framebuffer;
+    // TODO: Should white be tweaked ? This is the white point in linear space
+    const TerraFloat3 linear_white = terra_f3_set1 ( 11.2f );
+    resolve->white_scale = 1.f / terra_tonemapping_uncharted2 ( &linear_white ).x;
+    return tiles;
+}
+
+void terra_framebuffer_resolve ( TerraFramebuffer* framebuffer, const TerraTonemappingOptions* options ) {
+    TerraResolve resolve;
+    size_t tiles = terra_framebuffer_resolve_init ( framebuffer, options, &resolve );
+    terra_parallel_for ( tiles, 16, terra_framebuffer_resolve_tiles, &resolve );
+}
+
+void terra_framebuffer_resolve_serial ( TerraFramebuffer* framebuffer, const TerraTonemappingOptions* options ) {
+    TerraResolve resolve;
+    size_t tiles = terra_framebuffer_resolve_init ( framebuffer, options, &resolve );
+    terra_framebuffer_resolve_tiles ( &resolve, 0, tiles );
 }
 
 //--------------------------------------------------------------------------------------------------
-// @System
+// @TerraTexture
 //--------------------------------------------------------------------------------------------------
-#ifndef TERRA_MALLOC
-void* terra_malloc ( size_t size ) {
-    return malloc ( size );
+static size_t terra_texture_tiles ( size_t size ) {
+    return ( size + TERRA_TEXTURE_TILE_MASK ) >> TERRA_TEXTURE_TILE_LOG2;
 }
 
-void* terra_realloc ( void* p, size_t size ) {
-    return realloc ( p, size );
+static size_t terra_texture_tile_bytes ( const TerraTexture* texture ) {
+    return terra_texture_format_tile_bytes ( texture->format, texture->components );
 }
 
-void terra_free ( void* ptr ) {
-    free ( ptr );
+// Padding included
+static size_t terra_texture_storage_bytes ( const TerraTexture* texture ) {
+    return terra_texture_tiles ( texture->width ) * terra_texture_tiles ( texture->height ) * terra_texture_tile_bytes ( texture );
+}
+
+// Decodes a texel inside the texture
+static TerraFloat3 terra_texture_texel ( const TerraTexture* texture, size_t x, size_t y ) {
+    size_t tile = terra_texture_tile_index ( x, y, terra_texture_tiles ( texture->width ) );
+    const uint8_t* pixels = ( const uint8_t* ) texture->pixels + tile * terra_texture_tile_bytes ( texture );
+    return terra_texture_decode_texel ( texture->format, texture->components, pixels, x & TERRA_TEXTURE_TILE_MASK, y & TERRA_TEXTURE_TILE_MASK );
+}
+
+// The tiles of dst are encoded from the texels gathered for each of them, a row of tiles at a time.
+// Texels in the padding replicate the edges, it keeps the compressed blocks from wasting precision.
+typedef struct TerraTextureEncodeJob {
+    TerraTexture*       dst;
+    const TerraTexture* src;
+    const void*         data;
+    void ( *gather ) ( const struct TerraTextureEncodeJob* job, size_t x, size_t y, TerraFloat3* texels );
+} TerraTextureEncodeJob;
+
+// Rows of tiles per thread at least
+#ifndef TERRA_TEXTURE_ENCODE_GRAIN
+#define TERRA_TEXTURE_ENCODE_GRAIN 16
+#endif
+
+static void terra_texture_encode_rows ( void* _job, size_t begin, size_t end ) {
+    const TerraTextureEncodeJob* job = ( const TerraTextureEncodeJob* ) _job;
+    TerraTexture* dst = job->dst;
+    size_t tiles_x = terra_texture_tiles ( dst->width );
+    size_t tile_bytes = terra_texture_tile_bytes ( dst );
+    TerraFloat3 texels[TERRA_TEXTURE_TILE_TEXELS];
+
+    for ( size_t ty = begin; ty < end; ++ty ) {
+        for ( size_t tx = 0; tx < tiles_x; ++tx ) {
+            job->gather ( job, tx << TERRA_TEXTURE_TILE_LOG2, ty << TERRA_TEXTURE_TILE_LOG2, texels );
+            terra_texture_encode_tile ( dst->format, dst->components, texels, ( uint8_t* ) dst->pixels + ( ty * tiles_x + tx ) * tile_bytes );
+        }
+    }
+}
+
+static void terra_texture_encode ( TerraTextureEncodeJob* job ) {
+    terra_parallel_for ( terra_texture_tiles ( job->dst->height ), TERRA_TEXTURE_ENCODE_GRAIN, terra_texture_encode_rows, job );
+}
+
+// Row-major data, 8 bit or float components depending on the texture depth
+static void terra_texture_gather_data ( const TerraTextureEncodeJob* job, size_t x, size_t y, TerraFloat3* texels ) {
+    const TerraTexture* dst = job->dst;
+    size_t components = dst->components;
+
+    for ( size_t i = 0; i < TERRA_TEXTURE_TILE_TEXELS; ++i ) {
+        size_t sx = terra_mini ( x + ( i & TERRA_TEXTURE_TILE_MASK ), dst->width - 1 );
+        size_t sy = terra_mini ( y + ( i >> TERRA_TEXTURE_TILE_LOG2 ), dst->height - 1 );
+        size_t offset = ( sy * dst->width + sx ) * components;
+        float v[3] = { 0.f, 0.f, 0.f };
+
+        for ( size_t c = 0; c < components; ++c ) {
+            v[c] = dst->depth == 1 ? ( ( const uint8_t* ) job->data ) [offset + c] / 255.f : ( ( const float* ) job->data ) [offset + c];
+        }
+
+        texels[i] = terra_texture_components_expand ( v[0], v[1], v[2], dst->components );
+    }
+}
+
+// 2x2 box filter of the level above. Odd sizes round down and clamp the last texel.
+static void terra_texture_gather_downsample ( const TerraTextureEncodeJob* job, size_t x, size_t y, TerraFloat3* texels ) {
+    const TerraTexture* src = job->src;
+
+    for ( size_t i = 0; i < TERRA_TEXTURE_TILE_TEXELS; ++i ) {
+        size_t dx = terra_mini ( x + ( i & TERRA_TEXTURE_TILE_MASK ), job->dst->width - 1 );
+        size_t dy = terra_mini ( y + ( i >> TERRA_TEXTURE_TILE_LOG2 ), job->dst->height - 1 );
+        size_t x0 = terra_mini ( 2 * dx, src->width - 1 );
+        size_t x1 = terra_mini ( 2 * dx + 1, src->width - 1 );
+        size_t y0 = terra_mini ( 2 * dy, src->height - 1 );
+        size_t y1 = terra_mini ( 2 * dy + 1, src->height - 1 );
+        TerraFloat3 t00 = terra_texture_texel ( src, x0, y0 );
+        TerraFloat3 t01 = terra_texture_texel ( src, x1, y0 );
+        TerraFloat3 t10 = terra_texture_texel ( src, x0, y1 );
+        TerraFloat3 t11 = terra_texture_texel ( src, x1, y1 );
+        TerraFloat3 sum = terra_addf3 ( &t00, &t01 );
+        sum = terra_addf3 ( &sum, &t10 );
+        sum = terra_addf3 ( &sum, &t11 );
+        texels[i] = terra_mulf3 ( &sum, 0.25f );
+    }
+}
+
+// Same size textures, in any format
+static void terra_texture_gather_copy ( const TerraTextureEncodeJob* job, size_t x, size_t y, TerraFloat3* texels ) {
+    for ( size_t i = 0; i < TERRA_TEXTURE_TILE_TEXELS; ++i ) {
+        size_t sx = terra_mini ( x + ( i & TERRA_TEXTURE_TILE_MASK ), job->dst->width - 1 );
+        size_t sy = terra_mini ( y + ( i >> TERRA_TEXTURE_TILE_LOG2 ), job->dst->height - 1 );
+        texels[i] = terra_texture_texel ( job->src, sx, sy );
+    }
+}
+
+// In place sRGB to linear conversion, every tile only reads itself
+static void terra_texture_gather_linearize ( const TerraTextureEncodeJob* job, size_t x, size_t y, TerraFloat3* texels ) {
+    terra_texture_gather_copy ( job, x, y, texels );
+
+    for ( size_t i = 0; i < TERRA_TEXTURE_TILE_TEXELS; ++i ) {
+        texels[i] = terra_f3_set ( powf ( texels[i].x, 2.2f ), powf ( texels[i].y, 2.2f ), powf ( texels[i].z, 2.2f ) );
+    }
+}
+
+bool terra_texture_init_format ( TerraTexture* texture, size_t width, size_t height, size_t components, const void* data, TerraTextureFormat format ) {
+    bool block = format == kTerraTextureFormatBC1 || format == kTerraTextureFormatBC5;
+
+    if ( format >= kTerraTextureFormatCount || components == 0 || components > 3 || ( format == kTerraTextureFormatBC5 && components > 2 ) ||
+            ( block && !TERRA_TEXTURE_BLOCK_TILES ) ) {
+        return false;
+    }
+
+    bool hdr = format == kTerraTextureFormatFloat32 || format == kTerraTextureFormatFloat16 || format == kTerraTextureFormatRGB9E5;
+    texture->width = ( uint16_t ) width;
+    texture->height = ( uint16_t ) height;
+    texture->components = ( uint8_t ) components;
+    texture->depth = hdr ? 4 : 1;
+    texture->format = ( uint8_t ) format;
+    texture->mips = NULL;
+    texture->mips_count = 0;
+    texture->paged = NULL;
+    texture->pixels = terra_malloc ( terra_texture_storage_bytes ( texture ) );
+    TerraTextureEncodeJob job = { texture, NULL, data, terra_texture_gather_data };
+    terra_texture_encode ( &job );
+    terra_texture_bind_fetch ( texture );
+    return true;
+}
+
+bool terra_texture_init ( TerraTexture* texture, size_t width, size_t height, size_t components, const void* data ) {
+    return terra_texture_init_format ( texture, width, height, components, data, kTerraTextureFormatUnorm8 );
+}
+
+bool terra_texture_init_hdr ( TerraTexture* texture, size_t width, size_t height, size_t components, const float* data ) {
+    return terra_texture_init_format ( texture, width, height, components, data, kTerraTextureFormatFloat32 );
+}
+
+// Brings a texel coordinate, possibly negative, back inside [0, size)
+static inline int32_t terra_texture_address ( int32_t i, int32_t size, uint8_t address_mode ) {
+    switch ( address_mode ) {
+        case kTerraTextureAddressClamp:
+            return i < 0 ? 0 : ( i >= size ? size - 1 : i );
+
+        case kTerraTextureAddressWrap:
+            i %= size;
+            return i < 0 ? i + size : i;
+
+        case kTerraTextureAddressMirror: {
+            int32_t period = 2 * size;
+            i %= period;
+            i = i < 0 ? i + period : i;
+            return i < size ? i : period - 1 - i;
+        }
+
+        default:
+            assert ( false );
+            return 0;
+    }
+}
+
+// Instantiated below with constant format and address mode, the branches fold away
+static inline TerraFloat3 terra_texture_fetch_texel ( const TerraTexture* texture, int32_t x, int32_t y, uint8_t format, uint8_t address_mode ) {
+    x = terra_texture_address ( x, texture->width, address_mode );
+    y = terra_texture_address ( y, texture->height, address_mode );
+    size_t tile = terra_texture_tile_index ( ( size_t ) x, ( size_t ) y, terra_texture_tiles ( texture->width ) );
+    const uint8_t* pixels = ( const uint8_t* ) texture->pixels + tile * terra_texture_format_tile_bytes ( format, texture->components );
+    return terra_texture_decode_texel ( format, texture->components, pixels, x & TERRA_TEXTURE_TILE_MASK, y & TERRA_TEXTURE_TILE_MASK );
+}
+
+#define TERRA_TEXTURE_FETCH_ROUTINES(name, format) \
+    static TerraFloat3 terra_texture_fetch_##name##_wrap ( const TerraTexture* texture, int32_t x, int32_t y ) { \
+        return terra_texture_fetch_texel ( texture, x, y, format, kTerraTextureAddressWrap ); \
+    } \
+    static TerraFloat3 terra_texture_fetch_##name##_mirror ( const TerraTexture* texture, int32_t x, int32_t y ) { \
+        return terra_texture_fetch_texel ( texture, x, y, format, kTerraTextureAddressMirror ); \
+    } \
+    static TerraFloat3 terra_texture_fetch_##name##_clamp ( const TerraTexture* texture, int32_t x, int32_t y ) { \
+        return terra_texture_fetch_texel ( texture, x, y, format, kTerraTextureAddressClamp ); \
+    }
+
+TERRA_TEXTURE_FETCH_ROUTINES ( unorm8, kTerraTextureFormatUnorm8 )
+TERRA_TEXTURE_FETCH_ROUTINES ( float32, kTerraTextureFormatFloat32 )
+TERRA_TEXTURE_FETCH_ROUTINES ( float16, kTerraTextureFormatFloat16 )
+TERRA_TEXTURE_FETCH_ROUTINES ( rgb9e5, kTerraTextureFormatRGB9E5 )
+TERRA_TEXTURE_FETCH_ROUTINES ( bc1, kTerraTextureFormatBC1 )
+TERRA_TEXTURE_FETCH_ROUTINES ( bc5, kTerraTextureFormatBC5 )
+
+// Pages kept pinned by the footprint being filtered on this thread, released together once it is done.
+// A footprint touching more pages than this pins the others for each texel.
+#ifndef TERRA_TEXTURE_FOOTPRINT_PINS
+#define TERRA_TEXTURE_FOOTPRINT_PINS 8
+#endif
+
+typedef struct {
+    TerraTexturePagedLevel* level;
+    uint32_t                page;
+    int32_t                 slot;
+    const uint8_t*          pixels;
+} TerraTexturePin;
+
+typedef struct {
+    TerraTexturePin pins[TERRA_TEXTURE_FOOTPRINT_PINS];
+    size_t          count;
+    size_t          depth;      // Nested footprints, the outermost one releases the pins
+} TerraTextureFootprintPins;
+
+static TERRA_THREAD_LOCAL TerraTextureFootprintPins terra_texture_pins;
+
+static void terra_texture_pins_release() {
+    for ( size_t i = 0; i < terra_texture_pins.count; ++i ) {
+        terra_texture_cache_unpin ( terra_texture_pins.pins[i].level, terra_texture_pins.pins[i].slot );
+    }
+
+    terra_texture_pins.count = 0;
+}
+
+static inline void terra_texture_footprint_begin ( const TerraTexture* texture ) {
+    if ( texture->paged != NULL ) {
+        ++terra_texture_pins.depth;
+    }
+}
+
+static inline void terra_texture_footprint_end ( const TerraTexture* texture ) {
+    if ( texture->paged != NULL && --terra_texture_pins.depth == 0 ) {
+        terra_texture_pins_release();
+    }
+}
+
+// Outside of a footprint the page is pinned for the duration of the read
+static TerraFloat3 terra_texture_fetch_paged ( const TerraTexture* texture, int32_t x, int32_t y ) {
+    x = terra_texture_address ( x, texture->width, texture->address_mode );
+    y = terra_texture_address ( y, texture->height, texture->address_mode );
+    TerraTexturePagedLevel* level = texture->paged;
+    uint32_t page = ( ( uint32_t ) y >> TERRA_TEXTURE_PAGE_LOG2 ) * level->pages_x + ( ( uint32_t ) x >> TERRA_TEXTURE_PAGE_LOG2 );
+    const uint8_t* pixels = NULL;
+    int32_t slot = -1;
+
+    for ( size_t i = 0; i < terra_texture_pins.count; ++i ) {
+        if ( terra_texture_pins.pins[i].level == level && terra_texture_pins.pins[i].page == page ) {
+            pixels = terra_texture_pins.pins[i].pixels;
+            break;
+        }
+    }
+
+    if ( pixels == NULL ) {
+        // Pages are not kept pinned while waiting for a load, the threads filling the cache would
+        // otherwise end up waiting for each other's slots
+        if ( terra_texture_pins.count > 0 && !terra_texture_cache_resident ( level, page ) ) {
+            terra_texture_pins_release();
+        }
+
+        pixels = ( const uint8_t* ) terra_texture_cache_pin ( level, page, &slot );
+
+        if ( terra_texture_pins.depth > 0 && terra_texture_pins.count < TERRA_TEXTURE_FOOTPRINT_PINS ) {
+            TerraTexturePin pin = { level, page, slot, pixels };
+            terra_texture_pins.pins[terra_texture_pins.count++] = pin;
+            slot = -1;
+        }
+    }
+
+    pixels += terra_texture_page_tile ( ( size_t ) x, ( size_t ) y ) * terra_texture_tile_bytes ( texture );
+    TerraFloat3 texel = terra_texture_decode_texel ( texture->format, texture->components, pixels, x & TERRA_TEXTURE_TILE_MASK, y & TERRA_TEXTURE_TILE_MASK );
+
+    if ( slot >= 0 ) {
+        terra_texture_cache_unpin ( level, slot );
+    }
+
+    return texel;
+}
+
+// To be called again if format or address_mode are changed after init, the scene commit does it for the
+// textures referenced by the materials.
+void terra_texture_bind_fetch ( TerraTexture* texture ) {
+    static const TerraTextureFetch routines[kTerraTextureFormatCount][3] = {
+        { terra_texture_fetch_unorm8_wrap, terra_texture_fetch_unorm8_mirror, terra_texture_fetch_unorm8_clamp },
+        { terra_texture_fetch_float32_wrap, terra_texture_fetch_float32_mirror, terra_texture_fetch_float32_clamp },
+        { terra_texture_fetch_float16_wrap, terra_texture_fetch_float16_mirror, terra_texture_fetch_float16_clamp },
+        { terra_texture_fetch_rgb9e5_wrap, terra_texture_fetch_rgb9e5_mirror, terra_texture_fetch_rgb9e5_clamp },
+        { terra_texture_fetch_bc1_wrap, terra_texture_fetch_bc1_mirror, terra_texture_fetch_bc1_clamp },
+        { terra_texture_fetch_bc5_wrap, terra_texture_fetch_bc5_mirror, terra_texture_fetch_bc5_clamp },
+    };
+    assert ( texture->address_mode <= kTerraTextureAddressClamp );
+    assert ( texture->format < kTerraTextureFormatCount );
+    uint8_t address_mode = texture->address_mode <= kTerraTextureAddressClamp ? texture->address_mode : kTerraTextureAddressWrap;
+    texture->fetch = routines[texture->format][address_mode];
+
+    if ( texture->paged != NULL ) {
+        texture->fetch = terra_texture_fetch_paged;
+    }
+
+    for ( uint8_t i = 0; i < texture->mips_count; ++i ) {
+        texture->mips[i].address_mode = texture->address_mode;
+        texture->mips[i].fetch = texture->fetch;
+    }
+}
+
+static inline TerraFloat3 terra_texture_fetch ( const TerraTexture* texture, int32_t x, int32_t y ) {
+    return texture->fetch ( texture, x, y );
+}
+
+TerraFloat3 terra_texture_read ( TerraTexture* texture, size_t x, size_t y ) {
+    return terra_texture_fetch ( texture, ( int32_t ) x, ( int32_t ) y );
+}
+
+// Non filtered access from the public eval, the mip chain is only used when the footprint is known
+TerraFloat3 terra_texture_sample ( void* _texture, const void* _uv, const void* _xyz ) {
+    TerraTexture* texture = ( TerraTexture* ) _texture;
+    TerraFloat2* uv = ( TerraFloat2* ) _uv;
+    TerraFloat3 sample = terra_f3_zero;
+
+    switch ( texture->filter ) {
+        case kTerraFilterPoint:
+            sample = terra_texture_sample_point ( texture, uv );
+            break;
+
+        case kTerraFilterBilinear:
+        case kTerraFilterTrilinear:
+        case kTerraFilterAnisotropic:
+            sample = terra_texture_sample_bilinear ( texture, uv );
+            break;
+
+        default:
+            assert ( false );
+            break;
+    }
+
+    return sample;
+}
+
+TerraFloat3 terra_texture_sample_point ( const TerraTexture* texture, const TerraFloat2* uv ) {
+    int32_t x = ( int32_t ) floorf ( uv->x * texture->width );
+    int32_t y = ( int32_t ) floorf ( uv->y * texture->height );
+    return terra_texture_fetch ( texture, x, y );
+}
+
+TerraFloat3 terra_texture_sample_bilinear ( const TerraTexture* texture, const TerraFloat2* uv ) {
+    // Texel centers are at half coordinates
+    float fx = uv->x * texture->width - 0.5f;
+    float fy = uv->y * texture->height - 0.5f;
+    float x0 = floorf ( fx );
+    float y0 = floorf ( fy );
+    int32_t ix = ( int32_t ) x0;
+    int32_t iy = ( int32_t ) y0;
+    // Read
+    terra_texture_footprint_begin ( texture );
+    TerraFloat3 n1 = terra_texture_fetch ( texture, ix, iy );
+    TerraFloat3 n2 = terra_texture_fetch ( texture, ix + 1, iy );
+    TerraFloat3 n3 = terra_texture_fetch ( texture, ix, iy + 1 );
+    TerraFloat3 n4 = terra_texture_fetch ( texture, ix + 1, iy + 1 );
+    terra_texture_footprint_end ( texture );
+    // Compute weights for Bilinear filter
+    float w_u = fx - x0;
+    float w_v = fy - y0;
+    float w_ou = 1.f - w_u;
+    float w_ov = 1.f - w_v;
+    // Mix
+    TerraFloat3 sample;
+    sample.x = ( n1.x * w_ou + n2.x * w_u ) * w_ov + ( n3.x * w_ou + n4.x * w_u ) * w_v;
+    sample.y = ( n1.y * w_ou + n2.y * w_u ) * w_ov + ( n3.y * w_ou + n4.y * w_u ) * w_v;
+    sample.z = ( n1.z * w_ou + n2.z * w_u ) * w_ov + ( n3.z * w_ou + n4.z * w_u ) * w_v;
+    return sample;
+}
+
+// Level 0 is the texture itself, lod is clamped to the mip chain
+static const TerraTexture* terra_texture_level ( const TerraTexture* texture, int level ) {
+    level = level < 0 ? 0 : ( level > texture->mips_count ? texture->mips_count : level );
+    return level == 0 ? texture : &texture->mips[level - 1];
+}
+
+TerraFloat3 terra_texture_sample_trilinear ( const TerraTexture* texture, const TerraFloat2* uv, float lod ) {
+    lod = terra_clamp ( lod, 0.f, ( float ) texture->mips_count );
+    int level = ( int ) lod;
+    float w = lod - level;
+    TerraFloat3 s0 = terra_texture_sample_bilinear ( terra_texture_level ( texture, level ), uv );
+
+    if ( w == 0.f || level == texture->mips_count ) {
+        return s0;
+    }
+
+    TerraFloat3 s1 = terra_texture_sample_bilinear ( terra_texture_level ( texture, level + 1 ), uv );
+    return terra_lerpf3 ( &s0, &s1, w );
+}
+
+// The footprint axes are radii in texture coordinates. Trilinear filters the whole ellipse with the level
+// of its major axis, anisotropic averages probes spread along the major axis at the level of the minor one.
+TerraFloat3 terra_texture_sample_footprint ( const TerraTexture* texture, const TerraFloat2* uv, const TerraTextureFootprint* footprint ) {
+    float major_x = footprint->major.x * texture->width;
+    float major_y = footprint->major.y * texture->height;
+    float minor_x = footprint->minor.x * texture->width;
+    float minor_y = footprint->minor.y * texture->height;
+    // Diameters in texels
+    float major = 2 * sqrtf ( major_x * major_x + major_y * major_y );
+    float minor = 2 * sqrtf ( minor_x * minor_x + minor_y * minor_y );
+
+    if ( major < minor ) {
+        float t = major;
+        major = minor;
+        minor = t;
+        TerraFloat2 axis = footprint->minor;
+        major_x = axis.x;
+        major_y = axis.y;
+    } else {
+        major_x = footprint->major.x;
+        major_y = footprint->major.y;
+    }
+
+    if ( texture->filter != kTerraFilterAnisotropic || minor <= 0.f ) {
+        return terra_texture_sample_trilinear ( texture, uv, log2f ( terra_maxf ( major, 1.f ) ) );
+    }
+
+    int probes = ( int ) terra_minf ( ceilf ( major / minor ), ( float ) TERRA_TEXTURE_MAX_ANISOTROPY );
+    float lod = log2f ( terra_maxf ( terra_maxf ( major / probes, minor ), 1.f ) );
+    TerraFloat3 sample = terra_f3_zero;
+    // The probes mostly fall on the same pages
+    terra_texture_footprint_begin ( texture );
+
+    for ( int i = 0; i < probes; ++i ) {
+        // Evenly spaced along the major diameter
+        float t = ( 2.f * ( i + 0.5f ) / probes ) - 1.f;
+        TerraFloat2 p = terra_f2_set ( uv->x + major_x * t, uv->y + major_y * t );
+        TerraFloat3 s = terra_texture_sample_trilinear ( texture, &p, lod );
+        sample = terra_addf3 ( &sample, &s );
+    }
+
+    terra_texture_footprint_end ( texture );
+    return terra_divf3 ( &sample, ( float ) probes );
+}
+
+TerraFloat3 terra_texture_sample_latlong ( void* _texture, const void* _dir, const void* _xyz ) {
+    TerraTexture* texture = ( TerraTexture* ) _texture;
+    TerraFloat3* dir = ( TerraFloat3* ) _dir;
+    TerraFloat3 d = terra_normf3 ( dir );
+    float theta = acosf ( d.y );
+    float phi = atan2f ( d.z, d.x ) + terra_PI;
+    size_t u = ( size_t ) ( ( phi / ( 2 * terra_PI ) ) * texture->width );
+    size_t v = ( size_t ) ( ( theta / ( terra_PI ) ) * texture->height );
+    return terra_texture_read ( texture, u, v );
+}
+
+static void terra_texture_destroy_mips ( TerraTexture* texture ) {
+    for ( uint8_t i = 0; i < texture->mips_count; ++i ) {
+        terra_free ( texture->mips[i].pixels );
+    }
+
+    terra_free ( texture->mips );
+    texture->mips = NULL;
+    texture->mips_count = 0;
+}
+
+void terra_texture_destroy ( TerraTexture* texture ) {
+    if ( texture->paged != NULL ) {
+        terra_texture_paged_destroy ( texture );
+    }
+
+    terra_texture_destroy_mips ( texture );
+    terra_free ( texture->pixels );
+    texture->pixels = NULL;
+}
+
+// Each level is a 2x2 box filter of the one above, down to 1x1, in the same format.
+void terra_texture_generate_mips ( TerraTexture* texture ) {
+    if ( texture->paged != NULL ) {
+        return;
+    }
+
+    terra_texture_destroy_mips ( texture );
+
+    if ( texture->pixels == NULL ) {
+        return;
+    }
+
+    uint8_t count = 0;
+
+    for ( size_t w = texture->width, h = texture->height; w > 1 || h > 1; w = terra_maxi ( w / 2, 1 ), h = terra_maxi ( h / 2, 1 ) ) {
+        ++count;
+    }
+
+    if ( count == 0 ) {
+        return;
+    }
+
+    texture->mips = ( TerraTexture* ) terra_malloc ( sizeof ( TerraTexture ) * count );
+    // Lossy formats are filtered from a float copy of the level above, the error would build up otherwise
+    bool lossy = texture->format != kTerraTextureFormatUnorm8 && texture->format != kTerraTextureFormatFloat32;
+    TerraTexture src = *texture;
+
+    if ( lossy ) {
+        src.format = kTerraTextureFormatFloat32;
+        src.pixels = terra_malloc ( terra_texture_storage_bytes ( &src ) );
+        TerraTextureEncodeJob job = { &src, texture, NULL, terra_texture_gather_copy };
+        terra_texture_encode ( &job );
+    }
+
+    for ( uint8_t l = 0; l < count; ++l ) {
+        TerraTexture* dst = &texture->mips[l];
+        *dst = src;
+        dst->format = texture->format;
+        dst->width = ( uint16_t ) terra_maxi ( src.width / 2, 1 );
+        dst->height = ( uint16_t ) terra_maxi ( src.height / 2, 1 );
+        dst->mips = NULL;
+        dst->mips_count = 0;
+        dst->pixels = terra_malloc ( terra_texture_storage_bytes ( dst ) );
+
+        if ( lossy ) {
+            TerraTexture filtered = *dst;
+            filtered.format = kTerraTextureFormatFloat32;
+            filtered.pixels = terra_malloc ( terra_texture_storage_bytes ( &filtered ) );
+            TerraTextureEncodeJob downsample = { &filtered, &src, NULL, terra_texture_gather_downsample };
+            terra_texture_encode ( &downsample );
+            TerraTextureEncodeJob encode = { dst, &filtered, NULL, terra_texture_gather_copy };
+            terra_texture_encode ( &encode );
+            terra_free ( src.pixels );
+            src = filtered;
+        } else {
+            TerraTextureEncodeJob job = { dst, &src, NULL, terra_texture_gather_downsample };
+            terra_texture_encode ( &job );
+            src = *dst;
+        }
+    }
+
+    if ( lossy ) {
+        terra_free ( src.pixels );
+    }
+
+    texture->mips_count = count;
+    terra_texture_bind_fetch ( texture );
+}
+
+void terra_texture_finalize ( void* _texture ) {
+    TerraTexture* texture = ( TerraTexture* ) _texture;
+
+    if ( texture == NULL ) {
+        return;
+    }
+
+    // Paged textures are converted as the pages are loaded, the mips come from the file
+    if ( texture->paged != NULL ) {
+#ifndef TERRA_TEXTURE_NO_SRGB
+        terra_texture_paged_linearize ( texture );
+#endif
+        return;
+    }
+
+#ifndef TERRA_TEXTURE_NO_SRGB
+
+    if ( texture->pixels != NULL ) {
+        TerraTextureEncodeJob job = { texture, texture, NULL, terra_texture_gather_linearize };
+        terra_texture_encode ( &job );
+    }
+
+#endif
+
+    // The mips are filtered in linear space
+    if ( texture->filter == kTerraFilterTrilinear || texture->filter == kTerraFilterAnisotropic ) {
+        terra_texture_generate_mips ( texture );
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+// @TerraRender
+// Finalizer of MurmurHash3
+static uint64_t terra_hash64 ( uint64_t h ) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Depends on the scene seed, the region, the samples it already holds and the passes started in its tile.
+// Rendering the same region twice gives two independent passes, also once the count of the compact formats
+// is full, a render resumed from a saved state goes on with new samples, and the runs of different seeds
+// can be merged.
+static uint64_t terra_render_seed ( const TerraScene* scene, const TerraFramebuffer* framebuffer, size_t x, size_t y ) {
+    uint64_t samples = ( uint64_t ) terra_framebuffer_result ( framebuffer, y * framebuffer->width + x ).samples;
+    size_t tile = ( y / TERRA_RENDER_TILE_SIZE ) * terra_framebuffer_tiles_x ( framebuffer ) + x / TERRA_RENDER_TILE_SIZE;
+    uint64_t pass = ( uint32_t ) terra_atomic_fetch_add ( &framebuffer->passes[tile], 1 );
+    uint64_t h = terra_hash64 ( scene->opts.seed + 1 );
+    h = terra_hash64 ( h ^ ( framebuffer->image_x + x ) );
+    h = terra_hash64 ( h ^ ( ( uint64_t ) ( framebuffer->image_y + y ) << 32 ) );
+    return terra_hash64 ( h ^ samples ^ ( pass << 32 ) );
+}
+
+//--------------------------------------------------------------------------------------------------
+// The primary rays of a batch of pixels are all traced first, their hits are then grouped by object and the
+// surfaces of each group are evaluated together. The paths are continued in the same order, so that the hits
+// on the same material are shaded one after the other.
+static void terra_render_batched ( const TerraCamera* camera, TerraScene* scene, const TerraFramebuffer* framebuffer,
+                                   size_t x, size_t y, size_t width, size_t height, size_t spp, uint64_t seed ) {
+    TerraFloat4x4 camera_rotation = terra_camera_to_world_frame ( camera );
+    float pixel_spread = terra_camera_pixel_spread ( camera, framebuffer );
+    TerraSamplerRandom random_sampler;
+    terra_sampler_random_init ( &random_sampler, seed, 0 );
+    size_t batch_pixels = terra_maxi ( TERRA_SHADING_BATCH_SIZE / terra_maxi ( spp, 1 ), 1 );
+    size_t batch_cap = batch_pixels * spp;
+    TerraRay* rays = ( TerraRay* ) terra_malloc ( sizeof ( TerraRay ) * batch_cap );
+    TerraHitContext* hits = ( TerraHitContext* ) terra_malloc ( sizeof ( TerraHitContext ) * batch_cap );
+    TerraFloat3* radiance = ( TerraFloat3* ) terra_malloc ( sizeof ( TerraFloat3 ) * batch_cap );
+    uint32_t* order = ( uint32_t* ) terra_malloc ( sizeof ( uint32_t ) * batch_cap );
+    size_t pixels = width * height;
+
+    for ( size_t batch_begin = 0; batch_begin < pixels; batch_begin += batch_pixels ) {
+        size_t batch_end = terra_mini ( batch_begin + batch_pixels, pixels );
+        // Primary rays, the samples of a pixel are contiguous. Bin 0 holds the misses, bin i + 1 the hits on object i.
+        uint32_t bins[TERRA_SCENE_MAX_OBJECTS + 2] = { 0 };
+        size_t n = 0;
+
+        for ( size_t p = batch_begin; p < batch_end; ++p ) {
+            size_t px = x + p % width;
+            size_t py = y + p / width;
+
+            for ( size_t s = 0; s < spp; ++s, ++n ) {
+                float r1 = terra_sampler_random_next ( &random_sampler );
+                float r2 = terra_sampler_random_next ( &random_sampler );
+                TerraFloat3 ray_dir = terra_camera_perspective_sample ( camera, framebuffer, px, py, scene->opts.subpixel_jitter, r1, r2 );
+                ray_dir = terra_transformf3 ( &camera_rotation, &ray_dir );
+                rays[n] = terra_ray ( &camera->position, &ray_dir );
+                rays[n].cone_spread = pixel_spread;
+
+                if ( terra_scene_raycast ( scene, &rays[n], &hits[n] ) != NULL ) {
+                    ++bins[hits[n].hit.primitive.object_idx + 2];
+                } else {
+                    ++bins[1];
+                }
+            }
+        }
+
+        // Counting sort by object, the bins become the first index of each group
+        for ( size_t i = 1; i < TERRA_SCENE_MAX_OBJECTS + 2; ++i ) {
+            bins[i] += bins[i - 1];
+        }
+
+        for ( size_t i = 0; i < n; ++i ) {
+            size_t bin = hits[i].object != NULL ? hits[i].hit.primitive.object_idx + 1 : 0;
+            order[bins[bin]++] = ( uint32_t ) i;
+        }
+
+        // After the scatter each bin ends where the next one begins. A batch holds at least the samples of
+        // a pixel, with more than TERRA_SHADING_BATCH_SIZE of them the bins are evaluated in chunks.
+        for ( size_t i = 1, begin = bins[0]; i < TERRA_SCENE_MAX_OBJECTS + 1; ++i ) {
+            for ( ; begin < bins[i]; begin += TERRA_SHADING_BATCH_SIZE ) {
+                terra_surface_eval_batch ( hits, order + begin, terra_mini ( bins[i] - begin, TERRA_SHADING_BATCH_SIZE ) );
+            }
+
+            begin = bins[i];
+        }
+
+        for ( size_t i = 0; i < n; ++i ) {
+            uint32_t k = order[i];
+            radiance[k] = terra_trace ( scene, &rays[k], &hits[k] );
+        }
+
+        // Accumulate
+        for ( size_t p = batch_begin, k = 0; p < batch_end; ++p ) {
+            TerraFloat3 acc = terra_f3_zero;
+            float acc_lum2 = 0;
+
+            for ( size_t s = 0; s < spp; ++s, ++k ) {
+                acc = terra_addf3 ( &acc, &radiance[k] );
+                float lum = terra_luminance ( &radiance[k] );
+                acc_lum2 += lum * lum;
+            }
+
+            size_t idx = ( y + p / width ) * framebuffer->width + x + p % width;
+            terra_framebuffer_accumulate ( framebuffer, idx, &acc, acc_lum2, spp );
+        }
+    }
+
+    terra_framebuffer_touch ( framebuffer, x, y, width, height );
+
+    terra_free ( rays );
+    terra_free ( hits );
+    terra_free ( radiance );
+    terra_free ( order );
+}
+
+void terra_render ( const TerraCamera* camera, HTerraScene _scene, const TerraFramebuffer* framebuffer, size_t x, size_t y, size_t width, size_t height ) {
+    TerraScene* scene = ( TerraScene* ) _scene;
+    TerraClockTime t = TERRA_CLOCK();
+    TerraFloat4x4 camera_rotation = terra_camera_to_world_frame ( camera );
+    float pixel_spread = terra_camera_pixel_spread ( camera, framebuffer );
+    size_t spp = scene->opts.samples_per_pixel;
+    size_t samples_per_strata = 0;
+
+    if ( scene->opts.sampling_method == kTerraSamplingMethodStratified ) {
+        size_t cur = scene->opts.strata * scene->opts.strata;
+
+        while ( ++samples_per_strata && spp > cur ) {
+            cur *= cur;
+        }
+
+        spp = cur;
+    }
+
+    // The camera samples and the paths get a stream each
+    uint64_t seed = terra_render_seed ( scene, framebuffer, x, y );
+    terra_sampler_random_init ( &terra_thread_random, terra_hash64 ( seed ), 1 );
+
+    if ( scene->opts.batch_shading ) {
+        terra_render_batched ( camera, scene, framebuffer, x, y, width, height, spp, seed );
+        TERRA_PROFILE_ADD_SAMPLE ( time, TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_RENDER, TERRA_CLOCK() - t );
+        return;
+    }
+
+    TerraSamplerRandom random_sampler;
+    terra_sampler_random_init ( &random_sampler, seed, 0 );
+
+    for ( size_t i = y; i < y + height; ++i ) {
+        for ( size_t j = x; j < x + width; ++j ) {
+            // Init sampler
+            TerraSampler2D hemisphere_sampler;
+            hemisphere_sampler.sampler = NULL;
+            TerraSamplerStratified stratified_sampler;
+            TerraSamplerHalton halton_sampler;
+
+            if ( scene->opts.sampling_method == kTerraSamplingMethodStratified ) {
+                hemisphere_sampler.sampler = &stratified_sampler;
+                hemisphere_sampler.sample = terra_sampler_stratified_next_pair;
+                terra_sampler_stratified_init ( &stratified_sampler, &random_sampler, ( int ) scene->opts.strata, 16 );
+            } else if ( scene->opts.sampling_method == kTerraSamplingMethodHalton ) {
+                hemisphere_sampler.sampler = &halton_sampler;
+                hemisphere_sampler.sample = terra_sampler_halton_next_pair;
+                terra_sampler_halton_init ( &halton_sampler );
+            }
+
+            // Integrate
+            TerraFloat3 acc = terra_f3_zero;
+            float acc_lum2 = 0;
+
+            for ( size_t s = 0; s < spp; ++s ) {
+                // Sample random jitter
+                float r1 = terra_sampler_random_next ( &random_sampler );
+                float r2 = terra_sampler_random_next ( &random_sampler );
+                // Build camera ray
+                TerraFloat3 ray_dir = terra_camera_perspective_sample ( camera, framebuffer, j, i, scene->opts.subpixel_jitter, r1, r2 );
+                ray_dir = terra_transformf3 ( &camera_rotation, &ray_dir );
+                TerraRay ray = terra_ray ( &camera->position, &ray_dir );
+                ray.cone_spread = pixel_spread;
+                // Trace
+                TerraClockTime t = TERRA_CLOCK();
+                TerraFloat3 dL = terra_trace ( scene, &ray, NULL );
+                TERRA_PROFILE_ADD_SAMPLE ( time, TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_TRACE, TERRA_CLOCK() - t );
+                // Accumulate radiance
+                acc = terra_addf3 ( &acc, &dL );
+                float lum = terra_luminance ( &dL );
+                acc_lum2 += lum * lum;
+            }
+
+            // Accumulate with previous integrations
+            terra_framebuffer_accumulate ( framebuffer, i * framebuffer->width + j, &acc, acc_lum2, spp );
+        }
+    }
+
+    terra_framebuffer_touch ( framebuffer, x, y, width, height );
+    TERRA_PROFILE_ADD_SAMPLE ( time, TERRA_PROFILE_SESSION_DEFAULT, TERRA_PROFILE_TARGET_RENDER, TERRA_CLOCK() - t );
+}
+
+bool terra_render_until ( const TerraCamera* camera, HTerraScene _scene, const TerraFramebuffer* framebuffer, size_t x, size_t y, size_t width, size_t height,
+                          double budget_ms, float target_error, TerraRenderStats* stats ) {
+    TerraClockTime begin = terra_clock();
+    const size_t tile_size = TERRA_RENDER_TILE_SIZE;
+    size_t tiles_x = ( width + tile_size - 1 ) / tile_size;
+    size_t tiles_y = ( height + tile_size - 1 ) / tile_size;
+    size_t tiles = tiles_x * tiles_y;
+    size_t tiles_active = tiles;
+    size_t samples = 0;
+    bool* converged = ( bool* ) terra_malloc ( sizeof ( bool ) * tiles );
+    memset ( converged, 0, sizeof ( bool ) * tiles );
+
+    // One pass renders every tile that has yet to converge. Passes keep going until the error target is met
+    // or the budget runs out. Without either criterion there is nothing to wait for after the first pass.
+    bool out_of_time = false;
+
+    do {
+        for ( size_t t = 0; t < tiles && !out_of_time; ++t ) {
+            if ( converged[t] ) {
+                continue;
+            }
+
+            if ( budget_ms > 0 && terra_clock_to_ms ( terra_clock() - begin ) >= budget_ms ) {
+                out_of_time = true;
+                break;
+            }
+
+            size_t tx = x + ( t % tiles_x ) * tile_size;
+            size_t ty = y + ( t / tiles_x ) * tile_size;
+            size_t tw = terra_mini ( tile_size, x + width - tx );
+            size_t th = terra_mini ( tile_size, y + height - ty );
+            size_t before = terra_framebuffer_result ( framebuffer, ty * framebuffer->width + tx ).samples;
+            terra_render ( camera, _scene, framebuffer, tx, ty, tw, th );
+            samples += ( terra_framebuffer_result ( framebuffer, ty * framebuffer->width + tx ).samples - before ) * tw * th;
+
+            if ( target_error > 0 && terra_framebuffer_error ( framebuffer, tx, ty, tw, th ) <= target_error ) {
+                converged[t] = true;
+                --tiles_active;
+            }
+        }
+    } while ( tiles_active > 0 && !out_of_time && ( budget_ms > 0 || target_error > 0 ) );
+
+    if ( stats != NULL ) {
+        stats->samples = samples;
+        stats->tiles = tiles;
+        stats->tiles_converged = tiles - tiles_active;
+        stats->error = terra_framebuffer_error ( framebuffer, x, y, width, height );
+        stats->time_ms = terra_clock_to_ms ( terra_clock() - begin );
+    }
+
+    terra_free ( converged );
+    return tiles_active == 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+// @System
+//--------------------------------------------------------------------------------------------------
+#ifndef TERRA_MALLOC
+void* terra_malloc ( size_t size ) {
+    return malloc ( size );
+}
+
+void* terra_realloc ( void* p, size_t size ) {
+    return realloc ( p, size );
+}
+
+void terra_free ( void* ptr ) {
+    free ( ptr );
 }
 #endif
 
@@ -675,10 +1763,9 @@ void terra_log ( const char* str, ... ) {
 //--------------------------------------------------------------------------------------------------
 // @TerraSampler
 //--------------------------------------------------------------------------------------------------
-void terra_sampler_random_init ( TerraSamplerRandom* sampler ) {
-    uint32_t seed = ( uint32_t ) ( ( uint64_t ) time ( NULL ) ^ ( uint64_t ) &exit );
+void terra_sampler_random_init ( TerraSamplerRandom* sampler, uint64_t seed, uint64_t stream ) {
     sampler->state = 0;
-    sampler->inc = 1;
+    sampler->inc = ( stream << 1 ) | 1;
     terra_sampler_random_next ( sampler );
     sampler->state += seed;
     terra_sampler_random_next ( sampler );
@@ -757,92 +1844,282 @@ void terra_sampler_halton_next_pair ( void* _sampler, float* e1, float* e2 ) {
 //--------------------------------------------------------------------------------------------------
 // @TerraDistribution
 //--------------------------------------------------------------------------------------------------
-void terra_distribution_1d_init ( TerraDistribution1D* dist, const float* f, size_t n ) {
-    dist->n = n;
-    dist->cdf = ( float* ) terra_malloc ( sizeof ( float ) * n );
-    dist->f = ( float* ) terra_malloc ( sizeof ( float ) * n );
-    float integral = 0;
+// Fills the distribution arrays, already allocated for its method and size.
+// The alias method needs n uint32_t of scratch memory to hold the work lists.
+static void terra_distribution_1d_build ( TerraDistribution1D* dist, const float* f, uint32_t* scratch ) {
+    size_t n = dist->n;
+    double integral = 0;
 
     // compute the integral and the unnormalized cdf
     for ( size_t i = 0; i < n; ++i ) {
         dist->f[i] = f[i];
         integral += f[i];
-        dist->cdf[i] = integral;
+
+        if ( dist->method == kTerraDistributionCdf ) {
+            dist->cdf[i] = ( float ) integral;
+        }
+    }
+
+    dist->integral = ( float ) integral;
+
+    if ( dist->method == kTerraDistributionCdf ) {
+        // normalize the cdf, a null function is sampled uniformly
+        for ( size_t i = 0; i < n; ++i ) {
+            dist->cdf[i] = integral > 0 ? ( float ) ( dist->cdf[i] / integral ) : ( float ) ( i + 1 ) / n;
+        }
+
+        return;
     }
 
-    dist->integral = integral;
+    // Vose's alias method. Buckets are scaled so that the average is 1, then each underfull (small) bucket
+    // is topped up with an overfull (large) one, which becomes its alias.
+    // The small list grows from the front of scratch, the large one from the back.
+    size_t small_count = 0;
+    size_t large_begin = n;
 
-    // normalize the cdf
     for ( size_t i = 0; i < n; ++i ) {
-        dist->cdf[i] /= integral;
+        dist->alias_prob[i] = integral > 0 ? ( float ) ( f[i] * n / integral ) : 1.f;
+        dist->alias[i] = ( uint32_t ) i;
+
+        if ( dist->alias_prob[i] < 1 ) {
+            scratch[small_count++] = ( uint32_t ) i;
+        } else {
+            scratch[--large_begin] = ( uint32_t ) i;
+        }
+    }
+
+    while ( small_count > 0 && large_begin < n ) {
+        uint32_t l = scratch[--small_count];
+        uint32_t g = scratch[large_begin++];
+        dist->alias[l] = g;
+        dist->alias_prob[g] = ( dist->alias_prob[g] + dist->alias_prob[l] ) - 1;
+
+        if ( dist->alias_prob[g] < 1 ) {
+            scratch[small_count++] = g;
+        } else {
+            scratch[--large_begin] = g;
+        }
+    }
+
+    // Leftovers are only due to rounding, they are full
+    while ( large_begin < n ) {
+        dist->alias_prob[scratch[large_begin++]] = 1;
+    }
+
+    while ( small_count > 0 ) {
+        dist->alias_prob[scratch[--small_count]] = 1;
+    }
+}
+
+void terra_distribution_1d_init ( TerraDistribution1D* dist, const float* f, size_t n ) {
+    terra_distribution_1d_init_method ( dist, f, n, kTerraDistributionCdf );
+}
+
+void terra_distribution_1d_init_method ( TerraDistribution1D* dist, const float* f, size_t n, TerraDistributionMethod method ) {
+    dist->n = n;
+    dist->method = method;
+    dist->f = ( float* ) terra_malloc ( sizeof ( float ) * n );
+    dist->cdf = NULL;
+    dist->alias_prob = NULL;
+    dist->alias = NULL;
+    uint32_t* scratch = NULL;
+
+    if ( method == kTerraDistributionCdf ) {
+        dist->cdf = ( float* ) terra_malloc ( sizeof ( float ) * n );
+    } else {
+        dist->alias_prob = ( float* ) terra_malloc ( sizeof ( float ) * n );
+        dist->alias = ( uint32_t* ) terra_malloc ( sizeof ( uint32_t ) * n );
+        scratch = ( uint32_t* ) terra_malloc ( sizeof ( uint32_t ) * n );
     }
+
+    terra_distribution_1d_build ( dist, f, scratch );
+    terra_free ( scratch );
 }
 
-float terra_distribution_1d_sample ( TerraDistribution1D* dist, float e, float* pdf, size_t* idx ) {
+float terra_distribution_1d_sample ( const TerraDistribution1D* dist, float e, float* pdf, size_t* idx ) {
     size_t n = dist->n;
-    float prev = 0;
+    size_t i;
+    float d;
+
+    if ( dist->method == kTerraDistributionAlias ) {
+        // e picks the bucket, what is left of it decides between the bucket and its alias.
+        // In double the product is exact, in float it rounds away the fraction for millions of buckets.
+        double u = ( double ) e * n;
+        i = terra_mini ( ( size_t ) u, n - 1 );
+        double r = u - i;
+        double p = dist->alias_prob[i];
+
+        if ( r < p ) {
+            d = ( float ) ( r / p );
+        } else {
+            d = ( float ) ( ( r - p ) / ( 1 - p ) );
+            i = dist->alias[i];
+        }
+    } else {
+        // First bucket whose cdf is greater than e
+        size_t lo = 0;
+        size_t hi = n - 1;
 
-    for ( size_t i = 0; i < n; ++i ) {
-        float curr = dist->cdf[i];
+        while ( lo < hi ) {
+            size_t mid = ( lo + hi ) / 2;
 
-        if ( e < curr ) {
-            if ( pdf != NULL ) {
-                *pdf = dist->f[i] / dist->integral;
+            if ( dist->cdf[mid] <= e ) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
             }
+        }
 
-            if ( idx != NULL ) {
-                *idx = i;
-            }
+        i = lo;
 
-            // cdf[i - 1] <= e < cdf[i]
-            // Found the bucket, now interpolate.
-            float d = e - prev;
-            d /= curr - prev;
-            return ( i + d ) / n;
+        // e rounded past the last non empty bucket
+        while ( i > 0 && dist->f[i] == 0 && dist->integral > 0 ) {
+            --i;
         }
 
-        prev = curr;
+        // cdf[i - 1] <= e < cdf[i]
+        // Found the bucket, now interpolate.
+        float prev = i > 0 ? dist->cdf[i - 1] : 0;
+        float curr = dist->cdf[i];
+        d = curr > prev ? ( e - prev ) / ( curr - prev ) : 0;
     }
 
-    assert ( false );
-    return FLT_MAX;
+    if ( pdf != NULL ) {
+        *pdf = terra_distribution_1d_pdf ( dist, i );
+    }
+
+    if ( idx != NULL ) {
+        *idx = i;
+    }
+
+    d = terra_clamp ( d, 0.f, 1.f - terra_Epsilon );
+    return ( i + d ) / n;
 }
 
-void terra_distribution_2d_init ( TerraDistributon2D* dist, const float* f, size_t nx, size_t ny ) {
-    for ( size_t i = 0; i < ny; ++i ) {
-        terra_distribution_1d_init ( &dist->conditionals[i], f + nx * i, nx );
+float terra_distribution_1d_pdf ( const TerraDistribution1D* dist, size_t idx ) {
+    return dist->integral > 0 ? dist->f[idx] / dist->integral : 1.f / dist->n;
+}
+
+void terra_distribution_1d_destroy ( TerraDistribution1D* dist ) {
+    terra_free ( dist->f );
+    terra_free ( dist->cdf );
+    terra_free ( dist->alias_prob );
+    terra_free ( dist->alias );
+    memset ( dist, 0, sizeof ( TerraDistribution1D ) );
+}
+
+typedef struct {
+    TerraDistributon2D* dist;
+    const float*        f;
+} TerraDistributionRows;
+
+static void terra_distribution_2d_init_rows_job ( void* _job, size_t begin, size_t end ) {
+    TerraDistributionRows* job = ( TerraDistributionRows* ) _job;
+    terra_distribution_2d_init_rows ( job->dist, job->f, begin, end );
+}
+
+// Rows per thread at least
+#ifndef TERRA_DISTRIBUTION_ROWS_GRAIN
+#define TERRA_DISTRIBUTION_ROWS_GRAIN 16
+#endif
+
+void terra_distribution_2d_init ( TerraDistributon2D* dist, const float* f, size_t nx, size_t ny, TerraDistributionMethod method ) {
+    terra_distribution_2d_alloc ( dist, nx, ny, method );
+    TerraDistributionRows job = { dist, f };
+    terra_parallel_for ( ny, TERRA_DISTRIBUTION_ROWS_GRAIN, terra_distribution_2d_init_rows_job, &job );
+    terra_distribution_2d_finalize ( dist );
+}
+
+void terra_distribution_2d_alloc ( TerraDistributon2D* dist, size_t nx, size_t ny, TerraDistributionMethod method ) {
+    // f and either cdf or alias_prob + alias for each row, in a single block
+    size_t row_size = sizeof ( float ) * nx * 2;
+
+    if ( method == kTerraDistributionAlias ) {
+        row_size += sizeof ( uint32_t ) * nx;
     }
 
-    // compute the marginal distribution using the integral of each row
+    uint8_t* data = ( uint8_t* ) terra_malloc ( row_size * ny );
+    dist->rows_data = data;
+    dist->conditionals = ( TerraDistribution1D* ) terra_malloc ( sizeof ( TerraDistribution1D ) * ny );
     dist->marginal.n = ny;
-    dist->marginal.f = ( float* ) terra_malloc ( sizeof ( float ) * ny );
-    dist->marginal.cdf = ( float* ) terra_malloc ( sizeof ( float ) * ny );
-    float integral = 0;
+    dist->marginal.method = method;
 
     for ( size_t i = 0; i < ny; ++i ) {
-        dist->marginal.f[i] = dist->conditionals[i].integral;
-        integral += dist->conditionals[i].integral;
-        dist->marginal.cdf[i] = integral;
+        TerraDistribution1D* row = &dist->conditionals[i];
+        uint8_t* row_data = data + row_size * i;
+        row->n = nx;
+        row->method = method;
+        row->f = ( float* ) row_data;
+        row->cdf = NULL;
+        row->alias_prob = NULL;
+        row->alias = NULL;
+
+        if ( method == kTerraDistributionCdf ) {
+            row->cdf = ( float* ) ( row_data + sizeof ( float ) * nx );
+        } else {
+            row->alias_prob = ( float* ) ( row_data + sizeof ( float ) * nx );
+            row->alias = ( uint32_t* ) ( row_data + sizeof ( float ) * nx * 2 );
+        }
+    }
+}
+
+// f points to the whole width * height function, only rows [row_begin, row_end) are read.
+// Rows are independent, disjoint ranges can be initialized concurrently.
+void terra_distribution_2d_init_rows ( TerraDistributon2D* dist, const float* f, size_t row_begin, size_t row_end ) {
+    uint32_t* scratch = NULL;
+    size_t nx = dist->conditionals[0].n;
+
+    if ( dist->marginal.method == kTerraDistributionAlias ) {
+        scratch = ( uint32_t* ) terra_malloc ( sizeof ( uint32_t ) * nx );
     }
 
-    dist->marginal.integral = integral;
+    for ( size_t i = row_begin; i < row_end; ++i ) {
+        terra_distribution_1d_build ( &dist->conditionals[i], f + nx * i, scratch );
+    }
+
+    terra_free ( scratch );
+}
+
+void terra_distribution_2d_finalize ( TerraDistributon2D* dist ) {
+    // compute the marginal distribution using the integral of each row
+    size_t ny = dist->marginal.n;
+    float* integrals = ( float* ) terra_malloc ( sizeof ( float ) * ny );
 
     for ( size_t i = 0; i < ny; ++i ) {
-        dist->marginal.cdf[i] /= integral;
+        integrals[i] = dist->conditionals[i].integral;
     }
+
+    terra_distribution_1d_init_method ( &dist->marginal, integrals, ny, dist->marginal.method );
+    terra_free ( integrals );
 }
 
-TerraFloat2 terra_distribution_2d_sample ( TerraDistributon2D* dist, float e1, float e2, float* pdf ) {
+TerraFloat2 terra_distribution_2d_sample ( const TerraDistributon2D* dist, float e1, float e2, float* pdf ) {
     float pdfs[2];
     size_t i;
-    float s1 = terra_distribution_1d_sample ( &dist->marginal, e1, &pdfs[0], &i );
-    float s2 = terra_distribution_1d_sample ( &dist->conditionals[i], e2, &pdfs[1], NULL );
+    float v = terra_distribution_1d_sample ( &dist->marginal, e1, &pdfs[0], &i );
+    float u = terra_distribution_1d_sample ( &dist->conditionals[i], e2, &pdfs[1], NULL );
 
     if ( pdf != NULL ) {
         *pdf = pdfs[0] * pdfs[1];
     }
 
-    return terra_f2_set ( s1, s2 );
+    return terra_f2_set ( u, v );
+}
+
+float terra_distribution_2d_pdf ( const TerraDistributon2D* dist, float u, float v ) {
+    size_t nx = dist->conditionals[0].n;
+    size_t ny = dist->marginal.n;
+    size_t x = terra_mini ( ( size_t ) terra_maxf ( u * nx, 0.f ), nx - 1 );
+    size_t y = terra_mini ( ( size_t ) terra_maxf ( v * ny, 0.f ), ny - 1 );
+    return terra_distribution_1d_pdf ( &dist->marginal, y ) * terra_distribution_1d_pdf ( &dist->conditionals[y], x );
+}
+
+void terra_distribution_2d_destroy ( TerraDistributon2D* dist ) {
+    terra_distribution_1d_destroy ( &dist->marginal );
+    terra_free ( dist->conditionals );
+    terra_free ( dist->rows_data );
+    dist->conditionals = NULL;
+    dist->rows_data = NULL;
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -1036,52 +2313,87 @@ float terra_luminance ( const TerraFloat3* color ) {
     return ( float ) ( 0.212671 * color->x + 0.715160 * color->y + 0.072169 * color->z );
 }
 
-TerraFloat3 terra_trace ( TerraScene* scene, const TerraRay* primary_ray ) {
+TerraFloat3 terra_bsdf_sample_eval ( const TerraBSDF* bsdf, const TerraShadingSurface* surface, float e1, float e2, float e3, const TerraFloat3* wo, TerraFloat3* wi, float* pdf ) {
+    if ( bsdf->sample_eval != NULL ) {
+        return bsdf->sample_eval ( surface, e1, e2, e3, wo, wi, pdf );
+    }
+
+    *wi = bsdf->sample ( surface, e1, e2, e3, wo );
+    *pdf = bsdf->pdf ( surface, wi, wo );
+    return bsdf->eval ( surface, wi, wo );
+}
+
+TerraFloat3 terra_bsdf_eval_pdf ( const TerraBSDF* bsdf, const TerraShadingSurface* surface, const TerraFloat3* wi, const TerraFloat3* wo, float* pdf ) {
+    if ( bsdf->eval_pdf != NULL ) {
+        return bsdf->eval_pdf ( surface, wi, wo, pdf );
+    }
+
+    *pdf = bsdf->pdf ( surface, wi, wo );
+    return bsdf->eval ( surface, wi, wo );
+}
+
+// primary_hit is the already traced hit of the primary ray, NULL to trace it here.
+TerraFloat3 terra_trace ( TerraScene* scene, const TerraRay* primary_ray, const TerraHitContext* primary_hit ) {
     TerraFloat3 Lo = terra_f3_zero;
     TerraFloat3 throughput = terra_f3_one;
     TerraRay ray = *primary_ray;
-    TerraRayState ray_state;
+
+    if ( scene->opts.integrator == kTerraIntegratorPath ) {
+        return terra_trace_path ( scene, primary_ray, primary_hit );
+    }
 
     for ( size_t bounce = 0; bounce <= scene->opts.bounces; ++bounce ) {
-        terra_ray_state_init ( &ray, &ray_state );
         // Raycast
-        TerraShadingSurface surface;
-        TerraFloat3 intersection_point;
+        TerraHitContext hit;
         TerraObject* object;
-        object = terra_scene_raycast ( scene, &ray, &ray_state, &surface, &intersection_point, NULL );
+
+        if ( bounce == 0 && primary_hit != NULL ) {
+            hit = *primary_hit;
+            object = hit.object;
+        } else {
+            object = terra_scene_raycast ( scene, &ray, &hit );
+        }
 
         if ( object == NULL ) {
-            TerraFloat3 env_color = terra_attribute_eval ( &scene->opts.environment_map, &ray.direction, &intersection_point );
-            throughput = terra_pointf3 ( &throughput, &env_color );
-            //Lo = terra_addf3 ( &Lo, &throughput );
+            // The direct integrators sample the environment as a light after the first bounce
+            bool env_visible = scene->opts.integrator == kTerraIntegratorSimple ||
+                               ( bounce == 0 && ( scene->opts.integrator == kTerraIntegratorDirect || scene->opts.integrator == kTerraIntegratorDirectMis ) );
+
+            if ( env_visible ) {
+                TerraFloat3 env_color = terra_attribute_eval ( &scene->opts.environment_map, &ray.direction, NULL );
+                env_color = terra_pointf3 ( &throughput, &env_color );
+                Lo = terra_addf3 ( &Lo, &env_color );
+            }
+
             break;
         }
 
-        // Integrate radiance
+        // Integrate radiance, the path continues from the hit so it is shaded in full
+        const TerraShadingSurface* surface = terra_surface_eval ( &hit, TERRA_SURFACE_ALL );
         TerraFloat3 wo = terra_negf3 ( &ray.direction );
-        TerraFloat3 radiance = terra_integrate ( scene, &ray, object, &surface, &intersection_point, &wo, &throughput, bounce );
+        TerraFloat3 radiance = terra_integrate ( scene, &ray, object, surface, &hit.point, &wo, &throughput, bounce );
         Lo = terra_addf3 ( &Lo, &radiance );
         // Continue path
         TerraFloat3 wi;
+        TerraFloat3 f_brdf;
         float pdf;
         {
             float e0 = _randf();
             float e1 = _randf();
             float e2 = _randf();
-            wi = object->material.bsdf.sample ( &surface, e0, e1, e2, &wo );
-            pdf = terra_maxf ( object->material.bsdf.pdf ( &surface, &wi, &wo ), terra_Epsilon );
+            f_brdf = terra_bsdf_sample_eval ( &object->material.bsdf, surface, e0, e1, e2, &wo, &wi, &pdf );
+            pdf = terra_maxf ( pdf, terra_Epsilon );
         }
         // Update throughput
-        TerraFloat3 f_brdf = object->material.bsdf.eval ( &surface, &wi, &wo );
         f_brdf = terra_mulf3 ( &f_brdf, 1.f / pdf );
         throughput = terra_pointf3 ( &throughput, &f_brdf );
-        float NoL = terra_dotf3 ( &surface.normal, &wi );
+        float NoL = terra_dotf3 ( &surface->normal, &wi );
         throughput = terra_mulf3 ( &throughput, NoL );
         // Russian roulette
         {
             float p = terra_maxf ( throughput.x, terra_maxf ( throughput.y, throughput.z ) );
             float e3 = 0.5f;
-            e3 = ( float ) rand() / RAND_MAX;
+            e3 = _randf();
 
             if ( e3 > p ) {
                 break;
@@ -1090,7 +2402,129 @@ TerraFloat3 terra_trace ( TerraScene* scene, const TerraRay* primary_ray ) {
             throughput = terra_mulf3 ( &throughput, 1.f / ( p + terra_Epsilon ) );
         }
         // Prepare next ray
-        ray = terra_surface_ray ( &surface, &intersection_point, &wi, 1.f );
+        ray = terra_surface_ray ( surface, &hit.point, &wi, 1.f );
+        terra_ray_cone_continue ( &ray, &hit );
+    }
+
+    return Lo;
+}
+
+// Path tracer with next event estimation. At each vertex a light is sampled and the BSDF sample is traced once,
+// both to MIS weight the emission it hits and to continue the path from that hit.
+// The two hit contexts alternate between the current vertex and the next one.
+TerraFloat3 terra_trace_path ( TerraScene* scene, const TerraRay* primary_ray, const TerraHitContext* primary_hit ) {
+    TerraFloat3 Lo = terra_f3_zero;
+    TerraFloat3 throughput = terra_f3_one;
+    TerraRay ray = *primary_ray;
+    TerraHitContext hits[2];
+    TerraHitContext* hit = &hits[0];
+    TerraHitContext* next_hit = &hits[1];
+    // Primary hit
+    {
+        if ( primary_hit != NULL ) {
+            *hit = *primary_hit;
+        } else {
+            terra_scene_raycast ( scene, &ray, hit );
+        }
+
+        if ( hit->object == NULL ) {
+            return terra_attribute_eval ( &scene->opts.environment_map, &ray.direction, NULL );
+        }
+
+        TerraFloat3 wo = terra_negf3 ( &ray.direction );
+        const TerraShadingSurface* surface = terra_surface_eval ( hit, TERRA_SURFACE_LIGHT );
+
+        if ( terra_dotf3 ( &wo, &surface->normal ) > 0 ) {
+            Lo = surface->emissive;
+        }
+    }
+
+    for ( size_t bounce = 0; bounce <= scene->opts.bounces; ++bounce ) {
+        TerraFloat3 wo = terra_negf3 ( &ray.direction );
+        const TerraBSDF* bsdf = &hit->object->material.bsdf;
+        const TerraShadingSurface* surface = terra_surface_eval ( hit, TERRA_SURFACE_ALL );
+        // Sample light
+        {
+            TerraFloat3 wi;
+            float light_pdf;
+            TerraFloat3 L = terra_scene_sample_light ( scene, surface, &hit->point, &wi, &light_pdf );
+
+            if ( light_pdf != 0 ) {
+                float bsdf_pdf;
+                TerraFloat3 f = terra_bsdf_eval_pdf ( bsdf, surface, &wi, &wo, &bsdf_pdf );
+                float weight = ( light_pdf * light_pdf ) / ( light_pdf * light_pdf + bsdf_pdf * bsdf_pdf );
+                L = terra_pointf3 ( &L, &f );
+                L = terra_pointf3 ( &L, &throughput );
+                L = terra_mulf3 ( &L, terra_dotf3 ( &wi, &surface->normal ) * weight / light_pdf );
+                Lo = terra_addf3 ( &Lo, &L );
+            }
+        }
+        // Sample bsdf
+        TerraFloat3 wi;
+        TerraFloat3 f;
+        float bsdf_pdf;
+        {
+            float e0 = _randf();
+            float e1 = _randf();
+            float e2 = _randf();
+            f = terra_bsdf_sample_eval ( bsdf, surface, e0, e1, e2, &wo, &wi, &bsdf_pdf );
+
+            if ( bsdf_pdf <= 0 ) {
+                break;
+            }
+        }
+        // Update throughput
+        {
+            f = terra_mulf3 ( &f, terra_dotf3 ( &surface->normal, &wi ) / bsdf_pdf );
+            throughput = terra_pointf3 ( &throughput, &f );
+        }
+        // Trace the sample, the hit is the next vertex
+        ray = terra_surface_ray ( surface, &hit->point, &wi, 1.f );
+        terra_ray_cone_continue ( &ray, hit );
+        terra_scene_raycast ( scene, &ray, next_hit );
+        // Add the emission it hits, weighted against the light sampling that could have found it
+        {
+            TerraFloat3 light_wo = terra_negf3 ( &wi );
+            TerraFloat3 L = terra_f3_zero;
+
+            if ( next_hit->object == NULL ) {
+                L = terra_attribute_eval ( &scene->opts.environment_map, &ray.direction, NULL );
+            } else {
+                const TerraShadingSurface* light_surface = terra_surface_eval ( next_hit, TERRA_SURFACE_LIGHT );
+
+                if ( terra_dotf3 ( &light_surface->normal, &light_wo ) > 0 ) {
+                    L = light_surface->emissive;
+                }
+            }
+
+            if ( !terra_f3_is_zero ( &L ) ) {
+                float light_pdf = terra_scene_sample_light_pdf ( scene, surface, &hit->point, &wi, next_hit );
+                float weight = ( bsdf_pdf * bsdf_pdf ) / ( light_pdf * light_pdf + bsdf_pdf * bsdf_pdf );
+                L = terra_pointf3 ( &L, &throughput );
+                L = terra_mulf3 ( &L, weight );
+                Lo = terra_addf3 ( &Lo, &L );
+            }
+        }
+
+        if ( next_hit->object == NULL ) {
+            break;
+        }
+
+        // Russian roulette
+        {
+            float p = terra_maxf ( throughput.x, terra_maxf ( throughput.y, throughput.z ) );
+            float e3 = _randf();
+
+            if ( e3 > p ) {
+                break;
+            }
+
+            throughput = terra_mulf3 ( &throughput, 1.f / ( p + terra_Epsilon ) );
+        }
+
+        TerraHitContext* tmp = hit;
+        hit = next_hit;
+        next_hit = tmp;
     }
 
     return Lo;
@@ -1116,6 +2550,8 @@ TerraFloat3 terra_integrate (
         case kTerraIntegratorDirectMis:
             return terra_integrate_direct_mis ( scene, object, surface, point, wo, throughput, bounce );
 
+        // kTerraIntegratorPath is traced by terra_trace_path()
+
         // Debug integrators
 
         case kTerraIntegratorDebugMono:
@@ -1213,120 +2649,57 @@ TerraFloat3 terra_integrate_debug_mis_weight (
 
     // Sample BSDF first
     TerraFloat3 bsdf_sample;
+    float bsdf_sample_pdf;
     {
         float e1 = _randf();
         float e2 = _randf();
         float e3 = _randf();
-        bsdf_sample = ray_object->material.bsdf.sample ( ray_surface, e1, e2, e3, wo );
+        terra_bsdf_sample_eval ( &ray_object->material.bsdf, ray_surface, e1, e2, e3, wo, &bsdf_sample, &bsdf_sample_pdf );
     }
     // Sample light
-    TerraLight* light;
-    float light_pick_pdf;
     {
-        // Sample
-        TerraFloat3 sample_pos;
-        TerraFloat3 sample_norm;
-        size_t tri_idx;
-        {
-            {
-                float e = _randf() - terra_Epsilon;
-                light = terra_scene_pick_light ( scene, e, &light_pick_pdf );
-            }
-            // Pick triangle to sample
-            float tri_pdf;
-            {
-                float e = _randf();
-                tri_idx = terra_light_pick_triangle ( light, e, &tri_pdf );
-            }
-            // Sample triangle
-            TerraFloat2 sample_uv;
-            float sample_pdf;
-            {
-                float e1 = _randf();
-                float e2 = _randf();
-                terra_light_sample_triangle ( light, tri_idx, e1, e2, &sample_pos, &sample_uv, &sample_norm, &sample_pdf );
-            }
-        }
-        TerraFloat3 p_to_light = terra_subf3 ( &sample_pos, ray_point );
-        TerraFloat3 wi = terra_normf3 ( &p_to_light );
-        // Raycast
-        TerraShadingSurface light_surface;
-        TerraObject* object;
-        size_t light_triangle;
-        TerraFloat3 intersection_point;
-        {
-            TerraRay ray = terra_surface_ray ( ray_surface, ray_point, &wi, 1 );
-            TerraRayState ray_state;
-            terra_ray_state_init ( &ray, &ray_state );
-            object = terra_scene_raycast ( scene, &ray, &ray_state, &light_surface, &intersection_point, &light_triangle );
-
-            if ( object != light->object || light_triangle != tri_idx ) {
-                goto bsdf;
-            }
-        }
-        // Compute reflected radiance
-        TerraFloat3 light_wo = terra_negf3 ( &wi );
-        float cos = terra_dotf3 ( &sample_norm, &light_wo );
-
-        if ( cos <= 0 ) {
-            goto bsdf;
+        TerraFloat3 wi;
+        float light_pdf;
+        TerraFloat3 L = terra_scene_sample_light ( scene, ray_surface, ray_point, &wi, &light_pdf );
+
+        if ( light_pdf != 0 && !terra_f3_is_zero ( &L ) ) {
+            float bsdf_pdf;
+            terra_bsdf_eval_pdf ( &ray_object->material.bsdf, ray_surface, &wi, wo, &bsdf_pdf );
+            float weight = ( bsdf_pdf * bsdf_pdf ) / ( light_pdf * light_pdf + bsdf_pdf * bsdf_pdf );
+            TerraFloat3 W = terra_f3_set ( 0, 0, weight );
+            Lo = terra_addf3 ( &Lo, &W );
         }
-
-        float bsdf_pdf = ray_object->material.bsdf.pdf ( ray_surface, &wi, wo );
-        float light_pdf = terra_sqlenf3 ( &p_to_light ) / fabsf ( cos * light->triangle_area[light_triangle] );
-        float weight = ( bsdf_pdf * bsdf_pdf ) / ( light_pdf * light_pdf + bsdf_pdf * bsdf_pdf );
-        TerraFloat3 L = terra_f3_set ( 0, 0, weight );
-        Lo = terra_addf3 ( &Lo, &L );
     }
-bsdf:
     // Sample bsdf
     {
         // Sample bsdf lobe, eval, compute sample pdf
-        TerraFloat3 wi;
-        TerraFloat3 f;
-        float bsdf_pdf;
-        {
-            wi = bsdf_sample;
-            f = ray_object->material.bsdf.eval ( ray_surface, &wi, wo );
-            bsdf_pdf = ray_object->material.bsdf.pdf ( ray_surface, &wi, wo );
-        }
+        TerraFloat3 wi = bsdf_sample;
+        float bsdf_pdf = bsdf_sample_pdf;
         TerraFloat3 light_wo = terra_negf3 ( &wi );
         // Raycast the sample
-        TerraShadingSurface light_surface;
-        TerraObject* object;
-        TerraFloat3 intersection_point;
-        size_t light_triangle;
+        TerraHitContext light;
+        const TerraShadingSurface* light_surface = NULL;
         TerraRay ray;
-        TerraRayState ray_state;
         {
             ray = terra_surface_ray ( ray_surface, ray_point, &wi, 1 );
-            terra_ray_state_init ( &ray, &ray_state );
-            object = terra_scene_raycast ( scene, &ray, &ray_state, &light_surface, &intersection_point, &light_triangle );
+
+            if ( terra_scene_raycast ( scene, &ray, &light ) != NULL ) {
+                light_surface = terra_surface_eval ( &light, TERRA_SURFACE_LIGHT );
+            }
         }
 
-        // Exit on miss
-        if ( object != light->object ) {
+        // Exit if the hit surface does not emit or is hit from the back
+        if ( light_surface != NULL && ( terra_f3_is_zero ( &light_surface->emissive ) || terra_dotf3 ( &light_surface->normal, &light_wo ) <= 0 ) ) {
             goto exit;
         }
 
-        // If we hit a light, compute the pdf of such event
-        float light_pdf;
-        {
-            if ( object == NULL ) {
-                // TODO env light pdf
-                goto exit;
-            } else {
-                float NoW = terra_dotf3 ( &light_surface.normal, &light_wo );
-
-                if ( NoW <= 0 ) {
-                    goto exit;
-                }
-
-                float dist = terra_sqdistf3 ( &intersection_point, ray_point );
-                light_pdf = dist / ( NoW * terra_triangle_area ( &object->triangles[light_triangle] ) );
-            }
+        // Exit if the environment is not a light
+        if ( light_surface == NULL && scene->envmap_pick_pdf == 0 ) {
+            goto exit;
         }
+
         // Compute weight
+        float light_pdf = terra_scene_sample_light_pdf ( scene, ray_surface, ray_point, &wi, &light );
         float weight = ( bsdf_pdf * bsdf_pdf ) / ( light_pdf * light_pdf + bsdf_pdf * bsdf_pdf );
         TerraFloat3 L = terra_f3_set ( weight, 0, 0 );
         Lo = terra_addf3 ( &Lo, &L );
@@ -1350,74 +2723,33 @@ TerraFloat3 terra_integrate_direct (
     const TerraScene* scene,
     const TerraObject* ray_object,
     const TerraShadingSurface* ray_surface,
-    const TerraFloat3* ray_point,
-    const TerraFloat3* wo,
-    const TerraFloat3* throughput,
-    size_t bounce
-) {
-    TerraFloat3 Lo = terra_f3_zero;
-
-    // Emissive on first hit
-    if ( bounce == 0 && terra_dotf3 ( wo, &ray_surface->normal ) > 0 ) {
-        Lo = terra_addf3 ( &Lo, &ray_surface->emissive );
-    }
-
-    // TODO make sure the light triangle pick method follows the light pick pdf in all cases
-    // Pick light to sample
-    TerraLight* light;
-    float light_pick_pdf;
-    {
-        float e = _randf() - terra_Epsilon;
-        light = terra_scene_pick_light ( scene, e, &light_pick_pdf );
-    }
-    // Pick triangle to sample
-    size_t tri_idx;
-    float tri_pdf;
-    {
-        float e = _randf();
-        tri_idx = terra_light_pick_triangle ( light, e, &tri_pdf );
-    }
-    // Sample triangle
-    TerraFloat3 sample_pos;
-    TerraFloat2 sample_uv;
-    TerraFloat3 sample_norm;
-    float sample_pdf;
-    {
-        float e1 = _randf();
-        float e2 = _randf();
-        terra_light_sample_triangle ( light, tri_idx, e1, e2, &sample_pos, &sample_uv, &sample_norm, &sample_pdf );
+    const TerraFloat3* ray_point,
+    const TerraFloat3* wo,
+    const TerraFloat3* throughput,
+    size_t bounce
+) {
+    TerraFloat3 Lo = terra_f3_zero;
+
+    // Emissive on first hit
+    if ( bounce == 0 && terra_dotf3 ( wo, &ray_surface->normal ) > 0 ) {
+        Lo = terra_addf3 ( &Lo, &ray_surface->emissive );
     }
-    TerraFloat3 p_to_light = terra_subf3 ( &sample_pos, ray_point );
-    TerraFloat3 wi = terra_normf3 ( &p_to_light );
-    // Raycast
-    TerraShadingSurface light_surface;
-    TerraObject* object;
-    size_t light_triangle;
-    {
-        TerraFloat3 intersection_point;
-        TerraRay ray = terra_surface_ray ( ray_surface, ray_point, &wi, 1 );
-        TerraRayState ray_state;
-        terra_ray_state_init ( &ray, &ray_state );
-        object = terra_scene_raycast ( scene, &ray, &ray_state, &light_surface, &intersection_point, &light_triangle );
 
-        if ( object != light->object || light_triangle != tri_idx ) {
-            goto exit;
-        }
+    // Sample a light, emissive triangle or environment
+    TerraFloat3 wi;
+    float light_pdf;
+    TerraFloat3 L = terra_scene_sample_light ( scene, ray_surface, ray_point, &wi, &light_pdf );
+
+    if ( light_pdf == 0 ) {
+        goto exit;
     }
+
     // Compute reflected radiance
     TerraFloat3 Ld;
     {
-        TerraFloat3 light_wo = terra_negf3 ( &wi );
-        float cos = terra_dotf3 ( &light_wo, &sample_norm );
-
-        if ( cos <= 0 ) {
-            goto exit;
-        }
-
         TerraFloat3 f = ray_object->material.bsdf.eval ( ray_surface, &wi, wo );
-        float pdf = terra_sqlenf3 ( &p_to_light ) / fabsf ( cos * light->triangle_area[light_triangle] );
-        Ld = terra_pointf3 ( &light_surface.emissive, &f );
-        Ld = terra_mulf3 ( &Ld, terra_dotf3 ( &wi, &ray_surface->normal ) / ( pdf * light_pick_pdf ) );
+        Ld = terra_pointf3 ( &L, &f );
+        Ld = terra_mulf3 ( &Ld, terra_dotf3 ( &wi, &ray_surface->normal ) / light_pdf );
     }
     Lo = terra_addf3 ( &Lo, &Ld );
 exit:
@@ -1443,134 +2775,68 @@ TerraFloat3 terra_integrate_direct_mis (
 
     // Sample BSDF first
     TerraFloat3 bsdf_sample;
+    TerraFloat3 bsdf_sample_f;
+    float bsdf_sample_pdf;
     {
         float e1 = _randf();
         float e2 = _randf();
         float e3 = _randf();
-        bsdf_sample = ray_object->material.bsdf.sample ( ray_surface, e1, e2, e3, wo );
+        bsdf_sample_f = terra_bsdf_sample_eval ( &ray_object->material.bsdf, ray_surface, e1, e2, e3, wo, &bsdf_sample, &bsdf_sample_pdf );
     }
-    // Sample light
-    TerraLight* light;
-    float light_pick_pdf;
+    // Sample light, emissive triangle or environment
     {
-        // Sample
-        TerraFloat3 sample_pos;
-        TerraFloat3 sample_norm;
-        size_t tri_idx;
-        {
-            {
-                float e = _randf() - terra_Epsilon;
-                light = terra_scene_pick_light ( scene, e, &light_pick_pdf );
-            }
-            // Pick triangle to sample
-            float tri_pdf;
-            {
-                float e = _randf();
-                tri_idx = terra_light_pick_triangle ( light, e, &tri_pdf );
-            }
-            // Sample triangle
-            TerraFloat2 sample_uv;
-            float sample_pdf;
-            {
-                float e1 = _randf();
-                float e2 = _randf();
-                terra_light_sample_triangle ( light, tri_idx, e1, e2, &sample_pos, &sample_uv, &sample_norm, &sample_pdf );
-            }
-        }
-        TerraFloat3 p_to_light = terra_subf3 ( &sample_pos, ray_point );
-        TerraFloat3 wi = terra_normf3 ( &p_to_light );
-        // Raycast
-        TerraShadingSurface light_surface;
-        TerraObject* object;
-        size_t light_triangle;
-        TerraFloat3 intersection_point;
-        {
-            TerraRay ray = terra_surface_ray ( ray_surface, ray_point, &wi, 1 );
-            TerraRayState ray_state;
-            terra_ray_state_init ( &ray, &ray_state );
-            object = terra_scene_raycast ( scene, &ray, &ray_state, &light_surface, &intersection_point, &light_triangle );
-
-            if ( object != light->object || light_triangle != tri_idx ) {
-                goto bsdf;
-            }
-        }
-        // Compute reflected radiance
-        TerraFloat3 light_wo = terra_negf3 ( &wi );
-        float cos = terra_dotf3 ( &sample_norm, &light_wo );
-
-        if ( cos <= 0 ) {
-            goto bsdf;
-        }
-
-        float bsdf_pdf = ray_object->material.bsdf.pdf ( ray_surface, &wi, wo );
-        float light_pdf = terra_sqlenf3 ( &p_to_light ) / fabsf ( cos * light->triangle_area[light_triangle] );
-        float weight = ( light_pdf * light_pdf ) / ( light_pdf * light_pdf + bsdf_pdf * bsdf_pdf );
+        TerraFloat3 wi;
+        float light_pdf;
+        TerraFloat3 L = terra_scene_sample_light ( scene, ray_surface, ray_point, &wi, &light_pdf );
 
         if ( light_pdf != 0 ) {
-            TerraFloat3 f = ray_object->material.bsdf.eval ( ray_surface, &wi, wo );
-            TerraFloat3 L = terra_pointf3 ( &light_surface.emissive, &f );
-            L = terra_mulf3 ( &L, terra_dotf3 ( &wi, &ray_surface->normal ) * weight / ( light_pdf * light_pick_pdf ) );
+            float bsdf_pdf;
+            TerraFloat3 f = terra_bsdf_eval_pdf ( &ray_object->material.bsdf, ray_surface, &wi, wo, &bsdf_pdf );
+            float weight = ( light_pdf * light_pdf ) / ( light_pdf * light_pdf + bsdf_pdf * bsdf_pdf );
+            L = terra_pointf3 ( &L, &f );
+            L = terra_mulf3 ( &L, terra_dotf3 ( &wi, &ray_surface->normal ) * weight / light_pdf );
             Lo = terra_addf3 ( &Lo, &L );
         }
     }
-bsdf:
     // Sample bsdf
     {
         // Sample bsdf lobe, eval, compute sample pdf
-        TerraFloat3 wi;
-        TerraFloat3 f;
-        float bsdf_pdf;
-        {
-            wi = bsdf_sample;
-            f = ray_object->material.bsdf.eval ( ray_surface, &wi, wo );
-            bsdf_pdf = ray_object->material.bsdf.pdf ( ray_surface, &wi, wo );
-        }
+        TerraFloat3 wi = bsdf_sample;
+        TerraFloat3 f = bsdf_sample_f;
+        float bsdf_pdf = bsdf_sample_pdf;
         TerraFloat3 light_wo = terra_negf3 ( &wi );
         // Raycast the sample
-        TerraShadingSurface light_surface;
-        TerraObject* object;
-        TerraFloat3 intersection_point;
-        size_t light_triangle;
+        TerraHitContext light;
+        const TerraShadingSurface* light_surface = NULL;
         TerraRay ray;
-        TerraRayState ray_state;
         {
             ray = terra_surface_ray ( ray_surface, ray_point, &wi, 1 );
-            terra_ray_state_init ( &ray, &ray_state );
-            object = terra_scene_raycast ( scene, &ray, &ray_state, &light_surface, &intersection_point, &light_triangle );
+
+            if ( terra_scene_raycast ( scene, &ray, &light ) != NULL ) {
+                light_surface = terra_surface_eval ( &light, TERRA_SURFACE_LIGHT );
+            }
         }
 
-        // Exit on miss
-        if ( object != light->object ) {
+        // Exit if the hit surface does not emit or is hit from the back
+        if ( light_surface != NULL && ( terra_f3_is_zero ( &light_surface->emissive ) || terra_dotf3 ( &light_surface->normal, &light_wo ) <= 0 ) ) {
             goto exit;
         }
 
-        // If we hit a light, compute the pdf of such event
-        float light_pdf;
-        {
-            if ( object == NULL ) {
-                // TODO env light pdf
-                goto exit;
-            } else {
-                float NoW = terra_dotf3 ( &light_surface.normal, &light_wo );
-
-                if ( NoW <= 0 ) {
-                    goto exit;
-                }
-
-                float dist = terra_sqdistf3 ( &intersection_point, ray_point );
-                light_pdf = dist / ( NoW * terra_triangle_area ( &object->triangles[light_triangle] ) );
-            }
+        // Exit if the environment is not a light
+        if ( light_surface == NULL && scene->envmap_pick_pdf == 0 ) {
+            goto exit;
         }
+
         // Compute weight
+        float light_pdf = terra_scene_sample_light_pdf ( scene, ray_surface, ray_point, &wi, &light );
         float weight = ( bsdf_pdf * bsdf_pdf ) / ( light_pdf * light_pdf + bsdf_pdf * bsdf_pdf );
         // Fetch received radiance
-        TerraFloat3 L = terra_f3_zero;
+        TerraFloat3 L;
         {
-            if ( object == light->object ) {
-                L = light_surface.emissive;
+            if ( light_surface != NULL ) {
+                L = light_surface->emissive;
             } else {
-                // TODO env light eval
-                //L = terra_attribute_eval ( &scene->opts.environment_map, &ray.direction, &intersection_point );
+                L = terra_attribute_eval ( &scene->opts.environment_map, &ray.direction, NULL );
             }
         }
 
@@ -1589,39 +2855,175 @@ exit:
 //--------------------------------------------------------------------------------------------------
 // @TerraScene
 //--------------------------------------------------------------------------------------------------
-TerraLight* terra_scene_pick_light ( TerraScene* scene, float e, float* pdf ) {
-    // e1 is a random float between 0 and 1
-    /*float alpha_acc = *e1;
-    size_t light_idx = SIZE_MAX;
-    // TODO is this ok?
-    float total_power = scene->total_light_power.x + scene->total_light_power.y + scene->total_light_power.z;
+// The light BVH picks a single emissive triangle, the returned pdf is the discrete probability of picking it
+// from the given shading point.
+TerraLight* terra_scene_pick_light ( const TerraScene* scene, const TerraFloat3* point, const TerraFloat3* normal, float e, size_t* triangle, float* pdf ) {
+    const TerraLightEmitter* emitter = terra_light_bvh_sample ( &scene->light_bvh, point, normal, e, pdf );
 
-    for ( size_t i = 0; i < scene->lights_pop; ++i ) {
-        float light_power = scene->lights[i].power.x + scene->lights[i].power.y + scene->lights[i].power.z;
-        float alpha = light_power / total_power;
-        alpha_acc -= alpha;
-
-        if ( alpha_acc <= 0 ) {
-            // We pick this light, save its index
-            light_idx = i;
-            // Recompute e1
-            alpha_acc += alpha;
-            *e1 = alpha_acc / alpha;
-            break;
+    if ( emitter == NULL ) {
+        return NULL;
+    }
+
+    *triangle = emitter->triangle_idx;
+    return &scene->lights[emitter->light_idx];
+}
+
+float terra_scene_pick_light_pdf ( const TerraScene* scene, const TerraFloat3* point, const TerraFloat3* normal, const TerraObject* object, size_t triangle ) {
+    return terra_light_bvh_pdf ( &scene->light_bvh, point, normal, object - scene->objects, triangle );
+}
+
+// Picks the environment with probability envmap_pick_pdf, an emissive triangle otherwise, and samples a direction
+// towards it. Returns the radiance arriving along wi, pdf is per solid angle and includes the light pick.
+// pdf is 0 if the sample is occluded, below the surface or does not contribute.
+TerraFloat3 terra_scene_sample_light ( const TerraScene* scene, const TerraShadingSurface* surface, const TerraFloat3* point, TerraFloat3* wi, float* pdf ) {
+    *pdf = 0;
+    // In [0,1), the environment is picked with probability envmap_pick_pdf exactly
+    const float below_one = 1.f - FLT_EPSILON * 0.5f;
+    float e = terra_clamp ( _randf(), 0.f, below_one );
+    float env_pick_pdf = scene->envmap_pick_pdf;
+
+    if ( e < env_pick_pdf ) {
+        // Sample environment
+        float env_pdf;
+        TerraFloat3 L;
+        {
+            float e1 = _randf();
+            float e2 = _randf();
+            L = terra_envmap_sample ( scene, e1, e2, wi, &env_pdf );
+
+            if ( env_pdf == 0 || terra_dotf3 ( wi, &surface->normal ) <= 0 ) {
+                return terra_f3_zero;
+            }
+        }
+        // Raycast, the sample has to escape the scene
+        {
+            TerraHitContext hit;
+            TerraRay ray = terra_surface_ray ( surface, point, wi, 1 );
+
+            if ( terra_scene_raycast ( scene, &ray, &hit ) != NULL ) {
+                return terra_f3_zero;
+            }
+        }
+        *pdf = env_pick_pdf * env_pdf;
+        return L;
+    }
+
+    // Pick light triangle to sample
+    TerraLight* light;
+    size_t tri_idx;
+    float light_pick_pdf;
+    {
+        // Not reached as e < 1, an environment picked every time must not divide by zero
+        if ( env_pick_pdf >= 1 ) {
+            return terra_f3_zero;
+        }
+
+        e = terra_clamp ( ( e - env_pick_pdf ) / ( 1 - env_pick_pdf ), 0.f, below_one );
+        light = terra_scene_pick_light ( scene, point, &surface->normal, e, &tri_idx, &light_pick_pdf );
+
+        if ( light == NULL ) {
+            return terra_f3_zero;
+        }
+    }
+    // Sample triangle, uniformly in the solid angle it subtends if possible, by area otherwise
+    const TerraTriangle* triangle = &light->object->triangles[tri_idx];
+    float solid_angle = terra_triangle_solid_angle ( triangle, point );
+    bool sample_solid_angle = terra_light_use_solid_angle ( solid_angle );
+    {
+        float e1 = _randf();
+        float e2 = _randf();
+
+        if ( sample_solid_angle ) {
+            *wi = terra_triangle_sample_solid_angle ( triangle, point, e1, e2 );
+        } else {
+            TerraFloat3 sample_pos;
+            TerraFloat2 sample_uv;
+            TerraFloat3 sample_norm;
+            float sample_pdf;
+            terra_light_sample_triangle ( light, tri_idx, e1, e2, &sample_pos, &sample_uv, &sample_norm, &sample_pdf );
+            TerraFloat3 p_to_light = terra_subf3 ( &sample_pos, point );
+            *wi = terra_normf3 ( &p_to_light );
+        }
+    }
+
+    if ( terra_dotf3 ( wi, &surface->normal ) <= 0 ) {
+        return terra_f3_zero;
+    }
+
+    // Raycast
+    TerraHitContext hit;
+    const TerraShadingSurface* light_surface;
+    {
+        TerraRay ray = terra_surface_ray ( surface, point, wi, 1 );
+
+        if ( terra_scene_raycast ( scene, &ray, &hit ) != light->object || hit.hit.primitive.triangle_idx != tri_idx ) {
+            return terra_f3_zero;
         }
+
+        light_surface = terra_surface_eval ( &hit, TERRA_SURFACE_LIGHT );
+    }
+    // Lights emit on the front side only
+    TerraFloat3 light_wo = terra_negf3 ( wi );
+    float cos = terra_dotf3 ( &light_surface->normal, &light_wo );
+
+    if ( cos <= 0 ) {
+        return terra_f3_zero;
+    }
+
+    float sample_pdf;
+
+    if ( sample_solid_angle ) {
+        sample_pdf = 1.f / solid_angle;
+    } else {
+        // Convert the area pdf to solid angle
+        sample_pdf = terra_sqdistf3 ( &hit.point, point ) / ( cos * light->triangle_area[tri_idx] );
+    }
+
+    *pdf = ( 1 - env_pick_pdf ) * light_pick_pdf * sample_pdf;
+    return light_surface->emissive;
+}
+
+// Solid angle pdf of terra_scene_sample_light() sampling wi from point. light is what wi hits, a miss for the
+// environment, its surface normal has to be already evaluated.
+float terra_scene_sample_light_pdf ( const TerraScene* scene, const TerraShadingSurface* surface, const TerraFloat3* point, const TerraFloat3* wi,
+                                     const TerraHitContext* light ) {
+    float env_pick_pdf = scene->envmap_pick_pdf;
+
+    if ( terra_dotf3 ( wi, &surface->normal ) <= 0 ) {
+        return 0;
+    }
+
+    if ( light->object == NULL ) {
+        return env_pick_pdf * terra_envmap_pdf ( scene, wi );
+    }
+
+    assert ( light->evaluated & TERRA_SURFACE_NORMAL );
+    TerraFloat3 light_wo = terra_negf3 ( wi );
+    float NoW = terra_dotf3 ( &light->surface.normal, &light_wo );
+
+    if ( NoW <= 0 ) {
+        return 0;
     }
 
-    assert ( light_idx != SIZE_MAX );
-    return &scene->lights[light_idx];*/
-    // TODO
-    assert ( scene->lights_pop > 0 );
-    size_t i = ( size_t ) ( e * ( double ) scene->lights_pop );
-    *pdf = 1.f / scene->lights_triangles_count;
-    return &scene->lights[i];
+    // Same strategy terra_scene_sample_light() picks for the triangle
+    size_t light_triangle = light->hit.primitive.triangle_idx;
+    const TerraTriangle* triangle = &light->object->triangles[light_triangle];
+    float solid_angle = terra_triangle_solid_angle ( triangle, point );
+    float pdf;
+
+    if ( terra_light_use_solid_angle ( solid_angle ) ) {
+        pdf = 1.f / solid_angle;
+    } else {
+        float dist = terra_sqdistf3 ( &light->point, point );
+        pdf = dist / ( NoW * terra_triangle_area ( triangle ) );
+    }
+
+    return ( 1 - env_pick_pdf ) * pdf * terra_scene_pick_light_pdf ( scene, point, &surface->normal, light->object, light_triangle );
 }
 
-TerraObject* terra_scene_raycast ( TerraScene* scene, const TerraRay* _ray, const TerraRayState* _ray_state, TerraShadingSurface* surface_out, TerraFloat3* intersection_point, size_t* triangle ) {
-    TerraPrimitiveRef primitive;
+// Only finds the closest hit, its surface is evaluated later by terra_surface_eval(). The intersection state
+// is set up here for the offset ray.
+TerraObject* terra_scene_raycast ( TerraScene* scene, const TerraRay* _ray, TerraHitContext* ctx ) {
     TerraClockTime t = TERRA_CLOCK();
     bool miss = false;
     // Tracing the ray an epsilon above/below the surface
@@ -1630,9 +3032,11 @@ TerraObject* terra_scene_raycast ( TerraScene* scene, const TerraRay* _ray, cons
     ray.origin = terra_addf3 ( &ray.origin, &surface_offset );
     TerraRayState ray_state;
     terra_ray_state_init ( &ray, &ray_state );
+    ctx->object = NULL;
+    ctx->evaluated = 0;
 
     if ( scene->opts.accelerator == kTerraAcceleratorBVH ) {
-        if ( !terra_bvh_traverse ( &scene->bvh, scene->objects, &ray, &ray_state, intersection_point, &primitive ) ) {
+        if ( !terra_bvh_traverse ( &scene->bvh, scene->objects, &ray, &ray_state, &ctx->hit ) ) {
             miss = true;
         }
     } else {
@@ -1646,25 +3050,18 @@ TerraObject* terra_scene_raycast ( TerraScene* scene, const TerraRay* _ray, cons
         return NULL;
     }
 
-    TerraObject* object = &scene->objects[primitive.object_idx];
-
-    if ( triangle ) {
-        *triangle = primitive.triangle_idx;
-    }
-
-    terra_surface_init ( surface_out, &object->triangles[primitive.triangle_idx], &object->material, &object->properties[primitive.triangle_idx], intersection_point );
-    return object;
+    ctx->object = &scene->objects[ctx->hit.primitive.object_idx];
+    ctx->material = &scene->materials[ctx->hit.primitive.object_idx];
+    ctx->point = terra_ray_pos ( &ray, ctx->hit.t );
+    ctx->direction = ray.direction;
+    ctx->cone_width = ray.cone_width + ray.cone_spread * ctx->hit.t;
+    ctx->cone_spread = ray.cone_spread;
+    return ctx->object;
 }
 
 //--------------------------------------------------------------------------------------------------
 // @TerraLight
 //--------------------------------------------------------------------------------------------------
-size_t terra_light_pick_triangle ( const TerraLight* light, float e, float* pdf ) {
-    size_t i = ( size_t ) ( e * light->object->triangles_count );
-    *pdf = 1.f / light->object->triangles_count;
-    return i;
-}
-
 void terra_light_sample_triangle ( const TerraLight* light, size_t triangle_idx, float e1, float e2,
                                    TerraFloat3* pos, TerraFloat2* uv, TerraFloat3* norm, float* pdf ) {
     TerraTriangle* tri = &light->object->triangles[triangle_idx];
@@ -1696,6 +3093,194 @@ void terra_light_sample_triangle ( const TerraLight* light, size_t triangle_idx,
     *pdf = 1.f / light->triangle_area[triangle_idx];
 }
 
+bool terra_light_use_solid_angle ( float solid_angle ) {
+    return solid_angle >= TERRA_LIGHT_MIN_SOLID_ANGLE && solid_angle <= TERRA_LIGHT_MAX_SOLID_ANGLE;
+}
+
+// Van Oosterom & Strackee, "The Solid Angle of a Plane Triangle", 1983
+float terra_triangle_solid_angle ( const TerraTriangle* triangle, const TerraFloat3* point ) {
+    TerraFloat3 a = terra_subf3 ( &triangle->a, point );
+    TerraFloat3 b = terra_subf3 ( &triangle->b, point );
+    TerraFloat3 c = terra_subf3 ( &triangle->c, point );
+    a = terra_normf3 ( &a );
+    b = terra_normf3 ( &b );
+    c = terra_normf3 ( &c );
+    TerraFloat3 bxc = terra_crossf3 ( &b, &c );
+    float num = fabsf ( terra_dotf3 ( &a, &bxc ) );
+    float den = 1 + terra_dotf3 ( &a, &b ) + terra_dotf3 ( &b, &c ) + terra_dotf3 ( &c, &a );
+    return 2 * atan2f ( num, den );
+}
+
+// Part of v orthogonal to the unit vector w, normalized
+static TerraFloat3 terra_orthonormalf3 ( const TerraFloat3* v, const TerraFloat3* w ) {
+    TerraFloat3 proj = terra_mulf3 ( w, terra_dotf3 ( v, w ) );
+    TerraFloat3 ortho = terra_subf3 ( v, &proj );
+    return terra_normf3 ( &ortho );
+}
+
+static float terra_angle_between ( const TerraFloat3* a, const TerraFloat3* b ) {
+    return acosf ( terra_clamp ( terra_dotf3 ( a, b ), -1.f, 1.f ) );
+}
+
+// Arvo, "Stratified Sampling of Spherical Triangles", 1995
+// Returns a direction distributed uniformly in the solid angle the triangle subtends from point, the pdf is
+// 1 / terra_triangle_solid_angle(). The first sample picks the sub-triangle area, the second the point along its edge.
+TerraFloat3 terra_triangle_sample_solid_angle ( const TerraTriangle* triangle, const TerraFloat3* point, float e1, float e2 ) {
+    TerraFloat3 a = terra_subf3 ( &triangle->a, point );
+    TerraFloat3 b = terra_subf3 ( &triangle->b, point );
+    TerraFloat3 c = terra_subf3 ( &triangle->c, point );
+    a = terra_normf3 ( &a );
+    b = terra_normf3 ( &b );
+    c = terra_normf3 ( &c );
+    // Spherical triangle internal angles, from the normals of the great circles through the edges
+    TerraFloat3 n_ab = terra_crossf3 ( &a, &b );
+    TerraFloat3 n_bc = terra_crossf3 ( &b, &c );
+    TerraFloat3 n_ca = terra_crossf3 ( &c, &a );
+    n_ab = terra_normf3 ( &n_ab );
+    n_bc = terra_normf3 ( &n_bc );
+    n_ca = terra_normf3 ( &n_ca );
+    TerraFloat3 neg_ab = terra_negf3 ( &n_ab );
+    TerraFloat3 neg_bc = terra_negf3 ( &n_bc );
+    TerraFloat3 neg_ca = terra_negf3 ( &n_ca );
+    float alpha = terra_angle_between ( &n_ab, &neg_ca );
+    float beta = terra_angle_between ( &n_bc, &neg_ab );
+    float gamma = terra_angle_between ( &n_ca, &neg_bc );
+    // Area of the sub-triangle a b' c', plus pi
+    float area_pi = terra_lerp ( terra_PI, alpha + beta + gamma, e1 );
+    float cos_alpha = cosf ( alpha );
+    float sin_alpha = sinf ( alpha );
+    float sin_phi = sinf ( area_pi ) * cos_alpha - cosf ( area_pi ) * sin_alpha;
+    float cos_phi = cosf ( area_pi ) * cos_alpha + sinf ( area_pi ) * sin_alpha;
+    float k1 = cos_phi + cos_alpha;
+    float k2 = sin_phi - sin_alpha * terra_dotf3 ( &a, &b );
+    float cos_bp = ( k2 + ( k2 * cos_phi - k1 * sin_phi ) * cos_alpha ) / ( ( k2 * sin_phi + k1 * cos_phi ) * sin_alpha );
+    cos_bp = terra_clamp ( cos_bp, -1.f, 1.f );
+    float sin_bp = sqrtf ( terra_maxf ( 0.f, 1 - cos_bp * cos_bp ) );
+    // c' on the arc from a to c
+    TerraFloat3 c_ortho = terra_orthonormalf3 ( &c, &a );
+    TerraFloat3 cp_a = terra_mulf3 ( &a, cos_bp );
+    TerraFloat3 cp_c = terra_mulf3 ( &c_ortho, sin_bp );
+    TerraFloat3 cp = terra_addf3 ( &cp_a, &cp_c );
+    // Direction on the arc from b to c'
+    float cos_theta = 1 - e2 * ( 1 - terra_dotf3 ( &cp, &b ) );
+    float sin_theta = sqrtf ( terra_maxf ( 0.f, 1 - cos_theta * cos_theta ) );
+    TerraFloat3 cp_ortho = terra_orthonormalf3 ( &cp, &b );
+    TerraFloat3 w_b = terra_mulf3 ( &b, cos_theta );
+    TerraFloat3 w_cp = terra_mulf3 ( &cp_ortho, sin_theta );
+    TerraFloat3 w = terra_addf3 ( &w_b, &w_cp );
+    return terra_normf3 ( &w );
+}
+
+typedef struct {
+    TerraTexture* texture;
+    float*        f;
+} TerraEnvmapWeights;
+
+static void terra_envmap_weights_rows ( void* _job, size_t begin, size_t end ) {
+    TerraEnvmapWeights* job = ( TerraEnvmapWeights* ) _job;
+    size_t width = job->texture->width;
+    size_t height = job->texture->height;
+
+    for ( size_t y = begin; y < end; ++y ) {
+        float sin_theta = sinf ( terra_PI * ( y + 0.5f ) / height );
+
+        for ( size_t x = 0; x < width; ++x ) {
+            TerraFloat3 color = terra_texture_read ( job->texture, x, y );
+            job->f[y * width + x] = terra_luminance ( &color ) * sin_theta;
+        }
+    }
+}
+
+// Latlong environment maps are importance sampled proportionally to their luminance, weighted by sin(theta) to
+// account for the rows area shrinking towards the poles. Any other environment is sampled uniformly.
+// Both the distribution and the latlong lookup address the texels with floor, so cells and texels match.
+void terra_envmap_create ( TerraScene* scene ) {
+    const TerraAttribute* env = &scene->opts.environment_map;
+    scene->envmap_pick_pdf = 0;
+
+    if ( env->state == NULL && terra_f3_is_zero ( &env->value ) ) {
+        return;
+    }
+
+    // Split the samples evenly when there are emissive triangles too
+    scene->envmap_pick_pdf = scene->lights_pop > 0 ? 0.5f : 1.f;
+
+    if ( env->state == NULL || env->eval != terra_texture_sample_latlong ) {
+        return;
+    }
+
+    TerraTexture* texture = ( TerraTexture* ) env->state;
+    TerraEnvmapWeights job;
+    job.texture = texture;
+    job.f = ( float* ) terra_malloc ( sizeof ( float ) * texture->width * texture->height );
+    terra_parallel_for ( texture->height, TERRA_DISTRIBUTION_ROWS_GRAIN, terra_envmap_weights_rows, &job );
+    terra_distribution_2d_init ( &scene->envmap_distribution, job.f, texture->width, texture->height, kTerraDistributionCdf );
+    terra_free ( job.f );
+}
+
+void terra_envmap_destroy ( TerraScene* scene ) {
+    if ( scene->envmap_distribution.conditionals != NULL ) {
+        terra_distribution_2d_destroy ( &scene->envmap_distribution );
+    }
+
+    scene->envmap_pick_pdf = 0;
+}
+
+TerraFloat3 terra_envmap_sample ( const TerraScene* scene, float e1, float e2, TerraFloat3* wi, float* pdf ) {
+    const TerraDistributon2D* dist = &scene->envmap_distribution;
+
+    if ( dist->conditionals == NULL ) {
+        // Uniform sphere
+        float z = 1 - 2 * e1;
+        float r = sqrtf ( terra_maxf ( 0.f, 1 - z * z ) );
+        float phi = 2 * terra_PI * e2;
+        *wi = terra_f3_set ( r * cosf ( phi ), z, r * sinf ( phi ) );
+        *pdf = 1.f / ( 4 * terra_PI );
+        return terra_attribute_eval ( &scene->opts.environment_map, wi, NULL );
+    }
+
+    float cell_pdf;
+    TerraFloat2 uv = terra_distribution_2d_sample ( dist, e1, e2, &cell_pdf );
+    // Inverse of the terra_texture_sample_latlong mapping
+    float theta = uv.y * terra_PI;
+    float phi = uv.x * 2 * terra_PI - terra_PI;
+    float sin_theta = sinf ( theta );
+
+    if ( sin_theta == 0 || cell_pdf == 0 ) {
+        *pdf = 0;
+        return terra_f3_zero;
+    }
+
+    *wi = terra_f3_set ( sin_theta * cosf ( phi ), cosf ( theta ), sin_theta * sinf ( phi ) );
+    // From the discrete cell probability to the uv density, then to solid angle (dw = 2 pi^2 sin(theta) du dv)
+    float width = ( float ) dist->conditionals[0].n;
+    float height = ( float ) dist->marginal.n;
+    *pdf = cell_pdf * width * height / ( 2 * terra_PI * terra_PI * sin_theta );
+    return terra_attribute_eval ( &scene->opts.environment_map, wi, NULL );
+}
+
+float terra_envmap_pdf ( const TerraScene* scene, const TerraFloat3* wi ) {
+    const TerraDistributon2D* dist = &scene->envmap_distribution;
+
+    if ( dist->conditionals == NULL ) {
+        return 1.f / ( 4 * terra_PI );
+    }
+
+    TerraFloat3 d = terra_normf3 ( wi );
+    float theta = acosf ( terra_clamp ( d.y, -1.f, 1.f ) );
+    float phi = atan2f ( d.z, d.x ) + terra_PI;
+    float sin_theta = sinf ( theta );
+
+    if ( sin_theta == 0 ) {
+        return 0;
+    }
+
+    float width = ( float ) dist->conditionals[0].n;
+    float height = ( float ) dist->marginal.n;
+    float cell_pdf = terra_distribution_2d_pdf ( dist, phi / ( 2 * terra_PI ), theta / terra_PI );
+    return cell_pdf * width * height / ( 2 * terra_PI * terra_PI * sin_theta );
+}
+
 //--------------------------------------------------------------------------------------------------
 // @TerraRay
 //--------------------------------------------------------------------------------------------------
@@ -1706,9 +3291,17 @@ TerraRay terra_ray ( const TerraFloat3* origin, const TerraFloat3* direction ) {
     ray.inv_direction.x = 1.f / ray.direction.x;
     ray.inv_direction.y = 1.f / ray.direction.y;
     ray.inv_direction.z = 1.f / ray.direction.z;
+    ray.cone_width = 0;
+    ray.cone_spread = 0;
     return ray;
 }
 
+// The cone keeps its spread through the bounces, surface curvature is not accounted for
+void terra_ray_cone_continue ( TerraRay* ray, const TerraHitContext* hit ) {
+    ray->cone_width = hit->cone_width;
+    ray->cone_spread = hit->cone_spread;
+}
+
 //--------------------------------------------------------------------------------------------------
 // @TerraSurface
 //--------------------------------------------------------------------------------------------------
@@ -1720,47 +3313,172 @@ TerraRay terra_surface_ray ( const TerraShadingSurface* surface, const TerraFloa
     ray.inv_direction.x = 1.f / ray.direction.x;
     ray.inv_direction.y = 1.f / ray.direction.y;
     ray.inv_direction.z = 1.f / ray.direction.z;
+    ray.cone_width = 0;
+    ray.cone_spread = 0;
     return ray;
 }
 
-void terra_surface_init ( TerraShadingSurface* surface, const TerraTriangle* triangle, const TerraMaterial* material, const TerraTriangleProperties* properties, const TerraFloat3* point ) {
-    // Computing UV coordinates
-    TerraFloat3 e0 = terra_subf3 ( &triangle->b, &triangle->a );
-    TerraFloat3 e1 = terra_subf3 ( &triangle->c, &triangle->a );
-    TerraFloat3 p = terra_subf3 ( point, &triangle->a );
-    float d00 = terra_dotf3 ( &e0, &e0 );
-    float d11 = terra_dotf3 ( &e1, &e1 );
-    float d01 = terra_dotf3 ( &e0, &e1 );
-    float dp0 = terra_dotf3 ( &p, &e0 );
-    float dp1 = terra_dotf3 ( &p, &e1 );
-    float div = d00 * d11 - d01 * d01;
-    TerraFloat2 uv;
-    uv.x = ( d11 * dp0 - d01 * dp1 ) / div;
-    uv.y = ( d00 * dp1 - d01 * dp0 ) / div;
-    // Interpolating normal at vertices
-    TerraFloat3 na = terra_mulf3 ( &properties->normal_c, uv.y );
-    TerraFloat3 nb = terra_mulf3 ( &properties->normal_b, uv.x );
-    TerraFloat3 nc = terra_mulf3 ( &properties->normal_a, 1 - uv.x - uv.y );
-    surface->normal = terra_addf3 ( &na, &nb );
-    surface->normal = terra_addf3 ( &surface->normal, &nc );
-    surface->normal = terra_normf3 ( &surface->normal );
+// Maps a vector on the plane of the triangle to the matching texture coordinates offset
+static TerraFloat2 terra_triangle_vector_to_uv ( const TerraFloat3* v, const TerraFloat3* e1, const TerraFloat3* e2, const TerraFloat2* d1, const TerraFloat2* d2,
+        float e11, float e12, float e22, float inv_det ) {
+    float v1 = terra_dotf3 ( v, e1 );
+    float v2 = terra_dotf3 ( v, e2 );
+    float a = ( e22 * v1 - e12 * v2 ) * inv_det;
+    float b = ( e11 * v2 - e12 * v1 ) * inv_det;
+    return terra_f2_set ( a * d1->x + b * d2->x, a * d1->y + b * d2->y );
+}
+
+// The ray cone intersects the triangle plane in an ellipse, the minor axis is the cone radius and
+// the major one is stretched by the incidence angle. Both are mapped to texture coordinates.
+static void terra_surface_footprint ( TerraHitContext* ctx ) {
+    const TerraTriangle* tri = &ctx->object->triangles[ctx->hit.primitive.triangle_idx];
+    const TerraTriangleProperties* properties = &ctx->object->properties[ctx->hit.primitive.triangle_idx];
+    TerraFloat3 e1 = terra_subf3 ( &tri->b, &tri->a );
+    TerraFloat3 e2 = terra_subf3 ( &tri->c, &tri->a );
+    TerraFloat2 d1 = terra_f2_set ( properties->texcoord_b.x - properties->texcoord_a.x, properties->texcoord_b.y - properties->texcoord_a.y );
+    TerraFloat2 d2 = terra_f2_set ( properties->texcoord_c.x - properties->texcoord_a.x, properties->texcoord_c.y - properties->texcoord_a.y );
+    float e11 = terra_dotf3 ( &e1, &e1 );
+    float e12 = terra_dotf3 ( &e1, &e2 );
+    float e22 = terra_dotf3 ( &e2, &e2 );
+    float det = e11 * e22 - e12 * e12;
+
+    if ( det <= 0 || ctx->cone_width <= 0 ) {
+        ctx->footprint.major = terra_f2_set ( 0.f, 0.f );
+        ctx->footprint.minor = terra_f2_set ( 0.f, 0.f );
+        return;
+    }
+
+    TerraFloat3 ng = terra_crossf3 ( &e1, &e2 );
+    ng = terra_normf3 ( &ng );
+    // Grazing angles are capped, the footprint would grow unbounded
+    float cos_theta = terra_maxf ( fabsf ( terra_dotf3 ( &ctx->direction, &ng ) ), 0.01f );
+    float radius = 0.5f * ctx->cone_width;
+    TerraFloat3 minor = terra_crossf3 ( &ng, &ctx->direction );
+    minor = terra_sqlenf3 ( &minor ) > 1e-12f ? terra_normf3 ( &minor ) : terra_normf3 ( &e1 );
+    TerraFloat3 major = terra_crossf3 ( &minor, &ng );
+    minor = terra_mulf3 ( &minor, radius );
+    major = terra_mulf3 ( &major, radius / cos_theta );
+    ctx->footprint.major = terra_triangle_vector_to_uv ( &major, &e1, &e2, &d1, &d2, e11, e12, e22, 1.f / det );
+    ctx->footprint.minor = terra_triangle_vector_to_uv ( &minor, &e1, &e2, &d1, &d2, e11, e12, e22, 1.f / det );
+}
+
+// Evaluates the requested parts of the surface at the hit that have not been evaluated yet
+const TerraShadingSurface* terra_surface_eval ( TerraHitContext* ctx, uint32_t parts ) {
+    TerraShadingSurface* surface = &ctx->surface;
+    const TerraTriangleProperties* properties = &ctx->object->properties[ctx->hit.primitive.triangle_idx];
+    uint32_t missing = parts & ~ctx->evaluated;
+
+    if ( missing == 0 ) {
+        return surface;
+    }
+
+    // Barycentric weights of the vertices, from the intersection
+    float wb = ctx->hit.v;
+    float wc = ctx->hit.w;
+    float wa = 1 - wb - wc;
+
+    // The frame is built around the normal
+    if ( missing & TERRA_SURFACE_FRAME ) {
+        missing |= TERRA_SURFACE_NORMAL & ~ctx->evaluated;
+    }
+
     // Interpolating texcoords at vertices
-    TerraFloat2 ta = terra_mulf2 ( &properties->texcoord_c, uv.y );
-    TerraFloat2 tb = terra_mulf2 ( &properties->texcoord_b, uv.x );
-    TerraFloat2 tc = terra_mulf2 ( &properties->texcoord_a, 1 - uv.x - uv.y );
-    TerraFloat2 texcoord = terra_addf2 ( &ta, &tb );
-    texcoord = terra_addf2 ( &texcoord, &tc );
-    texcoord = texcoord;
+    if ( ctx->evaluated == 0 ) {
+        TerraFloat2 ta = terra_mulf2 ( &properties->texcoord_a, wa );
+        TerraFloat2 tb = terra_mulf2 ( &properties->texcoord_b, wb );
+        TerraFloat2 tc = terra_mulf2 ( &properties->texcoord_c, wc );
+        ctx->texcoord = terra_addf2 ( &ta, &tb );
+        ctx->texcoord = terra_addf2 ( &ctx->texcoord, &tc );
+    }
+
+    // Interpolating normal at vertices
+    if ( missing & TERRA_SURFACE_NORMAL ) {
+        TerraFloat3 na = terra_mulf3 ( &properties->normal_a, wa );
+        TerraFloat3 nb = terra_mulf3 ( &properties->normal_b, wb );
+        TerraFloat3 nc = terra_mulf3 ( &properties->normal_c, wc );
+        surface->normal = terra_addf3 ( &na, &nb );
+        surface->normal = terra_addf3 ( &surface->normal, &nc );
+        surface->normal = terra_normf3 ( &surface->normal );
+    }
+
+    if ( missing & ( TERRA_SURFACE_EMISSIVE | TERRA_SURFACE_ATTRIBUTES ) ) {
+        if ( ctx->material->footprint && ( ctx->evaluated & ( TERRA_SURFACE_EMISSIVE | TERRA_SURFACE_ATTRIBUTES ) ) == 0 ) {
+            terra_surface_footprint ( ctx );
+        }
+
+        terra_material_run ( ctx->material, missing, &ctx->texcoord, &ctx->point, &ctx->footprint, surface );
+    }
+
+    if ( missing & TERRA_SURFACE_FRAME ) {
+        surface->transform = terra_f4x4_basis ( &surface->normal );
+    }
+
+    ctx->evaluated |= missing;
+    return surface;
+}
+
+// Fully evaluates the surfaces of unevaluated hits on the same object. Interpolation goes through SoA arrays,
+// then each attribute op of the material runs over all the hits before moving to the next one.
+void terra_surface_eval_batch ( TerraHitContext* hits, const uint32_t* indices, size_t count ) {
+    assert ( count <= TERRA_SHADING_BATCH_SIZE );
+    float wa[TERRA_SHADING_BATCH_SIZE], wb[TERRA_SHADING_BATCH_SIZE], wc[TERRA_SHADING_BATCH_SIZE];
+    float nx[TERRA_SHADING_BATCH_SIZE], ny[TERRA_SHADING_BATCH_SIZE], nz[TERRA_SHADING_BATCH_SIZE];
+    float tu[TERRA_SHADING_BATCH_SIZE], tv[TERRA_SHADING_BATCH_SIZE];
+    const TerraObject* object = hits[indices[0]].object;
+    const TerraMaterialProgram* program = hits[indices[0]].material;
+
+    for ( size_t i = 0; i < count; ++i ) {
+        const TerraHitContext* ctx = &hits[indices[i]];
+        assert ( ctx->object == object && ctx->evaluated == 0 );
+        wb[i] = ctx->hit.v;
+        wc[i] = ctx->hit.w;
+        wa[i] = 1 - wb[i] - wc[i];
+    }
+
+    // Interpolating normals and texcoords at vertices
+    for ( size_t i = 0; i < count; ++i ) {
+        const TerraTriangleProperties* p = &object->properties[hits[indices[i]].hit.primitive.triangle_idx];
+        nx[i] = p->normal_a.x * wa[i] + p->normal_b.x * wb[i] + p->normal_c.x * wc[i];
+        ny[i] = p->normal_a.y * wa[i] + p->normal_b.y * wb[i] + p->normal_c.y * wc[i];
+        nz[i] = p->normal_a.z * wa[i] + p->normal_b.z * wb[i] + p->normal_c.z * wc[i];
+        tu[i] = p->texcoord_a.x * wa[i] + p->texcoord_b.x * wb[i] + p->texcoord_c.x * wc[i];
+        tv[i] = p->texcoord_a.y * wa[i] + p->texcoord_b.y * wb[i] + p->texcoord_c.y * wc[i];
+    }
+
+    for ( size_t i = 0; i < count; ++i ) {
+        float inv_len = 1.f / sqrtf ( nx[i] * nx[i] + ny[i] * ny[i] + nz[i] * nz[i] );
+        nx[i] *= inv_len;
+        ny[i] *= inv_len;
+        nz[i] *= inv_len;
+    }
+
+    for ( size_t i = 0; i < count; ++i ) {
+        TerraHitContext* ctx = &hits[indices[i]];
+        ctx->texcoord = terra_f2_set ( tu[i], tv[i] );
+        ctx->surface.normal = terra_f3_set ( nx[i], ny[i], nz[i] );
+        ctx->surface.emissive = program->emissive;
+        memcpy ( ctx->surface.attributes, program->constants, sizeof ( TerraFloat3 ) * program->attributes_count );
+
+        if ( program->footprint ) {
+            terra_surface_footprint ( ctx );
+        }
+    }
 
-    // Calculating screen space derivatives of UV coordinates
-    //TerraFloat2 dduv = terra_triangle_ss_derivatives ( point, surface );
+    for ( uint8_t j = 0; j < program->ops_count; ++j ) {
+        const TerraAttributeOp* op = &program->ops[j];
 
-    for ( int i = 0; i < material->attributes_count; ++i ) {
-        surface->attributes[i] = terra_attribute_eval ( &material->attributes[i], &texcoord, point );
+        for ( size_t i = 0; i < count; ++i ) {
+            TerraHitContext* ctx = &hits[indices[i]];
+            TerraFloat3* dst = op->dst == TERRA_ATTRIBUTE_OP_EMISSIVE ? &ctx->surface.emissive : &ctx->surface.attributes[op->dst];
+            *dst = terra_material_run_op ( op, &ctx->texcoord, &ctx->point, &ctx->footprint );
+        }
     }
 
-    surface->emissive = terra_attribute_eval ( &material->emissive, &texcoord, point );
-    surface->transform = terra_f4x4_basis ( &surface->normal );
+    for ( size_t i = 0; i < count; ++i ) {
+        TerraHitContext* ctx = &hits[indices[i]];
+        ctx->surface.transform = terra_f4x4_basis ( &ctx->surface.normal );
+        ctx->evaluated = TERRA_SURFACE_ALL;
+    }
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -1784,12 +3502,12 @@ TerraFloat3 terra_camera_perspective_sample ( const TerraCamera* camera, const T
     float dx = -jitter + 2 * r1 * jitter;
     float dy = -jitter + 2 * r2 * jitter;
     // [0:1], y points down
-    float ndc_x = ( x + 0.5f + dx ) / frame->width;
-    float ndc_y = ( y + 0.5f + dy ) / frame->height;
+    float ndc_x = ( frame->image_x + x + 0.5f + dx ) / frame->image_width;
+    float ndc_y = ( frame->image_y + y + 0.5f + dy ) / frame->image_height;
     // [-1:1], y points up
     float screen_x = 2 * ndc_x - 1;
     float screen_y = 1 - 2 * ndc_y;
-    float aspect_ratio = ( float ) frame->width / ( float ) frame->height;
+    float aspect_ratio = ( float ) frame->image_width / ( float ) frame->image_height;
     // [-aspect_ratio * tan(fov/2):aspect_ratio * tan(fov/2)]
     float frustum_x = screen_x * aspect_ratio * ( float ) tan ( ( camera->fov * 0.0174533f ) / 2 );
     float frustum_y = screen_y * ( float ) tan ( ( camera->fov * 0.0174533f ) / 2 );
@@ -1798,6 +3516,11 @@ TerraFloat3 terra_camera_perspective_sample ( const TerraCamera* camera, const T
     return dir;
 }
 
+// Angle subtended by a pixel, the spread of the primary ray cones
+float terra_camera_pixel_spread ( const TerraCamera* camera, const TerraFramebuffer* frame ) {
+    return 2 * ( float ) tan ( ( camera->fov * 0.0174533f ) / 2 ) / frame->image_height;
+}
+
 //--------------------------------------------------------------------------------------------------
 // @TerraAttribute
 //--------------------------------------------------------------------------------------------------
@@ -1809,6 +3532,109 @@ TerraFloat3 terra_attribute_eval ( const TerraAttribute* attribute, const void*
     return attribute->value;
 }
 
+// Returns false if the attribute is constant, its value is then written to constant
+static bool terra_attribute_compile ( const TerraAttribute* attribute, uint8_t dst, TerraAttributeOp* op, TerraFloat3* constant ) {
+    if ( attribute->state == NULL ) {
+        *constant = attribute->value;
+        return false;
+    }
+
+    *constant = terra_f3_zero;
+    op->dst = dst;
+    op->state = attribute->state;
+    op->eval = attribute->eval;
+    op->opcode = kTerraAttributeOpEval;
+
+    if ( attribute->eval == terra_texture_sample_latlong ) {
+        terra_texture_bind_fetch ( ( TerraTexture* ) attribute->state );
+    }
+
+    if ( attribute->eval == terra_texture_sample ) {
+        TerraTexture* texture = ( TerraTexture* ) attribute->state;
+        terra_texture_bind_fetch ( texture );
+
+        if ( texture->filter == kTerraFilterPoint ) {
+            op->opcode = kTerraAttributeOpTexturePoint;
+        } else if ( texture->filter == kTerraFilterBilinear ) {
+            op->opcode = kTerraAttributeOpTextureBilinear;
+        } else {
+            op->opcode = texture->filter == kTerraFilterTrilinear ? kTerraAttributeOpTextureTrilinear : kTerraAttributeOpTextureAnisotropic;
+
+            if ( texture->mips == NULL ) {
+                terra_texture_generate_mips ( texture );
+            }
+        }
+    }
+
+    return true;
+}
+
+void terra_material_compile ( const TerraMaterial* material, TerraMaterialProgram* program ) {
+    assert ( material->attributes_count <= TERRA_MATERIAL_MAX_ATTRIBUTES );
+    program->attributes_count = ( uint8_t ) material->attributes_count;
+    program->ops_count = 0;
+    program->emissive_ops = 0;
+    program->footprint = false;
+
+    if ( terra_attribute_compile ( &material->emissive, TERRA_ATTRIBUTE_OP_EMISSIVE, &program->ops[0], &program->emissive ) ) {
+        program->emissive_ops = 1;
+        program->ops_count = 1;
+    }
+
+    for ( size_t i = 0; i < material->attributes_count; ++i ) {
+        if ( terra_attribute_compile ( &material->attributes[i], ( uint8_t ) i, &program->ops[program->ops_count], &program->constants[i] ) ) {
+            ++program->ops_count;
+        }
+    }
+
+    for ( uint8_t i = 0; i < program->ops_count; ++i ) {
+        program->footprint |= program->ops[i].opcode == kTerraAttributeOpTextureTrilinear || program->ops[i].opcode == kTerraAttributeOpTextureAnisotropic;
+    }
+}
+
+TerraFloat3 terra_material_run_op ( const TerraAttributeOp* op, const TerraFloat2* texcoord, const TerraFloat3* point, const TerraTextureFootprint* footprint ) {
+    switch ( op->opcode ) {
+        case kTerraAttributeOpTexturePoint:
+            return terra_texture_sample_point ( ( const TerraTexture* ) op->state, texcoord );
+
+        case kTerraAttributeOpTextureBilinear:
+            return terra_texture_sample_bilinear ( ( const TerraTexture* ) op->state, texcoord );
+
+        case kTerraAttributeOpTextureTrilinear:
+        case kTerraAttributeOpTextureAnisotropic:
+            return terra_texture_sample_footprint ( ( const TerraTexture* ) op->state, texcoord, footprint );
+
+        case kTerraAttributeOpEval:
+            return op->eval ( op->state, texcoord, point );
+    }
+
+    assert ( false );
+    return terra_f3_zero;
+}
+
+// Writes the TERRA_SURFACE_EMISSIVE and/or TERRA_SURFACE_ATTRIBUTES parts of the surface
+void terra_material_run ( const TerraMaterialProgram* program, uint32_t parts, const TerraFloat2* texcoord, const TerraFloat3* point,
+                          const TerraTextureFootprint* footprint, TerraShadingSurface* surface ) {
+    uint8_t ops_begin = program->emissive_ops;
+    uint8_t ops_end = program->emissive_ops;
+
+    if ( parts & TERRA_SURFACE_EMISSIVE ) {
+        surface->emissive = program->emissive;
+        ops_begin = 0;
+    }
+
+    if ( parts & TERRA_SURFACE_ATTRIBUTES ) {
+        memcpy ( surface->attributes, program->constants, sizeof ( TerraFloat3 ) * program->attributes_count );
+        ops_end = program->ops_count;
+    }
+
+    for ( uint8_t i = ops_begin; i < ops_end; ++i ) {
+        const TerraAttributeOp* op = &program->ops[i];
+        TerraFloat3* dst = op->dst == TERRA_ATTRIBUTE_OP_EMISSIVE ? &surface->emissive : &surface->attributes[op->dst];
+        *dst = terra_material_run_op ( op, texcoord, point, footprint );
+    }
+}
+
 //--------------------------------------------------------------------------------------------------
 // @TerraTonemapping
 //--------------------------------------------------------------------------------------------------
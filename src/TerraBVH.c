@@ -248,13 +248,12 @@ void terra_bvh_destroy ( TerraBVH* bvh ) {
 }
 
 bool terra_bvh_traverse ( TerraBVH* bvh, const TerraObject* objects, const TerraRay* ray, const TerraRayState* ray_state,
-                          TerraFloat3* point_out, TerraPrimitiveRef* primitive_out ) {
+                          TerraHit* hit_out ) {
     int queue[64];
     queue[0] = 0;
     int queue_count = 1;
     int node = 0;
     float min_d = FLT_MAX;
-    TerraFloat3 min_p = terra_f3_set1 ( FLT_MAX );
     bool found = false;
 
     // Intersection queries (already initialized)
@@ -289,9 +288,11 @@ bool terra_bvh_traverse ( TerraBVH* bvh, const TerraObject* objects, const Terra
                         // Is it within the bounds ?
                         if ( iset_result.ray_depth < min_d ) {
                             min_d = iset_result.ray_depth;
-                            min_p = iset_result.point;
-                            primitive_out->object_idx = model_idx;
-                            primitive_out->triangle_idx = tri_idx;
+                            hit_out->primitive.object_idx = model_idx;
+                            hit_out->primitive.triangle_idx = tri_idx;
+                            hit_out->v = iset_result.v;
+                            hit_out->w = iset_result.w;
+                            hit_out->t = iset_result.ray_depth;
                             found = true;
                         }
                     }
@@ -305,6 +306,5 @@ bool terra_bvh_traverse ( TerraBVH* bvh, const TerraObject* objects, const Terra
         }
     }
 
-    *point_out = min_p;
     return found;
 }
@@ -0,0 +1,144 @@
+// fseeko
+#if !defined ( _WIN32 ) && !defined ( _POSIX_C_SOURCE )
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+// Terra
+#include <Terra.h>
+#include "TerraPrivate.h"
+#include "TerraParallel.h"
+
+// libc
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define terra_fseek64 _fseeki64
+#else
+#define terra_fseek64 fseeko
+#endif
+
+// Shared by the threads, each one owns a file handle and a bucket at a time
+typedef struct {
+    const TerraCamera*             camera;
+    HTerraScene                    scene;
+    const TerraTonemappingOptions* tonemapping;
+    const char*                    path;
+    size_t                         width;
+    size_t                         height;
+    size_t                         bucket_size;
+    size_t                         buckets_x;
+    size_t                         buckets;
+    size_t                         header_bytes;
+    double                         bucket_budget_ms;
+    float                          target_error;
+    volatile int32_t               next;
+    volatile int32_t               failed;
+} TerraBucketRender;
+
+//--------------------------------------------------------------------------------------------------
+// @TerraBucket
+//--------------------------------------------------------------------------------------------------
+// PFM rows go from the bottom to the top of the image
+static bool terra_bucket_write ( const TerraBucketRender* render, FILE* file, const TerraFramebuffer* bucket ) {
+    for ( size_t i = 0; i < bucket->height; ++i ) {
+        size_t row = render->height - 1 - ( bucket->image_y + i );
+        size_t offset = render->header_bytes + ( row * render->width + bucket->image_x ) * sizeof ( TerraFloat3 );
+
+        if ( terra_fseek64 ( file, offset, SEEK_SET ) != 0 ||
+                fwrite ( ( const TerraFloat3* ) bucket->pixels + i * bucket->width, sizeof ( TerraFloat3 ), bucket->width, file ) != bucket->width ) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Called once per thread, the buckets are handed out in row-major order until none is left
+static void terra_bucket_render_thread ( void* _render, size_t begin, size_t end ) {
+    TERRA_UNUSED ( begin );
+    TERRA_UNUSED ( end );
+    TerraBucketRender* render = ( TerraBucketRender* ) _render;
+    // Writes from different handles never overlap
+    FILE* file = fopen ( render->path, "r+b" );
+
+    if ( file == NULL ) {
+        terra_atomic_exchange ( &render->failed, 1 );
+        return;
+    }
+
+    for ( ;; ) {
+        size_t b = ( size_t ) terra_atomic_fetch_add ( &render->next, 1 );
+
+        if ( b >= render->buckets || render->failed ) {
+            break;
+        }
+
+        size_t x = ( b % render->buckets_x ) * render->bucket_size;
+        size_t y = ( b / render->buckets_x ) * render->bucket_size;
+        size_t width = terra_mini ( render->bucket_size, render->width - x );
+        size_t height = terra_mini ( render->bucket_size, render->height - y );
+        TerraFramebuffer bucket;
+
+        if ( !terra_framebuffer_create_bucket ( &bucket, render->width, render->height, x, y, width, height ) ) {
+            terra_atomic_exchange ( &render->failed, 1 );
+            break;
+        }
+
+        terra_render_until ( render->camera, render->scene, &bucket, 0, 0, width, height, render->bucket_budget_ms, render->target_error, NULL );
+        // The other threads are busy with their own bucket
+        terra_framebuffer_resolve_serial ( &bucket, render->tonemapping );
+
+        if ( !terra_bucket_write ( render, file, &bucket ) ) {
+            terra_atomic_exchange ( &render->failed, 1 );
+        }
+
+        terra_framebuffer_destroy ( &bucket );
+    }
+
+    if ( fclose ( file ) != 0 ) {
+        terra_atomic_exchange ( &render->failed, 1 );
+    }
+}
+
+bool terra_render_buckets ( const TerraCamera* camera, HTerraScene scene, size_t width, size_t height, size_t bucket_size,
+                            double bucket_budget_ms, float target_error, const TerraTonemappingOptions* tonemapping, const char* path ) {
+    if ( width == 0 || height == 0 || bucket_size == 0 ) {
+        return false;
+    }
+
+    TerraBucketRender render;
+    render.camera = camera;
+    render.scene = scene;
+    render.tonemapping = tonemapping;
+    render.path = path;
+    render.width = width;
+    render.height = height;
+    render.bucket_size = bucket_size;
+    render.buckets_x = ( width + bucket_size - 1 ) / bucket_size;
+    render.buckets = render.buckets_x * ( ( height + bucket_size - 1 ) / bucket_size );
+    render.bucket_budget_ms = bucket_budget_ms;
+    render.target_error = target_error;
+    render.next = 0;
+    render.failed = 0;
+
+    // The header is followed by the whole image, the file is extended to its final size by writing the last byte
+    FILE* file = fopen ( path, "wb" );
+
+    if ( file == NULL ) {
+        return false;
+    }
+
+    int header_bytes = fprintf ( file, "PF\n%zu %zu\n-1.0\n", width, height );
+    render.header_bytes = header_bytes > 0 ? ( size_t ) header_bytes : 0;
+    size_t file_bytes = render.header_bytes + width * height * sizeof ( TerraFloat3 );
+    bool sized = header_bytes > 0 && terra_fseek64 ( file, file_bytes - 1, SEEK_SET ) == 0 && fputc ( 0, file ) != EOF;
+
+    if ( fclose ( file ) != 0 || !sized ) {
+        return false;
+    }
+
+    size_t threads = render.buckets < TERRA_PARALLEL_MAX_THREADS ? render.buckets : TERRA_PARALLEL_MAX_THREADS;
+    terra_parallel_for ( threads, 1, terra_bucket_render_thread, &render );
+    return render.failed == 0;
+}
@@ -0,0 +1,159 @@
+// fseeko
+#if !defined ( _WIN32 ) && !defined ( _POSIX_C_SOURCE )
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+// Terra
+#include <Terra.h>
+#include "TerraPrivate.h"
+#include "TerraParallel.h"
+
+// libc
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#define terra_fseek64 _fseeki64
+#define terra_replace_file( src, dst ) ( MoveFileExA ( src, dst, MOVEFILE_REPLACE_EXISTING ) != 0 )
+#else
+#define terra_fseek64 fseeko
+#define terra_replace_file( src, dst ) ( rename ( src, dst ) == 0 )
+#endif
+
+// TRF2, the compact formats of TRFS states stored the root mean square luminance instead of its deviation
+#define TERRA_FRAMEBUFFER_STATE_MAGIC 0x32465254
+
+// Followed by the results in row-major order, as stored in memory
+typedef struct {
+    uint32_t magic;
+    uint32_t width;
+    uint32_t height;
+    uint8_t  accumulation_format;
+    uint8_t  saving;        // Set while an incremental save writes the tiles, left set if it was interrupted
+    uint8_t  reserved[2];
+} TerraFramebufferStateHeader;
+
+//--------------------------------------------------------------------------------------------------
+// @TerraFramebufferState
+//--------------------------------------------------------------------------------------------------
+static bool terra_framebuffer_state_matches ( const TerraFramebuffer* framebuffer, const TerraFramebufferStateHeader* header ) {
+    return header->magic == TERRA_FRAMEBUFFER_STATE_MAGIC && header->width == framebuffer->width &&
+           header->height == framebuffer->height && header->accumulation_format == framebuffer->accumulation_format;
+}
+
+static bool terra_framebuffer_state_write_tile ( const TerraFramebuffer* framebuffer, FILE* file, size_t tile ) {
+    size_t tiles_x = terra_framebuffer_tiles_x ( framebuffer );
+    size_t x = ( tile % tiles_x ) * TERRA_RENDER_TILE_SIZE;
+    size_t y = ( tile / tiles_x ) * TERRA_RENDER_TILE_SIZE;
+    size_t width = terra_mini ( TERRA_RENDER_TILE_SIZE, framebuffer->width - x );
+    size_t height = terra_mini ( TERRA_RENDER_TILE_SIZE, framebuffer->height - y );
+    size_t result_bytes = terra_framebuffer_result_bytes ( framebuffer->accumulation_format );
+
+    for ( size_t i = y; i < y + height; ++i ) {
+        size_t offset = ( i * framebuffer->width + x ) * result_bytes;
+
+        if ( terra_fseek64 ( file, sizeof ( TerraFramebufferStateHeader ) + offset, SEEK_SET ) != 0 ||
+                fwrite ( ( const uint8_t* ) framebuffer->results + offset, result_bytes, width, file ) != width ) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool terra_framebuffer_state_write_header ( FILE* file, const TerraFramebufferStateHeader* header ) {
+    return terra_fseek64 ( file, 0, SEEK_SET ) == 0 && fwrite ( header, sizeof ( *header ), 1, file ) == 1 && fflush ( file ) == 0;
+}
+
+// A whole save goes to path.tmp, then replaces the file: an interrupted one leaves the previous save intact.
+// An incremental one writes the tiles in place between two header updates, the saving flag tells load_state
+// the tiles might be torn if it did not get to the end.
+bool terra_framebuffer_save_state ( TerraFramebuffer* framebuffer, const char* path, bool incremental ) {
+    TerraFramebufferStateHeader header;
+    FILE* file = incremental ? fopen ( path, "r+b" ) : NULL;
+
+    if ( file != NULL && ( fread ( &header, sizeof ( header ), 1, file ) != 1 || !terra_framebuffer_state_matches ( framebuffer, &header ) || header.saving ) ) {
+        fclose ( file );
+        file = NULL;
+    }
+
+    bool whole = file == NULL;
+    char* tmp_path = NULL;
+
+    if ( whole ) {
+        size_t length = strlen ( path );
+        tmp_path = ( char* ) terra_malloc ( length + 5 );
+        memcpy ( tmp_path, path, length );
+        memcpy ( tmp_path + length, ".tmp", 5 );
+        file = fopen ( tmp_path, "wb" );
+
+        if ( file == NULL ) {
+            terra_free ( tmp_path );
+            return false;
+        }
+
+        memset ( &header, 0, sizeof ( header ) );
+        header.magic = TERRA_FRAMEBUFFER_STATE_MAGIC;
+        header.width = ( uint32_t ) framebuffer->width;
+        header.height = ( uint32_t ) framebuffer->height;
+        header.accumulation_format = framebuffer->accumulation_format;
+    } else {
+        header.saving = 1;
+    }
+
+    bool ok = terra_framebuffer_state_write_header ( file, &header );
+
+    for ( size_t t = 0; t < terra_framebuffer_tiles ( framebuffer ); ++t ) {
+        // Cleared before reading the results, a concurrent render flags the tile again
+        bool unsaved = ( terra_atomic_fetch_and ( &framebuffer->dirty[t], ~kTerraTileUnsaved ) & kTerraTileUnsaved ) != 0;
+
+        if ( ( whole || unsaved ) && ( !ok || !terra_framebuffer_state_write_tile ( framebuffer, file, t ) ) ) {
+            // The next save has to try again
+            terra_atomic_fetch_or ( &framebuffer->dirty[t], kTerraTileUnsaved );
+            ok = false;
+        }
+    }
+
+    // Tiles first, then the header saying they are complete
+    if ( ok && !whole ) {
+        header.saving = 0;
+        ok = fflush ( file ) == 0 && terra_framebuffer_state_write_header ( file, &header );
+    }
+
+    ok = fclose ( file ) == 0 && ok;
+
+    if ( whole ) {
+        ok = ok && terra_replace_file ( tmp_path, path );
+
+        if ( !ok ) {
+            remove ( tmp_path );
+        }
+
+        terra_free ( tmp_path );
+    }
+
+    return ok;
+}
+
+bool terra_framebuffer_load_state ( TerraFramebuffer* framebuffer, const char* path ) {
+    FILE* file = fopen ( path, "rb" );
+
+    if ( file == NULL ) {
+        return false;
+    }
+
+    TerraFramebufferStateHeader header;
+    size_t count = framebuffer->width * framebuffer->height;
+    bool ok = fread ( &header, sizeof ( header ), 1, file ) == 1 && terra_framebuffer_state_matches ( framebuffer, &header ) && !header.saving &&
+              fread ( framebuffer->results, terra_framebuffer_result_bytes ( framebuffer->accumulation_format ), count, file ) == count;
+    fclose ( file );
+
+    // A partial read leaves the framebuffer in an unknown state, it is saved whole the next time
+    for ( size_t t = 0; t < terra_framebuffer_tiles ( framebuffer ); ++t ) {
+        framebuffer->dirty[t] = ok ? kTerraTileUnresolved : kTerraTileUnresolved | kTerraTileUnsaved;
+    }
+
+    return ok;
+}
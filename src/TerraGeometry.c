@@ -75,6 +75,9 @@ int terra_ray_triangle_intersection_query ( const TerraRayIntersectionQuery* que
         TerraFloat3 offset = terra_mulf3 ( &query->ray->direction, t );
         result->point = terra_addf3 ( &offset, &query->ray->origin );
         result->ray_depth = t;
+        result->u = 1 - u - v;
+        result->v = u;
+        result->w = v;
 
         ret = 1;
         goto exit;
@@ -0,0 +1,390 @@
+// TerraLightBVH
+#include "TerraLightBVH.h"
+
+// Terra
+#include "TerraPrivate.h"
+
+// libc
+#include <assert.h>
+#include <string.h>
+
+typedef struct {
+    TerraAABB      aabb;
+    TerraLightCone cone;
+    TerraFloat3    centroid;
+    float          power;
+    int32_t        emitter;
+} TerraLightBVHVolume;
+
+static TerraAABB      terra_light_aabb_union ( const TerraAABB* a, const TerraAABB* b );
+static float          terra_light_aabb_surface_area ( const TerraAABB* aabb );
+static TerraLightCone terra_light_cone_union ( const TerraLightCone* a, const TerraLightCone* b );
+static float          terra_light_cone_measure ( const TerraLightCone* cone );
+static int            terra_light_volume_compare_x ( const void* left, const void* right );
+static int            terra_light_volume_compare_y ( const void* left, const void* right );
+static int            terra_light_volume_compare_z ( const void* left, const void* right );
+static int            terra_light_bvh_split_volumes ( TerraLightBVHVolume* volumes, int volumes_count );
+static int32_t        terra_light_bvh_build ( TerraLightBVH* bvh, TerraLightBVHVolume* volumes, int volumes_count, int32_t parent );
+static float          terra_light_bvh_importance ( const TerraLightBVHNode* node, const TerraFloat3* point, const TerraFloat3* normal );
+
+TerraAABB terra_light_aabb_union ( const TerraAABB* a, const TerraAABB* b ) {
+    TerraAABB aabb;
+    aabb.min.x = terra_minf ( a->min.x, b->min.x );
+    aabb.min.y = terra_minf ( a->min.y, b->min.y );
+    aabb.min.z = terra_minf ( a->min.z, b->min.z );
+    aabb.max.x = terra_maxf ( a->max.x, b->max.x );
+    aabb.max.y = terra_maxf ( a->max.y, b->max.y );
+    aabb.max.z = terra_maxf ( a->max.z, b->max.z );
+    return aabb;
+}
+
+float terra_light_aabb_surface_area ( const TerraAABB* aabb ) {
+    float w = aabb->max.x - aabb->min.x;
+    float h = aabb->max.y - aabb->min.y;
+    float d = aabb->max.z - aabb->min.z;
+    return 2 * ( w * d + w * h + d * h );
+}
+
+// Smallest cone containing both cones (Algorithm 1 of the paper)
+TerraLightCone terra_light_cone_union ( const TerraLightCone* _a, const TerraLightCone* _b ) {
+    const TerraLightCone* a = _a;
+    const TerraLightCone* b = _b;
+
+    if ( b->theta_o > a->theta_o ) {
+        a = _b;
+        b = _a;
+    }
+
+    TerraLightCone cone;
+    cone.axis = a->axis;
+    cone.theta_e = terra_maxf ( a->theta_e, b->theta_e );
+    float theta_d = acosf ( terra_clamp ( terra_dotf3 ( &a->axis, &b->axis ), -1.f, 1.f ) );
+
+    if ( terra_minf ( theta_d + b->theta_o, terra_PI ) <= a->theta_o ) {
+        cone.theta_o = a->theta_o;
+        return cone;
+    }
+
+    float theta_o = ( a->theta_o + theta_d + b->theta_o ) / 2;
+
+    if ( theta_o >= terra_PI ) {
+        cone.theta_o = terra_PI;
+        return cone;
+    }
+
+    // Rotate a's axis towards b's one by theta_r
+    float theta_r = theta_o - a->theta_o;
+    TerraFloat3 proj = terra_mulf3 ( &a->axis, terra_dotf3 ( &a->axis, &b->axis ) );
+    TerraFloat3 ortho = terra_subf3 ( &b->axis, &proj );
+
+    if ( terra_lenf3 ( &ortho ) < terra_Epsilon ) {
+        cone.theta_o = terra_PI;
+        return cone;
+    }
+
+    ortho = terra_normf3 ( &ortho );
+    TerraFloat3 axis_cos = terra_mulf3 ( &a->axis, cosf ( theta_r ) );
+    TerraFloat3 axis_sin = terra_mulf3 ( &ortho, sinf ( theta_r ) );
+    cone.axis = terra_addf3 ( &axis_cos, &axis_sin );
+    cone.axis = terra_normf3 ( &cone.axis );
+    cone.theta_o = theta_o;
+    return cone;
+}
+
+// Solid angle measure of the directions emitted by the cone, used by the split heuristic
+float terra_light_cone_measure ( const TerraLightCone* cone ) {
+    float theta_w = terra_minf ( cone->theta_o + cone->theta_e, terra_PI );
+    float cos_o = cosf ( cone->theta_o );
+    float sin_o = sinf ( cone->theta_o );
+    return 2 * terra_PI * ( 1 - cos_o ) + terra_PI / 2 * ( 2 * theta_w * sin_o - cosf ( cone->theta_o - 2 * theta_w ) - 2 * cone->theta_o * sin_o + cos_o );
+}
+
+int terra_light_volume_compare_x ( const void* left, const void* right ) {
+    float l = ( ( const TerraLightBVHVolume* ) left )->centroid.x;
+    float r = ( ( const TerraLightBVHVolume* ) right )->centroid.x;
+    return ( l > r ) - ( l < r );
+}
+
+int terra_light_volume_compare_y ( const void* left, const void* right ) {
+    float l = ( ( const TerraLightBVHVolume* ) left )->centroid.y;
+    float r = ( ( const TerraLightBVHVolume* ) right )->centroid.y;
+    return ( l > r ) - ( l < r );
+}
+
+int terra_light_volume_compare_z ( const void* left, const void* right ) {
+    float l = ( ( const TerraLightBVHVolume* ) left )->centroid.z;
+    float r = ( ( const TerraLightBVHVolume* ) right )->centroid.z;
+    return ( l > r ) - ( l < r );
+}
+
+// Sorts the volumes along the widest centroid axis and returns the number of volumes going to the left child.
+// The split minimizes the surface area orientation heuristic: power * area * orientation measure.
+int terra_light_bvh_split_volumes ( TerraLightBVHVolume* volumes, int volumes_count ) {
+    TerraAABB centroids;
+    centroids.min = terra_f3_set1 ( FLT_MAX );
+    centroids.max = terra_f3_set1 ( -FLT_MAX );
+
+    for ( int i = 0; i < volumes_count; ++i ) {
+        TerraAABB c = { volumes[i].centroid, volumes[i].centroid };
+        centroids = terra_light_aabb_union ( &centroids, &c );
+    }
+
+    TerraFloat3 extent = terra_subf3 ( &centroids.max, &centroids.min );
+
+    if ( extent.x >= extent.y && extent.x >= extent.z ) {
+        qsort ( volumes, volumes_count, sizeof ( *volumes ), terra_light_volume_compare_x );
+    } else if ( extent.y >= extent.z ) {
+        qsort ( volumes, volumes_count, sizeof ( *volumes ), terra_light_volume_compare_y );
+    } else {
+        qsort ( volumes, volumes_count, sizeof ( *volumes ), terra_light_volume_compare_z );
+    }
+
+    // cost[i] is the cost of the left side holding volumes [0, i]
+    float* cost = ( float* ) terra_malloc ( sizeof ( float ) * volumes_count );
+    TerraAABB aabb = volumes[0].aabb;
+    TerraLightCone cone = volumes[0].cone;
+    float power = 0;
+
+    for ( int i = 0; i < volumes_count; ++i ) {
+        aabb = terra_light_aabb_union ( &aabb, &volumes[i].aabb );
+        cone = terra_light_cone_union ( &cone, &volumes[i].cone );
+        power += volumes[i].power;
+        cost[i] = power * terra_light_aabb_surface_area ( &aabb ) * terra_light_cone_measure ( &cone );
+    }
+
+    aabb = volumes[volumes_count - 1].aabb;
+    cone = volumes[volumes_count - 1].cone;
+    power = 0;
+    float min_cost = FLT_MAX;
+    int split = volumes_count / 2;
+
+    for ( int i = volumes_count - 1; i > 0; --i ) {
+        aabb = terra_light_aabb_union ( &aabb, &volumes[i].aabb );
+        cone = terra_light_cone_union ( &cone, &volumes[i].cone );
+        power += volumes[i].power;
+        float c = cost[i - 1] + power * terra_light_aabb_surface_area ( &aabb ) * terra_light_cone_measure ( &cone );
+
+        if ( c < min_cost ) {
+            min_cost = c;
+            split = i;
+        }
+    }
+
+    terra_free ( cost );
+    return split;
+}
+
+int32_t terra_light_bvh_build ( TerraLightBVH* bvh, TerraLightBVHVolume* volumes, int volumes_count, int32_t parent ) {
+    // Nodes are preallocated, pointers stay valid while recursing
+    int32_t node_idx = bvh->nodes_count++;
+    TerraLightBVHNode* node = &bvh->nodes[node_idx];
+    node->parent = parent;
+
+    if ( volumes_count == 1 ) {
+        node->aabb = volumes[0].aabb;
+        node->cone = volumes[0].cone;
+        node->power = volumes[0].power;
+        node->index[0] = -1;
+        node->index[1] = -1;
+        node->emitter = volumes[0].emitter;
+        bvh->emitters_leaf[volumes[0].emitter] = node_idx;
+        return node_idx;
+    }
+
+    int split = terra_light_bvh_split_volumes ( volumes, volumes_count );
+    node->index[0] = terra_light_bvh_build ( bvh, volumes, split, node_idx );
+    node->index[1] = terra_light_bvh_build ( bvh, volumes + split, volumes_count - split, node_idx );
+    const TerraLightBVHNode* left = &bvh->nodes[node->index[0]];
+    const TerraLightBVHNode* right = &bvh->nodes[node->index[1]];
+    node->aabb = terra_light_aabb_union ( &left->aabb, &right->aabb );
+    node->cone = terra_light_cone_union ( &left->cone, &right->cone );
+    node->power = left->power + right->power;
+    node->emitter = -1;
+    return node_idx;
+}
+
+void terra_light_bvh_create ( TerraLightBVH* bvh, const TerraObject* objects, int objects_count, const TerraLight* lights, int lights_count ) {
+    memset ( bvh, 0, sizeof ( TerraLightBVH ) );
+    bvh->objects_count = objects_count;
+    bvh->objects_emitters = ( int32_t* ) terra_malloc ( sizeof ( int32_t ) * ( objects_count > 0 ? objects_count : 1 ) );
+
+    for ( int i = 0; i < objects_count; ++i ) {
+        bvh->objects_emitters[i] = -1;
+    }
+
+    for ( int i = 0; i < lights_count; ++i ) {
+        bvh->emitters_count += ( int ) lights[i].object->triangles_count;
+    }
+
+    if ( bvh->emitters_count == 0 ) {
+        return;
+    }
+
+    bvh->emitters = ( TerraLightEmitter* ) terra_malloc ( sizeof ( TerraLightEmitter ) * bvh->emitters_count );
+    bvh->emitters_leaf = ( int32_t* ) terra_malloc ( sizeof ( int32_t ) * bvh->emitters_count );
+    TerraLightBVHVolume* volumes = ( TerraLightBVHVolume* ) terra_malloc ( sizeof ( TerraLightBVHVolume ) * bvh->emitters_count );
+    int p = 0;
+
+    for ( int i = 0; i < lights_count; ++i ) {
+        const TerraObject* object = lights[i].object;
+        float radiance = terra_luminance ( &lights[i].power ) / ( lights[i].area * terra_PI );
+        bvh->objects_emitters[object - objects] = p;
+
+        for ( size_t j = 0; j < object->triangles_count; ++j, ++p ) {
+            const TerraTriangle* tri = &object->triangles[j];
+            const TerraTriangleProperties* props = &object->properties[j];
+            bvh->emitters[p].light_idx = ( uint32_t ) i;
+            bvh->emitters[p].triangle_idx = ( uint32_t ) j;
+            // Bounds
+            TerraLightBVHVolume* volume = &volumes[p];
+            volume->aabb.min = terra_f3_set1 ( FLT_MAX );
+            volume->aabb.max = terra_f3_set1 ( -FLT_MAX );
+            terra_aabb_fit_triangle ( &volume->aabb, tri );
+            volume->centroid = terra_addf3 ( &tri->a, &tri->b );
+            volume->centroid = terra_addf3 ( &volume->centroid, &tri->c );
+            volume->centroid = terra_divf3 ( &volume->centroid, 3 );
+            // Orientation, wide enough to contain the interpolated normals
+            TerraFloat3 axis = terra_addf3 ( &props->normal_a, &props->normal_b );
+            axis = terra_addf3 ( &axis, &props->normal_c );
+
+            if ( terra_lenf3 ( &axis ) < terra_Epsilon ) {
+                axis = terra_f3_set ( 0, 1, 0 );
+                volume->cone.theta_o = terra_PI;
+            } else {
+                axis = terra_normf3 ( &axis );
+                float cos_o = terra_minf ( terra_dotf3 ( &axis, &props->normal_a ), terra_dotf3 ( &axis, &props->normal_b ) );
+                cos_o = terra_minf ( cos_o, terra_dotf3 ( &axis, &props->normal_c ) );
+                volume->cone.theta_o = acosf ( terra_clamp ( cos_o, -1.f, 1.f ) );
+            }
+
+            volume->cone.axis = axis;
+            volume->cone.theta_e = terra_PI / 2;
+            // Power
+            volume->power = radiance * lights[i].triangle_area[j] * terra_PI;
+            volume->emitter = p;
+        }
+    }
+
+    bvh->nodes = ( TerraLightBVHNode* ) terra_malloc ( sizeof ( TerraLightBVHNode ) * ( 2 * bvh->emitters_count - 1 ) );
+    bvh->nodes_count = 0;
+    terra_light_bvh_build ( bvh, volumes, bvh->emitters_count, -1 );
+    terra_free ( volumes );
+}
+
+void terra_light_bvh_destroy ( TerraLightBVH* bvh ) {
+    terra_free ( bvh->nodes );
+    terra_free ( bvh->emitters );
+    terra_free ( bvh->emitters_leaf );
+    terra_free ( bvh->objects_emitters );
+    memset ( bvh, 0, sizeof ( TerraLightBVH ) );
+}
+
+// Conservative estimate of the node contribution to the shading point: power, attenuated by the squared distance
+// and by the smallest emitter and receiver angles the bounds allow.
+float terra_light_bvh_importance ( const TerraLightBVHNode* node, const TerraFloat3* point, const TerraFloat3* normal ) {
+    TerraFloat3 center = terra_addf3 ( &node->aabb.min, &node->aabb.max );
+    center = terra_mulf3 ( &center, 0.5f );
+    TerraFloat3 diagonal = terra_subf3 ( &node->aabb.max, &node->aabb.min );
+    float r2 = terra_dotf3 ( &diagonal, &diagonal ) / 4;
+    TerraFloat3 to_point = terra_subf3 ( point, &center );
+    float d2 = terra_dotf3 ( &to_point, &to_point );
+
+    // The point is inside the bounding sphere, every direction is possible
+    if ( d2 <= r2 ) {
+        return node->power / terra_maxf ( r2, terra_Epsilon );
+    }
+
+    float d = sqrtf ( d2 );
+    TerraFloat3 wi = terra_divf3 ( &to_point, d );
+    float theta_u = asinf ( terra_minf ( sqrtf ( r2 / d2 ), 1.f ) );
+    // Emitter side
+    float theta = acosf ( terra_clamp ( terra_dotf3 ( &node->cone.axis, &wi ), -1.f, 1.f ) );
+    float theta_p = terra_maxf ( theta - node->cone.theta_o - theta_u, 0.f );
+
+    if ( theta_p >= node->cone.theta_e ) {
+        return 0;
+    }
+
+    float importance = node->power * cosf ( theta_p ) / d2;
+
+    // Receiver side
+    if ( normal != NULL ) {
+        float theta_i = acosf ( terra_clamp ( -terra_dotf3 ( normal, &wi ), -1.f, 1.f ) );
+        float theta_ip = terra_maxf ( theta_i - theta_u, 0.f );
+
+        if ( theta_ip >= terra_PI / 2 ) {
+            return 0;
+        }
+
+        importance *= cosf ( theta_ip );
+    }
+
+    return importance;
+}
+
+const TerraLightEmitter* terra_light_bvh_sample ( const TerraLightBVH* bvh, const TerraFloat3* point, const TerraFloat3* normal, float e, float* pdf ) {
+    *pdf = 0;
+
+    if ( bvh->nodes_count == 0 || terra_light_bvh_importance ( &bvh->nodes[0], point, normal ) <= 0 ) {
+        return NULL;
+    }
+
+    int32_t node = 0;
+    float p = 1;
+
+    while ( bvh->nodes[node].emitter == -1 ) {
+        float importance[2];
+        importance[0] = terra_light_bvh_importance ( &bvh->nodes[bvh->nodes[node].index[0]], point, normal );
+        importance[1] = terra_light_bvh_importance ( &bvh->nodes[bvh->nodes[node].index[1]], point, normal );
+
+        if ( importance[0] + importance[1] <= 0 ) {
+            return NULL;
+        }
+
+        // Pick a child and remap e to [0, 1) for the next level
+        float p_left = importance[0] / ( importance[0] + importance[1] );
+
+        if ( e < p_left ) {
+            e = terra_minf ( e / p_left, 1.f - terra_Epsilon );
+            p *= p_left;
+            node = bvh->nodes[node].index[0];
+        } else {
+            e = terra_minf ( ( e - p_left ) / ( 1 - p_left ), 1.f - terra_Epsilon );
+            p *= 1 - p_left;
+            node = bvh->nodes[node].index[1];
+        }
+    }
+
+    *pdf = p;
+    return &bvh->emitters[bvh->nodes[node].emitter];
+}
+
+float terra_light_bvh_pdf ( const TerraLightBVH* bvh, const TerraFloat3* point, const TerraFloat3* normal, size_t object_idx, size_t triangle_idx ) {
+    if ( bvh->nodes_count == 0 || object_idx >= ( size_t ) bvh->objects_count || bvh->objects_emitters[object_idx] == -1 ) {
+        return 0;
+    }
+
+    if ( terra_light_bvh_importance ( &bvh->nodes[0], point, normal ) <= 0 ) {
+        return 0;
+    }
+
+    // Walk up from the leaf multiplying the probability of choosing each branch
+    int32_t node = bvh->emitters_leaf[bvh->objects_emitters[object_idx] + triangle_idx];
+    float p = 1;
+
+    while ( bvh->nodes[node].parent != -1 ) {
+        const TerraLightBVHNode* parent = &bvh->nodes[bvh->nodes[node].parent];
+        float importance[2];
+        importance[0] = terra_light_bvh_importance ( &bvh->nodes[parent->index[0]], point, normal );
+        importance[1] = terra_light_bvh_importance ( &bvh->nodes[parent->index[1]], point, normal );
+
+        if ( importance[0] + importance[1] <= 0 ) {
+            return 0;
+        }
+
+        p *= importance[parent->index[0] == node ? 0 : 1] / ( importance[0] + importance[1] );
+        node = bvh->nodes[node].parent;
+    }
+
+    return p;
+}
@@ -0,0 +1,61 @@
+#ifndef _TERRA_LIGHT_BVH_H_
+#define _TERRA_LIGHT_BVH_H_
+
+// Terra
+#include <Terra.h>
+#include <TerraMath.h>
+#include "TerraPrivate.h"
+
+// libc
+#include <stdint.h>
+
+// Bounds the emission directions of the emitters below a node.
+// Every emitter normal is within theta_o of axis, theta_e is how far from its normal an emitter still emits
+// (pi/2 for the one sided diffuse emitters supported).
+// Conty Estevez & Kulla, "Importance Sampling of Many Lights with Adaptive Tree Splitting", 2018
+typedef struct {
+    TerraFloat3 axis;
+    float       theta_o;
+    float       theta_e;
+} TerraLightCone;
+
+typedef struct {
+    TerraAABB      aabb;
+    TerraLightCone cone;
+    float          power;       // Luminance of the power emitted by all the emitters below
+    int32_t        index[2];    // Children nodes, -1 if leaf
+    int32_t        parent;      // -1 if root
+    int32_t        emitter;     // Index of the emitter if leaf, -1 otherwise
+} TerraLightBVHNode;
+
+// A single emissive triangle
+typedef struct {
+    uint32_t light_idx;     // Index in the scene lights
+    uint32_t triangle_idx;  // Index in the light object triangles
+} TerraLightEmitter;
+
+typedef struct {
+    TerraLightBVHNode* nodes;
+    int                nodes_count;
+    TerraLightEmitter* emitters;
+    int32_t*           emitters_leaf;       // Leaf node of each emitter
+    int                emitters_count;
+    int32_t*           objects_emitters;    // First emitter of each scene object, -1 if the object does not emit
+    int                objects_count;
+} TerraLightBVH;
+
+//--------------------------------------------------------------------------------------------------
+// Terra Light BVH Internal routines
+//--------------------------------------------------------------------------------------------------
+// Emitters are the triangles of the lights, lights reference the scene objects.
+void  terra_light_bvh_create  ( TerraLightBVH* bvh, const TerraObject* objects, int objects_count, const TerraLight* lights, int lights_count );
+void  terra_light_bvh_destroy ( TerraLightBVH* bvh );
+
+// Stochastically descends the tree choosing each child proportionally to its estimated contribution to the
+// shading point. normal can be NULL. Returns the picked emitter and its probability, NULL if no emitter contributes.
+const TerraLightEmitter* terra_light_bvh_sample ( const TerraLightBVH* bvh, const TerraFloat3* point, const TerraFloat3* normal, float e, float* pdf );
+
+// Probability of terra_light_bvh_sample picking the given object triangle from the same shading point.
+float terra_light_bvh_pdf ( const TerraLightBVH* bvh, const TerraFloat3* point, const TerraFloat3* normal, size_t object_idx, size_t triangle_idx );
+
+#endif // _TERRA_LIGHT_BVH_H_
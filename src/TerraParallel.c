@@ -0,0 +1,230 @@
+// sysconf
+#if !defined ( _WIN32 ) && !defined ( _POSIX_C_SOURCE )
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+// TerraParallel
+#include "TerraParallel.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+typedef SRWLOCK            TerraMutex;
+typedef CONDITION_VARIABLE TerraCondition;
+#define TERRA_MUTEX_INIT SRWLOCK_INIT
+#define TERRA_CONDITION_INIT CONDITION_VARIABLE_INIT
+#define terra_mutex_lock( m ) AcquireSRWLockExclusive ( m )
+#define terra_mutex_unlock( m ) ReleaseSRWLockExclusive ( m )
+#define terra_condition_wait( c, m ) SleepConditionVariableSRW ( c, m, INFINITE, 0 )
+#define terra_condition_broadcast( c ) WakeAllConditionVariable ( c )
+#else
+typedef pthread_mutex_t    TerraMutex;
+typedef pthread_cond_t     TerraCondition;
+#define TERRA_MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+#define TERRA_CONDITION_INIT PTHREAD_COND_INITIALIZER
+#define terra_mutex_lock( m ) pthread_mutex_lock ( m )
+#define terra_mutex_unlock( m ) pthread_mutex_unlock ( m )
+#define terra_condition_wait( c, m ) pthread_cond_wait ( c, m )
+#define terra_condition_broadcast( c ) pthread_cond_broadcast ( c )
+#endif
+
+// The job of the current call is written under the lock and published by incrementing the generation.
+// A call waits for the workers still inside the previous job before publishing its own, a late worker
+// never claims the ranges of a job with the routine of another.
+typedef struct {
+    TerraMutex           lock;
+    TerraCondition       wake;        // Generation incremented
+    TerraCondition       idle;        // Last worker left the job
+    TerraParallelRoutine routine;
+    void*                args;
+    size_t               count;
+    size_t               ranges;
+    volatile int32_t     next;        // Next range to claim, past the last one once all are taken
+    volatile int32_t     busy;        // Taken by the call running on the pool
+    uint32_t             generation;
+    size_t               active;      // Workers inside the current job
+    size_t               workers;     // Started, the calling thread excluded
+} TerraParallelPool;
+
+static TerraParallelPool terra_parallel_pool = { .lock = TERRA_MUTEX_INIT, .wake = TERRA_CONDITION_INIT, .idle = TERRA_CONDITION_INIT };
+
+// Set while the thread runs ranges, its nested calls run inline
+static TERRA_THREAD_LOCAL bool terra_parallel_inside;
+// Set by terra_parallel_serial(), every call from the thread runs inline
+static TERRA_THREAD_LOCAL bool terra_parallel_inline;
+
+static size_t terra_parallel_threads() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo ( &info );
+    return ( size_t ) info.dwNumberOfProcessors;
+#else
+    long count = sysconf ( _SC_NPROCESSORS_ONLN );
+    return count > 0 ? ( size_t ) count : 1;
+#endif
+}
+
+int32_t terra_atomic_exchange ( volatile int32_t* p, int32_t value ) {
+#ifdef _WIN32
+    return ( int32_t ) InterlockedExchange ( ( volatile LONG* ) p, ( LONG ) value );
+#else
+    return __atomic_exchange_n ( p, value, __ATOMIC_SEQ_CST );
+#endif
+}
+
+int32_t terra_atomic_fetch_add ( volatile int32_t* p, int32_t value ) {
+#ifdef _WIN32
+    return ( int32_t ) InterlockedExchangeAdd ( ( volatile LONG* ) p, ( LONG ) value );
+#else
+    return __atomic_fetch_add ( p, value, __ATOMIC_SEQ_CST );
+#endif
+}
+
+int32_t terra_atomic_fetch_or ( volatile int32_t* p, int32_t value ) {
+#ifdef _WIN32
+    return ( int32_t ) InterlockedOr ( ( volatile LONG* ) p, ( LONG ) value );
+#else
+    return __atomic_fetch_or ( p, value, __ATOMIC_SEQ_CST );
+#endif
+}
+
+int32_t terra_atomic_fetch_and ( volatile int32_t* p, int32_t value ) {
+#ifdef _WIN32
+    return ( int32_t ) InterlockedAnd ( ( volatile LONG* ) p, ( LONG ) value );
+#else
+    return __atomic_fetch_and ( p, value, __ATOMIC_SEQ_CST );
+#endif
+}
+
+static void terra_parallel_run ( TerraParallelRoutine routine, void* args, size_t count, size_t ranges ) {
+    terra_parallel_inside = true;
+
+    for ( ;; ) {
+        size_t r = ( size_t ) terra_atomic_fetch_add ( &terra_parallel_pool.next, 1 );
+
+        if ( r >= ranges ) {
+            break;
+        }
+
+        routine ( args, count * r / ranges, count * ( r + 1 ) / ranges );
+    }
+
+    terra_parallel_inside = false;
+}
+
+static void terra_parallel_worker() {
+    TerraParallelPool* pool = &terra_parallel_pool;
+    terra_mutex_lock ( &pool->lock );
+    uint32_t generation = pool->generation;
+
+    for ( ;; ) {
+        while ( pool->generation == generation ) {
+            terra_condition_wait ( &pool->wake, &pool->lock );
+        }
+
+        generation = pool->generation;
+        TerraParallelRoutine routine = pool->routine;
+        void* args = pool->args;
+        size_t count = pool->count;
+        size_t ranges = pool->ranges;
+        ++pool->active;
+        terra_mutex_unlock ( &pool->lock );
+        terra_parallel_run ( routine, args, count, ranges );
+        terra_mutex_lock ( &pool->lock );
+
+        if ( --pool->active == 0 ) {
+            terra_condition_broadcast ( &pool->idle );
+        }
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI terra_parallel_worker_entry ( LPVOID args ) {
+    ( void ) args;
+    terra_parallel_worker();
+    return 0;
+}
+#else
+static void* terra_parallel_worker_entry ( void* args ) {
+    ( void ) args;
+    terra_parallel_worker();
+    return NULL;
+}
+#endif
+
+// Under the lock. Workers live as long as the process, the pool stays smaller if one fails to start.
+static void terra_parallel_start ( size_t workers ) {
+    TerraParallelPool* pool = &terra_parallel_pool;
+
+    while ( pool->workers < workers ) {
+#ifdef _WIN32
+        HANDLE handle = CreateThread ( NULL, 0, terra_parallel_worker_entry, NULL, 0, NULL );
+
+        if ( handle == NULL ) {
+            break;
+        }
+
+        CloseHandle ( handle );
+#else
+        pthread_t handle;
+
+        if ( pthread_create ( &handle, NULL, terra_parallel_worker_entry, NULL ) != 0 ) {
+            break;
+        }
+
+        pthread_detach ( handle );
+#endif
+        ++pool->workers;
+    }
+}
+
+void terra_parallel_for ( size_t count, size_t grain, TerraParallelRoutine routine, void* args ) {
+    TerraParallelPool* pool = &terra_parallel_pool;
+    grain = grain > 0 ? grain : 1;
+    size_t threads = terra_parallel_threads();
+    threads = threads < TERRA_PARALLEL_MAX_THREADS ? threads : TERRA_PARALLEL_MAX_THREADS;
+    size_t ranges = threads < ( count + grain - 1 ) / grain ? threads : ( count + grain - 1 ) / grain;
+
+    if ( ranges <= 1 || terra_parallel_inside || terra_parallel_inline || terra_atomic_exchange ( &pool->busy, 1 ) != 0 ) {
+        routine ( args, 0, count );
+        return;
+    }
+
+    terra_mutex_lock ( &pool->lock );
+    terra_parallel_start ( threads - 1 );
+
+    while ( pool->active > 0 ) {
+        terra_condition_wait ( &pool->idle, &pool->lock );
+    }
+
+    pool->routine = routine;
+    pool->args = args;
+    pool->count = count;
+    pool->ranges = ranges;
+    pool->next = 0;
+    ++pool->generation;
+    terra_condition_broadcast ( &pool->wake );
+    terra_mutex_unlock ( &pool->lock );
+
+    terra_parallel_run ( routine, args, count, ranges );
+
+    // Every range has been claimed, the ones taken by the workers are done once they all left
+    terra_mutex_lock ( &pool->lock );
+
+    while ( pool->active > 0 ) {
+        terra_condition_wait ( &pool->idle, &pool->lock );
+    }
+
+    terra_mutex_unlock ( &pool->lock );
+    terra_atomic_exchange ( &pool->busy, 0 );
+}
+
+void terra_parallel_serial ( bool serial ) {
+    terra_parallel_inline = serial;
+}
@@ -0,0 +1,35 @@
+#ifndef _TERRA_PARALLEL_H_
+#define _TERRA_PARALLEL_H_
+
+// Terra
+#include <Terra.h>
+
+// Most threads terra_parallel_for() runs on
+#ifndef TERRA_PARALLEL_MAX_THREADS
+#define TERRA_PARALLEL_MAX_THREADS 64
+#endif
+
+#ifdef _WIN32
+#define TERRA_THREAD_LOCAL __declspec ( thread )
+#else
+#define TERRA_THREAD_LOCAL __thread
+#endif
+
+typedef void ( *TerraParallelRoutine ) ( void* args, size_t begin, size_t end );
+
+//--------------------------------------------------------------------------------------------------
+// Terra Parallel Internal routines
+//--------------------------------------------------------------------------------------------------
+// Splits [0, count) in contiguous ranges of at least grain items, one per hardware thread, and returns once
+// they have all been processed. The ranges run on a pool of threads started by the first call, the calling
+// thread takes part. The pool runs one call at a time: nested calls, calls from other threads while the pool
+// is busy and calls whose count fits in a single range run inline on the calling thread.
+void terra_parallel_for ( size_t count, size_t grain, TerraParallelRoutine routine, void* args );
+
+// Returns the previous value, a full barrier
+int32_t terra_atomic_exchange ( volatile int32_t* p, int32_t value );
+int32_t terra_atomic_fetch_add ( volatile int32_t* p, int32_t value );
+int32_t terra_atomic_fetch_or  ( volatile int32_t* p, int32_t value );
+int32_t terra_atomic_fetch_and ( volatile int32_t* p, int32_t value );
+
+#endif // _TERRA_PARALLEL_H_
@@ -53,10 +53,23 @@ TerraFloat3 terra_bsdf_diffuse_eval ( const TerraShadingSurface* surface, const
     return terra_mulf3 ( &surface->attributes[TERRA_DIFFUSE_ALBEDO], 1. / terra_PI );
 }
 
+TerraFloat3 terra_bsdf_diffuse_sample_eval ( const TerraShadingSurface* surface, float e1, float e2, float e3, const TerraFloat3* wo, TerraFloat3* wi, float* pdf ) {
+    *wi = terra_bsdf_diffuse_sample ( surface, e1, e2, e3, wo );
+    *pdf = terra_bsdf_diffuse_pdf ( surface, wi, wo );
+    return terra_bsdf_diffuse_eval ( surface, wi, wo );
+}
+
+TerraFloat3 terra_bsdf_diffuse_eval_pdf ( const TerraShadingSurface* surface, const TerraFloat3* wi, const TerraFloat3* wo, float* pdf ) {
+    *pdf = terra_bsdf_diffuse_pdf ( surface, wi, wo );
+    return terra_bsdf_diffuse_eval ( surface, wi, wo );
+}
+
 void terra_bsdf_diffuse_init ( TerraBSDF* bsdf ) {
     bsdf->sample = terra_bsdf_diffuse_sample;
     bsdf->pdf = terra_bsdf_diffuse_pdf;
     bsdf->eval = terra_bsdf_diffuse_eval;
+    bsdf->sample_eval = terra_bsdf_diffuse_sample_eval;
+    bsdf->eval_pdf = terra_bsdf_diffuse_eval_pdf;
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -81,23 +94,30 @@ void terra_bsdf_phong_calculate_kd_ks ( const TerraShadingSurface* surface, floa
     }
 }
 
-TerraFloat3 terra_bsdf_phong_sample ( const TerraShadingSurface* surface, float e1, float e2, float e3, const TerraFloat3* wo ) {
-    float kd, ks;
-    terra_bsdf_phong_calculate_kd_ks ( surface, &kd, &ks );
-    TerraFloat3* sample_attrib = &surface->attributes[TERRA_PHONG_SAMPLE_PICK];
+// The terms shared by sample, pdf and eval
+typedef struct {
+    float       kd;
+    float       ks;
+    float       n;  // Specular exponent
+    TerraFloat3 wr; // wo reflected around the normal
+} TerraBSDFPhongLobes;
+
+static void terra_bsdf_phong_lobes ( const TerraShadingSurface* surface, const TerraFloat3* wo, TerraBSDFPhongLobes* lobes ) {
+    terra_bsdf_phong_calculate_kd_ks ( surface, &lobes->kd, &lobes->ks );
+    lobes->n = surface->attributes[TERRA_PHONG_SPECULAR_INTENSITY].x;
+    lobes->wr = terra_mulf3 ( &surface->normal, 2.f * terra_dotf3 ( wo, &surface->normal ) );
+    lobes->wr = terra_subf3 ( &lobes->wr, wo );
+}
 
-    if ( e3 < kd ) {
+static TerraFloat3 terra_bsdf_phong_lobes_sample ( const TerraShadingSurface* surface, const TerraBSDFPhongLobes* lobes, float e1, float e2, float e3, const TerraFloat3* wo ) {
+    if ( e3 < lobes->kd ) {
         // Diffuse hemisphere sample.
-        sample_attrib->x = 1.f;
         return terra_bsdf_diffuse_sample ( surface, e1, e2, e3, wo );
     } else {
         // Specular lobe sample.
-        sample_attrib->x = -1.f;
-        TerraFloat3 wr = terra_mulf3 ( &surface->normal, 2.f * terra_dotf3 ( wo, &surface->normal ) );
-        wr = terra_subf3 ( &wr, wo );
-        TerraFloat4x4 wr_transform = terra_f4x4_basis ( &wr );
+        TerraFloat4x4 wr_transform = terra_f4x4_basis ( &lobes->wr );
         float phi = 2 * terra_PI * e1;
-        float theta = acosf ( powf ( 1.f - e2, 1.f / ( surface->attributes[TERRA_PHONG_SPECULAR_INTENSITY].x + 1 ) ) );
+        float theta = acosf ( powf ( 1.f - e2, 1.f / ( lobes->n + 1 ) ) );
         float sin_theta = sinf ( theta );
         TerraFloat3 wi = terra_f3_set ( sin_theta * cosf ( phi ), cosf ( theta ), sin_theta * sinf ( phi ) );
         wi = terra_transformf3 ( &wr_transform, &wi );
@@ -105,44 +125,65 @@ TerraFloat3 terra_bsdf_phong_sample ( const TerraShadingSurface* surface, float
     }
 }
 
-float terra_bsdf_phong_pdf ( const TerraShadingSurface* surface, const TerraFloat3* wi, const TerraFloat3* wo ) {
-    TerraFloat3* sample_attrib = &surface->attributes[TERRA_PHONG_SAMPLE_PICK];
-    assert ( sample_attrib->x == 1.f || sample_attrib->x == -1.f );
-
-    if ( sample_attrib->x == 1.f ) {
-        return terra_bsdf_diffuse_pdf ( surface, wi, wo );
-    } else if ( sample_attrib->x == -1.f ) {
-        TerraFloat3 wr = terra_mulf3 ( &surface->normal, 2.f * terra_dotf3 ( wo, &surface->normal ) );
-        wr = terra_subf3 ( &wr, wo );
-        float cos_alpha = terra_dotf3 ( wi, &wr );
-        float n = surface->attributes[TERRA_PHONG_SPECULAR_INTENSITY].x;
-        return ( n + 1 ) / ( 2 * terra_PI ) * powf ( cos_alpha, n );
-    } else {
-        assert ( false );
-    }
+// Either lobe can generate any direction, the pdf is their mixture
+static float terra_bsdf_phong_lobes_pdf ( const TerraShadingSurface* surface, const TerraBSDFPhongLobes* lobes, const TerraFloat3* wi, const TerraFloat3* wo ) {
+    float diffuse_pdf = terra_bsdf_diffuse_pdf ( surface, wi, wo );
+    float cos_alpha = terra_maxf ( 0.f, terra_dotf3 ( wi, &lobes->wr ) );
+    float specular_pdf = ( lobes->n + 1 ) / ( 2 * terra_PI ) * powf ( cos_alpha, lobes->n );
+    return lobes->kd * diffuse_pdf + lobes->ks * specular_pdf;
 }
 
-TerraFloat3 terra_bsdf_phong_eval ( const TerraShadingSurface* surface, const TerraFloat3* wi, const TerraFloat3* wo ) {
-    float kd, ks;
-    terra_bsdf_phong_calculate_kd_ks ( surface, &kd, &ks );
-    float n = surface->attributes[TERRA_PHONG_SPECULAR_INTENSITY].x;
+static TerraFloat3 terra_bsdf_phong_lobes_eval ( const TerraShadingSurface* surface, const TerraBSDFPhongLobes* lobes, const TerraFloat3* wi ) {
+    float n = lobes->n;
     // Diffuse
-    TerraFloat3 diffuse_term = terra_mulf3 ( &surface->attributes[TERRA_PHONG_ALBEDO], kd * 1.f / terra_PI );
+    TerraFloat3 diffuse_term = terra_mulf3 ( &surface->attributes[TERRA_PHONG_ALBEDO], lobes->kd * 1.f / terra_PI );
     // Specular
-    TerraFloat3 reflection_dir = terra_mulf3 ( &surface->normal, 2.f * terra_dotf3 ( wo, &surface->normal ) );
-    reflection_dir = terra_subf3 ( &reflection_dir, wo );
-    float cos_alpha = terra_dotf3 ( wi, &reflection_dir );
+    float cos_alpha = terra_maxf ( 0.f, terra_dotf3 ( wi, &lobes->wr ) );
     float cos_n_alpha = powf ( cos_alpha, n );
-    TerraFloat3 specular_term = terra_mulf3 ( &surface->attributes[TERRA_PHONG_SPECULAR_COLOR], ks * cos_n_alpha * ( n + 2 ) / ( 2 * terra_PI ) );
+    TerraFloat3 specular_term = terra_mulf3 ( &surface->attributes[TERRA_PHONG_SPECULAR_COLOR], lobes->ks * cos_n_alpha * ( n + 2 ) / ( 2 * terra_PI ) );
     // Final
-    TerraFloat3 final_term = terra_addf3 ( &diffuse_term, &specular_term );
-    return final_term;
+    return terra_addf3 ( &diffuse_term, &specular_term );
+}
+
+TerraFloat3 terra_bsdf_phong_sample ( const TerraShadingSurface* surface, float e1, float e2, float e3, const TerraFloat3* wo ) {
+    TerraBSDFPhongLobes lobes;
+    terra_bsdf_phong_lobes ( surface, wo, &lobes );
+    return terra_bsdf_phong_lobes_sample ( surface, &lobes, e1, e2, e3, wo );
+}
+
+float terra_bsdf_phong_pdf ( const TerraShadingSurface* surface, const TerraFloat3* wi, const TerraFloat3* wo ) {
+    TerraBSDFPhongLobes lobes;
+    terra_bsdf_phong_lobes ( surface, wo, &lobes );
+    return terra_bsdf_phong_lobes_pdf ( surface, &lobes, wi, wo );
+}
+
+TerraFloat3 terra_bsdf_phong_eval ( const TerraShadingSurface* surface, const TerraFloat3* wi, const TerraFloat3* wo ) {
+    TerraBSDFPhongLobes lobes;
+    terra_bsdf_phong_lobes ( surface, wo, &lobes );
+    return terra_bsdf_phong_lobes_eval ( surface, &lobes, wi );
+}
+
+TerraFloat3 terra_bsdf_phong_sample_eval ( const TerraShadingSurface* surface, float e1, float e2, float e3, const TerraFloat3* wo, TerraFloat3* wi, float* pdf ) {
+    TerraBSDFPhongLobes lobes;
+    terra_bsdf_phong_lobes ( surface, wo, &lobes );
+    *wi = terra_bsdf_phong_lobes_sample ( surface, &lobes, e1, e2, e3, wo );
+    *pdf = terra_bsdf_phong_lobes_pdf ( surface, &lobes, wi, wo );
+    return terra_bsdf_phong_lobes_eval ( surface, &lobes, wi );
+}
+
+TerraFloat3 terra_bsdf_phong_eval_pdf ( const TerraShadingSurface* surface, const TerraFloat3* wi, const TerraFloat3* wo, float* pdf ) {
+    TerraBSDFPhongLobes lobes;
+    terra_bsdf_phong_lobes ( surface, wo, &lobes );
+    *pdf = terra_bsdf_phong_lobes_pdf ( surface, &lobes, wi, wo );
+    return terra_bsdf_phong_lobes_eval ( surface, &lobes, wi );
 }
 
 void terra_bsdf_phong_init ( TerraBSDF* bsdf ) {
     bsdf->sample = terra_bsdf_phong_sample;
     bsdf->pdf = terra_bsdf_phong_pdf;
     bsdf->eval = terra_bsdf_phong_eval;
+    bsdf->sample_eval = terra_bsdf_phong_sample_eval;
+    bsdf->eval_pdf = terra_bsdf_phong_eval_pdf;
 }
 
 //--------------------------------------------------------------------------------------------------
@@ -152,7 +193,7 @@ void terra_bsdf_phong_init ( TerraBSDF* bsdf ) {
 // https://schuttejoe.github.io/post/disneybsdf/
 
 TerraFloat3 terra_bsdf_disney_tint ( TerraFloat3 base_color ) {
-    TerraFloat3 luminance_coeffs = terra_f3_set ( 0.3, 0.6, 1.0 );
+    TerraFloat3 luminance_coeffs = terra_f3_set ( 0.3, 0.6, 0.1 );
     float luminance = terra_dotf3 ( &luminance_coeffs, &base_color );
 
     if ( luminance == 0 ) {
@@ -162,23 +203,6 @@ TerraFloat3 terra_bsdf_disney_tint ( TerraFloat3 base_color ) {
     return terra_mulf3 ( &base_color, 1.f / luminance );
 }
 
-TerraFloat3 terra_bsdf_disney_sheen ( const TerraShadingSurface* surface, const TerraFloat3* wi, const TerraFloat3* wo, const TerraFloat3* h ) {
-    float sheen = surface->attributes[TERRA_DISNEY_SHEEN].x;
-    float sheen_tint = surface->attributes[TERRA_DISNEY_SHEEN].y;
-    TerraFloat3 base_color = surface->attributes[TERRA_DISNEY_BASE_COLOR];
-
-    if ( sheen <= 0.f ) {
-        return terra_f3_zero;
-    }
-
-    float HdotL = terra_dotf3 ( h, wi );
-    TerraFloat3 tint = terra_bsdf_disney_tint ( base_color );
-    TerraFloat3 onef3 = terra_f3_one;
-    TerraFloat3 sheenf3 = terra_lerpf3 ( &onef3, &tint, sheen_tint );
-    sheenf3 = terra_mulf3 ( &sheenf3, sheen * terra_bsdf_schlick_weight ( HdotL ) );
-    return sheenf3;
-}
-
 float terra_bsdf_disney_GTR2_aniso ( float NdotH, float HdotX, float HdotY, float ax, float ay ) {
     float x = HdotX / ax;
     float y = HdotY / ay;
@@ -216,85 +240,280 @@ float terra_bsdf_disney_GTR2 ( float NdotH, float a ) {
 
 /*
     [ base_color.rgb ]
+    [ metalness | _ | _ ]
+    [ roughness | _ | _ ]
     [ specular | specular_tint | _ ]
     [ sheen | sheen_tint | _ ]
     [ clearcoat | clearcoat_gloss | _ ]
-    [ metalness | roughness | _ ]
     [ anisotropic | subsurface  | _ ]
 */
 
-TerraFloat3 terra_bsdf_disney_eval ( const TerraShadingSurface* surface, const TerraFloat3* wi, const TerraFloat3* wo ) {
-    float NdotL = terra_dotf3 ( &surface->normal, wi );
-    float NdotV = terra_dotf3 ( &surface->normal, wo );
+// The parameters read from the surface and the terms shared by sample, pdf and eval
+typedef struct {
+    TerraFloat3 base_color;
+    TerraFloat3 tint;
+    TerraFloat3 spec0;      // Specular reflectance at normal incidence
+    float       metalness;
+    float       roughness;
+    float       sheen;
+    float       sheen_tint;
+    float       clearcoat;
+    float       clearcoat_alpha;
+    float       subsurface;
+    float       ax;
+    float       ay;
+    // Frame, n is the shading normal
+    TerraFloat3 x;
+    TerraFloat3 y;
+    TerraFloat3 n;
+    // Lobe selection probabilities, proportional to the estimated albedo of each lobe as seen from wo
+    float       p_diffuse;
+    float       p_specular;
+    float       p_clearcoat;
+} TerraBSDFDisney;
+
+static void terra_bsdf_disney_params ( const TerraShadingSurface* surface, const TerraFloat3* wo, TerraBSDFDisney* p ) {
+    p->base_color = surface->attributes[TERRA_DISNEY_BASE_COLOR];
+    p->metalness = terra_clamp ( surface->attributes[TERRA_DISNEY_METALNESS].x, 0.f, 1.f );
+    p->roughness = terra_clamp ( surface->attributes[TERRA_DISNEY_ROUGHNESS].x, 0.f, 1.f );
+    float specular = surface->attributes[TERRA_DISNEY_SPECULAR].x;
+    float specular_tint = surface->attributes[TERRA_DISNEY_SPECULAR].y;
+    p->sheen = surface->attributes[TERRA_DISNEY_SHEEN].x;
+    p->sheen_tint = surface->attributes[TERRA_DISNEY_SHEEN].y;
+    p->clearcoat = surface->attributes[TERRA_DISNEY_CLEARCOAT].x;
+    p->clearcoat_alpha = terra_lerp ( 0.1f, 0.001f, surface->attributes[TERRA_DISNEY_CLEARCOAT].y );
+    p->subsurface = surface->attributes[TERRA_DISNEY_ANISOTROPIC].y;
+    float anisotropic = surface->attributes[TERRA_DISNEY_ANISOTROPIC].x;
+    // Tint
+    p->tint = terra_bsdf_disney_tint ( p->base_color );
+    // Spec0
+    TerraFloat3 onef3 = terra_f3_one;
+    p->spec0 = terra_lerpf3 ( &onef3, &p->tint, specular_tint );
+    p->spec0 = terra_mulf3 ( &p->spec0, specular * 0.08f );
+    p->spec0 = terra_lerpf3 ( &p->spec0, &p->base_color, p->metalness );
+    // Specular roughness
+    float aspect = sqrtf ( 1.f - anisotropic * 0.9f );
+    p->ax = terra_maxf ( 0.001f, p->roughness * p->roughness / aspect );
+    p->ay = terra_maxf ( 0.001f, p->roughness * p->roughness * aspect );
+    // Frame
+    p->x = terra_f4x4_get_tangent ( &surface->transform );
+    p->y = terra_f4x4_get_bitangent ( &surface->transform );
+    p->n = surface->normal;
+    // Lobe selection
+    TerraFloat3 lum_weights = terra_f3_set ( 0.2126f, 0.7152f, 0.0722f );
+    float FV = terra_bsdf_schlick_weight ( terra_dotf3 ( &p->n, wo ) );
+    TerraFloat3 spec_albedo = terra_lerpf3 ( &p->spec0, &onef3, FV );
+    float w_diffuse = ( 1 - p->metalness ) * terra_dotf3 ( &p->base_color, &lum_weights );
+    float w_specular = terra_dotf3 ( &spec_albedo, &lum_weights );
+    float w_clearcoat = 0.25f * p->clearcoat * terra_lerp ( 0.04f, 1.f, FV );
+    float w_sum = w_diffuse + w_specular + w_clearcoat;
+
+    if ( w_sum <= 0 ) {
+        w_diffuse = 1;
+        w_sum = 1;
+    }
+
+    p->p_diffuse = w_diffuse / w_sum;
+    p->p_specular = w_specular / w_sum;
+    p->p_clearcoat = w_clearcoat / w_sum;
+}
+
+// Smith masking of the anisotropic GGX distribution, v in the (x, y, n) frame
+static float terra_bsdf_disney_G1_aniso ( const TerraFloat3* v, float ax, float ay ) {
+    float a2_tan2 = ( v->x * v->x * ax * ax + v->y * v->y * ay * ay ) / ( v->z * v->z );
+    return 2.f / ( 1.f + sqrtf ( 1.f + a2_tan2 ) );
+}
+
+// Samples the distribution of the normals visible from v, in the (x, y, n) frame
+// http://jcgt.org/published/0007/04/01/
+static TerraFloat3 terra_bsdf_disney_sample_vndf ( const TerraFloat3* v, float ax, float ay, float e1, float e2 ) {
+    // Stretching the view to the hemisphere configuration
+    TerraFloat3 vh = terra_f3_set ( ax * v->x, ay * v->y, v->z );
+    vh = terra_normf3 ( &vh );
+    // Orthonormal basis around it
+    float lensq = vh.x * vh.x + vh.y * vh.y;
+    TerraFloat3 t1 = lensq > 0 ? terra_f3_set ( -vh.y / sqrtf ( lensq ), vh.x / sqrtf ( lensq ), 0.f ) : terra_f3_set ( 1.f, 0.f, 0.f );
+    TerraFloat3 t2 = terra_crossf3 ( &vh, &t1 );
+    // Sampling the projected area
+    float r = sqrtf ( e1 );
+    float phi = 2 * terra_PI * e2;
+    float p1 = r * cosf ( phi );
+    float p2 = r * sinf ( phi );
+    float s = 0.5f * ( 1.f + vh.z );
+    p2 = ( 1.f - s ) * sqrtf ( 1.f - p1 * p1 ) + s * p2;
+    float p3 = sqrtf ( terra_maxf ( 0.f, 1.f - p1 * p1 - p2 * p2 ) );
+    // Reprojecting onto the hemisphere and unstretching
+    TerraFloat3 nh = terra_f3_set ( p1 * t1.x + p2 * t2.x + p3 * vh.x,
+                                    p1 * t1.y + p2 * t2.y + p3 * vh.y,
+                                    p1 * t1.z + p2 * t2.z + p3 * vh.z );
+    TerraFloat3 h = terra_f3_set ( ax * nh.x, ay * nh.y, terra_maxf ( 0.f, nh.z ) );
+    return terra_normf3 ( &h );
+}
+
+static TerraFloat3 terra_bsdf_disney_to_local ( const TerraBSDFDisney* p, const TerraFloat3* w ) {
+    return terra_f3_set ( terra_dotf3 ( w, &p->x ), terra_dotf3 ( w, &p->y ), terra_dotf3 ( w, &p->n ) );
+}
+
+static TerraFloat3 terra_bsdf_disney_to_world ( const TerraBSDFDisney* p, const TerraFloat3* w ) {
+    TerraFloat3 x = terra_mulf3 ( &p->x, w->x );
+    TerraFloat3 y = terra_mulf3 ( &p->y, w->y );
+    TerraFloat3 n = terra_mulf3 ( &p->n, w->z );
+    TerraFloat3 r = terra_addf3 ( &x, &y );
+    return terra_addf3 ( &r, &n );
+}
 
-    if ( NdotL < 0 || NdotV < 0 ) {
+static TerraFloat3 terra_bsdf_disney_reflect ( const TerraFloat3* wo, const TerraFloat3* h ) {
+    TerraFloat3 r = terra_mulf3 ( h, 2.f * terra_dotf3 ( wo, h ) );
+    return terra_subf3 ( &r, wo );
+}
+
+static TerraFloat3 terra_bsdf_disney_params_sample ( const TerraShadingSurface* surface, const TerraBSDFDisney* p, float e1, float e2, float e3, const TerraFloat3* wo ) {
+    if ( e3 < p->p_diffuse ) {
+        return terra_bsdf_diffuse_sample ( surface, e1, e2, e3, wo );
+    }
+
+    TerraFloat3 h;
+
+    if ( e3 < p->p_diffuse + p->p_specular ) {
+        TerraFloat3 v = terra_bsdf_disney_to_local ( p, wo );
+
+        if ( v.z <= 0 ) {
+            return terra_negf3 ( &p->n );
+        }
+
+        h = terra_bsdf_disney_sample_vndf ( &v, p->ax, p->ay, e1, e2 );
+    } else {
+        // GTR1 clearcoat, sampling D(h) * cos(theta_h)
+        float a2 = p->clearcoat_alpha * p->clearcoat_alpha;
+        float cos_theta = sqrtf ( terra_maxf ( 0.f, ( 1.f - powf ( a2, 1.f - e1 ) ) / ( 1.f - a2 ) ) );
+        float sin_theta = sqrtf ( terra_maxf ( 0.f, 1.f - cos_theta * cos_theta ) );
+        float phi = 2 * terra_PI * e2;
+        h = terra_f3_set ( sin_theta * cosf ( phi ), sin_theta * sinf ( phi ), cos_theta );
+    }
+
+    h = terra_bsdf_disney_to_world ( p, &h );
+    return terra_bsdf_disney_reflect ( wo, &h );
+}
+
+static float terra_bsdf_disney_params_pdf ( const TerraBSDFDisney* p, const TerraFloat3* wi, const TerraFloat3* wo ) {
+    float NdotL = terra_dotf3 ( &p->n, wi );
+    float NdotV = terra_dotf3 ( &p->n, wo );
+
+    if ( NdotL <= 0 || NdotV <= 0 ) {
+        return 0.f;
+    }
+
+    TerraFloat3 H = terra_addf3 ( wi, wo );
+    H = terra_normf3 ( &H );
+    float NdotH = terra_dotf3 ( &p->n, &H );
+    float VdotH = terra_dotf3 ( wo, &H );
+    // Diffuse
+    float pdf = p->p_diffuse * NdotL / terra_PI;
+
+    // Specular, visible normals
+    if ( p->p_specular > 0 ) {
+        TerraFloat3 v = terra_bsdf_disney_to_local ( p, wo );
+        float Ds = terra_bsdf_disney_GTR2_aniso ( NdotH, terra_dotf3 ( &H, &p->x ), terra_dotf3 ( &H, &p->y ), p->ax, p->ay );
+        pdf += p->p_specular * terra_bsdf_disney_G1_aniso ( &v, p->ax, p->ay ) * Ds / ( 4 * NdotV );
+    }
+
+    // Clearcoat
+    if ( p->p_clearcoat > 0 ) {
+        float Dr = terra_bsdf_disney_GTR1 ( NdotH, p->clearcoat_alpha );
+        pdf += p->p_clearcoat * Dr * NdotH / ( 4 * VdotH );
+    }
+
+    return pdf;
+}
+
+static TerraFloat3 terra_bsdf_disney_params_eval ( const TerraBSDFDisney* p, const TerraFloat3* wi, const TerraFloat3* wo ) {
+    float NdotL = terra_dotf3 ( &p->n, wi );
+    float NdotV = terra_dotf3 ( &p->n, wo );
+
+    if ( NdotL <= 0 || NdotV <= 0 ) {
         return terra_f3_zero;
     }
 
     // Half vector
     TerraFloat3 H = terra_addf3 ( wi, wo );
     H = terra_normf3 ( &H );
-    float NdotH = terra_dotf3 ( &surface->normal, &H );
+    float NdotH = terra_dotf3 ( &p->n, &H );
     float LdotH = terra_dotf3 ( wi, &H );
-    // Base Color Luminance
-    TerraFloat3 base_color = surface->attributes[TERRA_DISNEY_BASE_COLOR];
-    TerraFloat3 lum_weights = terra_f3_set ( 0.3, 0.6, 1 );
-    float base_color_lum = terra_dotf3 ( &base_color, &lum_weights );
-    // Tint
-    TerraFloat3 tint = base_color_lum > 0 ? terra_mulf3 ( &base_color, 1.f / base_color_lum ) : terra_f3_one;
-    // Spec0
-    float specular = 0; // =
-    float specular_tint = 0; // =
-    float metalness = 0; // =
-    TerraFloat3 spec0 = terra_lerpf3 ( &terra_f3_one, &tint, specular_tint );
-    spec0 = terra_mulf3 ( &spec0, specular * 0.8f );
-    spec0 = terra_lerpf3 ( &spec0, &base_color, metalness );
-    // Sheen
-    float sheen_tint = 0; // =
-    TerraFloat3 sheen_c = terra_lerpf3 ( &terra_f3_one, &tint, sheen_tint );
+    TerraFloat3 onef3 = terra_f3_one;
     // Diffuse Fresnel
-    float roughness = 0; // =
     float FL = terra_bsdf_schlick_weight ( NdotL );
     float FV = terra_bsdf_schlick_weight ( NdotV );
-    float Fd90 = 0.5f + 2 * LdotH * LdotH * roughness;
+    float Fd90 = 0.5f + 2 * LdotH * LdotH * p->roughness;
     float Fd = terra_lerp ( 1.f, Fd90, FL ) * terra_lerp ( 1.f, Fd90, FV );
     // Subsurface Scattering
-    float Fss90 = LdotH * LdotH * roughness;
+    float Fss90 = LdotH * LdotH * p->roughness;
     float Fss = terra_lerp ( 1.f, Fss90, FL ) * terra_lerp ( 1.f, Fss90, FV );
-    float ss = 1.25f * ( Fss * ( 1.f / ( NdotL * NdotV ) - 0.5f ) + 0.5f );
+    float ss = 1.25f * ( Fss * ( 1.f / ( NdotL + NdotV ) - 0.5f ) + 0.5f );
     // Specular
-    float anisotropic = 0; // =
-    float aspect = sqrtf ( 1.f - anisotropic * 0.9f );
-    float ax = terra_maxf ( 0.001f, roughness * roughness / aspect );
-    float ay = terra_maxf ( 0.001f, roughness * roughness * aspect );
-    TerraFloat3 X = terra_f4x4_get_tangent ( &surface->transform );
-    TerraFloat3 Y = terra_f4x4_get_bitangent ( &surface->transform );
-    float Ds = terra_bsdf_disney_GTR2_aniso ( NdotH, terra_dotf3 ( &H, &X ), terra_dotf3 ( &H, &Y ), ax, ay );
+    float Ds = terra_bsdf_disney_GTR2_aniso ( NdotH, terra_dotf3 ( &H, &p->x ), terra_dotf3 ( &H, &p->y ), p->ax, p->ay );
     float FH = terra_bsdf_schlick_weight ( LdotH );
-    TerraFloat3 Fs = terra_lerpf3 ( &spec0, &terra_f3_one, FH );
-    float Gs = terra_bsdf_disney_smithG_GGX_aniso ( NdotL, terra_dotf3 ( wi, &X ), terra_dotf3 ( wi, &Y ), ax, ay );
-    Gs *= terra_bsdf_disney_smithG_GGX_aniso ( NdotV, terra_dotf3 ( wo, &X ), terra_dotf3 ( wo, &Y ), ax, ay );
+    TerraFloat3 Fs = terra_lerpf3 ( &p->spec0, &onef3, FH );
+    float Gs = terra_bsdf_disney_smithG_GGX_aniso ( NdotL, terra_dotf3 ( wi, &p->x ), terra_dotf3 ( wi, &p->y ), p->ax, p->ay );
+    Gs *= terra_bsdf_disney_smithG_GGX_aniso ( NdotV, terra_dotf3 ( wo, &p->x ), terra_dotf3 ( wo, &p->y ), p->ax, p->ay );
     // Sheen
-    float sheen_p = 0; // =
-    TerraFloat3 sheen = terra_mulf3 ( &sheen_c, FH * sheen_p );
+    TerraFloat3 sheen = terra_lerpf3 ( &onef3, &p->tint, p->sheen_tint );
+    sheen = terra_mulf3 ( &sheen, FH * p->sheen );
     // Clearcoat
-    float clearcoat_gloss = 0; // =
-    float Dr = terra_bsdf_disney_GTR1 ( NdotH, terra_lerp ( 0.1f, 0.001f, clearcoat_gloss ) );
+    float Dr = terra_bsdf_disney_GTR1 ( NdotH, p->clearcoat_alpha );
     float Fr = terra_lerp ( 0.04f, 1.f, FH );
     float Gr = terra_bsdf_disney_smithG_GGX ( NdotL, 0.25f ) * terra_bsdf_disney_smithG_GGX ( NdotV, 0.25f );
     // Result
-    float subsurface = 0; // =
-    float clearcoat = 0; // =
-    TerraFloat3 result_a = terra_mulf3 ( &base_color, 1.f / terra_PI * terra_lerp ( Fd, ss, subsurface ) );
+    TerraFloat3 result_a = terra_mulf3 ( &p->base_color, 1.f / terra_PI * terra_lerp ( Fd, ss, p->subsurface ) );
     result_a = terra_addf3 ( &result_a, &sheen );
-    result_a = terra_mulf3 ( &result_a, 1 - metalness );
+    result_a = terra_mulf3 ( &result_a, 1 - p->metalness );
     TerraFloat3 result_b = terra_mulf3 ( &Fs, Gs * Ds );
-    TerraFloat3 result_c = terra_f3_set1 ( 0.25f * clearcoat * Gr * Fr * Dr );
+    TerraFloat3 result_c = terra_f3_set1 ( 0.25f * p->clearcoat * Gr * Fr * Dr );
     TerraFloat3 result = terra_addf3 ( &result_b, &result_c );
     result = terra_addf3 ( &result, &result_a );
     return result;
 }
 
+TerraFloat3 terra_bsdf_disney_sample ( const TerraShadingSurface* surface, float e1, float e2, float e3, const TerraFloat3* wo ) {
+    TerraBSDFDisney p;
+    terra_bsdf_disney_params ( surface, wo, &p );
+    return terra_bsdf_disney_params_sample ( surface, &p, e1, e2, e3, wo );
+}
+
+float terra_bsdf_disney_pdf ( const TerraShadingSurface* surface, const TerraFloat3* wi, const TerraFloat3* wo ) {
+    TerraBSDFDisney p;
+    terra_bsdf_disney_params ( surface, wo, &p );
+    return terra_bsdf_disney_params_pdf ( &p, wi, wo );
+}
+
+TerraFloat3 terra_bsdf_disney_eval ( const TerraShadingSurface* surface, const TerraFloat3* wi, const TerraFloat3* wo ) {
+    TerraBSDFDisney p;
+    terra_bsdf_disney_params ( surface, wo, &p );
+    return terra_bsdf_disney_params_eval ( &p, wi, wo );
+}
+
+TerraFloat3 terra_bsdf_disney_sample_eval ( const TerraShadingSurface* surface, float e1, float e2, float e3, const TerraFloat3* wo, TerraFloat3* wi, float* pdf ) {
+    TerraBSDFDisney p;
+    terra_bsdf_disney_params ( surface, wo, &p );
+    *wi = terra_bsdf_disney_params_sample ( surface, &p, e1, e2, e3, wo );
+    *pdf = terra_bsdf_disney_params_pdf ( &p, wi, wo );
+    return terra_bsdf_disney_params_eval ( &p, wi, wo );
+}
+
+TerraFloat3 terra_bsdf_disney_eval_pdf ( const TerraShadingSurface* surface, const TerraFloat3* wi, const TerraFloat3* wo, float* pdf ) {
+    TerraBSDFDisney p;
+    terra_bsdf_disney_params ( surface, wo, &p );
+    *pdf = terra_bsdf_disney_params_pdf ( &p, wi, wo );
+    return terra_bsdf_disney_params_eval ( &p, wi, wo );
+}
+
+void terra_bsdf_disney_init ( TerraBSDF* bsdf ) {
+    bsdf->sample = terra_bsdf_disney_sample;
+    bsdf->pdf = terra_bsdf_disney_pdf;
+    bsdf->eval = terra_bsdf_disney_eval;
+    bsdf->sample_eval = terra_bsdf_disney_sample_eval;
+    bsdf->eval_pdf = terra_bsdf_disney_eval_pdf;
+}
+
 #if 0
 //--------------------------------------------------------------------------------------------------
 // Preset: Rough-dielectric = Diffuse + Microfacet GGX specular
@@ -28,6 +28,36 @@ typedef struct {
     float*       triangle_area;
 } TerraLight;
 
+// Material attributes are compiled on scene commit into a flat program. Constant attributes are
+// copied in bulk, only the textured ones run an op, dispatched on the opcode rather than through
+// the attribute eval pointer. Client defined evals keep going through the pointer.
+typedef enum {
+    kTerraAttributeOpTexturePoint,
+    kTerraAttributeOpTextureBilinear,
+    kTerraAttributeOpTextureTrilinear,
+    kTerraAttributeOpTextureAnisotropic,
+    kTerraAttributeOpEval
+} TerraAttributeOpcode;
+
+#define TERRA_ATTRIBUTE_OP_EMISSIVE 0xff    // dst of the op writing the emissive
+
+typedef struct {
+    uint8_t            opcode;  // TerraAttributeOpcode
+    uint8_t            dst;     // Index of the attribute written
+    void*              state;
+    TerraAttributeEval eval;    // kTerraAttributeOpEval only
+} TerraAttributeOp;
+
+typedef struct {
+    TerraFloat3      constants[TERRA_MATERIAL_MAX_ATTRIBUTES];  // Value of the constant attributes, zero for the textured ones
+    TerraFloat3      emissive;                                  // Emissive if constant
+    TerraAttributeOp ops[TERRA_MATERIAL_MAX_ATTRIBUTES + 1];    // Ops of the textured attributes, emissive first
+    uint8_t          attributes_count;
+    uint8_t          ops_count;
+    uint8_t          emissive_ops;                              // 1 if the emissive is textured
+    bool             footprint;                                 // Some op filters over the hit footprint
+} TerraMaterialProgram;
+
 // Uniform distribution sampling
 
 // Adapted using the author's implementation as in
@@ -66,7 +96,8 @@ typedef struct TerraSampler2D {
 //--------------------------------------------------------------------------------------------------
 
 // Internal api
-void  terra_sampler_random_init ( TerraSamplerRandom* sampler );
+// Sequences with different streams are independent even if the seeds are the same
+void  terra_sampler_random_init ( TerraSamplerRandom* sampler, uint64_t seed, uint64_t stream );
 void  terra_sampler_random_destroy ( TerraSamplerRandom* sampler );
 float terra_sampler_random_next ( void* sampler );
 
@@ -81,35 +112,117 @@ void  terra_sampler_halton_next_pair ( void* sampler, float* e1, float* e2 );
 //--------------------------------------------------------------------------------------------------
 // Discrete arbitrary probability distribution sampling
 //--------------------------------------------------------------------------------------------------
-// TODO use Vose's algorithm for O(1) time generation performance.
+// Both methods sample a continuous value in [0, 1) by picking a bucket and placing the sample inside it.
+// The cdf keeps the samples stratification (monotonic mapping), the alias table is faster but scrambles it.
 // http://www.keithschwarz.com/darts-dice-coins/
+typedef enum {
+    kTerraDistributionCdf,      // Binary search over the cdf, O(log n)
+    kTerraDistributionAlias     // Vose's alias method, O(1)
+} TerraDistributionMethod;
+
 typedef struct {
-    float* f;           // The function evaluated on its domain
-    size_t n;           // The domain size (0->n-1)
-    float* cdf;         // The function's cdf
-    float  integral;     // The function's integral's value
+    float*    f;            // The function evaluated on its domain
+    size_t    n;            // The domain size (0->n-1)
+    float*    cdf;          // The function's cdf (kTerraDistributionCdf only)
+    float*    alias_prob;   // Probability of keeping a bucket rather than jumping to its alias (kTerraDistributionAlias only)
+    uint32_t* alias;        // Alias of each bucket (kTerraDistributionAlias only)
+    float     integral;     // The function's integral's value
+    TerraDistributionMethod method;
 } TerraDistribution1D;
 
+// The conditionals are batch allocated in a single block. For large distributions the rows can be
+// initialized in parallel: alloc, init_rows over disjoint ranges from each thread, then finalize to
+// build the marginal distribution from the rows integrals.
 typedef struct {
     TerraDistribution1D  marginal;      // Probability distribution of picking each row
     TerraDistribution1D* conditionals;  // Probability distribution of picking a value, given each row
+    void*                rows_data;     // Block backing the conditionals arrays
 } TerraDistributon2D;
 
-void        terra_distribution_1d_init   ( TerraDistribution1D* dist, const float* f, size_t size );
-float       terra_distribution_1d_sample ( TerraDistribution1D* dist, float e, float* pdf, size_t* idx );
+// pdf is the discrete probability of the picked bucket, multiply by n for the density over [0, 1)
+void        terra_distribution_1d_init         ( TerraDistribution1D* dist, const float* f, size_t size );
+void        terra_distribution_1d_init_method  ( TerraDistribution1D* dist, const float* f, size_t size, TerraDistributionMethod method );
+float       terra_distribution_1d_sample       ( const TerraDistribution1D* dist, float e, float* pdf, size_t* idx );
+float       terra_distribution_1d_pdf          ( const TerraDistribution1D* dist, size_t idx );
+void        terra_distribution_1d_destroy      ( TerraDistribution1D* dist );
 
-void        terra_distribution_2d_init   ( TerraDistributon2D* dist, const float* f, size_t width, size_t height );
-TerraFloat2 terra_distribution_2d_sample ( TerraDistributon2D* dist, float e1, float e2, float* pdf );
+// Samples are (u, v), u spanning the width and v the height. pdf is the discrete probability of the picked texel.
+void        terra_distribution_2d_init         ( TerraDistributon2D* dist, const float* f, size_t width, size_t height, TerraDistributionMethod method );
+void        terra_distribution_2d_alloc        ( TerraDistributon2D* dist, size_t width, size_t height, TerraDistributionMethod method );
+void        terra_distribution_2d_init_rows    ( TerraDistributon2D* dist, const float* f, size_t row_begin, size_t row_end );
+void        terra_distribution_2d_finalize     ( TerraDistributon2D* dist );
+TerraFloat2 terra_distribution_2d_sample       ( const TerraDistributon2D* dist, float e1, float e2, float* pdf );
+float       terra_distribution_2d_pdf          ( const TerraDistributon2D* dist, float u, float v );
+void        terra_distribution_2d_destroy      ( TerraDistributon2D* dist );
 
 //--------------------------------------------------------------------------------------------------
 // Geometry
 //--------------------------------------------------------------------------------------------------
+// The rays carry a cone, its width at distance t is width + spread * t.
+// https://www.realtimerendering.com/raytracinggems/ (Texture Level of Detail Strategies for Real-Time Ray Tracing)
 typedef struct TerraRay {
     TerraFloat3 origin;
     TerraFloat3 direction;
     TerraFloat3 inv_direction;
+    float       cone_width;
+    float       cone_spread;
 } TerraRay;
 
+// Tile holding a texel in an image tiles_x tiles wide, see TERRA_TEXTURE_TILE_LOG2
+#define TERRA_TEXTURE_TILE_SIZE ( 1 << TERRA_TEXTURE_TILE_LOG2 )
+#define TERRA_TEXTURE_TILE_MASK ( TERRA_TEXTURE_TILE_SIZE - 1 )
+
+static inline size_t terra_texture_tile_index ( size_t x, size_t y, size_t tiles_x ) {
+    return ( y >> TERRA_TEXTURE_TILE_LOG2 ) * tiles_x + ( x >> TERRA_TEXTURE_TILE_LOG2 );
+}
+
+// Compact accumulation formats, see TerraAccumulationFormat
+typedef struct {
+    uint16_t mean[3];
+    uint16_t std_lum;
+    uint16_t samples;
+} TerraResultHalf;
+
+typedef struct {
+    uint32_t mean;
+    uint16_t std_lum;
+    uint16_t samples;
+} TerraResultRGB9E5;
+
+static inline size_t terra_framebuffer_result_bytes ( uint8_t format ) {
+    switch ( format ) {
+        case kTerraAccumulationFormatFloat:
+            return sizeof ( TerraRawIntegrationResult );
+
+        case kTerraAccumulationFormatHalf:
+            return sizeof ( TerraResultHalf );
+
+        case kTerraAccumulationFormatRGB9E5:
+            return sizeof ( TerraResultRGB9E5 );
+
+        default:
+            return 0;
+    }
+}
+
+// The framebuffer flags are kept per TERRA_RENDER_TILE_SIZE tile
+static inline size_t terra_framebuffer_tiles_x ( const TerraFramebuffer* framebuffer ) {
+    return ( framebuffer->width + TERRA_RENDER_TILE_SIZE - 1 ) / TERRA_RENDER_TILE_SIZE;
+}
+
+static inline size_t terra_framebuffer_tiles ( const TerraFramebuffer* framebuffer ) {
+    return terra_framebuffer_tiles_x ( framebuffer ) * ( ( framebuffer->height + TERRA_RENDER_TILE_SIZE - 1 ) / TERRA_RENDER_TILE_SIZE );
+}
+
+// terra_framebuffer_resolve() on the calling thread only, for callers already running one per thread
+void terra_framebuffer_resolve_serial ( TerraFramebuffer* framebuffer, const TerraTonemappingOptions* options );
+
+// Footprint of a ray cone on a surface, the axes of the ellipse in texture coordinates
+typedef struct {
+    TerraFloat2 major;
+    TerraFloat2 minor;
+} TerraTextureFootprint;
+
 // Ray state information
 typedef struct TerraRayState {
     // ray/triangle intersection transformations (depends on algorithm, see TerraGeometry.c)
@@ -134,6 +247,14 @@ typedef struct {
     uint32_t    triangle_idx : 24; // Reference index to the triangle
 } TerraRayIntersectionResult;
 
+// Compact record of the closest hit of a traversal, the shading surface is derived from it on demand
+typedef struct {
+    TerraPrimitiveRef primitive;
+    float             v;    // Barycentric weights of the triangle b and c vertices (a is 1 - v - w)
+    float             w;
+    float             t;    // Ray depth
+} TerraHit;
+
 // Ray/Primitive intersection routine arguments
 typedef struct {
     TerraRay*      ray;
@@ -157,4 +278,6 @@ bool  terra_ray_aabb_intersection ( const TerraRay* ray, const TerraAABB* aabb,
 void  terra_aabb_fit_triangle     ( TerraAABB* aabb, const TerraTriangle* triangle );
 float terra_triangle_area         ( const TerraTriangle* triangle );
 
+float terra_luminance ( const TerraFloat3* color );
+
 #endif
\ No newline at end of file
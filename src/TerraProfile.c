@@ -1,3 +1,8 @@
+// clock_gettime
+#if !defined ( _WIN32 ) && !defined ( _POSIX_C_SOURCE )
+#define _POSIX_C_SOURCE 199309L
+#endif
+
 // TerraProfile
 #include "TerraProfile.h"
 
@@ -391,6 +396,11 @@ void terra_clock_init() {
 // something < 1 which will just return 0. Note that this can also be done by changing
 // the signature of `terra_clock_to_*` to take a real number rather than an integer.
 TerraClockTime terra_clock() {
+    // The clock is also used outside of profiling sessions (e.g. render deadlines)
+    if ( terra_clock_frequency.QuadPart == 0 ) {
+        terra_clock_init();
+    }
+
     LARGE_INTEGER ts;
     QueryPerformanceCounter ( &ts );
     return ( TerraClockTime ) ts.QuadPart * 1000 * 1000;
@@ -410,12 +420,20 @@ double terra_clock_to_us ( TerraClockTime delta_time ) {
 void terra_clock_init() {
 }
 
+// Monotonic wall clock in nanoseconds. clock() measures process CPU time, which
+// grows N times faster than wall time when N threads are rendering.
 TerraClockTime terra_clock() {
-    return clock();
+    struct timespec ts;
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+    return ( TerraClockTime ) ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
 }
 
-double terra_clock_elapsed_ms ( TerraClockTime delta_time ) {
-    return ( double ) ( delta_time / CLOCKS_PER_SEC * 1000 );
+double terra_clock_to_ms ( TerraClockTime delta_time ) {
+    return ( double ) delta_time / ( 1000 * 1000 );
+}
+
+double terra_clock_to_us ( TerraClockTime delta_time ) {
+    return ( double ) delta_time / 1000;
 }
 
 #endif
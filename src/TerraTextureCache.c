@@ -0,0 +1,512 @@
+// pread
+#if !defined ( _WIN32 ) && !defined ( _POSIX_C_SOURCE )
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+// TerraTextureCache
+#include "TerraTextureCache.h"
+
+// Terra
+#include "TerraTextureFormat.h"
+
+// libc
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#include <io.h>
+typedef SRWLOCK TerraTextureCacheLock;
+#define terra_cache_lock_init(l)        InitializeSRWLock ( l )
+#define terra_cache_lock_destroy(l)
+#define terra_cache_lock(l)             AcquireSRWLockExclusive ( l )
+#define terra_cache_unlock(l)           ReleaseSRWLockExclusive ( l )
+// Volatile reads have acquire semantics on MSVC
+#define terra_atomic_load(p)            ( *( p ) )
+#define terra_atomic_store(p, v)        InterlockedExchange ( ( volatile LONG* ) ( p ), ( v ) )
+#define terra_atomic_add(p, v)          ( InterlockedExchangeAdd ( ( volatile LONG* ) ( p ), ( v ) ) + ( v ) )
+#define terra_atomic_cas(p, e, d)       ( InterlockedCompareExchange ( ( volatile LONG* ) ( p ), ( d ), ( e ) ) == ( e ) )
+#define terra_cache_yield()             SwitchToThread()
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+typedef pthread_mutex_t TerraTextureCacheLock;
+#define terra_cache_lock_init(l)        pthread_mutex_init ( l, NULL )
+#define terra_cache_lock_destroy(l)     pthread_mutex_destroy ( l )
+#define terra_cache_lock(l)             pthread_mutex_lock ( l )
+#define terra_cache_unlock(l)           pthread_mutex_unlock ( l )
+#define terra_atomic_load(p)            __atomic_load_n ( p, __ATOMIC_ACQUIRE )
+#define terra_atomic_store(p, v)        __atomic_store_n ( p, v, __ATOMIC_RELEASE )
+#define terra_atomic_add(p, v)          __atomic_add_fetch ( p, v, __ATOMIC_SEQ_CST )
+#define terra_atomic_cas(p, e, d)       terra_atomic_cas_i32 ( p, e, d )
+#define terra_cache_yield()             sched_yield()
+
+static inline bool terra_atomic_cas_i32 ( volatile int32_t* p, int32_t expected, int32_t desired ) {
+    return __atomic_compare_exchange_n ( p, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+}
+#endif
+
+// Added to the pins of a slot being refilled, readers pinning it meanwhile see a negative count and retry
+#define TERRA_TEXTURE_CACHE_LOCKED ( -0x40000000 )
+
+// Fewer slots than this would thrash as soon as a few threads filter across page borders. Every pool gets
+// them, even past the budget.
+#ifndef TERRA_TEXTURE_CACHE_MIN_SLOTS
+#define TERRA_TEXTURE_CACHE_MIN_SLOTS 64
+#endif
+
+// One pool per page size, there is one for each format and number of components at most
+#define TERRA_TEXTURE_CACHE_MAX_POOLS ( kTerraTextureFormatCount * 3 )
+
+#define TERRA_TEXTURE_PAGED_MAGIC 0x47505254 // TRPG
+
+typedef struct {
+    uint32_t magic;
+    uint16_t width;
+    uint16_t height;
+    uint8_t  components;
+    uint8_t  depth;
+    uint8_t  format;
+    uint8_t  levels;
+    uint8_t  page_log2;
+    uint8_t  reserved[3];
+} TerraTexturePagedHeader;
+
+typedef struct TerraTexturePagedFile {
+    FILE*                   file;
+    TerraTexturePagedLevel* levels;
+    uint8_t                 levels_count;
+    uint8_t                 components;
+    uint8_t                 format;
+    bool                    linearize;
+    size_t                  page_bytes;
+} TerraTexturePagedFile;
+
+typedef struct {
+    volatile int32_t        pins;
+    volatile int32_t        referenced; // Clock bit, set on access
+    TerraTexturePagedLevel* owner;      // NULL if free
+    uint32_t                page;
+    uint8_t*                pixels;
+} TerraTextureCacheSlot;
+
+// Slots are allocated on first use, the pools share the budget of the cache
+typedef struct TerraTextureCachePool {
+    TerraTextureCacheSlot* slots;
+    size_t                 slots_count;
+    size_t                 slots_capacity;
+    size_t                 slot_bytes;
+    size_t                 hand;
+} TerraTextureCachePool;
+
+struct TerraTextureCache {
+    TerraTextureCachePool  pools[TERRA_TEXTURE_CACHE_MAX_POOLS];
+    size_t                 pools_count;
+    size_t                 budget;
+    size_t                 bytes;      // Of the slots allocated by all the pools
+    TerraTextureCacheLock  lock;
+};
+
+static size_t  terra_texture_paged_tiles ( size_t size );
+static TerraTextureCachePool* terra_texture_cache_pool ( TerraTextureCache* cache, size_t page_bytes );
+static bool    terra_texture_cache_read ( FILE* file, void* pixels, size_t bytes, uint64_t offset );
+static void    terra_texture_cache_load ( TerraTexturePagedLevel* level, uint32_t page );
+static int32_t terra_texture_cache_evict ( TerraTextureCache* cache, TerraTextureCachePool* pool );
+static void    terra_texture_cache_drop ( TerraTextureCache* cache, const TerraTexturePagedFile* file );
+static void    terra_texture_page_linearize ( const TerraTexturePagedFile* file, void* pixels );
+
+//--------------------------------------------------------------------------------------------------
+// @TerraTextureCache
+//--------------------------------------------------------------------------------------------------
+TerraTextureCache* terra_texture_cache_create ( size_t budget ) {
+    TerraTextureCache* cache = ( TerraTextureCache* ) terra_malloc ( sizeof ( TerraTextureCache ) );
+    cache->pools_count = 0;
+    cache->budget = budget;
+    cache->bytes = 0;
+    terra_cache_lock_init ( &cache->lock );
+    return cache;
+}
+
+void terra_texture_cache_destroy ( TerraTextureCache* cache ) {
+    if ( cache == NULL ) {
+        return;
+    }
+
+    for ( size_t i = 0; i < cache->pools_count; ++i ) {
+        TerraTextureCachePool* pool = &cache->pools[i];
+
+        for ( size_t s = 0; s < pool->slots_count; ++s ) {
+            terra_free ( pool->slots[s].pixels );
+        }
+
+        terra_free ( pool->slots );
+    }
+
+    terra_cache_lock_destroy ( &cache->lock );
+    terra_free ( cache );
+}
+
+// Called with the lock held
+TerraTextureCachePool* terra_texture_cache_pool ( TerraTextureCache* cache, size_t page_bytes ) {
+    for ( size_t i = 0; i < cache->pools_count; ++i ) {
+        if ( cache->pools[i].slot_bytes == page_bytes ) {
+            return &cache->pools[i];
+        }
+    }
+
+    assert ( cache->pools_count < TERRA_TEXTURE_CACHE_MAX_POOLS );
+    TerraTextureCachePool* pool = &cache->pools[cache->pools_count++];
+    pool->slot_bytes = page_bytes;
+    pool->slots_count = 0;
+    pool->slots_capacity = terra_maxi ( cache->budget / page_bytes, TERRA_TEXTURE_CACHE_MIN_SLOTS );
+    pool->slots = ( TerraTextureCacheSlot* ) terra_malloc ( sizeof ( TerraTextureCacheSlot ) * pool->slots_capacity );
+    memset ( pool->slots, 0, sizeof ( TerraTextureCacheSlot ) * pool->slots_capacity );
+    pool->hand = 0;
+    return pool;
+}
+
+const void* terra_texture_cache_pin ( TerraTexturePagedLevel* level, uint32_t page, int32_t* slot ) {
+    TerraTextureCachePool* pool = level->pool;
+
+    for ( ;; ) {
+        int32_t s = terra_atomic_load ( &level->page_table[page] );
+
+        if ( s == TERRA_TEXTURE_PAGE_LOADING ) {
+            terra_cache_yield();
+            continue;
+        }
+
+        if ( s < 0 ) {
+            terra_texture_cache_load ( level, page );
+            continue;
+        }
+
+        // The slot might have been recycled between the table lookup and the pin
+        TerraTextureCacheSlot* entry = &pool->slots[s];
+
+        if ( terra_atomic_add ( &entry->pins, 1 ) > 0 && entry->owner == level && entry->page == page ) {
+            if ( terra_atomic_load ( &entry->referenced ) == 0 ) {
+                terra_atomic_store ( &entry->referenced, 1 );
+            }
+
+            *slot = s;
+            return entry->pixels;
+        }
+
+        terra_atomic_add ( &entry->pins, -1 );
+    }
+}
+
+void terra_texture_cache_unpin ( TerraTexturePagedLevel* level, int32_t slot ) {
+    terra_atomic_add ( &level->pool->slots[slot].pins, -1 );
+}
+
+bool terra_texture_cache_resident ( TerraTexturePagedLevel* level, uint32_t page ) {
+    return terra_atomic_load ( &level->page_table[page] ) >= 0;
+}
+
+// Positioned, the render threads read the same file concurrently
+bool terra_texture_cache_read ( FILE* file, void* pixels, size_t bytes, uint64_t offset ) {
+#ifdef _WIN32
+    HANDLE handle = ( HANDLE ) _get_osfhandle ( _fileno ( file ) );
+    OVERLAPPED overlapped;
+    memset ( &overlapped, 0, sizeof ( overlapped ) );
+    overlapped.Offset = ( DWORD ) offset;
+    overlapped.OffsetHigh = ( DWORD ) ( offset >> 32 );
+    DWORD read = 0;
+    return ReadFile ( handle, pixels, ( DWORD ) bytes, &read, &overlapped ) && read == bytes;
+#else
+    int fd = fileno ( file );
+
+    for ( size_t done = 0; done < bytes; ) {
+        ssize_t read = pread ( fd, ( uint8_t* ) pixels + done, bytes - done, ( off_t ) ( offset + done ) );
+
+        if ( read <= 0 ) {
+            return false;
+        }
+
+        done += ( size_t ) read;
+    }
+
+    return true;
+#endif
+}
+
+// The slot is claimed under the lock and filled outside of it, the page is marked as loading meanwhile and
+// the threads needing it wait for the mapping instead of loading it again.
+void terra_texture_cache_load ( TerraTexturePagedLevel* level, uint32_t page ) {
+    TerraTextureCache* cache = level->cache;
+    const TerraTexturePagedFile* file = level->file;
+    terra_cache_lock ( &cache->lock );
+
+    // Somebody else loaded it, or started to, while waiting
+    if ( terra_atomic_load ( &level->page_table[page] ) != -1 ) {
+        terra_cache_unlock ( &cache->lock );
+        return;
+    }
+
+    int32_t s = terra_texture_cache_evict ( cache, level->pool );
+    TerraTextureCacheSlot* entry = &level->pool->slots[s];
+    entry->owner = level;
+    entry->page = page;
+    terra_atomic_store ( &level->page_table[page], TERRA_TEXTURE_PAGE_LOADING );
+    terra_cache_unlock ( &cache->lock );
+
+    // An unreadable page is black, the render goes on
+    if ( !terra_texture_cache_read ( file->file, entry->pixels, file->page_bytes, level->offset + ( uint64_t ) page * file->page_bytes ) ) {
+        memset ( entry->pixels, 0, file->page_bytes );
+    }
+
+    if ( file->linearize ) {
+        terra_texture_page_linearize ( file, entry->pixels );
+    }
+
+    // Mapped before unlocking, pins taken in between see the slot locked and retry
+    terra_atomic_store ( &entry->referenced, 1 );
+    terra_atomic_store ( &level->page_table[page], s );
+    terra_atomic_add ( &entry->pins, -TERRA_TEXTURE_CACHE_LOCKED );
+}
+
+// Called with the lock held. Returns a slot locked for refill, no longer referenced by its previous page.
+// The pool grows while the cache is under budget.
+int32_t terra_texture_cache_evict ( TerraTextureCache* cache, TerraTextureCachePool* pool ) {
+    if ( pool->slots_count < pool->slots_capacity &&
+            ( cache->bytes + pool->slot_bytes <= cache->budget || pool->slots_count < TERRA_TEXTURE_CACHE_MIN_SLOTS ) ) {
+        TerraTextureCacheSlot* entry = &pool->slots[pool->slots_count];
+        entry->pixels = ( uint8_t* ) terra_malloc ( pool->slot_bytes );
+        entry->pins = TERRA_TEXTURE_CACHE_LOCKED;
+        cache->bytes += pool->slot_bytes;
+        return ( int32_t ) pool->slots_count++;
+    }
+
+    for ( ;; ) {
+        int32_t s = ( int32_t ) pool->hand;
+        TerraTextureCacheSlot* entry = &pool->slots[s];
+        pool->hand = ( pool->hand + 1 ) % pool->slots_count;
+
+        // Second chance
+        if ( terra_atomic_load ( &entry->referenced ) ) {
+            terra_atomic_store ( &entry->referenced, 0 );
+            continue;
+        }
+
+        if ( terra_atomic_cas ( &entry->pins, 0, TERRA_TEXTURE_CACHE_LOCKED ) ) {
+            if ( entry->owner != NULL ) {
+                terra_atomic_store ( &entry->owner->page_table[entry->page], -1 );
+                entry->owner = NULL;
+            }
+
+            return s;
+        }
+    }
+}
+
+// Evicts every resident page of the file
+void terra_texture_cache_drop ( TerraTextureCache* cache, const TerraTexturePagedFile* file ) {
+    terra_cache_lock ( &cache->lock );
+    TerraTextureCachePool* pool = file->levels[0].pool;
+
+    for ( size_t i = 0; i < pool->slots_count; ++i ) {
+        TerraTextureCacheSlot* entry = &pool->slots[i];
+
+        if ( entry->owner == NULL || entry->owner->file != file ) {
+            continue;
+        }
+
+        while ( !terra_atomic_cas ( &entry->pins, 0, TERRA_TEXTURE_CACHE_LOCKED ) ) { }
+
+        terra_atomic_store ( &entry->owner->page_table[entry->page], -1 );
+        entry->owner = NULL;
+        terra_atomic_store ( &entry->referenced, 0 );
+        terra_atomic_add ( &entry->pins, -TERRA_TEXTURE_CACHE_LOCKED );
+    }
+
+    terra_cache_unlock ( &cache->lock );
+}
+
+void terra_texture_page_linearize ( const TerraTexturePagedFile* file, void* pixels ) {
+    size_t tile_bytes = terra_texture_format_tile_bytes ( file->format, file->components );
+    TerraFloat3 texels[TERRA_TEXTURE_TILE_TEXELS];
+
+    for ( size_t t = 0; t < TERRA_TEXTURE_PAGE_TILES; ++t ) {
+        uint8_t* tile = ( uint8_t* ) pixels + t * tile_bytes;
+
+        for ( size_t i = 0; i < TERRA_TEXTURE_TILE_TEXELS; ++i ) {
+            TerraFloat3 v = terra_texture_decode_texel ( file->format, file->components, tile, i & TERRA_TEXTURE_TILE_MASK, i >> TERRA_TEXTURE_TILE_LOG2 );
+            texels[i] = terra_f3_set ( powf ( v.x, 2.2f ), powf ( v.y, 2.2f ), powf ( v.z, 2.2f ) );
+        }
+
+        terra_texture_encode_tile ( file->format, file->components, texels, tile );
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+// @TerraTexturePaged
+//--------------------------------------------------------------------------------------------------
+size_t terra_texture_paged_tiles ( size_t size ) {
+    return ( size + TERRA_TEXTURE_TILE_MASK ) >> TERRA_TEXTURE_TILE_LOG2;
+}
+
+// Header, then the pages of each level from the largest. Pages are in row-major order, each one padded
+// to the full page size.
+bool terra_texture_save_paged ( TerraTexture* texture, const char* path ) {
+    if ( texture->pixels == NULL || texture->paged != NULL ) {
+        return false;
+    }
+
+    if ( texture->mips == NULL ) {
+        terra_texture_generate_mips ( texture );
+    }
+
+    FILE* file = fopen ( path, "wb" );
+
+    if ( file == NULL ) {
+        return false;
+    }
+
+    TerraTexturePagedHeader header;
+    header.magic = TERRA_TEXTURE_PAGED_MAGIC;
+    header.width = texture->width;
+    header.height = texture->height;
+    header.components = texture->components;
+    header.depth = texture->depth;
+    header.format = texture->format;
+    memset ( header.reserved, 0, sizeof ( header.reserved ) );
+    header.levels = ( uint8_t ) ( texture->mips_count + 1 );
+    header.page_log2 = TERRA_TEXTURE_PAGE_LOG2;
+    bool ok = fwrite ( &header, sizeof ( header ), 1, file ) == 1;
+
+    size_t tile_bytes = terra_texture_format_tile_bytes ( texture->format, texture->components );
+    size_t page_bytes = TERRA_TEXTURE_PAGE_TILES * tile_bytes;
+    uint8_t* page = ( uint8_t* ) terra_malloc ( page_bytes );
+
+    for ( uint8_t l = 0; l < header.levels && ok; ++l ) {
+        const TerraTexture* level = l == 0 ? texture : &texture->mips[l - 1];
+        size_t tiles_x = terra_texture_paged_tiles ( level->width );
+        size_t pages_x = ( level->width + TERRA_TEXTURE_PAGE_MASK ) >> TERRA_TEXTURE_PAGE_LOG2;
+        size_t pages_y = ( level->height + TERRA_TEXTURE_PAGE_MASK ) >> TERRA_TEXTURE_PAGE_LOG2;
+
+        for ( size_t py = 0; py < pages_y && ok; ++py ) {
+            for ( size_t px = 0; px < pages_x && ok; ++px ) {
+                memset ( page, 0, page_bytes );
+
+                for ( size_t y = py << TERRA_TEXTURE_PAGE_LOG2; y < terra_mini ( ( py + 1 ) << TERRA_TEXTURE_PAGE_LOG2, level->height ); y += TERRA_TEXTURE_TILE_SIZE ) {
+                    for ( size_t x = px << TERRA_TEXTURE_PAGE_LOG2; x < terra_mini ( ( px + 1 ) << TERRA_TEXTURE_PAGE_LOG2, level->width ); x += TERRA_TEXTURE_TILE_SIZE ) {
+                        memcpy ( page + terra_texture_page_tile ( x, y ) * tile_bytes,
+                                 ( const uint8_t* ) level->pixels + terra_texture_tile_index ( x, y, tiles_x ) * tile_bytes, tile_bytes );
+                    }
+                }
+
+                ok = fwrite ( page, page_bytes, 1, file ) == 1;
+            }
+        }
+    }
+
+    terra_free ( page );
+    return fclose ( file ) == 0 && ok;
+}
+
+bool terra_texture_init_paged ( TerraTexture* texture, TerraTextureCache* cache, const char* path ) {
+    FILE* fp = fopen ( path, "rb" );
+
+    if ( fp == NULL ) {
+        return false;
+    }
+
+    TerraTexturePagedHeader header;
+
+    if ( fread ( &header, sizeof ( header ), 1, fp ) != 1 || header.magic != TERRA_TEXTURE_PAGED_MAGIC || header.page_log2 != TERRA_TEXTURE_PAGE_LOG2 ||
+            ( header.depth != 1 && header.depth != 4 ) || header.format >= kTerraTextureFormatCount || header.components == 0 || header.components > 3 ||
+            header.levels == 0 ) {
+        fclose ( fp );
+        return false;
+    }
+
+    TerraTexturePagedFile* file = ( TerraTexturePagedFile* ) terra_malloc ( sizeof ( TerraTexturePagedFile ) );
+    file->file = fp;
+    file->levels_count = header.levels;
+    file->components = header.components;
+    file->format = header.format;
+    file->linearize = false;
+    file->page_bytes = TERRA_TEXTURE_PAGE_TILES * terra_texture_format_tile_bytes ( header.format, header.components );
+    file->levels = ( TerraTexturePagedLevel* ) terra_malloc ( sizeof ( TerraTexturePagedLevel ) * header.levels );
+    terra_cache_lock ( &cache->lock );
+    TerraTextureCachePool* pool = terra_texture_cache_pool ( cache, file->page_bytes );
+    terra_cache_unlock ( &cache->lock );
+
+    texture->pixels = NULL;
+    texture->width = header.width;
+    texture->height = header.height;
+    texture->components = header.components;
+    texture->depth = header.depth;
+    texture->format = header.format;
+    texture->mips_count = ( uint8_t ) ( header.levels - 1 );
+    texture->mips = texture->mips_count > 0 ? ( TerraTexture* ) terra_malloc ( sizeof ( TerraTexture ) * texture->mips_count ) : NULL;
+    texture->paged = &file->levels[0];
+
+    uint64_t offset = sizeof ( header );
+    size_t width = header.width;
+    size_t height = header.height;
+
+    for ( uint8_t l = 0; l < header.levels; ++l ) {
+        TerraTexturePagedLevel* level = &file->levels[l];
+        level->cache = cache;
+        level->pool = pool;
+        level->file = file;
+        level->offset = offset;
+        level->pages_x = ( uint32_t ) ( ( width + TERRA_TEXTURE_PAGE_MASK ) >> TERRA_TEXTURE_PAGE_LOG2 );
+        level->pages_y = ( uint32_t ) ( ( height + TERRA_TEXTURE_PAGE_MASK ) >> TERRA_TEXTURE_PAGE_LOG2 );
+        size_t pages = ( size_t ) level->pages_x * level->pages_y;
+        level->page_table = ( volatile int32_t* ) terra_malloc ( sizeof ( int32_t ) * pages );
+
+        for ( size_t i = 0; i < pages; ++i ) {
+            level->page_table[i] = -1;
+        }
+
+        if ( l > 0 ) {
+            TerraTexture* mip = &texture->mips[l - 1];
+            *mip = *texture;
+            mip->width = ( uint16_t ) width;
+            mip->height = ( uint16_t ) height;
+            mip->mips = NULL;
+            mip->mips_count = 0;
+            mip->paged = level;
+        }
+
+        offset += pages * file->page_bytes;
+        width = terra_maxi ( width / 2, 1 );
+        height = terra_maxi ( height / 2, 1 );
+    }
+
+    terra_texture_bind_fetch ( texture );
+    return true;
+}
+
+void terra_texture_paged_linearize ( TerraTexture* texture ) {
+    TerraTexturePagedFile* file = texture->paged->file;
+
+    if ( !file->linearize ) {
+        file->linearize = true;
+        terra_texture_cache_drop ( texture->paged->cache, file );
+    }
+}
+
+void terra_texture_paged_destroy ( TerraTexture* texture ) {
+    TerraTexturePagedFile* file = texture->paged->file;
+    terra_texture_cache_drop ( texture->paged->cache, file );
+
+    for ( uint8_t l = 0; l < file->levels_count; ++l ) {
+        terra_free ( ( void* ) file->levels[l].page_table );
+    }
+
+    fclose ( file->file );
+    terra_free ( file->levels );
+    terra_free ( file );
+    terra_free ( texture->mips );
+    texture->mips = NULL;
+    texture->mips_count = 0;
+    texture->paged = NULL;
+}
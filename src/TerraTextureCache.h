@@ -0,0 +1,53 @@
+#ifndef _TERRA_TEXTURE_CACHE_H_
+#define _TERRA_TEXTURE_CACHE_H_
+
+// Terra
+#include <Terra.h>
+#include "TerraPrivate.h"
+
+// libc
+#include <stdint.h>
+#include <stdio.h>
+
+#define TERRA_TEXTURE_PAGE_SIZE ( 1 << TERRA_TEXTURE_PAGE_LOG2 )
+#define TERRA_TEXTURE_PAGE_MASK ( TERRA_TEXTURE_PAGE_SIZE - 1 )
+#define TERRA_TEXTURE_PAGE_TILES ( 1 << ( 2 * ( TERRA_TEXTURE_PAGE_LOG2 - TERRA_TEXTURE_TILE_LOG2 ) ) )
+
+// page_table value of a page being read into its slot
+#define TERRA_TEXTURE_PAGE_LOADING ( -2 )
+
+struct TerraTexturePagedFile;
+struct TerraTextureCachePool;
+
+// A mip level of a paged texture. page_table maps each page to the slot of the pool holding it, -1 if not
+// resident. The pool is the one of the page size of the file.
+typedef struct TerraTexturePagedLevel {
+    TerraTextureCache*            cache;
+    struct TerraTextureCachePool* pool;
+    struct TerraTexturePagedFile* file;
+    uint64_t                      offset;       // Of the first page in the file
+    uint32_t                      pages_x;
+    uint32_t                      pages_y;
+    volatile int32_t*             page_table;
+} TerraTexturePagedLevel;
+
+//--------------------------------------------------------------------------------------------------
+// Terra Texture Cache Internal routines
+//--------------------------------------------------------------------------------------------------
+// Returns the page pixels, in tiles, loading them if needed. The slot stays pinned, it can not be evicted
+// until terra_texture_cache_unpin() is called.
+const void* terra_texture_cache_pin   ( TerraTexturePagedLevel* level, uint32_t page, int32_t* slot );
+void        terra_texture_cache_unpin ( TerraTexturePagedLevel* level, int32_t slot );
+// Whether pinning the page would not load it, can change right after
+bool        terra_texture_cache_resident ( TerraTexturePagedLevel* level, uint32_t page );
+
+// Converts the pages from sRGB when loaded, resident ones are dropped. Not safe while rendering.
+void        terra_texture_paged_linearize ( TerraTexture* texture );
+void        terra_texture_paged_destroy   ( TerraTexture* texture );
+
+// Tile holding a texel inside its page
+static inline size_t terra_texture_page_tile ( size_t x, size_t y ) {
+    return terra_texture_tile_index ( x & TERRA_TEXTURE_PAGE_MASK, y & TERRA_TEXTURE_PAGE_MASK, TERRA_TEXTURE_PAGE_SIZE >> TERRA_TEXTURE_TILE_LOG2 );
+}
+
+#endif // _TERRA_TEXTURE_CACHE_H_
@@ -0,0 +1,250 @@
+// TerraTextureFormat
+#include "TerraTextureFormat.h"
+
+// libc
+#include <assert.h>
+#include <float.h>
+
+static uint16_t terra_bc1_quantize ( const TerraFloat3* c );
+static void     terra_bc1_encode ( const TerraFloat3* texels, uint8_t* block );
+static void     terra_bc4_encode ( const float* values, uint8_t* block );
+
+void terra_texture_encode_tile ( uint8_t format, uint8_t components, const TerraFloat3* texels, void* tile ) {
+    switch ( format ) {
+        case kTerraTextureFormatUnorm8:
+            for ( size_t i = 0; i < TERRA_TEXTURE_TILE_TEXELS; ++i ) {
+                for ( size_t c = 0; c < components; ++c ) {
+                    float v = terra_clamp ( ( &texels[i].x ) [c], 0.f, 1.f );
+                    ( ( uint8_t* ) tile ) [i * components + c] = ( uint8_t ) ( v * 255.f + 0.5f );
+                }
+            }
+
+            break;
+
+        case kTerraTextureFormatFloat32:
+            for ( size_t i = 0; i < TERRA_TEXTURE_TILE_TEXELS; ++i ) {
+                memcpy ( ( float* ) tile + i * components, &texels[i], sizeof ( float ) * components );
+            }
+
+            break;
+
+        case kTerraTextureFormatFloat16:
+            for ( size_t i = 0; i < TERRA_TEXTURE_TILE_TEXELS; ++i ) {
+                for ( size_t c = 0; c < components; ++c ) {
+                    ( ( uint16_t* ) tile ) [i * components + c] = terra_float_to_half ( ( &texels[i].x ) [c] );
+                }
+            }
+
+            break;
+
+        case kTerraTextureFormatRGB9E5:
+            for ( size_t i = 0; i < TERRA_TEXTURE_TILE_TEXELS; ++i ) {
+                ( ( uint32_t* ) tile ) [i] = terra_rgb9e5_encode ( &texels[i] );
+            }
+
+            break;
+
+        case kTerraTextureFormatBC1:
+            terra_bc1_encode ( texels, ( uint8_t* ) tile );
+            break;
+
+        case kTerraTextureFormatBC5: {
+            float r[TERRA_TEXTURE_TILE_TEXELS];
+            float g[TERRA_TEXTURE_TILE_TEXELS];
+
+            for ( size_t i = 0; i < TERRA_TEXTURE_TILE_TEXELS; ++i ) {
+                r[i] = texels[i].x;
+                g[i] = texels[i].y;
+            }
+
+            terra_bc4_encode ( r, ( uint8_t* ) tile );
+            terra_bc4_encode ( g, ( uint8_t* ) tile + 8 );
+            break;
+        }
+
+        default:
+            assert ( false );
+    }
+}
+
+// Rounds to nearest, out of range values are clamped to the largest half rather than turned into infinities
+uint16_t terra_float_to_half ( float f ) {
+    uint32_t bits;
+    memcpy ( &bits, &f, sizeof ( bits ) );
+    uint16_t sign = ( uint16_t ) ( ( bits >> 16 ) & 0x8000 );
+    float a = fabsf ( f );
+
+    if ( a != a ) {
+        return 0x7e00;
+    }
+
+    if ( a >= 65504.f ) {
+        return sign | 0x7bff;
+    }
+
+    // Denormals, a multiple of 2^-24
+    if ( a < 6.10351562e-05f ) {
+        return sign | ( uint16_t ) ( a * 16777216.f + 0.5f );
+    }
+
+    bits &= 0x7fffffff;
+    bits += 0xfff + ( ( bits >> 13 ) & 1 );
+    return sign | ( uint16_t ) ( ( bits - ( 112u << 23 ) ) >> 13 );
+}
+
+uint32_t terra_rgb9e5_encode ( const TerraFloat3* v ) {
+    const float max_value = 65408.f; // ( 2^9 - 1 ) / 2^9 * 2^( 31 - 15 )
+    float r = terra_clamp ( v->x, 0.f, max_value );
+    float g = terra_clamp ( v->y, 0.f, max_value );
+    float b = terra_clamp ( v->z, 0.f, max_value );
+    float max_c = terra_maxf ( r, terra_maxf ( g, b ) );
+
+    if ( max_c < FLT_MIN ) {
+        return 0;
+    }
+
+    int exponent;
+    frexpf ( max_c, &exponent );
+    // frexp mantissa is in [0.5, 1), floor ( log2 ( max_c ) ) is exponent - 1
+    int shared = ( exponent - 1 < -16 ? -16 : exponent - 1 ) + 1 + 15;
+
+    if ( ( int ) floorf ( ldexpf ( max_c, 9 + 15 - shared ) + 0.5f ) == 512 ) {
+        ++shared;
+    }
+
+    float scale = ldexpf ( 1.f, 9 + 15 - shared );
+    uint32_t rm = ( uint32_t ) terra_minf ( floorf ( r * scale + 0.5f ), 511.f );
+    uint32_t gm = ( uint32_t ) terra_minf ( floorf ( g * scale + 0.5f ), 511.f );
+    uint32_t bm = ( uint32_t ) terra_minf ( floorf ( b * scale + 0.5f ), 511.f );
+    return rm | ( gm << 9 ) | ( bm << 18 ) | ( ( uint32_t ) shared << 27 );
+}
+
+uint16_t terra_bc1_quantize ( const TerraFloat3* c ) {
+    uint32_t r = ( uint32_t ) ( terra_clamp ( c->x, 0.f, 1.f ) * 31.f + 0.5f );
+    uint32_t g = ( uint32_t ) ( terra_clamp ( c->y, 0.f, 1.f ) * 63.f + 0.5f );
+    uint32_t b = ( uint32_t ) ( terra_clamp ( c->z, 0.f, 1.f ) * 31.f + 0.5f );
+    return ( uint16_t ) ( ( r << 11 ) | ( g << 5 ) | b );
+}
+
+// The endpoints are the extremes of the texels projected on the principal axis of the block colors,
+// always in the four colors mode.
+void terra_bc1_encode ( const TerraFloat3* texels, uint8_t* block ) {
+    TerraFloat3 mean = terra_f3_zero;
+
+    for ( size_t i = 0; i < TERRA_TEXTURE_TILE_TEXELS; ++i ) {
+        mean = terra_addf3 ( &mean, &texels[i] );
+    }
+
+    mean = terra_divf3 ( &mean, ( float ) TERRA_TEXTURE_TILE_TEXELS );
+    float cov[6] = { 0 };
+
+    for ( size_t i = 0; i < TERRA_TEXTURE_TILE_TEXELS; ++i ) {
+        TerraFloat3 d = terra_subf3 ( &texels[i], &mean );
+        cov[0] += d.x * d.x;
+        cov[1] += d.x * d.y;
+        cov[2] += d.x * d.z;
+        cov[3] += d.y * d.y;
+        cov[4] += d.y * d.z;
+        cov[5] += d.z * d.z;
+    }
+
+    // Power iteration
+    TerraFloat3 axis = terra_f3_set ( 1.f, 1.f, 1.f );
+
+    for ( int i = 0; i < 4; ++i ) {
+        TerraFloat3 next = terra_f3_set ( cov[0] * axis.x + cov[1] * axis.y + cov[2] * axis.z,
+                                          cov[1] * axis.x + cov[3] * axis.y + cov[4] * axis.z,
+                                          cov[2] * axis.x + cov[4] * axis.y + cov[5] * axis.z );
+        float len = terra_lenf3 ( &next );
+        axis = len > 1e-12f ? terra_divf3 ( &next, len ) : axis;
+    }
+
+    float t_min = FLT_MAX;
+    float t_max = -FLT_MAX;
+
+    for ( size_t i = 0; i < TERRA_TEXTURE_TILE_TEXELS; ++i ) {
+        TerraFloat3 d = terra_subf3 ( &texels[i], &mean );
+        float t = terra_dotf3 ( &d, &axis );
+        t_min = terra_minf ( t_min, t );
+        t_max = terra_maxf ( t_max, t );
+    }
+
+    TerraFloat3 e0 = terra_mulf3 ( &axis, t_max );
+    TerraFloat3 e1 = terra_mulf3 ( &axis, t_min );
+    e0 = terra_addf3 ( &mean, &e0 );
+    e1 = terra_addf3 ( &mean, &e1 );
+    uint16_t c0 = terra_bc1_quantize ( &e0 );
+    uint16_t c1 = terra_bc1_quantize ( &e1 );
+
+    if ( c0 < c1 ) {
+        uint16_t c = c0;
+        c0 = c1;
+        c1 = c;
+    }
+
+    block[0] = ( uint8_t ) c0;
+    block[1] = ( uint8_t ) ( c0 >> 8 );
+    block[2] = ( uint8_t ) c1;
+    block[3] = ( uint8_t ) ( c1 >> 8 );
+    memset ( block + 4, 0, 4 );
+
+    // Equal endpoints, every index 0 is exact
+    if ( c0 == c1 ) {
+        return;
+    }
+
+    TerraFloat3 palette[4];
+    palette[0] = terra_bc1_color ( c0 );
+    palette[1] = terra_bc1_color ( c1 );
+    palette[2] = terra_lerpf3 ( &palette[0], &palette[1], 1.f / 3 );
+    palette[3] = terra_lerpf3 ( &palette[0], &palette[1], 2.f / 3 );
+
+    for ( size_t i = 0; i < TERRA_TEXTURE_TILE_TEXELS; ++i ) {
+        uint32_t best = 0;
+        float best_distance = FLT_MAX;
+
+        for ( uint32_t p = 0; p < 4; ++p ) {
+            TerraFloat3 d = terra_subf3 ( &texels[i], &palette[p] );
+            float distance = terra_dotf3 ( &d, &d );
+
+            if ( distance < best_distance ) {
+                best_distance = distance;
+                best = p;
+            }
+        }
+
+        block[4 + i / 4] |= ( uint8_t ) ( best << ( 2 * ( i % 4 ) ) );
+    }
+}
+
+// Min and max endpoints with the 6 interpolated values mode
+void terra_bc4_encode ( const float* values, uint8_t* block ) {
+    float v_min = 1.f;
+    float v_max = 0.f;
+
+    for ( size_t i = 0; i < TERRA_TEXTURE_TILE_TEXELS; ++i ) {
+        float v = terra_clamp ( values[i], 0.f, 1.f );
+        v_min = terra_minf ( v_min, v );
+        v_max = terra_maxf ( v_max, v );
+    }
+
+    uint8_t r0 = ( uint8_t ) ( v_max * 255.f + 0.5f );
+    uint8_t r1 = ( uint8_t ) ( v_min * 255.f + 0.5f );
+    block[0] = r0;
+    block[1] = r1;
+    uint64_t bits = 0;
+
+    if ( r0 > r1 ) {
+        for ( size_t i = 0; i < TERRA_TEXTURE_TILE_TEXELS; ++i ) {
+            // Position between r1 (0) and r0 (7), mapped to the palette order r0, r1, interpolated from r0
+            float t = ( terra_clamp ( values[i], 0.f, 1.f ) * 255.f - r1 ) / ( r0 - r1 );
+            uint64_t k = ( uint64_t ) terra_clamp ( floorf ( t * 7.f + 0.5f ), 0.f, 7.f );
+            uint64_t index = k == 7 ? 0 : ( k == 0 ? 1 : 8 - k );
+            bits |= index << ( 3 * i );
+        }
+    }
+
+    for ( size_t i = 0; i < 6; ++i ) {
+        block[2 + i] = ( uint8_t ) ( bits >> ( 8 * i ) );
+    }
+}
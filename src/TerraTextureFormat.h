@@ -0,0 +1,171 @@
+#ifndef _TERRA_TEXTURE_FORMAT_H_
+#define _TERRA_TEXTURE_FORMAT_H_
+
+// Terra
+#include <Terra.h>
+#include "TerraPrivate.h"
+
+// libc
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#define TERRA_TEXTURE_TILE_TEXELS ( 1 << ( 2 * TERRA_TEXTURE_TILE_LOG2 ) )
+
+// Block compressed formats store a 4x4 block per tile
+#define TERRA_TEXTURE_BLOCK_TILES ( TERRA_TEXTURE_TILE_LOG2 == 2 )
+
+//--------------------------------------------------------------------------------------------------
+// Terra Texture Format Internal routines
+//--------------------------------------------------------------------------------------------------
+// Encodes the texels of a tile, in row-major order. Components missing from the texture are ignored.
+void terra_texture_encode_tile ( uint8_t format, uint8_t components, const TerraFloat3* texels, void* tile );
+
+// Also used by the compact framebuffer formats
+uint16_t terra_float_to_half ( float f );
+uint32_t terra_rgb9e5_encode ( const TerraFloat3* v );
+
+static inline size_t terra_texture_format_tile_bytes ( uint8_t format, uint8_t components ) {
+    switch ( format ) {
+        case kTerraTextureFormatUnorm8:
+            return TERRA_TEXTURE_TILE_TEXELS * components;
+
+        case kTerraTextureFormatFloat32:
+            return TERRA_TEXTURE_TILE_TEXELS * components * sizeof ( float );
+
+        case kTerraTextureFormatFloat16:
+            return TERRA_TEXTURE_TILE_TEXELS * components * sizeof ( uint16_t );
+
+        case kTerraTextureFormatRGB9E5:
+            return TERRA_TEXTURE_TILE_TEXELS * sizeof ( uint32_t );
+
+        case kTerraTextureFormatBC1:
+            return 8;
+
+        case kTerraTextureFormatBC5:
+            return 16;
+
+        default:
+            return 0;
+    }
+}
+
+// Gray textures are replicated, two components ones have no blue
+static inline TerraFloat3 terra_texture_components_expand ( float r, float g, float b, uint8_t components ) {
+    return components == 1 ? terra_f3_set ( r, r, r ) : ( components == 2 ? terra_f3_set ( r, g, 0.f ) : terra_f3_set ( r, g, b ) );
+}
+
+static inline float terra_half_to_float ( uint16_t h ) {
+    uint32_t sign = ( uint32_t ) ( h & 0x8000 ) << 16;
+    uint32_t exponent = ( h >> 10 ) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t bits;
+
+    if ( exponent == 0 ) {
+        float denormal = mantissa * 5.9604645e-8f; // 2^-24
+        return sign ? -denormal : denormal;
+    } else if ( exponent == 31 ) {
+        bits = sign | 0x7f800000 | ( mantissa << 13 );
+    } else {
+        bits = sign | ( ( exponent + 112 ) << 23 ) | ( mantissa << 13 );
+    }
+
+    float f;
+    memcpy ( &f, &bits, sizeof ( f ) );
+    return f;
+}
+
+// Three 9 bit mantissas sharing a 5 bit exponent (EXT_texture_shared_exponent)
+static inline TerraFloat3 terra_rgb9e5_decode ( uint32_t v ) {
+    float scale = ldexpf ( 1.f, ( int ) ( v >> 27 ) - 15 - 9 );
+    return terra_f3_set ( ( v & 0x1ff ) * scale, ( ( v >> 9 ) & 0x1ff ) * scale, ( ( v >> 18 ) & 0x1ff ) * scale );
+}
+
+static inline TerraFloat3 terra_bc1_color ( uint16_t c ) {
+    uint32_t r = ( c >> 11 ) & 0x1f;
+    uint32_t g = ( c >> 5 ) & 0x3f;
+    uint32_t b = c & 0x1f;
+    return terra_f3_set ( ( ( r << 3 ) | ( r >> 2 ) ) / 255.f, ( ( g << 2 ) | ( g >> 4 ) ) / 255.f, ( ( b << 3 ) | ( b >> 2 ) ) / 255.f );
+}
+
+static inline TerraFloat3 terra_bc1_decode ( const uint8_t* block, size_t texel ) {
+    uint16_t c0 = ( uint16_t ) ( block[0] | ( block[1] << 8 ) );
+    uint16_t c1 = ( uint16_t ) ( block[2] | ( block[3] << 8 ) );
+    uint32_t index = ( block[4 + texel / 4] >> ( 2 * ( texel % 4 ) ) ) & 3;
+    TerraFloat3 p0 = terra_bc1_color ( c0 );
+    TerraFloat3 p1 = terra_bc1_color ( c1 );
+
+    switch ( index ) {
+        case 0:
+            return p0;
+
+        case 1:
+            return p1;
+
+        case 2:
+            return c0 > c1 ? terra_lerpf3 ( &p0, &p1, 1.f / 3 ) : terra_lerpf3 ( &p0, &p1, 0.5f );
+
+        default:
+            return c0 > c1 ? terra_lerpf3 ( &p0, &p1, 2.f / 3 ) : terra_f3_zero;
+    }
+}
+
+static inline float terra_bc4_decode ( const uint8_t* block, size_t texel ) {
+    float r0 = block[0] / 255.f;
+    float r1 = block[1] / 255.f;
+    size_t bit = 3 * texel;
+    // Indices might straddle two bytes
+    uint32_t bits = block[2 + bit / 8] | ( ( bit / 8 + 1 < 6 ? block[3 + bit / 8] : 0 ) << 8 );
+    uint32_t index = ( bits >> ( bit % 8 ) ) & 7;
+
+    if ( index < 2 ) {
+        return index == 0 ? r0 : r1;
+    }
+
+    if ( block[0] > block[1] ) {
+        return ( ( 8 - index ) * r0 + ( index - 1 ) * r1 ) / 7.f;
+    }
+
+    return index == 6 ? 0.f : ( index == 7 ? 1.f : ( ( 6 - index ) * r0 + ( index - 1 ) * r1 ) / 5.f );
+}
+
+// x, y are the texel coordinates inside the tile. Inlined with a constant format in the fetch routines.
+static inline TerraFloat3 terra_texture_decode_texel ( uint8_t format, uint8_t components, const uint8_t* tile, size_t x, size_t y ) {
+    size_t texel = ( y << TERRA_TEXTURE_TILE_LOG2 ) + x;
+
+    switch ( format ) {
+        case kTerraTextureFormatUnorm8: {
+            const uint8_t* p = tile + texel * components;
+            return terra_texture_components_expand ( p[0] / 255.f, p[components > 1] / 255.f, p[components > 2 ? 2 : 0] / 255.f, components );
+        }
+
+        case kTerraTextureFormatFloat32: {
+            const float* p = ( const float* ) tile + texel * components;
+            return terra_texture_components_expand ( p[0], p[components > 1], p[components > 2 ? 2 : 0], components );
+        }
+
+        case kTerraTextureFormatFloat16: {
+            const uint16_t* p = ( const uint16_t* ) tile + texel * components;
+            return terra_texture_components_expand ( terra_half_to_float ( p[0] ), terra_half_to_float ( p[components > 1] ),
+                    terra_half_to_float ( p[components > 2 ? 2 : 0] ), components );
+        }
+
+        case kTerraTextureFormatRGB9E5: {
+            TerraFloat3 v = terra_rgb9e5_decode ( ( ( const uint32_t* ) tile ) [texel] );
+            return terra_texture_components_expand ( v.x, v.y, v.z, components );
+        }
+
+        case kTerraTextureFormatBC1: {
+            TerraFloat3 v = terra_bc1_decode ( tile, texel );
+            return terra_texture_components_expand ( v.x, v.y, v.z, components );
+        }
+
+        case kTerraTextureFormatBC5:
+            return terra_texture_components_expand ( terra_bc4_decode ( tile, texel ), terra_bc4_decode ( tile + 8, texel ), 0.f, components );
+
+        default:
+            return terra_f3_zero;
+    }
+}
+
+#endif // _TERRA_TEXTURE_FORMAT_H_